@@ -0,0 +1,336 @@
+/* ZAMDACH2022
+ * Store-and-forward backlog for measurements that could not be
+ * submitted.
+ *
+ * The backlog is a ring of fixed-size records in flash. New records are
+ * always written behind the newest one, and a sector is only erased
+ * when the ring wraps around into it again. So every sector gets erased
+ * exactly once per pass through the whole partition - with 256 KB and
+ * at most one record per minute, that is about once every 34 hours per
+ * sector, which is not something the flash will ever notice.
+ * Records are never rewritten. Marking a record as sent just clears the
+ * pending-word for that destination to 0, and NOR flash can clear bits
+ * without an erase. */
+
+#include <string.h>
+#include <esp_log.h>
+#ifdef ESP_PLATFORM
+#include <esp_partition.h>
+#endif
+#include "backlog.h"
+
+#define BACKLOG_RECSIZE 128
+#define BACKLOG_SLOTSPERSECTOR (BACKLOG_SECTORSIZE / BACKLOG_RECSIZE)
+#define BACKLOG_MAGIC 0x5a424c31
+/* Timestamps before 2023-01-01 mean we did not have NTP time yet.
+ * Storing such batches is pointless, they cannot be backfilled. */
+#define BACKLOG_MINVALIDTS 1672531200
+
+struct backlogrec {
+  uint32_t magic;
+  uint32_t seq;
+  uint32_t ts;
+  uint16_t valid;
+  uint16_t crc; /* over everything above (except crc) and values */
+  float values[SUBMITFIELD_COUNT];
+  /* Left at 0xffffffff (erased) while the record is still pending for
+   * that destination, and cleared to 0 once it has been sent. */
+  uint32_t pending[SUBMITDEST_COUNT];
+};
+_Static_assert(sizeof(struct backlogrec) <= BACKLOG_RECSIZE, "backlog record too large");
+
+static struct backlogflash blfl;
+static int blavail = 0;
+static uint32_t blslots;
+static uint32_t blhead;    /* The slot the next record will be written to */
+static uint32_t blnextseq;
+/* Per destination, the oldest slot that might still be pending. */
+static uint32_t bltail[SUBMITDEST_COUNT];
+static struct backlogstats blstats;
+
+static uint16_t backlog_crc(uint16_t crc, const uint8_t * d, size_t len)
+{
+  for (size_t i = 0; i < len; i++) {
+    crc ^= (uint16_t)d[i] << 8;
+    for (int b = 0; b < 8; b++) {
+      if (crc & 0x8000) {
+        crc = (crc << 1) ^ 0x1021;
+      } else {
+        crc = crc << 1;
+      }
+    }
+  }
+  return crc;
+}
+
+static uint16_t backlog_reccrc(const struct backlogrec * r)
+{
+  uint16_t crc = backlog_crc(0xffff, (const uint8_t *)r, offsetof(struct backlogrec, crc));
+  return backlog_crc(crc, (const uint8_t *)r->values, sizeof(r->values));
+}
+
+static int backlog_recvalid(const struct backlogrec * r)
+{
+  return (r->magic == BACKLOG_MAGIC) && (r->crc == backlog_reccrc(r));
+}
+
+/* Anything that is not fully cleared counts as pending: if we lost power
+ * while marking a record as sent, we would rather send it twice than
+ * not at all. */
+static int backlog_recpending(const struct backlogrec * r, int d)
+{
+  return (r->pending[d] != 0);
+}
+
+static esp_err_t backlog_readrec(uint32_t slot, struct backlogrec * r)
+{
+  return blfl.read(blfl.ctx, slot * BACKLOG_RECSIZE, r, sizeof(struct backlogrec));
+}
+
+static int backlog_slotblank(uint32_t slot)
+{
+  uint8_t buf[BACKLOG_RECSIZE];
+  if (blfl.read(blfl.ctx, slot * BACKLOG_RECSIZE, buf, sizeof(buf)) != ESP_OK) {
+    return 0;
+  }
+  for (size_t i = 0; i < sizeof(buf); i++) {
+    if (buf[i] != 0xff) { return 0; }
+  }
+  return 1;
+}
+
+/* Erases a sector. Whatever was still pending in there is lost. */
+static esp_err_t backlog_erasesector(uint32_t sector)
+{
+  uint32_t first = sector * BACKLOG_SLOTSPERSECTOR;
+  long totalpending = 0;
+  for (int d = 0; d < SUBMITDEST_COUNT; d++) {
+    totalpending += blstats.pending[d];
+  }
+  if (totalpending > 0) {
+    for (uint32_t slot = first; slot < (first + BACKLOG_SLOTSPERSECTOR); slot++) {
+      struct backlogrec r;
+      if ((backlog_readrec(slot, &r) != ESP_OK) || (!backlog_recvalid(&r))) {
+        continue;
+      }
+      int lost = 0;
+      for (int d = 0; d < SUBMITDEST_COUNT; d++) {
+        if (backlog_recpending(&r, d)) {
+          blstats.pending[d]--;
+          lost = 1;
+        }
+      }
+      if (lost) { blstats.overwritten++; }
+    }
+    for (int d = 0; d < SUBMITDEST_COUNT; d++) {
+      if ((bltail[d] >= first) && (bltail[d] < (first + BACKLOG_SLOTSPERSECTOR))) {
+        bltail[d] = (first + BACKLOG_SLOTSPERSECTOR) % blslots;
+      }
+    }
+  }
+  blstats.erases++;
+  return blfl.erase(blfl.ctx, sector * BACKLOG_SECTORSIZE, BACKLOG_SECTORSIZE);
+}
+
+esp_err_t backlog_init_flash(const struct backlogflash * fl)
+{
+  struct backlogrec r;
+  int found = 0;
+  uint32_t maxseq = 0;
+  int foundpending[SUBMITDEST_COUNT] = { 0 };
+  uint32_t minpendingseq[SUBMITDEST_COUNT] = { 0 };
+
+  blavail = 0;
+  memset(&blstats, 0, sizeof(blstats));
+  blfl = *fl;
+  blslots = (fl->size / BACKLOG_SECTORSIZE) * BACKLOG_SLOTSPERSECTOR;
+  /* We need at least two sectors, otherwise wrapping around would
+   * erase the whole backlog at once. */
+  if (blslots < (2 * BACKLOG_SLOTSPERSECTOR)) {
+    ESP_LOGE("backlog.c", "Flash for the backlog is too small (%u bytes).", (unsigned)fl->size);
+    return ESP_ERR_INVALID_SIZE;
+  }
+  blhead = 0;
+  for (uint32_t slot = 0; slot < blslots; slot++) {
+    esp_err_t err = backlog_readrec(slot, &r);
+    if (err != ESP_OK) {
+      ESP_LOGE("backlog.c", "Failed to read the backlog: %s", esp_err_to_name(err));
+      return err;
+    }
+    if (!backlog_recvalid(&r)) {
+      continue;
+    }
+    if ((!found) || (r.seq > maxseq)) {
+      found = 1;
+      maxseq = r.seq;
+      blhead = (slot + 1) % blslots;
+    }
+    for (int d = 0; d < SUBMITDEST_COUNT; d++) {
+      if (backlog_recpending(&r, d)) {
+        blstats.pending[d]++;
+        if ((!foundpending[d]) || (r.seq < minpendingseq[d])) {
+          foundpending[d] = 1;
+          minpendingseq[d] = r.seq;
+          bltail[d] = slot;
+        }
+      }
+    }
+  }
+  blnextseq = (found) ? (maxseq + 1) : 0;
+  for (int d = 0; d < SUBMITDEST_COUNT; d++) {
+    if (!foundpending[d]) { bltail[d] = blhead; }
+  }
+  blstats.available = 1;
+  blstats.slots = blslots;
+  blavail = 1;
+  ESP_LOGI("backlog.c", "Backlog initialized: %lu slots, %ld/%ld batches pending.",
+           (unsigned long)blslots, blstats.pending[SUBMITDEST_WPD],
+           blstats.pending[SUBMITDEST_OSM]);
+  return ESP_OK;
+}
+
+esp_err_t backlog_append(const struct submitbatch * b, int pendingmask)
+{
+  struct backlogrec r;
+  if (!blavail) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  if (b->ts < BACKLOG_MINVALIDTS) {
+    ESP_LOGW("backlog.c", "Not storing batch in backlog, it has no valid timestamp.");
+    return ESP_ERR_INVALID_ARG;
+  }
+  memset(&r, 0, sizeof(r));
+  r.magic = BACKLOG_MAGIC;
+  r.seq = blnextseq;
+  r.ts = (uint32_t)b->ts;
+  r.valid = b->valid;
+  memcpy(r.values, b->values, sizeof(r.values));
+  r.crc = backlog_reccrc(&r);
+  for (int d = 0; d < SUBMITDEST_COUNT; d++) {
+    r.pending[d] = (pendingmask & (1 << d)) ? 0xffffffff : 0;
+  }
+  /* Normally, the slot at blhead is erased and we can just write to it.
+   * But after a reset in the middle of a write, there might be garbage,
+   * and in that case we skip ahead to the next usable slot. */
+  for (uint32_t tries = 0; tries < blslots; tries++) {
+    uint32_t slot = blhead;
+    blhead = (blhead + 1) % blslots;
+    if ((slot % BACKLOG_SLOTSPERSECTOR) == 0) {
+      esp_err_t err = backlog_erasesector(slot / BACKLOG_SLOTSPERSECTOR);
+      if (err != ESP_OK) {
+        ESP_LOGE("backlog.c", "Failed to erase backlog sector: %s", esp_err_to_name(err));
+        return err;
+      }
+    } else if (!backlog_slotblank(slot)) {
+      continue;
+    }
+    esp_err_t err = blfl.write(blfl.ctx, slot * BACKLOG_RECSIZE, &r, sizeof(r));
+    if (err != ESP_OK) {
+      ESP_LOGE("backlog.c", "Failed to write to backlog: %s", esp_err_to_name(err));
+      return err;
+    }
+    blnextseq++;
+    for (int d = 0; d < SUBMITDEST_COUNT; d++) {
+      if (backlog_recpending(&r, d)) {
+        if (blstats.pending[d] <= 0) { bltail[d] = slot; }
+        blstats.pending[d]++;
+      }
+    }
+    return ESP_OK;
+  }
+  return ESP_FAIL;
+}
+
+long backlog_pending(int d)
+{
+  return (blavail) ? blstats.pending[d] : 0;
+}
+
+int backlog_peek(int d, struct submitbatch * out, uint32_t * handles, int max)
+{
+  int n = 0;
+  if ((!blavail) || (blstats.pending[d] <= 0)) {
+    return 0;
+  }
+  /* Walk from the tail to the newest record. The oldest slot in the
+   * ring is the one at blhead, so that tells us how far we may go. */
+  uint32_t slot = bltail[d];
+  uint32_t togo = blslots - ((bltail[d] + blslots - blhead) % blslots);
+  for (; (togo > 0) && (n < max); togo--) {
+    struct backlogrec r;
+    if (backlog_readrec(slot, &r) != ESP_OK) {
+      break;
+    }
+    if (backlog_recvalid(&r) && backlog_recpending(&r, d)) {
+      out[n].ts = r.ts;
+      out[n].valid = r.valid;
+      memcpy(out[n].values, r.values, sizeof(out[n].values));
+      handles[n] = slot;
+      n++;
+    } else if (n == 0) {
+      /* Nothing pending here, no need to ever look at this slot again */
+      bltail[d] = (slot + 1) % blslots;
+    }
+    slot = (slot + 1) % blslots;
+  }
+  return n;
+}
+
+void backlog_marksent(int d, const uint32_t * handles, int n)
+{
+  const uint32_t zero = 0;
+  if (!blavail) {
+    return;
+  }
+  for (int i = 0; i < n; i++) {
+    size_t offset = (handles[i] * BACKLOG_RECSIZE) + offsetof(struct backlogrec, pending)
+                  + (d * sizeof(uint32_t));
+    if (blfl.write(blfl.ctx, offset, &zero, sizeof(zero)) == ESP_OK) {
+      blstats.pending[d]--;
+    }
+  }
+  if (n > 0) {
+    bltail[d] = (handles[n - 1] + 1) % blslots;
+  }
+}
+
+void backlog_getstats(struct backlogstats * st)
+{
+  *st = blstats;
+}
+
+#ifdef ESP_PLATFORM
+static esp_err_t backlog_partread(void * ctx, size_t offset, void * buf, size_t len)
+{
+  return esp_partition_read((const esp_partition_t *)ctx, offset, buf, len);
+}
+
+static esp_err_t backlog_partwrite(void * ctx, size_t offset, const void * buf, size_t len)
+{
+  return esp_partition_write((const esp_partition_t *)ctx, offset, buf, len);
+}
+
+static esp_err_t backlog_parterase(void * ctx, size_t offset, size_t len)
+{
+  return esp_partition_erase_range((const esp_partition_t *)ctx, offset, len);
+}
+
+esp_err_t backlog_init(void)
+{
+  const esp_partition_t * part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+                                                          ESP_PARTITION_SUBTYPE_ANY,
+                                                          "backlog");
+  if (part == NULL) {
+    ESP_LOGW("backlog.c", "No backlog partition found - measurements that cannot be submitted will be lost. Reflash the partition table to fix this.");
+    return ESP_ERR_NOT_FOUND;
+  }
+  struct backlogflash fl = {
+    .ctx = (void *)part,
+    .size = part->size,
+    .read = backlog_partread,
+    .write = backlog_partwrite,
+    .erase = backlog_parterase,
+  };
+  return backlog_init_flash(&fl);
+}
+#endif /* ESP_PLATFORM */
@@ -0,0 +1,67 @@
+/* ZAMDACH2022
+ * Store-and-forward backlog for measurements that could not be
+ * submitted, kept in a ring log on a dedicated flash partition. */
+
+#ifndef _BACKLOG_H_
+#define _BACKLOG_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <esp_err.h>
+#include "submit.h"
+
+/* The flash the backlog lives in. On the ESP this is the "backlog"
+ * partition, but anything that behaves like NOR flash (erase sets
+ * everything to 0xff, writes can only clear bits) will do - e.g. a
+ * file on the host for testing. offset and len for erase are always
+ * multiples of BACKLOG_SECTORSIZE. */
+#define BACKLOG_SECTORSIZE 4096
+struct backlogflash {
+  void * ctx;
+  size_t size;
+  esp_err_t (*read)(void * ctx, size_t offset, void * buf, size_t len);
+  esp_err_t (*write)(void * ctx, size_t offset, const void * buf, size_t len);
+  esp_err_t (*erase)(void * ctx, size_t offset, size_t len);
+};
+
+/* Initializes the backlog on the "backlog" flash partition and scans
+ * it for batches that are still pending from before the last reset.
+ * If there is no such partition (e.g. because the device has been
+ * OTA-updated from a firmware with an older partition table), this
+ * returns an error and all the other functions do nothing. */
+esp_err_t backlog_init(void);
+
+/* The same, but with an arbitrary flash. */
+esp_err_t backlog_init_flash(const struct backlogflash * fl);
+
+/* Appends a batch to the backlog. pendingmask has (1 << SUBMITDEST_xxx)
+ * set for every destination the batch still needs to be sent to.
+ * If the backlog is full, the oldest batches are overwritten. */
+esp_err_t backlog_append(const struct submitbatch * b, int pendingmask);
+
+/* Returns the number of batches pending for destination d. */
+long backlog_pending(int d);
+
+/* Fetches up to max of the oldest batches pending for destination d,
+ * oldest first. handles receives one handle per batch that needs to be
+ * handed to backlog_marksent() once the batches have been submitted.
+ * Returns the number of batches fetched. */
+int backlog_peek(int d, struct submitbatch * out, uint32_t * handles, int max);
+
+/* Marks batches previously fetched with backlog_peek() as sent for
+ * destination d. */
+void backlog_marksent(int d, const uint32_t * handles, int n);
+
+struct backlogstats {
+  int available;
+  long slots;
+  long pending[SUBMITDEST_COUNT];
+  long overwritten; /* pending batches that were lost because the backlog was full */
+  long erases; /* sector erases since boot */
+};
+
+/* Gets the current statistics. These are only updated by the task that
+ * uses the backlog, so the copy might be slightly inconsistent. */
+void backlog_getstats(struct backlogstats * st);
+
+#endif /* _BACKLOG_H_ */
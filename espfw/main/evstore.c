@@ -0,0 +1,50 @@
+/* ZAMDACH2022
+ * The values last published, kept in a seqlock.
+ *
+ * The writer makes curevseq odd while it is updating curev, and even
+ * again afterwards. Readers copy curev and retry if curevseq was odd or
+ * changed in the meantime, so they always get a consistent copy without
+ * ever blocking the writer. The fences are the ones from Boehm, "Can
+ * seqlocks get along with programming language memory models?": the
+ * release fence keeps the stores to curev from becoming visible before
+ * curevseq is odd, the acquire fence keeps the reads of curev from
+ * happening after the second read of curevseq. */
+
+#include <stdatomic.h>
+#include <string.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include "evstore.h"
+
+static struct ev curev;
+static atomic_uint curevseq = 0;
+
+void evstore_put(const struct ev * e)
+{
+  unsigned int seq = atomic_load_explicit(&curevseq, memory_order_relaxed);
+  atomic_store_explicit(&curevseq, seq + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  memcpy(&curev, e, sizeof(curev));
+  atomic_store_explicit(&curevseq, seq + 2, memory_order_release);
+}
+
+void evstore_get(struct ev * e)
+{
+  int tries = 0;
+  while (1) {
+    unsigned int seq1 = atomic_load_explicit(&curevseq, memory_order_acquire);
+    if ((seq1 & 1) == 0) {
+      memcpy(e, &curev, sizeof(struct ev));
+      atomic_thread_fence(memory_order_acquire);
+      if (atomic_load_explicit(&curevseq, memory_order_relaxed) == seq1) {
+        return;
+      }
+    }
+    /* The main loop runs at a lower priority than the webserver. If
+     * it got preempted in the middle of an update on our core, it
+     * would never finish while we keep spinning. */
+    if (++tries > 3) {
+      vTaskDelay(1);
+    }
+  }
+}
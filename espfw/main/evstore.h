@@ -0,0 +1,18 @@
+/* ZAMDACH2022
+ * The values last published, kept in a seqlock so that any task can
+ * get a consistent copy without ever blocking the one that publishes. */
+
+#ifndef _EVSTORE_H_
+#define _EVSTORE_H_
+
+#include <time.h>
+#include "webserver.h" /* for struct ev */
+
+/* Stores new values. There must only ever be one task calling this. */
+void evstore_put(const struct ev * e);
+
+/* Gets a consistent copy of the values last stored. Can be called
+ * from any task, but not from an ISR. */
+void evstore_get(struct ev * e);
+
+#endif /* _EVSTORE_H_ */
@@ -0,0 +1,228 @@
+/* ZAMDACH2022
+ * Keeps the values of the last 24 hours (one row per measurement
+ * cycle) in RAM, for serving them via /history. */
+
+#include <math.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <esp_log.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include "history.h"
+
+const struct histfielddesc history_fields[HISTFIELD_COUNT] = {
+  [HISTFIELD_TEMP]       = { "temp",       100,    0, 2, 0 },
+  [HISTFIELD_HUM]        = { "hum",        100,    0, 2, 0 },
+  /* 1000 hPa +- 327 hPa is plenty, even on the Zugspitze. */
+  [HISTFIELD_PRESS]      = { "press",      100, 1000, 2, 0 },
+  [HISTFIELD_PM010]      = { "pm010",       10,    0, 1, 0 },
+  [HISTFIELD_PM025]      = { "pm025",       10,    0, 1, 0 },
+  [HISTFIELD_PM040]      = { "pm040",       10,    0, 1, 0 },
+  [HISTFIELD_PM100]      = { "pm100",       10,    0, 1, 0 },
+  /* Direct sunlight is more than 100000 lux. */
+  [HISTFIELD_LUX]        = { "lux",        100,    0, 2, 1 },
+  [HISTFIELD_UVIND]      = { "uvind",      100,    0, 2, 0 },
+  [HISTFIELD_RAING]      = { "raing",      100,    0, 2, 0 },
+  [HISTFIELD_WINDSPEED]  = { "windspeed",   10,    0, 1, 0 },
+  [HISTFIELD_WINDSPMAX]  = { "windspmax",   10,    0, 1, 0 },
+  [HISTFIELD_WINDDIRDEG] = { "winddirdeg",  10,    0, 1, 0 },
+};
+
+/* Structure of arrays: one array per field, so that every field
+ * only takes the space it needs, without any padding. */
+static uint32_t * histts = NULL;
+static void * histvals[HISTFIELD_COUNT];
+/* Rows ever added. The next one goes to histadded % HISTORY_ROWS.
+ * At one row per minute, this wraps around after 8000 years. */
+static uint32_t histadded = 0;
+static int histcount = 0;
+static portMUX_TYPE histlock = portMUX_INITIALIZER_UNLOCKED;
+
+void history_init(void)
+{
+  size_t sz = HISTORY_ROWS * sizeof(uint32_t);
+  for (int f = 0; f < HISTFIELD_COUNT; f++) {
+    sz += HISTORY_ROWS * ((history_fields[f].wide) ? sizeof(int32_t) : sizeof(int16_t));
+  }
+  uint8_t * mem = malloc(sz);
+  if (mem == NULL) {
+    ESP_LOGE("history.c", "Failed to allocate %u bytes for the history, running without.", (unsigned)sz);
+    return;
+  }
+  histts = (uint32_t *)mem;
+  mem += HISTORY_ROWS * sizeof(uint32_t);
+  for (int f = 0; f < HISTFIELD_COUNT; f++) {
+    histvals[f] = mem;
+    mem += HISTORY_ROWS * ((history_fields[f].wide) ? sizeof(int32_t) : sizeof(int16_t));
+  }
+  ESP_LOGI("history.c", "History for %d measurements allocated, %u bytes.", HISTORY_ROWS, (unsigned)sz);
+}
+
+/* Converts to fixed point, saturating. NaN becomes the invalid marker. */
+static int32_t history_toraw(int f, float v)
+{
+  const struct histfielddesc * fd = &history_fields[f];
+  int32_t min = (fd->wide) ? (INT32_MIN + 1) : (INT16_MIN + 1);
+  int32_t max = (fd->wide) ? INT32_MAX : INT16_MAX;
+  if (isnan(v)) {
+    return min - 1;
+  }
+  double r = round(((double)v - fd->offset) * fd->scale);
+  if (r < min) { return min; }
+  if (r > max) { return max; }
+  return (int32_t)r;
+}
+
+int history_rawisvalid(int f, int32_t raw)
+{
+  return (raw != ((history_fields[f].wide) ? INT32_MIN : INT16_MIN));
+}
+
+void history_add(const struct ev * e)
+{
+  int32_t raw[HISTFIELD_COUNT];
+  if (histts == NULL) {
+    return;
+  }
+  raw[HISTFIELD_TEMP] = history_toraw(HISTFIELD_TEMP, e->temp);
+  raw[HISTFIELD_HUM] = history_toraw(HISTFIELD_HUM, e->hum);
+  raw[HISTFIELD_PRESS] = history_toraw(HISTFIELD_PRESS, e->press);
+  raw[HISTFIELD_PM010] = history_toraw(HISTFIELD_PM010, e->pm010);
+  raw[HISTFIELD_PM025] = history_toraw(HISTFIELD_PM025, e->pm025);
+  raw[HISTFIELD_PM040] = history_toraw(HISTFIELD_PM040, e->pm040);
+  raw[HISTFIELD_PM100] = history_toraw(HISTFIELD_PM100, e->pm100);
+  raw[HISTFIELD_LUX] = history_toraw(HISTFIELD_LUX, e->lux);
+  raw[HISTFIELD_UVIND] = history_toraw(HISTFIELD_UVIND, e->uvind);
+  raw[HISTFIELD_RAING] = history_toraw(HISTFIELD_RAING, e->raing);
+  raw[HISTFIELD_WINDSPEED] = history_toraw(HISTFIELD_WINDSPEED, e->windspeed);
+  raw[HISTFIELD_WINDSPMAX] = history_toraw(HISTFIELD_WINDSPMAX, e->windspmax);
+  /* winddirdeg is -1 if there is no valid wind direction. */
+  raw[HISTFIELD_WINDDIRDEG] = history_toraw(HISTFIELD_WINDDIRDEG,
+                                            (e->winddirdeg < 0.0) ? NAN : e->winddirdeg);
+  taskENTER_CRITICAL(&histlock);
+  int r = histadded % HISTORY_ROWS;
+  histts[r] = e->lastupd;
+  for (int f = 0; f < HISTFIELD_COUNT; f++) {
+    if (history_fields[f].wide) {
+      ((int32_t *)histvals[f])[r] = raw[f];
+    } else {
+      ((int16_t *)histvals[f])[r] = raw[f];
+    }
+  }
+  histadded++;
+  if (histcount < HISTORY_ROWS) { histcount++; }
+  taskEXIT_CRITICAL(&histlock);
+}
+
+int history_count(void)
+{
+  return histcount;
+}
+
+void history_range(uint32_t * first, uint32_t * end)
+{
+  taskENTER_CRITICAL(&histlock);
+  *first = histadded - histcount;
+  *end = histadded;
+  taskEXIT_CRITICAL(&histlock);
+}
+
+int history_getraw(uint32_t seq, uint32_t * ts, int32_t * raw)
+{
+  int res = 1;
+  taskENTER_CRITICAL(&histlock);
+  /* Unsigned, so this also rejects rows that are still to come. */
+  if ((histadded - seq - 1) < (uint32_t)histcount) {
+    int r = seq % HISTORY_ROWS;
+    *ts = histts[r];
+    for (int f = 0; f < HISTFIELD_COUNT; f++) {
+      if (history_fields[f].wide) {
+        raw[f] = ((int32_t *)histvals[f])[r];
+      } else {
+        raw[f] = ((int16_t *)histvals[f])[r];
+      }
+    }
+    res = 0;
+  }
+  taskEXIT_CRITICAL(&histlock);
+  return res;
+}
+
+int history_fieldbyname(const char * name, size_t len)
+{
+  for (int f = 0; f < HISTFIELD_COUNT; f++) {
+    if ((strlen(history_fields[f].name) == len)
+     && (strncmp(history_fields[f].name, name, len) == 0)) {
+      return f;
+    }
+  }
+  return -1;
+}
+
+/* Appends a little endian integer of n bytes. */
+static void history_putle(struct sbuf * sb, uint32_t v, int n)
+{
+  for (int i = 0; i < n; i++) {
+    sbuf_putc(sb, (v >> (8 * i)) & 0xff);
+  }
+}
+
+void history_query(const struct histquery * q, struct sbuf * sb,
+                   void (*flush)(struct sbuf * sb, void * ctx), void * ctx)
+{
+  if (q->binary) {
+    sbuf_puts(sb, "ZDH1");
+    sbuf_putc(sb, q->nf);
+    for (int i = 0; i < q->nf; i++) {
+      const struct histfielddesc * fd = &history_fields[q->fields[i]];
+      sbuf_putc(sb, strlen(fd->name));
+      sbuf_puts(sb, fd->name);
+      history_putle(sb, fd->scale, 4);
+      history_putle(sb, fd->offset, 4);
+      sbuf_putc(sb, (fd->wide) ? 4 : 2);
+    }
+  } else {
+    sbuf_puts(sb, "ts");
+    for (int i = 0; i < q->nf; i++) {
+      sbuf_putc(sb, ',');
+      sbuf_puts(sb, history_fields[q->fields[i]].name);
+    }
+    sbuf_putc(sb, '\n');
+  }
+  flush(sb, ctx);
+  /* The range is taken once: rows added while we are sending are not
+   * part of this answer, and rows that get overwritten in the meantime
+   * are skipped instead of being sent twice or out of order. */
+  uint32_t first, end;
+  history_range(&first, &end);
+  for (uint32_t seq = first; seq != end; seq++) {
+    uint32_t ts;
+    int32_t raw[HISTFIELD_COUNT];
+    if (history_getraw(seq, &ts, raw) != 0) {
+      continue;
+    }
+    if ((ts < q->from) || (ts > q->to)) {
+      continue;
+    }
+    /* A row is at most 4 + 13 * 4 bytes binary or about 150 bytes CSV. */
+    if (q->binary) {
+      history_putle(sb, ts, 4);
+      for (int i = 0; i < q->nf; i++) {
+        history_putle(sb, raw[q->fields[i]], (history_fields[q->fields[i]].wide) ? 4 : 2);
+      }
+    } else {
+      sbuf_putll(sb, ts);
+      for (int i = 0; i < q->nf; i++) {
+        int f = q->fields[i];
+        sbuf_putc(sb, ',');
+        if (history_rawisvalid(f, raw[f])) {
+          const struct histfielddesc * fd = &history_fields[f];
+          sbuf_putfloat(sb, (float)raw[f] / fd->scale + fd->offset, fd->decimals);
+        }
+      }
+      sbuf_putc(sb, '\n');
+    }
+    flush(sb, ctx);
+  }
+}
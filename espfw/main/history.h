@@ -0,0 +1,93 @@
+/* ZAMDACH2022
+ * Keeps the values of the last 24 hours (one row per measurement
+ * cycle) in RAM, for serving them via /history. */
+
+#ifndef _HISTORY_H_
+#define _HISTORY_H_
+
+#include <stdint.h>
+#include <time.h>
+#include "sbuf.h"
+#include "webserver.h"
+
+/* How many measurement cycles we keep. At one per minute, that is
+ * 24 hours. */
+#define HISTORY_ROWS 1440
+
+/* The values we keep. Do not confuse with enum submitfield, these
+ * are the values from struct ev. */
+enum histfield {
+  HISTFIELD_TEMP = 0,
+  HISTFIELD_HUM,
+  HISTFIELD_PRESS,
+  HISTFIELD_PM010,
+  HISTFIELD_PM025,
+  HISTFIELD_PM040,
+  HISTFIELD_PM100,
+  HISTFIELD_LUX,
+  HISTFIELD_UVIND,
+  HISTFIELD_RAING,
+  HISTFIELD_WINDSPEED,
+  HISTFIELD_WINDSPMAX,
+  HISTFIELD_WINDDIRDEG,
+  HISTFIELD_COUNT
+};
+
+/* Values are stored in fixed point: value = raw / scale + offset.
+ * Most fields use 16 bits, those that need it (wide) 32 bits.
+ * The smallest possible raw value (INT16_MIN / INT32_MIN) marks
+ * an invalid value. */
+struct histfielddesc {
+  const char * name; /* same as the key in /json */
+  int32_t scale;
+  int32_t offset;
+  int decimals;
+  int wide;
+};
+extern const struct histfielddesc history_fields[HISTFIELD_COUNT];
+
+/* Allocates the ring. Without calling this, all the other
+ * functions do nothing. */
+void history_init(void);
+
+/* Appends the values from one measurement cycle, overwriting the
+ * oldest row if the ring is full. */
+void history_add(const struct ev * e);
+
+/* Returns the number of rows currently stored. */
+int history_count(void);
+
+/* Rows are numbered in the order they were added, and keep their
+ * number while rows are added after them. This gets the number of
+ * the oldest row still stored (*first) and of the row that will be
+ * added next (*end), both at the same point in time. */
+void history_range(uint32_t * first, uint32_t * end);
+
+/* Copies row seq in raw form. raw receives HISTFIELD_COUNT values,
+ * each sign-extended to 32 bits. Returns 0 on success, 1 if there is
+ * no such row (anymore), i.e. it has been overwritten since. */
+int history_getraw(uint32_t seq, uint32_t * ts, int32_t * raw);
+
+/* Checks whether a raw value is the invalid marker for field f. */
+int history_rawisvalid(int f, int32_t raw);
+
+/* Looks up a field by name, returns -1 if there is none. */
+int history_fieldbyname(const char * name, size_t len);
+
+/* What to send for /history, see get_history_handler() in webserver.c
+ * for the formats. */
+struct histquery {
+  uint32_t from;
+  uint32_t to;
+  int binary;
+  int nf;
+  uint8_t fields[HISTFIELD_COUNT];
+};
+
+/* Writes the header and all rows matching q into sb. Calls
+ * flush(sb, ctx) after the header (at most 300 bytes) and after every
+ * row (at most 200 bytes), flush has to make room in sb. */
+void history_query(const struct histquery * q, struct sbuf * sb,
+                   void (*flush)(struct sbuf * sb, void * ctx), void * ctx);
+
+#endif /* _HISTORY_H_ */
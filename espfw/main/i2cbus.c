@@ -0,0 +1,588 @@
+/* ZAMDACH2022
+ * A transaction layer on top of the I2C driver: every I2C port gets a
+ * queue and a worker task that does all the talking on that bus. */
+
+#include <stdio.h>
+#include <string.h>
+#include <esp_idf_version.h>
+#include <esp_log.h>
+#include <esp_rom_sys.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/task.h>
+#include "driver/gpio.h"
+#include "i2cbus.h"
+
+/* ESP-IDF 5.2 brought the new i2c_master driver, which deprecates the
+ * old one. The two cannot be linked into the same firmware. */
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 2, 0)
+#define I2CBUS_NEWDRIVER 1
+#include "driver/i2c_master.h"
+#else
+#define I2CBUS_NEWDRIVER 0
+#include "driver/i2c.h"
+#endif
+
+static int i2cbus_driverinit(int port, void * bectx);
+static int i2cbus_driveradddevice(int port, int devidx, uint8_t addr, uint32_t sclhz, void * bectx);
+static esp_err_t i2cbus_driverexec(int port, struct i2ctrans * t, void * bectx);
+static int i2cbus_driversdastuck(int port, void * bectx);
+static int i2cbus_driverrecover(int port, void * bectx);
+
+static const struct i2cbackend i2cbus_driverbackend = {
+  .init = i2cbus_driverinit,
+  .adddevice = i2cbus_driveradddevice,
+  .exec = i2cbus_driverexec,
+  .sdastuck = i2cbus_driversdastuck,
+  .recover = i2cbus_driverrecover,
+  .bectx = NULL
+};
+
+struct i2cbusdev {
+  struct i2cdevstats stats;
+  uint32_t sclhz;
+  void (*reinit)(void);
+  int needsreinit;
+  /* Set while reinit runs. It talks to the device through
+   * i2cbus_exec() too, and if the bus wedges again in the middle of
+   * that, those nested calls must not start another reinit. */
+  int inreinit;
+};
+
+struct i2cbusport {
+  QueueHandle_t queue;
+  const struct i2cbackend * be;
+  struct i2cbusconfig conf;
+#if I2CBUS_NEWDRIVER
+  i2c_master_bus_handle_t bus;
+  i2c_master_dev_handle_t devhandles[I2CBUS_MAXDEVS];
+#else
+  /* Only used by the worker task of the port. */
+  uint8_t linkbuf[I2C_LINK_RECOMMENDED_SIZE(2 * I2CBUS_MAXOPS)];
+#endif
+  int consectimeouts;
+  /* Everything below is protected by i2cstatsspinlock. */
+  struct i2cbusstats stats;
+  int ndevs;
+  struct i2cbusdev devs[I2CBUS_MAXDEVS];
+};
+static struct i2cbusport i2cports[I2CBUS_PORTS];
+static portMUX_TYPE i2cstatsspinlock = portMUX_INITIALIZER_UNLOCKED;
+
+/* Finds the device with address addr on port. Call with
+ * i2cstatsspinlock held. */
+static struct i2cbusdev * i2cbus_finddev(int port, uint8_t addr)
+{
+  struct i2cbusport * p = &i2cports[port];
+  for (int i = 0; i < p->ndevs; i++) {
+    if (p->devs[i].stats.addr == addr) {
+      return &p->devs[i];
+    }
+  }
+  return NULL;
+}
+
+/* Checks whether SDA is held low. The pin stays readable while it is
+ * assigned to the I2C controller. */
+static int i2cbus_driversdastuck(int port, void * bectx)
+{
+  return (gpio_get_level(i2cports[port].conf.sdapin) == 0);
+}
+
+#if I2CBUS_NEWDRIVER
+
+static int i2cbus_driverinit(int port, void * bectx)
+{
+  struct i2cbusport * p = &i2cports[port];
+  i2c_master_bus_config_t bc = {
+    .i2c_port = port,
+    .sda_io_num = p->conf.sdapin,
+    .scl_io_num = p->conf.sclpin,
+    .clk_source = I2C_CLK_SRC_DEFAULT,
+    .glitch_ignore_cnt = 7,
+    /* The worker already makes transfers asynchronous for everyone
+     * else, and in the synchronous mode, the driver reports the
+     * result of every single transfer. */
+    .trans_queue_depth = 0,
+    .flags.enable_internal_pullup = p->conf.pullups,
+  };
+  return (i2c_new_master_bus(&bc, &p->bus) != ESP_OK);
+}
+
+/* Every device gets its own handle, with its own clock speed. */
+static int i2cbus_driveradddevice(int port, int devidx, uint8_t addr, uint32_t sclhz, void * bectx)
+{
+  struct i2cbusport * p = &i2cports[port];
+  i2c_device_config_t dc = {
+    .dev_addr_length = I2C_ADDR_BIT_LEN_7,
+    .device_address = addr,
+    .scl_speed_hz = sclhz,
+  };
+  return (i2c_master_bus_add_device(p->bus, &dc, &p->devhandles[devidx]) != ESP_OK);
+}
+
+/* Executes t with the new driver. It has no way to chain several
+ * operations into one transfer, so every operation is a transfer of
+ * its own, with a stop at the end. */
+static esp_err_t i2cbus_driverexec(int port, struct i2ctrans * t, void * bectx)
+{
+  struct i2cbusport * p = &i2cports[port];
+  for (int i = 0; i < t->nops; i++) {
+    const struct i2cop * op = &t->ops[i];
+    i2c_master_dev_handle_t dev = NULL;
+    taskENTER_CRITICAL(&i2cstatsspinlock);
+    struct i2cbusdev * d = i2cbus_finddev(port, op->addr);
+    if (d != NULL) {
+      dev = p->devhandles[d - &p->devs[0]];
+    }
+    taskEXIT_CRITICAL(&i2cstatsspinlock);
+    if (dev == NULL) {
+      /* The new driver can only talk to registered devices. */
+      return ESP_ERR_INVALID_ARG;
+    }
+    esp_err_t res;
+    if ((op->wrlen > 0) && (op->rdlen > 0)) {
+      res = i2c_master_transmit_receive(dev, op->wr, op->wrlen, op->rd, op->rdlen, t->timeoutms);
+    } else if (op->wrlen > 0) {
+      res = i2c_master_transmit(dev, op->wr, op->wrlen, t->timeoutms);
+    } else {
+      res = i2c_master_receive(dev, op->rd, op->rdlen, t->timeoutms);
+    }
+    if ((res == ESP_ERR_INVALID_STATE) || (res == ESP_ERR_INVALID_RESPONSE)) {
+      /* That is how the new driver reports a NACK (depending on the
+       * version). The rest of this file expects ESP_FAIL, like the old
+       * driver returns it. */
+      res = ESP_FAIL;
+    }
+    if (res != ESP_OK) {
+      return res;
+    }
+  }
+  return ESP_OK;
+}
+
+/* The new driver can do the clock-out and STOP itself, and it resets
+ * the controller while it is at it. */
+static int i2cbus_driverrecover(int port, void * bectx)
+{
+  if (i2c_master_bus_reset(i2cports[port].bus) != ESP_OK) {
+    return 1;
+  }
+  return i2cbus_driversdastuck(port, bectx);
+}
+
+#else /* !I2CBUS_NEWDRIVER */
+
+/* The old driver has one clock speed for the whole bus. */
+static void i2cbus_legacyconf(int port, i2c_config_t * ic)
+{
+  struct i2cbusport * p = &i2cports[port];
+  memset(ic, 0, sizeof(i2c_config_t));
+  ic->mode = I2C_MODE_MASTER;
+  ic->sda_io_num = p->conf.sdapin;
+  ic->scl_io_num = p->conf.sclpin;
+  ic->sda_pullup_en = (p->conf.pullups) ? GPIO_PULLUP_ENABLE : GPIO_PULLUP_DISABLE;
+  ic->scl_pullup_en = (p->conf.pullups) ? GPIO_PULLUP_ENABLE : GPIO_PULLUP_DISABLE;
+  ic->master.clk_speed = p->conf.sclhz;
+}
+
+static int i2cbus_driverinit(int port, void * bectx)
+{
+  i2c_config_t ic;
+  i2cbus_legacyconf(port, &ic);
+  i2c_param_config(port, &ic);
+  return (i2c_driver_install(port, ic.mode, 0, 0, 0) != ESP_OK);
+}
+
+static int i2cbus_driveradddevice(int port, int devidx, uint8_t addr, uint32_t sclhz, void * bectx)
+{
+  return 0;
+}
+
+/* Executes t with the old driver, as one command link. */
+static esp_err_t i2cbus_driverexec(int port, struct i2ctrans * t, void * bectx)
+{
+  struct i2cbusport * p = &i2cports[port];
+  i2c_cmd_handle_t cmd = i2c_cmd_link_create_static(p->linkbuf, sizeof(p->linkbuf));
+  if (cmd == NULL) {
+    return ESP_ERR_NO_MEM;
+  }
+  esp_err_t res = ESP_OK;
+  for (int i = 0; i < t->nops; i++) {
+    const struct i2cop * op = &t->ops[i];
+    if (op->wrlen > 0) {
+      res |= i2c_master_start(cmd);
+      res |= i2c_master_write_byte(cmd, (op->addr << 1) | I2C_MASTER_WRITE, true);
+      res |= i2c_master_write(cmd, op->wr, op->wrlen, true);
+    }
+    if (op->rdlen > 0) {
+      res |= i2c_master_start(cmd);
+      res |= i2c_master_write_byte(cmd, (op->addr << 1) | I2C_MASTER_READ, true);
+      res |= i2c_master_read(cmd, op->rd, op->rdlen, I2C_MASTER_LAST_NACK);
+    }
+  }
+  res |= i2c_master_stop(cmd);
+  if (res == ESP_OK) {
+    res = i2c_master_cmd_begin(port, cmd, pdMS_TO_TICKS(t->timeoutms));
+  } else {
+    /* The link buffer was too small. */
+    res = ESP_ERR_NO_MEM;
+  }
+  i2c_cmd_link_delete_static(cmd);
+  return res;
+}
+
+/* The usual recovery for a device that holds SDA low because it got
+ * interrupted in the middle of sending a byte: clock SCL by hand until
+ * the device has shifted out the rest of that byte and lets go of SDA,
+ * then send a STOP. Afterwards, the driver is reinstalled, because the
+ * I2C controller itself may be stuck too. */
+static int i2cbus_driverrecover(int port, void * bectx)
+{
+  struct i2cbusport * p = &i2cports[port];
+  int sda = p->conf.sdapin;
+  int scl = p->conf.sclpin;
+  i2c_driver_delete(port);
+  /* This takes the pins away from the I2C controller. */
+  gpio_set_level(sda, 1);
+  gpio_set_level(scl, 1);
+  gpio_set_direction(sda, GPIO_MODE_INPUT_OUTPUT_OD);
+  gpio_set_direction(scl, GPIO_MODE_INPUT_OUTPUT_OD);
+  esp_rom_delay_us(5);
+  /* 9 clocks are enough for any device to finish its byte and the ACK. */
+  for (int i = 0; (i < 9) && (gpio_get_level(sda) == 0); i++) {
+    gpio_set_level(scl, 0);
+    esp_rom_delay_us(5);
+    gpio_set_level(scl, 1);
+    esp_rom_delay_us(5);
+  }
+  /* STOP: SDA goes high while SCL is high. */
+  gpio_set_level(scl, 0);
+  esp_rom_delay_us(5);
+  gpio_set_level(sda, 0);
+  esp_rom_delay_us(5);
+  gpio_set_level(scl, 1);
+  esp_rom_delay_us(5);
+  gpio_set_level(sda, 1);
+  esp_rom_delay_us(5);
+  int stuck = (gpio_get_level(sda) == 0);
+  /* This gives the pins back to the I2C controller. */
+  if (i2cbus_driverinit(port, bectx) != 0) {
+    ESP_LOGE("i2cbus.c", "Failed to reinstall I2C driver for port %d.", port);
+    return 1;
+  }
+  return stuck;
+}
+
+#endif /* I2CBUS_NEWDRIVER */
+
+int i2cbus_adddevice(int port, uint8_t addr, const char * name, uint32_t sclhz,
+                     void (*reinit)(void))
+{
+  int newidx = -1;
+  if ((port < 0) || (port >= I2CBUS_PORTS)) {
+    return 1;
+  }
+  struct i2cbusport * p = &i2cports[port];
+  taskENTER_CRITICAL(&i2cstatsspinlock);
+  struct i2cbusdev * d = i2cbus_finddev(port, addr);
+  if ((d == NULL) && (p->ndevs < I2CBUS_MAXDEVS)) {
+    newidx = p->ndevs;
+    d = &p->devs[p->ndevs++];
+    memset(d, 0, sizeof(struct i2cbusdev));
+    d->stats.addr = addr;
+    d->sclhz = sclhz;
+  }
+  if (d != NULL) {
+    d->stats.name = name;
+    d->reinit = reinit;
+  }
+  taskEXIT_CRITICAL(&i2cstatsspinlock);
+  if (d == NULL) {
+    ESP_LOGE("i2cbus.c", "No room for device %s on I2C port %d.", name, port);
+    return 1;
+  }
+  /* Devices added before the port was initialized are handed to the
+   * backend by i2cbus_init(). */
+  if ((newidx >= 0) && (p->queue != NULL) && (p->be->adddevice != NULL)) {
+    if (p->be->adddevice(port, newidx, addr, sclhz, p->be->bectx) != 0) {
+      ESP_LOGE("i2cbus.c", "Failed to add device %s to I2C port %d.", name, port);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+void i2cbus_reportcrcerror(int port, uint8_t addr)
+{
+  if ((port < 0) || (port >= I2CBUS_PORTS)) {
+    return;
+  }
+  taskENTER_CRITICAL(&i2cstatsspinlock);
+  struct i2cbusdev * d = i2cbus_finddev(port, addr);
+  if (d != NULL) {
+    d->stats.crcerrors++;
+  }
+  taskEXIT_CRITICAL(&i2cstatsspinlock);
+}
+
+static void i2cbus_updatestats(int port, struct i2ctrans * t)
+{
+  struct i2cbusstats * st = &i2cports[port].stats;
+  uint32_t busus = t->endts - t->startts;
+  uint32_t waitus = t->startts - t->queuedts;
+  taskENTER_CRITICAL(&i2cstatsspinlock);
+  st->transactions++;
+  if (t->res == ESP_ERR_TIMEOUT) {
+    st->timeouts++;
+  } else if (t->res != ESP_OK) {
+    st->errors++;
+  }
+  st->lastus = busus;
+  if (busus > st->maxus) { st->maxus = busus; }
+  st->totalus += busus;
+  if (waitus > st->maxwaitus) { st->maxwaitus = waitus; }
+  struct i2cbusdev * d = i2cbus_finddev(port, t->ops[0].addr);
+  if (d != NULL) {
+    if (t->res == ESP_OK) {
+      d->stats.ok++;
+    } else if (t->res == ESP_ERR_TIMEOUT) {
+      d->stats.timeouts++;
+    } else if (t->res == ESP_FAIL) { /* that is what the driver returns for a NACK */
+      d->stats.nacks++;
+    }
+  }
+  taskEXIT_CRITICAL(&i2cstatsspinlock);
+}
+
+/* Called after a failed transaction. If the bus looks wedged, tries
+ * to recover it right away, so we lose as few measurements as
+ * possible. */
+static void i2cbus_checkwedged(int port, struct i2ctrans * t)
+{
+  struct i2cbusport * p = &i2cports[port];
+  if (t->res == ESP_ERR_TIMEOUT) {
+    p->consectimeouts++;
+  }
+  int sdastuck = (p->be->sdastuck != NULL) && (p->be->sdastuck(port, p->be->bectx));
+  if ((!sdastuck) && (p->consectimeouts < I2CBUS_WEDGETIMEOUTS)) {
+    return;
+  }
+  ESP_LOGW("i2cbus.c", "I2C port %d looks wedged (%s), trying to recover.",
+           port, (sdastuck) ? "SDA held low" : "timeouts");
+  int64_t startts = esp_timer_get_time();
+  int r = (p->be->recover != NULL) ? p->be->recover(port, p->be->bectx) : 1;
+  uint32_t recus = esp_timer_get_time() - startts;
+  p->consectimeouts = 0;
+  taskENTER_CRITICAL(&i2cstatsspinlock);
+  p->stats.recoveries++;
+  if (r != 0) { p->stats.recoveryfails++; }
+  p->stats.lastrecoveryus = recus;
+  /* A device that wedged the bus has probably been reset or lost its
+   * configuration, and we do not know which one it was. But only if
+   * the bus works again: while it is still stuck, rerunning the inits
+   * would just fail again and trigger the next recovery. */
+  if (r == 0) {
+    for (int i = 0; i < p->ndevs; i++) {
+      if (p->devs[i].reinit != NULL) {
+        p->devs[i].needsreinit = 1;
+      }
+    }
+  }
+  taskEXIT_CRITICAL(&i2cstatsspinlock);
+  if (r != 0) {
+    ESP_LOGE("i2cbus.c", "Recovery of I2C port %d failed after %lu us.", port, (unsigned long)recus);
+  } else {
+    ESP_LOGI("i2cbus.c", "I2C port %d recovered in %lu us.", port, (unsigned long)recus);
+  }
+}
+
+static void i2cbus_worker(void * pvParameters)
+{
+  int port = (intptr_t)pvParameters;
+  struct i2cbusport * p = &i2cports[port];
+  while (1) {
+    struct i2ctrans * t;
+    if (xQueueReceive(p->queue, &t, portMAX_DELAY) != pdTRUE) {
+      continue;
+    }
+    t->startts = esp_timer_get_time();
+    t->res = p->be->exec(port, t, p->be->bectx);
+    t->endts = esp_timer_get_time();
+    i2cbus_updatestats(port, t);
+    if (t->res == ESP_OK) {
+      p->consectimeouts = 0;
+    } else {
+      i2cbus_checkwedged(port, t);
+    }
+    /* Careful: once done or the waiter have been told, t may be gone. */
+    TaskHandle_t waiter = t->waiter;
+    if (t->done != NULL) {
+      t->done(t);
+    }
+    if (waiter != NULL) {
+      xTaskNotifyGive(waiter);
+    }
+  }
+}
+
+void i2cbus_setbackend(int port, const struct i2cbackend * be)
+{
+  if ((port < 0) || (port >= I2CBUS_PORTS)) {
+    return;
+  }
+  i2cports[port].be = be;
+}
+
+int i2cbus_init(int port, const struct i2cbusconfig * conf)
+{
+  if ((port < 0) || (port >= I2CBUS_PORTS)) {
+    return 1;
+  }
+  struct i2cbusport * p = &i2cports[port];
+  p->conf = *conf;
+  if (p->be == NULL) {
+    p->be = &i2cbus_driverbackend;
+  }
+  if ((p->be->init != NULL) && (p->be->init(port, p->be->bectx) != 0)) {
+    ESP_LOGE("i2cbus.c", "Failed to initialize I2C port %d.", port);
+    return 1;
+  }
+  /* No need for the spinlock, nobody can use the port yet. */
+  for (int i = 0; (i < p->ndevs) && (p->be->adddevice != NULL); i++) {
+    if (p->be->adddevice(port, i, p->devs[i].stats.addr, p->devs[i].sclhz, p->be->bectx) != 0) {
+      ESP_LOGE("i2cbus.c", "Failed to add device %s to I2C port %d.", p->devs[i].stats.name, port);
+    }
+  }
+  p->queue = xQueueCreate(I2CBUS_QUEUELEN, sizeof(struct i2ctrans *));
+  if (p->queue == NULL) {
+    ESP_LOGE("i2cbus.c", "Failed to create queue for I2C port %d.", port);
+    return 1;
+  }
+  char tname[12];
+  snprintf(tname, sizeof(tname), "i2cbus%d", port);
+  /* Above the sensor lanes, so that a transaction gets onto the bus
+   * as soon as it is submitted. The worker mostly sleeps anyways. */
+  if (xTaskCreate(&i2cbus_worker, tname, 3072, (void *)(intptr_t)port, 5, NULL) != pdPASS) {
+    ESP_LOGE("i2cbus.c", "Failed to create worker task for I2C port %d.", port);
+    vQueueDelete(p->queue);
+    p->queue = NULL;
+    return 1;
+  }
+  return 0;
+}
+
+static int i2cbus_enqueue(int port, struct i2ctrans * t)
+{
+  if ((port < 0) || (port >= I2CBUS_PORTS) || (i2cports[port].queue == NULL)
+   || (t->nops < 1) || (t->nops > I2CBUS_MAXOPS)) {
+    return 1;
+  }
+  t->res = ESP_FAIL;
+  t->queuedts = esp_timer_get_time();
+  /* Never wait here: if the queue is full, the bus is stuck. */
+  if (xQueueSend(i2cports[port].queue, &t, 0) != pdTRUE) {
+    taskENTER_CRITICAL(&i2cstatsspinlock);
+    i2cports[port].stats.queuefull++;
+    taskEXIT_CRITICAL(&i2cstatsspinlock);
+    return 1;
+  }
+  return 0;
+}
+
+int i2cbus_submit(int port, struct i2ctrans * t)
+{
+  t->waiter = NULL;
+  return i2cbus_enqueue(port, t);
+}
+
+esp_err_t i2cbus_exec(int port, struct i2ctrans * t)
+{
+  if ((port >= 0) && (port < I2CBUS_PORTS) && (t->nops > 0)) {
+    void (*reinit)(void) = NULL;
+    taskENTER_CRITICAL(&i2cstatsspinlock);
+    struct i2cbusdev * d = i2cbus_finddev(port, t->ops[0].addr);
+    if ((d != NULL) && (d->needsreinit) && (!d->inreinit)) {
+      /* Cleared before calling reinit, which will call us again. If
+       * another recovery happens during the reinit, the flag is set
+       * again, and the reinit is rerun on the next transaction after
+       * this one - but never from within reinit itself. */
+      d->needsreinit = 0;
+      d->inreinit = 1;
+      d->stats.reinits++;
+      reinit = d->reinit;
+    }
+    taskEXIT_CRITICAL(&i2cstatsspinlock);
+    if (reinit != NULL) {
+      reinit();
+      taskENTER_CRITICAL(&i2cstatsspinlock);
+      d->inreinit = 0;
+      taskEXIT_CRITICAL(&i2cstatsspinlock);
+    }
+  }
+  t->waiter = xTaskGetCurrentTaskHandle();
+  /* Clear a notification that might be left over. */
+  ulTaskNotifyTake(pdTRUE, 0);
+  if (i2cbus_enqueue(port, t) != 0) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  /* This cannot hang forever: the worker finishes every transaction
+   * within its timeout. And we cannot give up early, because then the
+   * worker would later write into a t that no longer exists. */
+  ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+  return t->res;
+}
+
+esp_err_t i2cbus_writeread(int port, uint8_t addr, const uint8_t * wr, size_t wrlen,
+                           uint8_t * rd, size_t rdlen, uint32_t timeoutms)
+{
+  struct i2ctrans t;
+  memset(&t, 0, sizeof(t));
+  t.nops = 1;
+  t.ops[0].addr = addr;
+  t.ops[0].wr = wr;
+  t.ops[0].wrlen = wrlen;
+  t.ops[0].rd = rd;
+  t.ops[0].rdlen = rdlen;
+  t.timeoutms = timeoutms;
+  return i2cbus_exec(port, &t);
+}
+
+esp_err_t i2cbus_write(int port, uint8_t addr, const uint8_t * wr, size_t wrlen,
+                       uint32_t timeoutms)
+{
+  return i2cbus_writeread(port, addr, wr, wrlen, NULL, 0, timeoutms);
+}
+
+esp_err_t i2cbus_read(int port, uint8_t addr, uint8_t * rd, size_t rdlen,
+                      uint32_t timeoutms)
+{
+  return i2cbus_writeread(port, addr, NULL, 0, rd, rdlen, timeoutms);
+}
+
+int i2cbus_getstats(int port, struct i2cbusstats * st)
+{
+  if ((port < 0) || (port >= I2CBUS_PORTS)) {
+    return 1;
+  }
+  taskENTER_CRITICAL(&i2cstatsspinlock);
+  *st = i2cports[port].stats;
+  taskEXIT_CRITICAL(&i2cstatsspinlock);
+  return 0;
+}
+
+int i2cbus_getdevstats(int port, int idx, struct i2cdevstats * st)
+{
+  int res = 1;
+  if ((port < 0) || (port >= I2CBUS_PORTS)) {
+    return 1;
+  }
+  taskENTER_CRITICAL(&i2cstatsspinlock);
+  if ((idx >= 0) && (idx < i2cports[port].ndevs)) {
+    *st = i2cports[port].devs[idx].stats;
+    res = 0;
+  }
+  taskEXIT_CRITICAL(&i2cstatsspinlock);
+  return res;
+}
@@ -0,0 +1,163 @@
+/* ZAMDACH2022
+ * A transaction layer on top of the I2C driver: every I2C port gets a
+ * queue and a worker task that does all the talking on that bus.
+ * Transactions can be submitted asynchronously (with a callback that
+ * is called when they are done) or synchronously. */
+
+#ifndef _I2CBUS_H_
+#define _I2CBUS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <esp_err.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+/* How many I2C ports there are. The ESP32 has two. */
+#define I2CBUS_PORTS 2
+/* How many operations a single transaction can batch. */
+#define I2CBUS_MAXOPS 4
+/* How many transactions can be waiting per port. */
+#define I2CBUS_QUEUELEN 8
+/* How many devices per port we keep health counters for. */
+#define I2CBUS_MAXDEVS 6
+/* After this many timeouts in a row, we consider the bus wedged, even
+ * if SDA does not look stuck. */
+#define I2CBUS_WEDGETIMEOUTS 3
+
+/* How a port is wired up. */
+struct i2cbusconfig {
+  int sdapin;
+  int sclpin;
+  int pullups; /* use the internal pullups? */
+  /* Only used with the old I2C driver, which has one clock speed for
+   * the whole bus. The new one uses the speed of each device. */
+  uint32_t sclhz;
+};
+
+/* One operation: write wrlen bytes, then (with a repeated start) read
+ * rdlen bytes. Either part can be empty. */
+struct i2cop {
+  uint8_t addr;
+  const uint8_t * wr;
+  size_t wrlen;
+  uint8_t * rd;
+  size_t rdlen;
+};
+
+struct i2ctrans;
+typedef void (*i2cdonefn)(struct i2ctrans * t);
+
+/* A transaction: up to I2CBUS_MAXOPS operations that are sent as one
+ * command link, i.e. with repeated starts in between and only one
+ * stop at the end. (The new I2C driver in ESP-IDF 5.2 and later cannot
+ * do that, there every operation ends with a stop.) The struct must stay valid until the transaction
+ * is done. All operations should go to the same device, the health
+ * counters are kept for the address of the first one. */
+struct i2ctrans {
+  int nops;
+  struct i2cop ops[I2CBUS_MAXOPS];
+  uint32_t timeoutms;
+  /* Called from the worker task when the transaction is done. May be
+   * NULL. Must not block. */
+  i2cdonefn done;
+  void * ctx;
+  /* Everything below is filled in by i2cbus.c */
+  TaskHandle_t waiter;
+  esp_err_t res;
+  int64_t queuedts; /* esp_timer time, us */
+  int64_t startts;
+  int64_t endts;
+};
+
+/* The backend that actually executes transactions. The default one
+ * uses the ESP-IDF I2C driver, but it can be replaced, e.g. by a
+ * simulated bus. */
+struct i2cbackend {
+  /* Sets up the port, using the config passed to i2cbus_init(). */
+  int (*init)(int port, void * bectx);
+  /* Registers device number devidx. */
+  int (*adddevice)(int port, int devidx, uint8_t addr, uint32_t sclhz, void * bectx);
+  esp_err_t (*exec)(int port, struct i2ctrans * t, void * bectx);
+  /* Returns 1 if SDA is held low while the bus should be idle. */
+  int (*sdastuck)(int port, void * bectx);
+  /* Tries to get a wedged bus going again. Returns 0 on success. */
+  int (*recover)(int port, void * bectx);
+  void * bectx;
+};
+
+struct i2cbusstats {
+  uint32_t transactions;
+  uint32_t errors;
+  uint32_t timeouts;
+  uint32_t queuefull; /* submits refused because the queue was full */
+  uint32_t lastus; /* how long the last transaction took on the bus */
+  uint32_t maxus;
+  uint64_t totalus;
+  uint32_t maxwaitus; /* how long a transaction waited in the queue at most */
+  uint32_t recoveries; /* how often the bus was found wedged */
+  uint32_t recoveryfails;
+  uint32_t lastrecoveryus; /* how long the last recovery took */
+};
+
+/* Health counters for one device on a bus. */
+struct i2cdevstats {
+  const char * name;
+  uint8_t addr;
+  uint32_t ok;
+  uint32_t nacks;
+  uint32_t timeouts;
+  uint32_t crcerrors; /* reported by the driver */
+  uint32_t reinits; /* how often its init was rerun after a recovery */
+};
+
+/* Sets up port with the I2C driver and creates its queue and worker
+ * task. Returns 0 on success. */
+int i2cbus_init(int port, const struct i2cbusconfig * conf);
+
+/* Registers a device, so that it gets health counters. The device is
+ * talked to at sclhz, if the driver supports that. reinit (may be
+ * NULL) is called when the device needs to be set up again after a
+ * bus recovery that succeeded. That happens in the task that next
+ * calls i2cbus_exec() for the device, right before that transaction,
+ * so reinit can simply use the i2cbus functions (the calls it makes
+ * never start another reinit). Registering the same
+ * address again only updates name and reinit.
+ * Returns 0 on success, 1 if there is no more room. */
+int i2cbus_adddevice(int port, uint8_t addr, const char * name, uint32_t sclhz,
+                     void (*reinit)(void));
+
+/* For drivers to report that data from a device had a bad CRC. */
+void i2cbus_reportcrcerror(int port, uint8_t addr);
+
+/* Replaces the backend for port. Call before i2cbus_init(). */
+void i2cbus_setbackend(int port, const struct i2cbackend * be);
+
+/* Queues t for execution on port and returns immediately. t->done is
+ * called once it is done. Returns 0 if it was queued, 1 if not, in
+ * which case t->done is NOT called. */
+int i2cbus_submit(int port, struct i2ctrans * t);
+
+/* Queues t and waits until it is done. Returns the result. If the
+ * device needs to be set up again after a bus recovery, this does
+ * that first. */
+esp_err_t i2cbus_exec(int port, struct i2ctrans * t);
+
+/* Shortcuts for the common single operation transactions, these
+ * work like i2c_master_write_to_device() and friends. */
+esp_err_t i2cbus_write(int port, uint8_t addr, const uint8_t * wr, size_t wrlen,
+                       uint32_t timeoutms);
+esp_err_t i2cbus_read(int port, uint8_t addr, uint8_t * rd, size_t rdlen,
+                      uint32_t timeoutms);
+esp_err_t i2cbus_writeread(int port, uint8_t addr, const uint8_t * wr, size_t wrlen,
+                           uint8_t * rd, size_t rdlen, uint32_t timeoutms);
+
+/* Gets a consistent copy of the statistics for port.
+ * Returns 0 on success, 1 if there is no such port. */
+int i2cbus_getstats(int port, struct i2cbusstats * st);
+
+/* Gets a copy of the health counters of device idx on port.
+ * Returns 0 on success, 1 if there is no such device. */
+int i2cbus_getdevstats(int port, int idx, struct i2cdevstats * st);
+
+#endif /* _I2CBUS_H_ */
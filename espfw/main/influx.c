@@ -0,0 +1,140 @@
+/* ZAMDACH2022
+ * Sends our measurements as InfluxDB line protocol via UDP,
+ * for local dashboards. */
+
+#include <errno.h>
+#include <math.h>
+#include <string.h>
+#include <time.h>
+#include <esp_log.h>
+#include <freertos/FreeRTOS.h>
+#include <lwip/netdb.h>
+#include <lwip/sockets.h>
+#include "influx.h"
+#include "sbuf.h"
+#include "sdkconfig.h"
+
+/* This is in zamdach2022_main.c */
+extern char chipid[30];
+
+/* Set once by influx_resolve(), from the uploader task, and read
+ * by influx_send(), from the main task. */
+static int influxsock = -1;
+static struct sockaddr_storage influxaddr;
+static socklen_t influxaddrlen = 0;
+static portMUX_TYPE influxspinlock = portMUX_INITIALIZER_UNLOCKED;
+/* If the lookup of the host failed, we do not retry on every single
+ * measurement, as that would hold up the uploads for a while. */
+static time_t influxlastlookup = 0;
+#define INFLUX_LOOKUPRETRY 600
+
+void influx_resolve(void)
+{
+  char port[8];
+  struct addrinfo hints = { .ai_socktype = SOCK_DGRAM };
+  struct addrinfo * res = NULL;
+  /* Nobody else sets influxsock, so no need for the lock here. */
+  if ((strcmp(CONFIG_ZAMDACH_INFLUX_HOST, "") == 0) || (influxsock >= 0)) {
+    return;
+  }
+  if ((influxlastlookup != 0) && ((time(NULL) - influxlastlookup) < INFLUX_LOOKUPRETRY)) {
+    return;
+  }
+  snprintf(port, sizeof(port), "%d", CONFIG_ZAMDACH_INFLUX_PORT);
+  influxlastlookup = time(NULL);
+  if ((getaddrinfo(CONFIG_ZAMDACH_INFLUX_HOST, port, &hints, &res) != 0) || (res == NULL)) {
+    ESP_LOGE("influx.c", "Failed to look up %s, will retry in %d s.",
+             CONFIG_ZAMDACH_INFLUX_HOST, INFLUX_LOOKUPRETRY);
+    return;
+  }
+  int s = socket(res->ai_family, SOCK_DGRAM, IPPROTO_UDP);
+  if (s < 0) {
+    ESP_LOGE("influx.c", "Failed to create UDP socket.");
+    freeaddrinfo(res);
+    return;
+  }
+  taskENTER_CRITICAL(&influxspinlock);
+  memcpy(&influxaddr, res->ai_addr, res->ai_addrlen);
+  influxaddrlen = res->ai_addrlen;
+  influxsock = s;
+  taskEXIT_CRITICAL(&influxspinlock);
+  freeaddrinfo(res);
+}
+
+/* Adds ",name=value" (or "name=value" for the first field) to the line,
+ * unless the value is invalid. */
+static void influx_field(struct sbuf * sb, int * nfields, const char * name,
+                         float value, int decimals)
+{
+  if (isnan(value)) {
+    return;
+  }
+  if (*nfields > 0) {
+    sbuf_putc(sb, ',');
+  }
+  sbuf_puts(sb, name);
+  sbuf_putc(sb, '=');
+  sbuf_putfloat(sb, value, decimals);
+  (*nfields)++;
+}
+
+void influx_send(const struct ev * e)
+{
+  char line[512];
+  struct sbuf sb;
+  int nfields = 0;
+  int sock;
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+  taskENTER_CRITICAL(&influxspinlock);
+  sock = influxsock;
+  memcpy(&addr, &influxaddr, sizeof(addr));
+  addrlen = influxaddrlen;
+  taskEXIT_CRITICAL(&influxspinlock);
+  if (sock < 0) {
+    /* Not configured, or not looked up yet */
+    return;
+  }
+  sbuf_init(&sb, line, sizeof(line));
+  sbuf_puts(&sb, "zamdach,chipid=");
+  sbuf_puts(&sb, chipid);
+  sbuf_putc(&sb, ' ');
+  influx_field(&sb, &nfields, "temp", e->temp, 2);
+  influx_field(&sb, &nfields, "hum", e->hum, 2);
+  influx_field(&sb, &nfields, "press", e->press, 3);
+  influx_field(&sb, &nfields, "pm010", e->pm010, 1);
+  influx_field(&sb, &nfields, "pm025", e->pm025, 1);
+  influx_field(&sb, &nfields, "pm040", e->pm040, 1);
+  influx_field(&sb, &nfields, "pm100", e->pm100, 1);
+  influx_field(&sb, &nfields, "lux", e->lux, 2);
+  influx_field(&sb, &nfields, "uvind", e->uvind, 2);
+  influx_field(&sb, &nfields, "raing", e->raing, 2);
+  influx_field(&sb, &nfields, "windspeed", e->windspeed, 1);
+  influx_field(&sb, &nfields, "windspmax", e->windspmax, 1);
+  if (e->winddirdeg >= 0.0) {
+    influx_field(&sb, &nfields, "winddirdeg", e->winddirdeg, 1);
+  }
+  if (nfields == 0) {
+    /* A line without fields is not valid line protocol. */
+    return;
+  }
+  /* Integer fields need an 'i' suffix. */
+  sbuf_puts(&sb, ",lastsht4xheat=");
+  sbuf_putll(&sb, e->lastsht4xheat);
+  sbuf_putc(&sb, 'i');
+  /* The timestamp is in nanoseconds by default. */
+  if (e->lastupd > 0) {
+    sbuf_putc(&sb, ' ');
+    sbuf_putll(&sb, e->lastupd);
+    sbuf_puts(&sb, "000000000");
+  }
+  sbuf_putc(&sb, '\n');
+  if (sb.overflow) {
+    ESP_LOGE("influx.c", "Line does not fit into %d bytes, not sending.", (int)sizeof(line));
+    return;
+  }
+  if (sendto(sock, line, sb.len, 0, (struct sockaddr *)&addr, addrlen) < 0) {
+    ESP_LOGW("influx.c", "sendto %s:%d failed: errno %d",
+             CONFIG_ZAMDACH_INFLUX_HOST, CONFIG_ZAMDACH_INFLUX_PORT, errno);
+  }
+}
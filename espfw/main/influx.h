@@ -0,0 +1,23 @@
+/* ZAMDACH2022
+ * Sends our measurements as InfluxDB line protocol via UDP,
+ * for local dashboards. */
+
+#ifndef _INFLUX_H_
+#define _INFLUX_H_
+
+#include <time.h>
+#include "webserver.h"
+
+/* Looks up the host configured in menuconfig, unless that has
+ * already been done. A failed lookup is retried after 10 minutes.
+ * This can block for as long as DNS takes, so it is called from the
+ * uploader task, which waits for the network anyways. */
+void influx_resolve(void);
+
+/* Sends all values from one measurement cycle as one UDP datagram
+ * to the host:port configured in menuconfig. Does nothing if no
+ * host is configured or influx_resolve() has not found it yet. This
+ * never waits for anything. */
+void influx_send(const struct ev * e);
+
+#endif /* _INFLUX_H_ */
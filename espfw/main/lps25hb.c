@@ -1,20 +1,21 @@
 /* Talking to the LPS25HB pressure sensor */
 
 #include "esp_log.h"
+#include "i2cbus.h"
 #include "lps25hb.h"
 #include "sdkconfig.h"
 
 
 #define LPS25HBADDR 0x5c  /* That is hardwired on our breakout board */
-#define I2C_MASTER_TIMEOUT_MS 1000  /* Timeout for I2C communication */
+#define I2C_MASTER_TIMEOUT_MS 100  /* Timeout for I2C communication */
 
 static i2c_port_t lps25hbi2cport;
 
 static esp_err_t lps25hb_register_read(uint8_t reg_addr, uint8_t *data, size_t len)
 {
-    return i2c_master_write_read_device(lps25hbi2cport,
-                                        LPS25HBADDR, &reg_addr, 1, data, len,
-                                        I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS);
+    return i2cbus_writeread(lps25hbi2cport,
+                            LPS25HBADDR, &reg_addr, 1, data, len,
+                            I2C_MASTER_TIMEOUT_MS);
 }
 
 static esp_err_t lps25hb_register_write_byte(uint8_t reg_addr, uint8_t data)
@@ -22,16 +23,22 @@ static esp_err_t lps25hb_register_write_byte(uint8_t reg_addr, uint8_t data)
     int ret;
     uint8_t write_buf[2] = {reg_addr, data};
 
-    ret = i2c_master_write_to_device(lps25hbi2cport,
-                                     LPS25HBADDR, write_buf, sizeof(write_buf),
-                                     I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS);
+    ret = i2cbus_write(lps25hbi2cport,
+                       LPS25HBADDR, write_buf, sizeof(write_buf),
+                       I2C_MASTER_TIMEOUT_MS);
 
     return ret;
 }
 
+static void lps25hb_reinit(void)
+{
+    lps25hb_init(lps25hbi2cport);
+}
+
 void lps25hb_init(i2c_port_t port)
 {
     lps25hbi2cport = port;
+    i2cbus_adddevice(port, LPS25HBADDR, "lps25hb", 400000, lps25hb_reinit);
 
     /* Configure the LPS25HB */
     /* CTRL_REG1 0x20: Power on/Enable, 1 Hz */
@@ -1,6 +1,8 @@
 /* Talking to the LTR390 UV sensor */
 
+#include <string.h>
 #include "esp_log.h"
+#include "i2cbus.h"
 #include "ltr390.h"
 #include "sdkconfig.h"
 
@@ -79,9 +81,32 @@ static esp_err_t ltr390_writereg(uint8_t reg, uint8_t val)
     uint8_t regandval[2];
     regandval[0] = reg;
     regandval[1] = val;
-    return i2c_master_write_to_device(ltr390i2cport, LTR390ADDR,
-                                      regandval, 2,
-                                      I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS);
+    return i2cbus_write(ltr390i2cport, LTR390ADDR,
+                        regandval, 2,
+                        I2C_MASTER_TIMEOUT_MS);
+}
+
+/* Reads the status register and the 3 data registers starting at
+ * datareg in one I2C transaction. The data is only meaningful if the
+ * status says there is new data. */
+static esp_err_t ltr390_readstatusanddata(uint8_t datareg, uint8_t * status, uint8_t * data)
+{
+    static const uint8_t statusreg = LTR390_REG_MAINSTATUS;
+    struct i2ctrans t;
+    memset(&t, 0, sizeof(t));
+    t.nops = 2;
+    t.ops[0].addr = LTR390ADDR;
+    t.ops[0].wr = &statusreg;
+    t.ops[0].wrlen = 1;
+    t.ops[0].rd = status;
+    t.ops[0].rdlen = 1;
+    t.ops[1].addr = LTR390ADDR;
+    t.ops[1].wr = &datareg;
+    t.ops[1].wrlen = 1;
+    t.ops[1].rd = data;
+    t.ops[1].rdlen = 3;
+    t.timeoutms = I2C_MASTER_TIMEOUT_MS;
+    return i2cbus_exec(ltr390i2cport, &t);
 }
 
 void ltr390_startuvmeas(void)
@@ -108,9 +133,15 @@ void ltr390_stopmeas(void)
     ltr390_writereg(LTR390_REG_MAINCTRL, 0);
 }
 
+static void ltr390_reinit(void)
+{
+    ltr390_init(ltr390i2cport);
+}
+
 void ltr390_init(i2c_port_t port)
 {
     ltr390i2cport = port;
+    i2cbus_adddevice(port, LTR390ADDR, "ltr390", 400000, ltr390_reinit);
 
     /* Configure the LTR390 */
     ltr390_writereg(LTR390_REG_MEASRATE, (LTR390_RES20BIT | LTR390_RATE2000MS));
@@ -122,21 +153,18 @@ void ltr390_init(i2c_port_t port)
 double ltr390_readuv(void)
 {
     uint8_t uvsreg[3];
+    uint8_t status;
     int isvalid = 1;
     uint8_t repctr = 0;
-    uint8_t rtr = LTR390_REG_MAINSTATUS;
     do {
       if (isvalid != 1) {
         /* Sleep a short while before retrying */
         vTaskDelay(pdMS_TO_TICKS(50));
       }
-      uint8_t res = i2c_master_write_read_device(ltr390i2cport, LTR390ADDR,
-                                                 &rtr, 1, &uvsreg[0], 1,
-                                                 I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS);
-      if (res != ESP_OK) {
+      if (ltr390_readstatusanddata(LTR390_REG_UVSDATAL, &status, &uvsreg[0]) != ESP_OK) {
         isvalid = 0;
       } else {
-        if ((uvsreg[0] & LTR390_MSTA_NEWDATA) == LTR390_MSTA_NEWDATA) {
+        if ((status & LTR390_MSTA_NEWDATA) == LTR390_MSTA_NEWDATA) {
           isvalid = 1;
         } else {
           isvalid = 0;
@@ -148,17 +176,6 @@ double ltr390_readuv(void)
       ESP_LOGE("ltr390.c", "ERROR: I2C-read from LTR390 failed (3).");
       return -1.0;
     }
-    rtr = LTR390_REG_UVSDATAL;
-    if (i2c_master_write_read_device(ltr390i2cport, LTR390ADDR,
-        &rtr, 1, &uvsreg[0], 3,
-        I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS) != ESP_OK) {
-      isvalid = 0;
-    }
-    if (isvalid != 1) {
-      /* Read error, signal that we received nonsense by returning a negative UV index */
-      ESP_LOGE("ltr390.c", "ERROR: I2C-read from LTR390 failed (4).");
-      return -1.0;
-    }
     uint32_t uvsr32 = ((uint32_t)(uvsreg[2] & 0x0F) << 16)
                     | ((uint32_t)uvsreg[1] << 8)
                     | uvsreg[0];
@@ -178,21 +195,18 @@ double ltr390_readuv(void)
 double ltr390_readal(void)
 {
     uint8_t alsreg[3];
+    uint8_t status;
     int isvalid = 1;
-    uint8_t rtr = LTR390_REG_MAINSTATUS;
     uint8_t repctr = 0;
     do {
       if (isvalid != 1) {
         /* Sleep a short while before retrying */
         vTaskDelay(pdMS_TO_TICKS(50));
       }
-      uint8_t res = i2c_master_write_read_device(ltr390i2cport, LTR390ADDR,
-                                                 &rtr, 1, &alsreg[0], 1,
-                                                 I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS);
-      if (res != ESP_OK) {
+      if (ltr390_readstatusanddata(LTR390_REG_ALSDATAL, &status, &alsreg[0]) != ESP_OK) {
         isvalid = 0;
       } else {
-        if ((alsreg[0] & LTR390_MSTA_NEWDATA) == LTR390_MSTA_NEWDATA) {
+        if ((status & LTR390_MSTA_NEWDATA) == LTR390_MSTA_NEWDATA) {
           isvalid = 1;
         } else {
           isvalid = 0;
@@ -204,17 +218,6 @@ double ltr390_readal(void)
       ESP_LOGE("ltr390.c", "ERROR: I2C-read from LTR390 failed (1).");
       return -1.0;
     }
-    rtr = LTR390_REG_ALSDATAL;
-    if (i2c_master_write_read_device(ltr390i2cport, LTR390ADDR,
-        &rtr, 1, &alsreg[0], 3,
-        I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS) != ESP_OK) {
-      isvalid = 0;
-    }
-    if (isvalid != 1) {
-      /* Read error, signal that we received nonsense by returning a negative UV index */
-      ESP_LOGE("ltr390.c", "ERROR: I2C-read from LTR390 failed (2).");
-      return -1.0;
-    }
     uint32_t alsr32 = ((uint32_t)(alsreg[2] & 0x0F) << 16)
                     | ((uint32_t)alsreg[1] << 8)
                     | alsreg[0];
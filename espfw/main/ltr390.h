@@ -2,7 +2,7 @@
 #ifndef _LTR390_H_
 #define _LTR390_H_
 
-#include "driver/i2c.h" /* Needed for i2c_port_t */
+#include "hal/i2c_types.h" /* Needed for i2c_port_t */
 
 /* Init needs to be called before anything else.
  * will implicitly start UV measurement! */
@@ -0,0 +1,316 @@
+/* ZAMDACH2022
+ * Firmware updates over the air, done in a background task so that
+ * neither the webserver nor the measurements have to wait for them. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <esp_crt_bundle.h>
+#include <esp_http_client.h>
+#include <esp_https_ota.h>
+#include <esp_log.h>
+#include <esp_ota_ops.h>
+#include <esp_system.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/task.h>
+#include "ota.h"
+
+static struct otastatus otast;
+static portMUX_TYPE otastspinlock = portMUX_INITIALIZER_UNLOCKED;
+
+const char * ota_statename(enum otastate s)
+{
+  switch (s) {
+  case OTASTATE_IDLE:    return "idle";
+  case OTASTATE_RUNNING: return "running";
+  case OTASTATE_SUCCESS: return "success";
+  case OTASTATE_FAILED:  return "failed";
+  }
+  return "unknown";
+}
+
+void ota_getstatus(struct otastatus * st)
+{
+  taskENTER_CRITICAL(&otastspinlock);
+  *st = otast;
+  taskEXIT_CRITICAL(&otastspinlock);
+}
+
+static void ota_progress(long bytesdone, long imagesize)
+{
+  taskENTER_CRITICAL(&otastspinlock);
+  otast.bytesdone = bytesdone;
+  otast.imagesize = imagesize;
+  taskEXIT_CRITICAL(&otastspinlock);
+}
+
+static void ota_done(enum otastate state, const char * errmsg)
+{
+  taskENTER_CRITICAL(&otastspinlock);
+  otast.state = state;
+  otast.endts = esp_timer_get_time();
+  strlcpy(otast.errmsg, errmsg, sizeof(otast.errmsg));
+  taskEXIT_CRITICAL(&otastspinlock);
+}
+
+static void ota_task(void * pvParameters)
+{
+  /* otast.url is only written by ota_start, and only while no update
+   * is running, so we can use it without holding the lock. */
+  esp_http_client_config_t httpccfg = {
+      .url = otast.url,
+      .timeout_ms = 60000,
+      .keep_alive_enable = true,
+      .crt_bundle_attach = esp_crt_bundle_attach
+  };
+  esp_https_ota_config_t otacfg = {
+      .http_config = &httpccfg
+  };
+  esp_https_ota_handle_t otah = NULL;
+  esp_err_t err = esp_https_ota_begin(&otacfg, &otah);
+  if (err != ESP_OK) {
+    ESP_LOGE("ota.c", "Failed to start OTA update: %s", esp_err_to_name(err));
+    ota_done(OTASTATE_FAILED, esp_err_to_name(err));
+    vTaskDelete(NULL);
+    return;
+  }
+  do {
+    err = esp_https_ota_perform(otah);
+    ota_progress(esp_https_ota_get_image_len_read(otah),
+                 esp_https_ota_get_image_size(otah));
+  } while (err == ESP_ERR_HTTPS_OTA_IN_PROGRESS);
+  if ((err == ESP_OK) && (!esp_https_ota_is_complete_data_received(otah))) {
+    ESP_LOGE("ota.c", "OTA update: Incomplete image received.");
+    esp_https_ota_abort(otah);
+    ota_done(OTASTATE_FAILED, "Incomplete image received");
+  } else if (err != ESP_OK) {
+    ESP_LOGE("ota.c", "OTA update failed: %s", esp_err_to_name(err));
+    esp_https_ota_abort(otah);
+    ota_done(OTASTATE_FAILED, esp_err_to_name(err));
+  } else {
+    /* This validates the image and sets the boot partition. */
+    err = esp_https_ota_finish(otah);
+    if (err == ESP_OK) {
+      ESP_LOGI("ota.c", "OTA update succeeded, rebooting in 5 seconds...");
+      ota_done(OTASTATE_SUCCESS, "");
+      /* Give whoever is watching /otastatus a chance to see that. */
+      vTaskDelay(5 * (1000 / portTICK_PERIOD_MS));
+      esp_restart();
+    }
+    ESP_LOGE("ota.c", "OTA update: Finishing failed: %s", esp_err_to_name(err));
+    ota_done(OTASTATE_FAILED, esp_err_to_name(err));
+  }
+  vTaskDelete(NULL);
+}
+
+/* Marks an update as running, unless there already is one.
+ * Returns 0 on success. */
+static int ota_claim(const char * url, long imagesize)
+{
+  taskENTER_CRITICAL(&otastspinlock);
+  if (otast.state == OTASTATE_RUNNING) {
+    taskEXIT_CRITICAL(&otastspinlock);
+    return 1;
+  }
+  memset(&otast, 0, sizeof(otast));
+  otast.state = OTASTATE_RUNNING;
+  strlcpy(otast.url, url, sizeof(otast.url));
+  otast.imagesize = imagesize;
+  otast.startts = esp_timer_get_time();
+  taskEXIT_CRITICAL(&otastspinlock);
+  return 0;
+}
+
+int ota_start(const char * url)
+{
+  if (ota_claim(url, -1) != 0) {
+    return 1;
+  }
+  /* TLS needs a lot of stack. The priority is the same as that of the
+   * main loop (which sleeps most of the time) and below the uploader
+   * and the webserver, so the update only uses what time is left. */
+  if (xTaskCreate(&ota_task, "ota", 8192, NULL, 1, NULL) != pdPASS) {
+    ESP_LOGE("ota.c", "Failed to create the OTA task.");
+    ota_done(OTASTATE_FAILED, "Failed to create task");
+    return 1;
+  }
+  return 0;
+}
+
+/* For updates pushed to us. Only one can be running (see ota_claim),
+ * so these need no locking. The receiving side (ota_push*) and the
+ * writer task hand the buffers back and forth through the queues: a
+ * buffer is either in pushfreeq, being received into, or in
+ * pushworkq / being written. A message with data == NULL tells the
+ * writer that there is no more, len then is the aborted flag. */
+#define OTA_PUSHBUFS 2
+struct otapushmsg {
+  uint8_t * data;
+  size_t len;
+};
+static esp_ota_handle_t pushh;
+static const esp_partition_t * pushpart;
+static long pushdone;
+static long pushsize;
+static uint8_t * pushbufs;
+static QueueHandle_t pushfreeq;
+static QueueHandle_t pushworkq;
+static QueueHandle_t pushresq;
+
+static int ota_pushfailed(void)
+{
+  taskENTER_CRITICAL(&otastspinlock);
+  int res = (otast.state == OTASTATE_FAILED);
+  taskEXIT_CRITICAL(&otastspinlock);
+  return res;
+}
+
+/* Does everything that touches the flash. Writing a sector can take
+ * a while, and esp_ota_end() verifies the whole image. This way that
+ * neither needs the stack of the webserver task nor keeps it from
+ * receiving the next chunk in the meantime. */
+static void ota_pushtask(void * pvParameters)
+{
+  struct otapushmsg m;
+  int res = 0;
+  /* Erasing the whole partition up front would take seconds. This
+   * way, every sector gets erased right before it is written. */
+  esp_err_t err = esp_ota_begin(pushpart, OTA_WITH_SEQUENTIAL_WRITES, &pushh);
+  if (err != ESP_OK) {
+    ESP_LOGE("ota.c", "esp_ota_begin failed: %s", esp_err_to_name(err));
+    ota_done(OTASTATE_FAILED, esp_err_to_name(err));
+    res = 1;
+  }
+  xQueueSend(pushresq, &res, portMAX_DELAY);
+  if (res != 0) {
+    vTaskDelete(NULL);
+    return;
+  }
+  while (1) {
+    xQueueReceive(pushworkq, &m, portMAX_DELAY);
+    if (m.data == NULL) {
+      break;
+    }
+    /* After a failure, the rest is only handed back. */
+    if (res == 0) {
+      /* This also rejects anything that does not start like an
+       * app image right with the first chunk. */
+      err = esp_ota_write(pushh, m.data, m.len);
+      if (err != ESP_OK) {
+        ESP_LOGE("ota.c", "esp_ota_write failed at offset %ld: %s",
+                 pushdone, esp_err_to_name(err));
+        esp_ota_abort(pushh);
+        ota_done(OTASTATE_FAILED, esp_err_to_name(err));
+        res = 1;
+      } else {
+        pushdone += m.len;
+        ota_progress(pushdone, pushsize);
+      }
+    }
+    xQueueSend(pushfreeq, &m.data, portMAX_DELAY);
+  }
+  if ((res == 0) && (m.len != 0)) {
+    esp_ota_abort(pushh);
+    ota_done(OTASTATE_FAILED, "Upload aborted");
+    res = 1;
+  }
+  if (res == 0) {
+    /* This verifies the image (checksum, and hash/signature if
+     * enabled) before we switch to it. */
+    err = esp_ota_end(pushh);
+    if (err == ESP_OK) {
+      err = esp_ota_set_boot_partition(pushpart);
+    }
+    if (err != ESP_OK) {
+      ESP_LOGE("ota.c", "Pushed update failed verification: %s", esp_err_to_name(err));
+      ota_done(OTASTATE_FAILED, esp_err_to_name(err));
+      res = 1;
+    } else {
+      ESP_LOGI("ota.c", "Pushed update of %ld bytes written and verified.", pushdone);
+      ota_done(OTASTATE_SUCCESS, "");
+    }
+  }
+  xQueueSend(pushresq, &res, portMAX_DELAY);
+  vTaskDelete(NULL);
+}
+
+/* Frees what ota_pushbegin() allocated. The writer task must not be
+ * using any of it anymore. */
+static void ota_pushcleanup(void)
+{
+  if (pushfreeq != NULL) { vQueueDelete(pushfreeq); pushfreeq = NULL; }
+  if (pushworkq != NULL) { vQueueDelete(pushworkq); pushworkq = NULL; }
+  if (pushresq != NULL) { vQueueDelete(pushresq); pushresq = NULL; }
+  free(pushbufs);
+  pushbufs = NULL;
+}
+
+int ota_pushbegin(long imagesize)
+{
+  int res;
+  if (ota_claim("(pushed)", imagesize) != 0) {
+    return 1;
+  }
+  pushdone = 0;
+  pushsize = imagesize;
+  pushpart = esp_ota_get_next_update_partition(NULL);
+  if (pushpart == NULL) {
+    ESP_LOGE("ota.c", "No partition to write an update to.");
+    ota_done(OTASTATE_FAILED, "No update partition");
+    return 1;
+  }
+  pushbufs = malloc(OTA_PUSHBUFS * OTA_PUSHBUFSIZE);
+  pushfreeq = xQueueCreate(OTA_PUSHBUFS, sizeof(uint8_t *));
+  /* One more for the end marker */
+  pushworkq = xQueueCreate(OTA_PUSHBUFS + 1, sizeof(struct otapushmsg));
+  pushresq = xQueueCreate(1, sizeof(int));
+  if ((pushbufs == NULL) || (pushfreeq == NULL) || (pushworkq == NULL) || (pushresq == NULL)) {
+    ESP_LOGE("ota.c", "Out of memory for receiving an update.");
+    ota_pushcleanup();
+    ota_done(OTASTATE_FAILED, "Out of memory");
+    return 1;
+  }
+  for (int i = 0; i < OTA_PUSHBUFS; i++) {
+    uint8_t * b = &pushbufs[i * OTA_PUSHBUFSIZE];
+    xQueueSend(pushfreeq, &b, 0);
+  }
+  /* Same priority as the webserver: while it waits for the network,
+   * this writes, and the other way round. */
+  if (xTaskCreate(&ota_pushtask, "otapush", 4096, NULL, 5, NULL) != pdPASS) {
+    ESP_LOGE("ota.c", "Failed to create the OTA writer task.");
+    ota_pushcleanup();
+    ota_done(OTASTATE_FAILED, "Failed to create task");
+    return 1;
+  }
+  /* Whether esp_ota_begin() worked */
+  xQueueReceive(pushresq, &res, portMAX_DELAY);
+  if (res != 0) {
+    ota_pushcleanup();
+  }
+  return res;
+}
+
+void * ota_pushgetbuf(void)
+{
+  uint8_t * b;
+  xQueueReceive(pushfreeq, &b, portMAX_DELAY);
+  return b;
+}
+
+int ota_pushwrite(void * buf, size_t len)
+{
+  struct otapushmsg m = { .data = buf, .len = len };
+  xQueueSend(pushworkq, &m, portMAX_DELAY);
+  return ota_pushfailed();
+}
+
+int ota_pushfinish(int aborted)
+{
+  struct otapushmsg m = { .data = NULL, .len = (aborted) ? 1 : 0 };
+  int res;
+  xQueueSend(pushworkq, &m, portMAX_DELAY);
+  xQueueReceive(pushresq, &res, portMAX_DELAY);
+  ota_pushcleanup();
+  return res;
+}
@@ -0,0 +1,58 @@
+/* ZAMDACH2022
+ * Firmware updates over the air, done in a background task so that
+ * neither the webserver nor the measurements have to wait for them. */
+
+#ifndef _OTA_H_
+#define _OTA_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum otastate {
+  OTASTATE_IDLE = 0, /* no update has been started since boot */
+  OTASTATE_RUNNING,
+  OTASTATE_SUCCESS, /* the new firmware is written, we are about to reboot */
+  OTASTATE_FAILED
+};
+
+struct otastatus {
+  enum otastate state;
+  char url[200];
+  long bytesdone;
+  long imagesize; /* -1 if not known (yet) */
+  int64_t startts; /* esp_timer time */
+  int64_t endts; /* esp_timer time, 0 while still running */
+  char errmsg[80];
+};
+
+/* Starts an update from url in the background. Returns 0 if the update
+ * was started, 1 if there already is one running or the task could
+ * not be created. */
+int ota_start(const char * url);
+
+/* Updates that are pushed to us (POST /otaupload). Writing to flash
+ * is done by a task of its own, the caller only receives the image:
+ * ota_pushbegin() returns 0 if the update could be started.
+ * ota_pushgetbuf() hands out a buffer of OTA_PUSHBUFSIZE bytes to
+ * receive the next chunk into, waiting for the writer to finish one
+ * if necessary, and ota_pushwrite() queues up to OTA_PUSHBUFSIZE bytes
+ * in it for writing. That returns 0 if no chunk has failed to write
+ * so far, 1 if one did - then the update is already aborted. Once
+ * ota_pushbegin() succeeded, ota_pushfinish() has to be called in any
+ * case. It waits for the writer, verifies the image and switches the
+ * boot partition to it, or aborts the update if aborted is set. It
+ * returns 0 if we can reboot into the new firmware. The caller does
+ * the reboot. */
+#define OTA_PUSHBUFSIZE 4096
+int ota_pushbegin(long imagesize);
+void * ota_pushgetbuf(void);
+int ota_pushwrite(void * buf, size_t len);
+int ota_pushfinish(int aborted);
+
+/* Gets a consistent copy of the status of the last update. */
+void ota_getstatus(struct otastatus * st);
+
+/* Returns the name of an otastate, as used on /otastatus. */
+const char * ota_statename(enum otastate s);
+
+#endif /* _OTA_H_ */
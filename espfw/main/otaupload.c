@@ -0,0 +1,86 @@
+/* ZAMDACH2022
+ * Firmware images pushed to us via POST /otaupload. This runs on the
+ * webserver task, which has little stack, so it only receives: the
+ * chunks go straight into buffers from ota.c, and the task there
+ * writes them to flash. */
+
+#include <stdio.h>
+#include <string.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include "ota.h"
+#include "otaupload.h"
+#include "secrets.h"
+
+esp_err_t otaupload_recv(httpd_req_t * req, int * reboot)
+{
+  char pw[64];
+  char msg[120];
+  *reboot = 0;
+  if ((httpd_req_get_hdr_value_str(req, "X-Updatepw", pw, sizeof(pw)) != ESP_OK)
+   || (strcmp(pw, ZAMDACH_WEBIFADMINPW) != 0)) {
+    ESP_LOGI("otaupload.c", "Missing or incorrect X-Updatepw.");
+    httpd_resp_set_status(req, "403 Forbidden");
+    httpd_resp_send(req, "Admin-Password incorrect.", HTTPD_RESP_USE_STRLEN);
+    return ESP_OK;
+  }
+  if (req->content_len == 0) {
+    httpd_resp_set_status(req, "400 Bad Request");
+    httpd_resp_send(req, "No firmware image in the request.", HTTPD_RESP_USE_STRLEN);
+    return ESP_OK;
+  }
+  if (ota_pushbegin(req->content_len) != 0) {
+    httpd_resp_set_status(req, "503 Service Unavailable");
+    httpd_resp_send(req, "Could not start the update - is there already one running?", HTTPD_RESP_USE_STRLEN);
+    return ESP_OK;
+  }
+  ESP_LOGI("otaupload.c", "Receiving %d bytes.", (int)req->content_len);
+  int64_t startts = esp_timer_get_time();
+  size_t remaining = req->content_len;
+  while (remaining > 0) {
+    char * buf = ota_pushgetbuf();
+    size_t len = 0;
+    int timeouts = 0;
+    /* Fill the buffer, fewer and larger chunks are faster to write. */
+    while ((len < OTA_PUSHBUFSIZE) && (len < remaining)) {
+      size_t want = remaining - len;
+      if (want > (OTA_PUSHBUFSIZE - len)) { want = OTA_PUSHBUFSIZE - len; }
+      int r = httpd_req_recv(req, &buf[len], want);
+      if (r == HTTPD_SOCK_ERR_TIMEOUT) {
+        /* The sender might just be slow, give it a few chances. */
+        if (++timeouts < 5) { continue; }
+      }
+      if (r <= 0) {
+        ESP_LOGE("otaupload.c", "Receiving failed with %d bytes to go.", (int)(remaining - len));
+        ota_pushfinish(1);
+        /* The connection is probably gone, but try anyways. */
+        httpd_resp_send_err(req, HTTPD_408_REQ_TIMEOUT, "Receiving the image failed.");
+        return ESP_FAIL;
+      }
+      timeouts = 0;
+      len += r;
+    }
+    /* A failure shows up here one buffer late, as the writer is busy
+     * with the previous one while we receive. */
+    if (ota_pushwrite(buf, len) != 0) {
+      ota_pushfinish(1);
+      httpd_resp_set_status(req, "400 Bad Request");
+      httpd_resp_send(req, "Writing the image failed - is it a valid firmware image?", HTTPD_RESP_USE_STRLEN);
+      return ESP_OK;
+    }
+    remaining -= len;
+  }
+  if (ota_pushfinish(0) != 0) {
+    httpd_resp_set_status(req, "400 Bad Request");
+    httpd_resp_send(req, "The image failed verification, not switching to it.", HTTPD_RESP_USE_STRLEN);
+    return ESP_OK;
+  }
+  long elapsedms = (esp_timer_get_time() - startts) / 1000;
+  snprintf(msg, sizeof(msg), "OK, received and verified %d bytes in %ld ms (%ld KB/s). Will reboot in 3 seconds.\n",
+           (int)req->content_len, elapsedms,
+           (elapsedms > 0) ? (long)(req->content_len * 1000LL / 1024 / elapsedms) : 0L);
+  ESP_LOGI("otaupload.c", "%s", msg);
+  httpd_resp_send(req, msg, HTTPD_RESP_USE_STRLEN);
+  *reboot = 1;
+  return ESP_OK;
+}
@@ -0,0 +1,16 @@
+/* ZAMDACH2022
+ * Firmware images pushed to us via POST /otaupload. */
+
+#ifndef _OTAUPLOAD_H_
+#define _OTAUPLOAD_H_
+
+#include <esp_err.h>
+#include <esp_http_server.h>
+
+/* Checks the password, receives the image from req and hands it to
+ * ota.c for writing, then sends the response. Sets *reboot if the new
+ * firmware has been written and verified - the caller has to reboot
+ * into it then. Returns ESP_FAIL if the connection should be closed. */
+esp_err_t otaupload_recv(httpd_req_t * req, int * reboot);
+
+#endif /* _OTAUPLOAD_H_ */
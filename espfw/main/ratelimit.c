@@ -0,0 +1,147 @@
+/* ZAMDACH2022
+ * Admission control for the webserver: a token bucket per client IP,
+ * and a limit on the number of connections per client IP. */
+
+#include <string.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include "ratelimit.h"
+
+/* Tokens are kept in thousandths, so that refilling works with
+ * integer math even if requests come in every few milliseconds. */
+#define RATELIMIT_SCALE 1000
+
+struct rlclient {
+  uint8_t ip[16];
+  int inuse;
+  int32_t tokens;
+  int64_t lastrefill; /* ms */
+  int conns;
+};
+static struct rlclient rlclients[RATELIMIT_CLIENTS];
+
+/* Which connection belongs to which client. Large enough for all
+ * sockets LWIP can have. */
+#define RATELIMIT_MAXFDS 16
+static struct {
+  int fd;
+  int client;
+} rlfds[RATELIMIT_MAXFDS];
+static int rlfdsinit = 0;
+
+static struct ratelimitstats rlstats;
+
+static int64_t ratelimit_now(void)
+{
+  return esp_timer_get_time() / 1000;
+}
+
+static void ratelimit_refill(struct rlclient * c, int64_t now)
+{
+  int64_t add = (now - c->lastrefill) * RATELIMIT_PERSEC * RATELIMIT_SCALE / 1000;
+  if (add > 0) {
+    int64_t t = c->tokens + add;
+    if (t > (RATELIMIT_BURST * RATELIMIT_SCALE)) { t = RATELIMIT_BURST * RATELIMIT_SCALE; }
+    c->tokens = t;
+    c->lastrefill = now;
+  }
+}
+
+/* Finds the entry for ip, or creates one. */
+static int ratelimit_client(const uint8_t ip[16])
+{
+  int64_t now = ratelimit_now();
+  int victim = -1;
+  for (int i = 0; i < RATELIMIT_CLIENTS; i++) {
+    struct rlclient * c = &rlclients[i];
+    if (!c->inuse) {
+      if (victim < 0) { victim = i; }
+      continue;
+    }
+    if (memcmp(c->ip, ip, 16) == 0) {
+      ratelimit_refill(c, now);
+      return i;
+    }
+  }
+  if (victim < 0) {
+    /* Forget whoever has had the longest time to refill, but not
+     * someone who still has connections open. */
+    for (int i = 0; i < RATELIMIT_CLIENTS; i++) {
+      struct rlclient * c = &rlclients[i];
+      if ((c->conns == 0)
+       && ((victim < 0) || (c->lastrefill < rlclients[victim].lastrefill))) {
+        victim = i;
+      }
+    }
+    if (victim < 0) { victim = 0; }
+    for (int f = 0; f < RATELIMIT_MAXFDS; f++) {
+      if ((rlfdsinit) && (rlfds[f].client == victim)) { rlfds[f].fd = -1; }
+    }
+    rlstats.evictions++;
+  } else {
+    rlstats.clients++;
+  }
+  struct rlclient * c = &rlclients[victim];
+  memcpy(c->ip, ip, 16);
+  c->inuse = 1;
+  c->tokens = RATELIMIT_BURST * RATELIMIT_SCALE;
+  c->lastrefill = now;
+  c->conns = 0;
+  return victim;
+}
+
+int ratelimit_connopen(int fd, const uint8_t ip[16])
+{
+  if (!rlfdsinit) {
+    for (int f = 0; f < RATELIMIT_MAXFDS; f++) { rlfds[f].fd = -1; }
+    rlfdsinit = 1;
+  }
+  int cl = ratelimit_client(ip);
+  if (rlclients[cl].conns >= RATELIMIT_MAXCONNS) {
+    rlstats.connsrejected++;
+    return 1;
+  }
+  for (int f = 0; f < RATELIMIT_MAXFDS; f++) {
+    if (rlfds[f].fd < 0) {
+      rlfds[f].fd = fd;
+      rlfds[f].client = cl;
+      rlclients[cl].conns++;
+      return 0;
+    }
+  }
+  /* Cannot happen with RATELIMIT_MAXFDS >= LWIP_MAX_SOCKETS. The
+   * connection just does not count towards the limit then. */
+  ESP_LOGW("ratelimit.c", "No free slot to track fd %d.", fd);
+  return 0;
+}
+
+void ratelimit_connclose(int fd)
+{
+  if (!rlfdsinit) { return; }
+  for (int f = 0; f < RATELIMIT_MAXFDS; f++) {
+    if (rlfds[f].fd == fd) {
+      rlfds[f].fd = -1;
+      if (rlclients[rlfds[f].client].conns > 0) {
+        rlclients[rlfds[f].client].conns--;
+      }
+      return;
+    }
+  }
+}
+
+int ratelimit_request(const uint8_t ip[16], int cost)
+{
+  struct rlclient * c = &rlclients[ratelimit_client(ip)];
+  if (c->tokens < (cost * RATELIMIT_SCALE)) {
+    rlstats.limited++;
+    return 1;
+  }
+  c->tokens -= cost * RATELIMIT_SCALE;
+  rlstats.allowed++;
+  return 0;
+}
+
+void ratelimit_getstats(struct ratelimitstats * st)
+{
+  *st = rlstats;
+}
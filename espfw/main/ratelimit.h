@@ -0,0 +1,48 @@
+/* ZAMDACH2022
+ * Admission control for the webserver: a token bucket per client IP,
+ * and a limit on the number of connections per client IP.
+ * All of these functions must only be called from the webserver task,
+ * they do no locking. */
+
+#ifndef _RATELIMIT_H_
+#define _RATELIMIT_H_
+
+#include <stdint.h>
+
+/* How many client IPs we keep track of. If there are more, the one
+ * that has been quiet for the longest time is forgotten. */
+#define RATELIMIT_CLIENTS 8
+/* Every client can do a burst of this many requests... */
+#define RATELIMIT_BURST 30
+/* ...after which it gets this many per second. */
+#define RATELIMIT_PERSEC 2
+/* What a request to one of the expensive pages costs, in requests. */
+#define RATELIMIT_HEAVY 5
+/* How many connections one client IP may have open at the same time.
+ * The start page needs two (one of them for /stream). */
+#define RATELIMIT_MAXCONNS 4
+
+struct ratelimitstats {
+  long allowed;
+  long limited; /* requests answered with 429 */
+  long connsrejected; /* connections closed right away */
+  long evictions; /* clients forgotten because the table was full */
+  int clients;
+};
+
+/* IPs are passed as IPv6 addresses, IPv4 as IPv4-mapped. */
+
+/* Called for every new connection. Returns 0 if it may stay open,
+ * 1 if the client already has too many. */
+int ratelimit_connopen(int fd, const uint8_t ip[16]);
+
+/* Called whenever a connection gets closed. */
+void ratelimit_connclose(int fd);
+
+/* Called for every request, cost is 1 or RATELIMIT_HEAVY.
+ * Returns 0 if the request may proceed, 1 if it is to be refused. */
+int ratelimit_request(const uint8_t ip[16], int cost);
+
+void ratelimit_getstats(struct ratelimitstats * st);
+
+#endif /* _RATELIMIT_H_ */
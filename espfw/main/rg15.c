@@ -41,6 +41,15 @@ void rg15_requestread(void)
     uart_write_bytes(UART_NUM_1, "A\n", 2);
 }
 
+int rg15_pendingbytes(void)
+{
+    size_t length = 0;
+    if (uart_get_buffered_data_len(UART_NUM_1, &length) != ESP_OK) {
+      return 0;
+    }
+    return length;
+}
+
 float rg15_readraincount(void)
 {
     char rcvdata[128];
@@ -4,6 +4,8 @@
 
 void rg15_init(void);
 void rg15_requestread(void);
+/* Returns how many bytes of the reply have arrived so far. */
+int rg15_pendingbytes(void);
 float rg15_readraincount(void);
 
 #endif /* _RG15_H_ */
@@ -0,0 +1,145 @@
+/* ZAMDACH2022
+ * A simple append-only string buffer, used for building the
+ * payloads we send and the pages we serve. */
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include "sbuf.h"
+
+void sbuf_init(struct sbuf * sb, char * buf, size_t cap)
+{
+  sb->buf = buf;
+  sb->cap = cap;
+  sb->len = 0;
+  sb->overflow = 0;
+  sb->buf[0] = 0;
+}
+
+void sbuf_putn(struct sbuf * sb, const char * s, size_t n)
+{
+  size_t avail = sb->cap - 1 - sb->len;
+  if (n > avail) {
+    n = avail;
+    sb->overflow = 1;
+  }
+  memcpy(&sb->buf[sb->len], s, n);
+  sb->len += n;
+  sb->buf[sb->len] = 0;
+}
+
+void sbuf_puts(struct sbuf * sb, const char * s)
+{
+  sbuf_putn(sb, s, strlen(s));
+}
+
+void sbuf_putc(struct sbuf * sb, char c)
+{
+  if ((sb->len + 1) >= sb->cap) {
+    sb->overflow = 1;
+    return;
+  }
+  sb->buf[sb->len++] = c;
+  sb->buf[sb->len] = 0;
+}
+
+/* Writes the decimal digits of v right-aligned into the 20 byte
+ * buffer tmp, returns pointer to the first digit. */
+static char * sbuf_utoa(char * tmp, unsigned long long v)
+{
+  char * p = &tmp[20];
+  do {
+    *--p = '0' + (v % 10);
+    v /= 10;
+  } while (v > 0);
+  return p;
+}
+
+void sbuf_putll(struct sbuf * sb, long long v)
+{
+  char tmp[21];
+  unsigned long long uv = (unsigned long long)v;
+  if (v < 0) {
+    sbuf_putc(sb, '-');
+    uv = -uv;
+  }
+  char * p = sbuf_utoa(tmp, uv);
+  sbuf_putn(sb, p, &tmp[20] - p);
+}
+
+static const double sbuf_pow10[] = { 1.0, 10.0, 100.0, 1000.0, 10000.0, 100000.0, 1000000.0 };
+
+void sbuf_putfloat(struct sbuf * sb, float v, int decimals)
+{
+  if (decimals < 0) { decimals = 0; }
+  if (decimals > 6) { decimals = 6; }
+  if (isnan(v)) {
+    sbuf_puts(sb, "nan");
+    return;
+  }
+  double dv = v;
+  if (fabs(dv) >= 1.0e12) {
+    /* Out of range for our fixed point conversion. Nothing we
+     * measure ever gets there, so don't bother being clever. */
+    if (isinf(dv)) {
+      sbuf_puts(sb, (dv < 0.0) ? "-inf" : "inf");
+    } else {
+      char tmp[64];
+      int l = snprintf(tmp, sizeof(tmp), "%.*f", decimals, dv);
+      if (l > 0) {
+        sbuf_putn(sb, tmp, ((size_t)l < sizeof(tmp)) ? (size_t)l : (sizeof(tmp) - 1));
+      }
+    }
+    return;
+  }
+  if (signbit(dv)) { /* not dv < 0.0, printf prints -0.0 with a sign too */
+    sbuf_putc(sb, '-');
+    dv = -dv;
+  }
+  /* Scale and round to an integer, then split that up into the
+   * integer part and the fractional part. Exact ties are rounded
+   * to even, which is what printf does too. */
+  double scaled = dv * sbuf_pow10[decimals];
+  unsigned long long sv = (unsigned long long)scaled;
+  double frac = scaled - (double)sv;
+  if ((frac > 0.5) || ((frac == 0.5) && ((sv & 1) != 0))) {
+    sv++;
+  }
+  unsigned long long div = (unsigned long long)sbuf_pow10[decimals];
+  char tmp[21];
+  char * p = sbuf_utoa(tmp, sv / div);
+  sbuf_putn(sb, p, &tmp[20] - p);
+  if (decimals > 0) {
+    sbuf_putc(sb, '.');
+    p = sbuf_utoa(tmp, sv % div);
+    /* pad with leading zeroes */
+    for (int i = &tmp[20] - p; i < decimals; i++) {
+      sbuf_putc(sb, '0');
+    }
+    sbuf_putn(sb, p, &tmp[20] - p);
+  }
+}
+
+static void sbuf_put2digits(struct sbuf * sb, int v)
+{
+  char tmp[2] = { '0' + ((v / 10) % 10), '0' + (v % 10) };
+  sbuf_putn(sb, tmp, 2);
+}
+
+void sbuf_putisotime(struct sbuf * sb, time_t ts)
+{
+  struct tm tm;
+  gmtime_r(&ts, &tm);
+  sbuf_putll(sb, tm.tm_year + 1900);
+  sbuf_putc(sb, '-');
+  sbuf_put2digits(sb, tm.tm_mon + 1);
+  sbuf_putc(sb, '-');
+  sbuf_put2digits(sb, tm.tm_mday);
+  sbuf_putc(sb, 'T');
+  sbuf_put2digits(sb, tm.tm_hour);
+  sbuf_putc(sb, ':');
+  sbuf_put2digits(sb, tm.tm_min);
+  sbuf_putc(sb, ':');
+  sbuf_put2digits(sb, tm.tm_sec);
+  sbuf_putc(sb, 'Z');
+}
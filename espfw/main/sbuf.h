@@ -0,0 +1,46 @@
+/* ZAMDACH2022
+ * A simple append-only string buffer, used for building the
+ * payloads we send and the pages we serve. */
+
+#ifndef _SBUF_H_
+#define _SBUF_H_
+
+#include <stddef.h>
+#include <time.h>
+
+/* The buffer is always kept 0-terminated. Appending never writes past
+ * cap; if something does not fit, as much as fits is appended and the
+ * overflow flag is set, so that callers only need to check once at
+ * the end instead of after every append. */
+struct sbuf {
+  char * buf;
+  size_t cap;
+  size_t len;
+  int overflow;
+};
+
+/* Initializes sb to use buf (of size cap, which must be at least 1). */
+void sbuf_init(struct sbuf * sb, char * buf, size_t cap);
+
+/* Appends a 0-terminated string. */
+void sbuf_puts(struct sbuf * sb, const char * s);
+
+/* Appends n bytes of s. */
+void sbuf_putn(struct sbuf * sb, const char * s, size_t n);
+
+/* Appends a single character. */
+void sbuf_putc(struct sbuf * sb, char c);
+
+/* Appends a signed integer in decimal. */
+void sbuf_putll(struct sbuf * sb, long long v);
+
+/* Appends a float in fixed point notation with decimals (0 to 6)
+ * digits after the decimal point, like printf("%.<decimals>f") does -
+ * but without pulling the whole printf machinery in. */
+void sbuf_putfloat(struct sbuf * sb, float v, int decimals);
+
+/* Appends ts as an RFC 3339 timestamp in UTC, e.g.
+ * "2023-01-02T03:04:05Z". */
+void sbuf_putisotime(struct sbuf * sb, time_t ts);
+
+#endif /* _SBUF_H_ */
@@ -0,0 +1,207 @@
+/* ZAMDACH2022
+ * A tiny scheduler for the sensors: Every sensor gets a job that runs
+ * on its own timeline, so that one slow sensor does not delay all the
+ * others. Jobs are grouped into lanes, every lane has its own task. */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/event_groups.h>
+#include <freertos/task.h>
+#include "sched.h"
+
+static struct schedjob * schedjobs[SCHED_MAXJOBS];
+static int schednjobs = 0;
+static int64_t schedstart;
+static portMUX_TYPE schedstatsspinlock = portMUX_INITIALIZER_UNLOCKED;
+
+/* The record cycle that is currently open, and one bit per job that
+ * feeds the record, set when it finishes a cycle that belongs to it.
+ * Both are protected by schedstatsspinlock. The event group only wakes
+ * up sched_waitcycle(), a bit in there might be left over from a job
+ * that finished just as the cycle was closed. */
+static uint32_t schedcycle = SCHED_FIRSTCYCLE;
+static EventBits_t scheddone = 0;
+static EventGroupHandle_t schedevg;
+static EventBits_t schedrecordbits = 0;
+/* When the jobs that feed the record last started / finished a cycle. */
+static int64_t schedfirststart[SCHED_MAXJOBS];
+static int64_t schedlastdone[SCHED_MAXJOBS];
+static struct schedwindowstats schedwin;
+
+int sched_add(struct schedjob * j)
+{
+  if ((schednjobs >= SCHED_MAXJOBS) || (j->lane < 0) || (j->lane >= SCHED_MAXLANES)) {
+    ESP_LOGE("sched.c", "Cannot add job %s.", j->name);
+    return 1;
+  }
+  j->idx = schednjobs;
+  if (j->feedsrecord) {
+    schedrecordbits |= (1 << j->idx);
+  }
+  schedjobs[schednjobs++] = j;
+  return 0;
+}
+
+int sched_getstats(int idx, const char ** name, struct schedjobstats * st)
+{
+  if ((idx < 0) || (idx >= schednjobs)) {
+    return 1;
+  }
+  *name = schedjobs[idx]->name;
+  taskENTER_CRITICAL(&schedstatsspinlock);
+  *st = schedjobs[idx]->stats;
+  taskEXIT_CRITICAL(&schedstatsspinlock);
+  return 0;
+}
+
+void sched_getwindow(struct schedwindowstats * st)
+{
+  taskENTER_CRITICAL(&schedstatsspinlock);
+  *st = schedwin;
+  taskEXIT_CRITICAL(&schedstatsspinlock);
+}
+
+/* Runs the due step of job j. */
+static void sched_runstep(struct schedjob * j)
+{
+  int64_t now = esp_timer_get_time();
+  uint32_t latems = (now - j->nextdue) / 1000;
+  if (j->stepno == 0) {
+    taskENTER_CRITICAL(&schedstatsspinlock);
+    j->cycle = schedcycle;
+    taskEXIT_CRITICAL(&schedstatsspinlock);
+  }
+  int r = j->step(j, j->stepno);
+  int64_t end = esp_timer_get_time();
+  uint32_t stepms = (end - now) / 1000;
+  int counts = 0;
+  taskENTER_CRITICAL(&schedstatsspinlock);
+  j->stats.steps++;
+  if (j->stepno == 0) { j->stats.cycles++; }
+  if (latems > j->stats.maxlatems) { j->stats.maxlatems = latems; }
+  j->stats.totallatems += latems;
+  if (stepms > j->stats.maxstepms) { j->stats.maxstepms = stepms; }
+  /* A job that started before the last record was made is too late
+   * for it, and it does not count for the next one either. */
+  if ((r == SCHED_DONE) && (j->feedsrecord) && (j->cycle == schedcycle)) {
+    scheddone |= (1 << j->idx);
+    schedfirststart[j->idx] = j->cyclestart;
+    schedlastdone[j->idx] = end;
+    counts = 1;
+  }
+  taskEXIT_CRITICAL(&schedstatsspinlock);
+  if (r != SCHED_DONE) {
+    j->stepno++;
+    j->nextdue = now + (int64_t)r * 1000;
+    return;
+  }
+  if (counts) {
+    xEventGroupSetBits(schedevg, (1 << j->idx));
+  }
+  /* On to the next cycle. The start times are always calculated from
+   * the previous start, so that lateness does not add up. If we are
+   * so late that the next start has already passed, it is skipped. */
+  j->stepno = 0;
+  j->cyclestart += (int64_t)j->periodms * 1000;
+  while (j->cyclestart < esp_timer_get_time()) {
+    j->cyclestart += (int64_t)j->periodms * 1000;
+    taskENTER_CRITICAL(&schedstatsspinlock);
+    j->stats.overruns++;
+    taskEXIT_CRITICAL(&schedstatsspinlock);
+  }
+  j->nextdue = j->cyclestart;
+}
+
+static void sched_lanetask(void * pvParameters)
+{
+  int lane = (intptr_t)pvParameters;
+  while (1) {
+    /* Find the job in our lane that is due next. If several are due at
+     * the same time, the one that was added first goes first. */
+    struct schedjob * next = NULL;
+    for (int i = 0; i < schednjobs; i++) {
+      if (schedjobs[i]->lane != lane) { continue; }
+      if ((next == NULL) || (schedjobs[i]->nextdue < next->nextdue)) {
+        next = schedjobs[i];
+      }
+    }
+    int64_t wait = next->nextdue - esp_timer_get_time();
+    if (wait > 0) {
+      /* Round up, we would rather be a tick late than early. */
+      vTaskDelay((wait + (portTICK_PERIOD_MS * 1000) - 1) / (portTICK_PERIOD_MS * 1000));
+      continue;
+    }
+    sched_runstep(next);
+  }
+}
+
+void sched_start(void)
+{
+  schedevg = xEventGroupCreate();
+  schedstart = esp_timer_get_time();
+  for (int i = 0; i < schednjobs; i++) {
+    schedjobs[i]->cyclestart = schedstart + (int64_t)schedjobs[i]->offsetms * 1000;
+    schedjobs[i]->nextdue = schedjobs[i]->cyclestart;
+    schedjobs[i]->stepno = 0;
+  }
+  for (int l = 0; l < SCHED_MAXLANES; l++) {
+    int used = 0;
+    for (int i = 0; i < schednjobs; i++) {
+      if (schedjobs[i]->lane == l) { used = 1; }
+    }
+    if (!used) { continue; }
+    char tname[12];
+    snprintf(tname, sizeof(tname), "schedlane%d", l);
+    /* The jobs do I2C, UART and logging, that needs a bit of stack.
+     * The priority is above the main loop, which only does the
+     * bookkeeping after the jobs. */
+    if (xTaskCreate(&sched_lanetask, tname, 4096, (void *)(intptr_t)l, 4, NULL) != pdPASS) {
+      ESP_LOGE("sched.c", "Failed to create task for lane %d.", l);
+    }
+  }
+}
+
+int sched_waitcycle(uint32_t timeoutms, uint32_t * cycle)
+{
+  int64_t deadline = esp_timer_get_time() + (int64_t)timeoutms * 1000;
+  EventBits_t done;
+  while (1) {
+    taskENTER_CRITICAL(&schedstatsspinlock);
+    done = scheddone;
+    taskEXIT_CRITICAL(&schedstatsspinlock);
+    int64_t left = deadline - esp_timer_get_time();
+    if (((done & schedrecordbits) == schedrecordbits) || (left <= 0)) {
+      break;
+    }
+    xEventGroupWaitBits(schedevg, schedrecordbits, pdTRUE, pdFALSE,
+                        pdMS_TO_TICKS((left + 999) / 1000));
+  }
+  int64_t first = INT64_MAX;
+  int64_t last = 0;
+  taskENTER_CRITICAL(&schedstatsspinlock);
+  /* Close the cycle. Everything that finishes from now on belongs to
+   * the next one. */
+  done = scheddone;
+  *cycle = schedcycle;
+  schedcycle++;
+  scheddone = 0;
+  int res = ((done & schedrecordbits) == schedrecordbits) ? 0 : 1;
+  for (int i = 0; i < schednjobs; i++) {
+    if ((schedrecordbits & done & (1 << i)) == 0) { continue; }
+    if (schedfirststart[i] < first) { first = schedfirststart[i]; }
+    if (schedlastdone[i] > last) { last = schedlastdone[i]; }
+  }
+  schedwin.cycles++;
+  if (res != 0) {
+    schedwin.timeouts++;
+  } else if (last > first) {
+    schedwin.lastms = (last - first) / 1000;
+    if (schedwin.lastms > schedwin.maxms) { schedwin.maxms = schedwin.lastms; }
+    schedwin.totalms += schedwin.lastms;
+  }
+  taskEXIT_CRITICAL(&schedstatsspinlock);
+  return res;
+}
@@ -0,0 +1,93 @@
+/* ZAMDACH2022
+ * A tiny scheduler for the sensors: Every sensor gets a job that runs
+ * on its own timeline, so that one slow sensor does not delay all the
+ * others. Jobs are grouped into lanes, every lane has its own task, so
+ * that jobs in different lanes (e.g. on different I2C buses) really
+ * run at the same time. */
+
+#ifndef _SCHED_H_
+#define _SCHED_H_
+
+#include <stdint.h>
+
+/* How many jobs and lanes there can be. */
+#define SCHED_MAXJOBS 10
+#define SCHED_MAXLANES 4
+
+/* Returned by a step function when the job is done for this cycle. */
+#define SCHED_DONE -1
+
+struct schedjobstats {
+  uint32_t cycles;
+  uint32_t steps;
+  uint32_t maxlatems; /* how late a step was started at most */
+  uint64_t totallatems;
+  uint32_t maxstepms; /* how long a step took at most */
+  uint32_t overruns; /* cycles skipped because the previous one was not done */
+};
+
+struct schedjob {
+  const char * name;
+  /* The job is started every periodms, offsetms after the start of
+   * the scheduler. */
+  uint32_t periodms;
+  uint32_t offsetms;
+  /* Which task runs this job. Jobs in the same lane never run at the
+   * same time, so jobs that share a bus belong into the same lane. */
+  int lane;
+  /* Jobs that deliver results for the measurement record. See
+   * sched_waitcycle(). */
+  int feedsrecord;
+  /* Does step stepno (0 at the start of every cycle) of the job, and
+   * returns after how many ms the next step is due, or SCHED_DONE.
+   * This way, a job can start a measurement in one step and read the
+   * result in the next, and the other jobs can run in between.
+   * Steps should never block for more than a few ms. */
+  int (*step)(const struct schedjob * j, int stepno);
+  /* Everything below is managed by sched.c */
+  int idx;
+  /* The record cycle (see sched_waitcycle()) that was open when the
+   * current cycle of the job started. Jobs tag their results with it. */
+  uint32_t cycle;
+  int64_t cyclestart; /* esp_timer time, us */
+  int64_t nextdue; /* esp_timer time, us */
+  int stepno;
+  struct schedjobstats stats;
+};
+
+/* The measurement window: the time from the start of a cycle until
+ * the last job that feeds the record is done. */
+struct schedwindowstats {
+  uint32_t cycles;
+  uint32_t timeouts; /* cycles where not all jobs were done in time */
+  uint32_t lastms;
+  uint32_t maxms;
+  uint64_t totalms;
+};
+
+/* Adds a job. Must be called before sched_start().
+ * Returns 0 on success, 1 if there are too many jobs. */
+int sched_add(struct schedjob * j);
+
+/* Starts one task per lane that runs the jobs in it. */
+void sched_start(void);
+
+/* Record cycles are numbered from 1, so 0 can mean "never". */
+#define SCHED_FIRSTCYCLE 1
+
+/* Waits until all jobs with feedsrecord set have finished a cycle that
+ * started while the current record cycle was open, or for at most
+ * timeoutms. Returns 0 if they all did, 1 on timeout. *cycle is set to
+ * the number of that record cycle, and the next one is opened. A job
+ * that was still running does not count for the next record cycle,
+ * so results tagged with an older cycle than *cycle are stale. */
+int sched_waitcycle(uint32_t timeoutms, uint32_t * cycle);
+
+/* Gets the name and a consistent copy of the statistics of job idx.
+ * Returns 0 on success, 1 if there is no such job. */
+int sched_getstats(int idx, const char ** name, struct schedjobstats * st);
+
+/* Gets a consistent copy of the measurement window statistics. */
+void sched_getwindow(struct schedwindowstats * st);
+
+#endif /* _SCHED_H_ */
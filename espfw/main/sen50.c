@@ -1,6 +1,7 @@
 /* Talking to SEN50 particulate matter sensors */
 
 #include "esp_log.h"
+#include "i2cbus.h"
 #include "sen50.h"
 #include "sdkconfig.h"
 
@@ -11,9 +12,18 @@
 
 static i2c_port_t sen50i2cport;
 
+/* If the SEN50 wedged the bus, it has probably been reset, and after a
+ * reset it is no longer measuring. */
+static void sen50_reinit(void)
+{
+    sen50_startmeas();
+}
+
 void sen50_init(i2c_port_t port)
 {
     sen50i2cport = port;
+    /* The SEN50 can only do 100 kHz. */
+    i2cbus_adddevice(port, SEN50ADDR, "sen50", 100000, sen50_reinit);
 
     /* The default power-on-config of the sensor should
      * be perfectly fine for us, so there is nothing to
@@ -23,9 +33,9 @@ void sen50_init(i2c_port_t port)
 void sen50_startmeas(void)
 {
     uint8_t cmd[2] = { 0x00, 0x21 };
-    i2c_master_write_to_device(sen50i2cport, SEN50ADDR,
-                               cmd, sizeof(cmd),
-                               I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS);
+    i2cbus_write(sen50i2cport, SEN50ADDR,
+                 cmd, sizeof(cmd),
+                 I2C_MASTER_TIMEOUT_MS);
     /* We ignore the return value. If that failed, we'll notice
      * soon enough, namely when we try to read the result... */
 }
@@ -33,9 +43,9 @@ void sen50_startmeas(void)
 void sen50_stopmeas(void)
 {
     uint8_t cmd[2] = { 0x01, 0x04 };
-    i2c_master_write_to_device(sen50i2cport, SEN50ADDR,
-                               cmd, sizeof(cmd),
-                               I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS);
+    i2cbus_write(sen50i2cport, SEN50ADDR,
+                 cmd, sizeof(cmd),
+                 I2C_MASTER_TIMEOUT_MS);
     /* We ignore the return value. If that failed, we'll notice
      * soon enough, namely when we try to read the result... */
 }
@@ -70,18 +80,18 @@ void sen50_read(struct sen50data * d)
 {
     uint8_t readbuf[23];
     uint8_t cmd[2] = { 0x03, 0xc4 };
-    i2c_master_write_to_device(sen50i2cport, SEN50ADDR,
-                               cmd, sizeof(cmd),
-                               I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS);
+    i2cbus_write(sen50i2cport, SEN50ADDR,
+                 cmd, sizeof(cmd),
+                 I2C_MASTER_TIMEOUT_MS);
     d->valid = 0;
     d->pm010raw = 0xffff;  d->pm025raw = 0xffff; d->pm040raw = 0xffff; d->pm100raw = 0xffff;
     d->pm010 = -999.99; d->pm025 = -999.9; d->pm040 = -999.99; d->pm100 = -999.9;
     /* Datasheet says we need to give the sensor at least 20 ms time before
      * we can read the data so that it can fill its internal buffers */
     vTaskDelay(pdMS_TO_TICKS(22));
-    int res = i2c_master_read_from_device(sen50i2cport, SEN50ADDR,
-                                          readbuf, sizeof(readbuf),
-                                          I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS);
+    int res = i2cbus_read(sen50i2cport, SEN50ADDR,
+                          readbuf, sizeof(readbuf),
+                          I2C_MASTER_TIMEOUT_MS);
     if (res != ESP_OK) {
       ESP_LOGE("sen50.c", "ERROR: I2C-read from SEN50 failed.");
       return;
@@ -89,18 +99,22 @@ void sen50_read(struct sen50data * d)
     /* Check CRC */
     if (sen50_crc(readbuf[0], readbuf[1]) != readbuf[2]) {
       ESP_LOGE("sen50.c", "ERROR: CRC-check for read part 1 failed.");
+      i2cbus_reportcrcerror(sen50i2cport, SEN50ADDR);
       return;
     }
     if (sen50_crc(readbuf[3], readbuf[4]) != readbuf[5]) {
       ESP_LOGE("sen50.c", "ERROR: CRC-check for read part 2 failed.");
+      i2cbus_reportcrcerror(sen50i2cport, SEN50ADDR);
       return;
     }
     if (sen50_crc(readbuf[6], readbuf[7]) != readbuf[8]) {
       ESP_LOGE("sen50.c", "ERROR: CRC-check for read part 3 failed.");
+      i2cbus_reportcrcerror(sen50i2cport, SEN50ADDR);
       return;
     }
     if (sen50_crc(readbuf[9], readbuf[10]) != readbuf[11]) {
       ESP_LOGE("sen50.c", "ERROR: CRC-check for read part 4 failed.");
+      i2cbus_reportcrcerror(sen50i2cport, SEN50ADDR);
       return;
     }
     /* We could also check CRC for temperature / humidity / noxi data, but
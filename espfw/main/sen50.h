@@ -4,7 +4,7 @@
 #ifndef _SEN50_H_
 #define _SEN50_H_
 
-#include "driver/i2c.h" /* Needed for i2c_port_t */
+#include "hal/i2c_types.h" /* Needed for i2c_port_t */
 
 struct sen50data {
   uint8_t valid;
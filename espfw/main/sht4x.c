@@ -1,6 +1,7 @@
 /* Talking to SHT4x (SHT40, SHT41, SHT45) temperature / humidity sensors */
 
 #include "esp_log.h"
+#include "i2cbus.h"
 #include "sht4x.h"
 #include "sdkconfig.h"
 
@@ -12,13 +13,15 @@
 /* Turn on heater with medium power (110 mW) for 1 second */
 #define SHT4X_CMD_HEAT_MID_LONG 0x2F
 
-#define I2C_MASTER_TIMEOUT_MS 1000  /* Timeout for I2C communication */
+#define I2C_MASTER_TIMEOUT_MS 100  /* Timeout for I2C communication */
 
 static i2c_port_t sht4xi2cport;
 
 void sht4x_init(i2c_port_t port)
 {
     sht4xi2cport = port;
+    /* Nothing to redo after a bus recovery either. */
+    i2cbus_adddevice(port, SHT4XADDR, "sht4x", 400000, NULL);
 
     /* The default power-on-config of the sensor should
      * be perfectly fine for us, so there is nothing to
@@ -28,9 +31,9 @@ void sht4x_init(i2c_port_t port)
 void sht4x_startmeas(void)
 {
     uint8_t cmd[1] = { SHT4X_CMD_MEASURE_HIGH };
-    i2c_master_write_to_device(sht4xi2cport, SHT4XADDR,
-                               cmd, sizeof(cmd),
-                               I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS);
+    i2cbus_write(sht4xi2cport, SHT4XADDR,
+                 cmd, sizeof(cmd),
+                 I2C_MASTER_TIMEOUT_MS);
     /* We ignore the return value. If that failed, we'll notice
      * soon enough, namely when we try to read the result... */
 }
@@ -66,9 +69,9 @@ void sht4x_read(struct sht4xdata * d)
     uint8_t readbuf[6];
     d->valid = 0; d->tempraw = 0xffff;  d->humraw = 0xffff;
     d->temp = -999.99; d->hum = 200.0;
-    int res = i2c_master_read_from_device(sht4xi2cport, SHT4XADDR,
-                                          readbuf, sizeof(readbuf),
-                                          I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS);
+    int res = i2cbus_read(sht4xi2cport, SHT4XADDR,
+                          readbuf, sizeof(readbuf),
+                          I2C_MASTER_TIMEOUT_MS);
     if (res != ESP_OK) {
       ESP_LOGE("sht4x.c", "ERROR: I2C-read from SHT4x failed.");
       return;
@@ -76,10 +79,12 @@ void sht4x_read(struct sht4xdata * d)
     /* Check CRC */
     if (sht4x_crc(readbuf[0], readbuf[1]) != readbuf[2]) {
       ESP_LOGE("sht4x.c", "ERROR: CRC-check for read part 1 failed.");
+      i2cbus_reportcrcerror(sht4xi2cport, SHT4XADDR);
       return;
     }
     if (sht4x_crc(readbuf[3], readbuf[4]) != readbuf[5]) {
       ESP_LOGE("sht4x.c", "ERROR: CRC-check for read part 2 failed.");
+      i2cbus_reportcrcerror(sht4xi2cport, SHT4XADDR);
       return;
     }
     /* OK, CRC matches, this is looking good. */
@@ -99,8 +104,8 @@ void sht4x_heatercycle(void)
 {
     uint8_t cmd[1] = { SHT4X_CMD_HEAT_MID_LONG };
     ESP_LOGI("sht4x.c", "turning SHT4x heater on for 1.0 seconds at medium power (110 mW).");
-    i2c_master_write_to_device(sht4xi2cport, SHT4XADDR,
-                               cmd, sizeof(cmd),
-                               I2C_MASTER_TIMEOUT_MS / portTICK_PERIOD_MS);
+    i2cbus_write(sht4xi2cport, SHT4XADDR,
+                 cmd, sizeof(cmd),
+                 I2C_MASTER_TIMEOUT_MS);
 }
 
@@ -4,7 +4,7 @@
 #ifndef _SHT4X_H_
 #define _SHT4X_H_
 
-#include "driver/i2c.h" /* Needed for i2c_port_t */
+#include "hal/i2c_types.h" /* Needed for i2c_port_t */
 
 struct sht4xdata {
   uint8_t valid;
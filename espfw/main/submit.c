@@ -1,133 +1,920 @@
 /* ZAMDACH2022
  * Functions for submitting measurements to various APIs/Websites. */
 
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
 #include <esp_log.h>
-#include <esp_http_client.h>
+#include <esp_tls.h>
 #include <esp_crt_bundle.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/task.h>
+#include <lwip/netdb.h>
+#include "backlog.h"
+#include "influx.h"
+#include "network.h"
+#include "sbuf.h"
 #include "submit.h"
 #include "sdkconfig.h"
 #include "secrets.h"
 
-int submit_to_wpd_multi(int arraysize, struct osm * aoosm)
+/* We keep the connection to each destination open for the whole
+ * runtime if the server lets us, so that the TCP/TLS-connection can be
+ * reused between submissions. Without this, every single POST costs a
+ * full TLS handshake, which takes ages at 80 MHz. */
+struct submitconn {
+  /* The backend connection, NULL while we have none. A server closing
+   * an idle connection is only noticed on next use. */
+  void * h;
+  /* Set when a (new) connection was established during the current
+   * request, and when any part of the reply was received. */
+  int connectedthisreq;
+  int gotreply;
+};
+
+/* Everything we need to know about a destination. Adding a new one
+ * means adding a SUBMITDEST_xxx in submit.h and an entry in
+ * submitdests[] below, plus an encoder if none of the existing
+ * ones fits. */
+struct submitdest {
+  const char * name;
+  /* The URL to POST to. A %s in there is replaced by urlarg. */
+  const char * urltemplate;
+  const char * urlarg;
+  /* The HTTP header used for authentication, and the token to put
+   * there. If the token is "", the header is not sent. If
+   * authrequired is set, the destination counts as not configured
+   * without a (real) token. */
+  const char * authheader;
+  const char * authtoken;
+  int authrequired;
+  /* Writes the payload for an array of values. */
+  void (*encode)(struct sbuf * sb, int arraysize, const struct osm * aoosm);
+  /* Does the API take explicit timestamps? Only then can we keep what
+   * could not be sent in the backlog and send it later. */
+  int replay;
+  /* Which sensor IDs to use for which field.
+   * NULL or "" means that field is not sent to this destination. */
+  const char * sids[SUBMITFIELD_COUNT];
+  /* Runtime state */
+  struct submitconn conn;
+  char host[64]; /* from the URL */
+  int port;
+  struct submitmetrics metrics;
+  int consecfails;
+  int64_t nextattempt; /* esp_timer time before which we skip this destination */
+};
+
+/* After this many failures in a row, we consider a destination down,
+ * and stop trying for a while: The first pause is SUBMIT_BACKOFFMIN
+ * seconds, and it doubles with every failed attempt after that, up to
+ * SUBMIT_BACKOFFMAX. Everything that is not sent in the meantime goes
+ * to the backlog (for destinations that can take it later), so this
+ * costs little data, but saves us from waiting for the timeout every
+ * single minute. */
+#define SUBMIT_BREAKERTHRESHOLD 3
+#define SUBMIT_BACKOFFMIN 60
+#define SUBMIT_BACKOFFMAX 1800
+
+/* The token from secrets.h.template, i.e. no token was set. */
+#define SUBMIT_TOKENPLACEHOLDER "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLM123456789"
+
+static void submit_encodewpd(struct sbuf * sb, int arraysize, const struct osm * aoosm);
+static void submit_encodeosm(struct sbuf * sb, int arraysize, const struct osm * aoosm);
+
+static struct submitdest submitdests[SUBMITDEST_COUNT] = {
+  [SUBMITDEST_WPD] = {
+    .name = "wetter.poempelfox.de",
+    .urltemplate = "https://wetter.poempelfox.de/api/pushmeasurement/",
+    .urlarg = "",
+    .authheader = "X-Sensor",
+    .authtoken = ZAMDACH_WPDTOKEN,
+    .authrequired = 1,
+    .encode = submit_encodewpd,
+    /* There is no documented way to tell it when a value was measured,
+     * it always uses the time the value arrives. */
+    .replay = 0,
+    .sids = {
+      [SUBMITFIELD_PRESSURE] = CONFIG_ZAMDACH_WPDSID_PRESSURE,
+      [SUBMITFIELD_RAIN] = CONFIG_ZAMDACH_WPDSID_RAINGAUGE1,
+      [SUBMITFIELD_WINDSPEED] = CONFIG_ZAMDACH_WPDSID_WINDSPEED,
+      [SUBMITFIELD_WINDSPMAX] = CONFIG_ZAMDACH_WPDSID_WINDSPMAX,
+      [SUBMITFIELD_WINDDIR] = CONFIG_ZAMDACH_WPDSID_WINDDIR,
+      [SUBMITFIELD_TEMPERATURE] = CONFIG_ZAMDACH_WPDSID_TEMPERATURE,
+      [SUBMITFIELD_HUMIDITY] = CONFIG_ZAMDACH_WPDSID_HUMIDITY,
+      [SUBMITFIELD_PM010] = CONFIG_ZAMDACH_WPDSID_PM010,
+      [SUBMITFIELD_PM025] = CONFIG_ZAMDACH_WPDSID_PM025,
+      [SUBMITFIELD_PM040] = CONFIG_ZAMDACH_WPDSID_PM040,
+      [SUBMITFIELD_PM100] = CONFIG_ZAMDACH_WPDSID_PM100,
+      [SUBMITFIELD_UV] = CONFIG_ZAMDACH_WPDSID_UV,
+      [SUBMITFIELD_ILLUMINANCE] = CONFIG_ZAMDACH_WPDSID_ILLUMINANCE,
+    },
+  },
+  [SUBMITDEST_OSM] = {
+    .name = "opensensemap",
+    .urltemplate = "https://api.opensensemap.org/boxes/%s/data",
+    .urlarg = CONFIG_ZAMDACH_OSM_BOXID,
+    .authheader = "Authorization",
+    /* Not having a token can be perfectly valid for opensensemap */
+    .authtoken = ZAMDACH_OSMTOKEN,
+    .authrequired = 0,
+    .encode = submit_encodeosm,
+    .replay = 1,
+    .sids = {
+      [SUBMITFIELD_PRESSURE] = CONFIG_ZAMDACH_OSMSID_PRESSURE,
+      /* FIXME not to opensensemap yet, values not sane */
+      [SUBMITFIELD_RAIN] = NULL,
+      [SUBMITFIELD_WINDSPEED] = CONFIG_ZAMDACH_OSMSID_WINDSPEED,
+      [SUBMITFIELD_WINDSPMAX] = CONFIG_ZAMDACH_OSMSID_WINDSPMAX,
+      [SUBMITFIELD_WINDDIR] = CONFIG_ZAMDACH_OSMSID_WINDDIR,
+      [SUBMITFIELD_TEMPERATURE] = CONFIG_ZAMDACH_OSMSID_TEMPERATURE,
+      [SUBMITFIELD_HUMIDITY] = CONFIG_ZAMDACH_OSMSID_HUMIDITY,
+      [SUBMITFIELD_PM010] = CONFIG_ZAMDACH_OSMSID_PM010,
+      [SUBMITFIELD_PM025] = CONFIG_ZAMDACH_OSMSID_PM025,
+      [SUBMITFIELD_PM040] = CONFIG_ZAMDACH_OSMSID_PM040,
+      [SUBMITFIELD_PM100] = CONFIG_ZAMDACH_OSMSID_PM100,
+      /* FIXME not to opensensemap yet, values not sane */
+      [SUBMITFIELD_UV] = NULL,
+      [SUBMITFIELD_ILLUMINANCE] = CONFIG_ZAMDACH_OSMSID_ILLUMINANCE,
+    },
+  },
+};
+
+/* Buffer for building the payload of our POST requests. Since all
+ * submissions happen from the uploader task, one static buffer is enough.
+ * A full batch with all our sensors needs about 700 bytes, with explicit
+ * timestamps (when replaying from the backlog) about 1200. */
+static char post_data[4096];
+
+static void submit_encodewpd(struct sbuf * sb, int arraysize, const struct osm * aoosm)
+{
+  sbuf_puts(sb, "{\"software_version\":\"zamdach2022-0.1\",\"sensordatavalues\":[\n");
+  for (int i = 0; i < arraysize; i++) {
+    if (i != 0) { sbuf_puts(sb, ",\n"); }
+    sbuf_puts(sb, "{\"value_type\":\"");
+    sbuf_puts(sb, aoosm[i].sensorid);
+    sbuf_puts(sb, "\",\"value\":\"");
+    sbuf_putfloat(sb, aoosm[i].value, 3);
+    sbuf_puts(sb, "\"}");
+  }
+  sbuf_puts(sb, "\n]}\n");
+}
+
+static void submit_encodeosm(struct sbuf * sb, int arraysize, const struct osm * aoosm)
+{
+  sbuf_putc(sb, '[');
+  for (int i = 0; i < arraysize; i++) {
+    if (i != 0) { sbuf_putc(sb, ','); }
+    sbuf_puts(sb, "{\"sensor\":\"");
+    sbuf_puts(sb, aoosm[i].sensorid);
+    sbuf_puts(sb, "\",\"value\":\"");
+    sbuf_putfloat(sb, aoosm[i].value, 3);
+    sbuf_putc(sb, '"');
+    if (aoosm[i].ts != 0) {
+      /* opensensemap wants RFC 3339 timestamps */
+      sbuf_puts(sb, ",\"createdAt\":\"");
+      sbuf_putisotime(sb, aoosm[i].ts);
+      sbuf_putc(sb, '"');
+    }
+    sbuf_putc(sb, '}');
+  }
+  sbuf_putc(sb, ']');
+}
+
+const uint32_t submit_histbounds[SUBMIT_HISTBUCKETS - 1] = {
+  10, 20, 50, 100, 200, 500, 1000, 2000, 5000
+};
+const char * const submit_phasenames[SUBMITPHASE_COUNT] = {
+  "dns", "connect", "resume", "request"
+};
+
+const struct submitmetrics * submit_getmetrics(int d)
+{
+  return &submitdests[d].metrics;
+}
+
+static void submit_histadd(struct submitmetrics * m, int phase, int64_t us)
+{
+  uint32_t ms = us / 1000;
+  int b = 0;
+  while ((b < (SUBMIT_HISTBUCKETS - 1)) && (ms > submit_histbounds[b])) {
+    b++;
+  }
+  m->hist[phase][b]++;
+  m->histsum[phase] += ms;
+}
+
+static void submit_countcode(struct submitmetrics * m, int32_t code)
+{
+  for (int i = 0; i < SUBMIT_MAXCODES; i++) {
+    if (m->codes[i].code == code) {
+      m->codes[i].count++;
+      return;
+    }
+    if (m->codes[i].code == 0) {
+      /* Count first, so that a reader never sees the new code with
+       * a count of 0. */
+      m->codes[i].count = 1;
+      m->codes[i].code = code;
+      return;
+    }
+  }
+  m->othercodes++;
+}
+
+/* The default backend: TLS connections with esp-tls, checked against
+ * the certificate bundle. Every destination has at most one connection
+ * at a time, so they can simply live in an array.
+ * With CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS, we also keep the TLS
+ * session of the last connection to each destination, and offer it
+ * when connecting again. If the server still knows it, it skips the
+ * certificate check and the key exchange, i.e. all the asymmetric
+ * crypto that makes a handshake so slow at 80 MHz. The session is
+ * saved when the connection is closed, because with TLS 1.3 the
+ * server only sends its ticket after the handshake. */
+struct submittlsconn {
+  esp_tls_t * tls;
+#ifdef CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+  esp_tls_client_session_t * session;
+#endif
+};
+static struct submittlsconn submittlsconns[SUBMITDEST_COUNT];
+
+static void submit_tlsresolve(const char * host, void * bectx)
+{
+  struct addrinfo hints = { .ai_socktype = SOCK_STREAM };
+  struct addrinfo * res = NULL;
+  if (getaddrinfo(host, NULL, &hints, &res) == 0) {
+    freeaddrinfo(res);
+  }
+}
+
+static void * submit_tlsconnect(int d, const char * host, int port, int * resumed,
+                                esp_err_t * err, void * bectx)
+{
+  struct submittlsconn * tc = &submittlsconns[d];
+  esp_tls_cfg_t cfg = {
+    .crt_bundle_attach = esp_crt_bundle_attach,
+    /* esp-tls uses this for connecting as well as for every read. */
+    .timeout_ms = 5000,
+#ifdef CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+    .client_session = tc->session,
+#endif
+  };
+#ifdef CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+  /* esp-tls does not tell whether the server accepted it. If it did
+   * not, this was a full handshake after all, which shows up as no
+   * gain in the resume histogram. */
+  *resumed = (tc->session != NULL);
+#endif
+  esp_tls_t * tls = esp_tls_init();
+  if (tls == NULL) {
+    *err = ESP_ERR_NO_MEM;
+    return NULL;
+  }
+  if (esp_tls_conn_new_sync(host, strlen(host), port, &cfg, tls) != 1) {
+    esp_tls_error_handle_t eh = NULL;
+    int tlscode = 0;
+    int tlsflags = 0;
+    *err = ESP_FAIL;
+    if ((esp_tls_get_error_handle(tls, &eh) == ESP_OK) && (eh != NULL)) {
+      esp_err_t lasterr = esp_tls_get_and_clear_last_error(eh, &tlscode, &tlsflags);
+      if (lasterr != ESP_OK) { *err = lasterr; }
+    }
+    esp_tls_conn_destroy(tls);
+#ifdef CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+    /* Maybe it was the session the server did not like. */
+    esp_tls_free_client_session(tc->session);
+    tc->session = NULL;
+#endif
+    return NULL;
+  }
+  tc->tls = tls;
+  return tc;
+}
+
+static esp_err_t submit_tlswrite(void * h, const char * data, size_t len, void * bectx)
+{
+  struct submittlsconn * tc = h;
+  while (len > 0) {
+    ssize_t n = esp_tls_conn_write(tc->tls, data, len);
+    if (n <= 0) {
+      return ESP_FAIL;
+    }
+    data += n;
+    len -= n;
+  }
+  return ESP_OK;
+}
+
+static int submit_tlsread(void * h, char * buf, size_t len, void * bectx)
 {
-    int res = 0;
-    if ((strcmp(ZAMDACH_WPDTOKEN, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLM123456789") == 0)
-     || (strcmp(ZAMDACH_WPDTOKEN, "") == 0)) {
-      ESP_LOGI("submit.c", "Not sending data to wetter.poempelfox.de because no valid token has been set.");
-      return 1;
+  struct submittlsconn * tc = h;
+  ssize_t n = esp_tls_conn_read(tc->tls, buf, len);
+  return (n >= 0) ? n : -1;
+}
+
+static void submit_tlsclose(void * h, void * bectx)
+{
+  struct submittlsconn * tc = h;
+#ifdef CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+  esp_tls_client_session_t * cs = esp_tls_get_client_session(tc->tls);
+  if (cs != NULL) {
+    esp_tls_free_client_session(tc->session);
+    tc->session = cs;
+  }
+#endif
+  esp_tls_conn_destroy(tc->tls);
+  tc->tls = NULL;
+}
+
+static const struct submitbackend submit_tlsbackend = {
+  .resolve = submit_tlsresolve,
+  .connect = submit_tlsconnect,
+  .write = submit_tlswrite,
+  .read = submit_tlsread,
+  .close = submit_tlsclose,
+};
+
+static const struct submitbackend * submitbe = &submit_tlsbackend;
+
+void submit_setbackend(const struct submitbackend * be)
+{
+  submitbe = be;
+}
+
+/* What we got back for a request. */
+struct submitreply {
+  int status;
+  int keepalive;
+  long long contentlength; /* -1 if not known */
+};
+
+/* The reply is read through this buffer. Like post_data, it is only
+ * ever used from the uploader task. It has to hold the longest line in
+ * the header we care about, longer ones are rejected. */
+static struct {
+  char buf[512];
+  size_t len;
+  size_t pos;
+} rd;
+
+/* Moves what was not used yet to the start of the buffer and reads more
+ * from the connection. */
+static esp_err_t submit_rdmore(struct submitdest * sd)
+{
+  if (rd.pos > 0) {
+    memmove(rd.buf, rd.buf + rd.pos, rd.len - rd.pos);
+    rd.len -= rd.pos;
+    rd.pos = 0;
+  }
+  if (rd.len >= sizeof(rd.buf)) {
+    return ESP_ERR_INVALID_RESPONSE;
+  }
+  int n = submitbe->read(sd->conn.h, rd.buf + rd.len, sizeof(rd.buf) - rd.len, submitbe->bectx);
+  if (n < 0) {
+    return ESP_ERR_TIMEOUT;
+  }
+  if (n == 0) { /* closed by the server */
+    return ESP_ERR_INVALID_RESPONSE;
+  }
+  sd->conn.gotreply = 1;
+  rd.len += n;
+  return ESP_OK;
+}
+
+/* Returns the next line of the reply, without the line end, in *line.
+ * That stays valid until the next read. */
+static esp_err_t submit_rdline(struct submitdest * sd, char ** line)
+{
+  while (1) {
+    char * nl = memchr(rd.buf + rd.pos, '\n', rd.len - rd.pos);
+    if (nl != NULL) {
+      *line = rd.buf + rd.pos;
+      rd.pos = (nl - rd.buf) + 1;
+      if ((nl > *line) && (nl[-1] == '\r')) { nl--; }
+      *nl = 0;
+      return ESP_OK;
+    }
+    esp_err_t err = submit_rdmore(sd);
+    if (err != ESP_OK) {
+      return err;
+    }
+  }
+}
+
+/* Throws away the next n bytes of the reply. */
+static esp_err_t submit_rdskip(struct submitdest * sd, unsigned long long n)
+{
+  while (n > 0) {
+    if (rd.pos == rd.len) {
+      esp_err_t err = submit_rdmore(sd);
+      if (err != ESP_OK) {
+        return err;
+      }
+    }
+    size_t k = rd.len - rd.pos;
+    if (k > n) { k = n; }
+    rd.pos += k;
+    n -= k;
+  }
+  return ESP_OK;
+}
+
+/* Reads the reply to a request: the status and the headers we care
+ * about, and then the body, which we do not need, but which has to be
+ * out of the way before the connection can be used again. */
+static esp_err_t submit_readreply(struct submitdest * sd, struct submitreply * r)
+{
+  char * line;
+  int minor;
+  int chunked;
+  esp_err_t err;
+  rd.len = 0;
+  rd.pos = 0;
+  /* An informational (1xx) reply is followed by the real one. */
+  do {
+    r->contentlength = -1;
+    chunked = 0;
+    if ((err = submit_rdline(sd, &line)) != ESP_OK) {
+      return err;
+    }
+    if (sscanf(line, "HTTP/1.%d %d", &minor, &r->status) != 2) {
+      return ESP_ERR_INVALID_RESPONSE;
     }
-    for (int i = 0; i < arraysize; i++) {
-      if (strcmp(aoosm[i].sensorid, "") == 0) {
-        ESP_LOGI("submit.c", "Not sending data to wetter.poempelfox.de because sensorid has not been set in arrayelement %d of %d.", i, arraysize);
-        return 1;
+    r->keepalive = (minor >= 1);
+    while (1) {
+      if ((err = submit_rdline(sd, &line)) != ESP_OK) {
+        return err;
+      }
+      if (*line == 0) {
+        break;
       }
+      for (char * c = line; *c != 0; c++) {
+        *c = tolower((unsigned char)*c);
+      }
+      if (strncmp(line, "content-length:", 15) == 0) {
+        r->contentlength = strtoll(line + 15, NULL, 10);
+      } else if (strncmp(line, "transfer-encoding:", 18) == 0) {
+        chunked = (strstr(line + 18, "chunked") != NULL);
+      } else if (strncmp(line, "connection:", 11) == 0) {
+        if (strstr(line + 11, "close") != NULL) { r->keepalive = 0; }
+        if (strstr(line + 11, "keep-alive") != NULL) { r->keepalive = 1; }
+      }
+    }
+  } while (r->status < 200);
+  if ((r->status == 204) || (r->status == 304)) {
+    return ESP_OK;
+  }
+  if (chunked) {
+    while (1) {
+      if ((err = submit_rdline(sd, &line)) != ESP_OK) {
+        return err;
+      }
+      unsigned long cl = strtoul(line, NULL, 16);
+      if (cl == 0) {
+        break;
+      }
+      if ((err = submit_rdskip(sd, cl)) != ESP_OK) { return err; }
+      if ((err = submit_rdline(sd, &line)) != ESP_OK) { return err; }
     }
-    char post_data[500];
-    /* Build the contents of the HTTP POST we will
-     * send to wetter.poempelfox.de */
-    strcpy(post_data, "{\"software_version\":\"zamdach2022-0.1\",\"sensordatavalues\":[\n");
-    for (int i = 0; i < arraysize; i++) {
-      if (i != 0) { strcat(post_data, ",\n"); }
-      sprintf(&post_data[strlen(post_data)],
-              "{\"value_type\":\"%s\",\"value\":\"%.3f\"}",
-              aoosm[i].sensorid, aoosm[i].value);
-    }
-    strcat(post_data, "\n]}\n");
-    ESP_LOGI("submit.c", "wpd-payload: %d bytes: '%s'", strlen(post_data), post_data);
-    esp_http_client_config_t httpcc = {
-      .url = "https://wetter.poempelfox.de/api/pushmeasurement/",
-      .crt_bundle_attach = esp_crt_bundle_attach,
-      .method = HTTP_METHOD_POST,
-      .timeout_ms = 5000,
-      .user_agent = "ZAMDACH2022/0.1 (ESP32)"
-    };
-    esp_http_client_handle_t httpcl = esp_http_client_init(&httpcc);
-    esp_http_client_set_header(httpcl, "Content-Type", "application/json");
-    esp_http_client_set_header(httpcl, "X-Sensor", ZAMDACH_WPDTOKEN);
-    esp_http_client_set_post_field(httpcl, post_data, strlen(post_data));
-    esp_err_t err = esp_http_client_perform(httpcl);
-    if (err == ESP_OK) {
-        ESP_LOGI("submit.c", "HTTP POST Status = %d, content_length = %lld",
-                      esp_http_client_get_status_code(httpcl),
-                      esp_http_client_get_content_length(httpcl));
-    } else {
-        ESP_LOGE("submit.c", "HTTP POST request failed: %s", esp_err_to_name(err));
-        res = 1;
-    }
-    esp_http_client_cleanup(httpcl);
-    return res;
-}
-
-int submit_to_wpd(char * sensorid, float value)
-{
-  struct osm aoosm[1];
-  if (strcmp(sensorid, "") == 0) {
-    ESP_LOGI("submit.c", "Not sending data to wetter.poempelfox.de because sensorid is not set.");
+    /* Trailers, if any, up to the final empty line. */
+    do {
+      if ((err = submit_rdline(sd, &line)) != ESP_OK) {
+        return err;
+      }
+    } while (*line != 0);
+    return ESP_OK;
+  }
+  if (r->contentlength >= 0) {
+    return submit_rdskip(sd, r->contentlength);
+  }
+  /* Neither: the body ends when the server closes the connection. */
+  r->keepalive = 0;
+  while (submit_rdmore(sd) == ESP_OK) {
+    rd.pos = rd.len;
+  }
+  return ESP_OK;
+}
+
+static void submit_closeconn(struct submitdest * sd)
+{
+  if (sd->conn.h != NULL) {
+    submitbe->close(sd->conn.h, submitbe->bectx);
+    sd->conn.h = NULL;
+  }
+}
+
+/* Does one request on the connection of sd (opening one if there is
+ * none), and records timings and outcome. Before connecting, we look
+ * up the host: That way the lookup gets timed separately, and the
+ * connect itself then gets the answer from the lwIP DNS cache. */
+static esp_err_t submit_perform1(struct submitdest * sd, int d, const char * reqhead,
+                                 size_t headlen, size_t postlen, struct submitreply * r)
+{
+  struct submitconn * sc = &sd->conn;
+  struct submitmetrics * m = &sd->metrics;
+  esp_err_t err = ESP_OK;
+  sc->connectedthisreq = 0;
+  sc->gotreply = 0;
+  m->attempts++;
+  m->bytessent += postlen;
+  if (sc->h == NULL) {
+    if (submitbe->resolve != NULL) {
+      int64_t dnsstart = esp_timer_get_time();
+      submitbe->resolve(sd->host, submitbe->bectx);
+      submit_histadd(m, SUBMITPHASE_DNS, esp_timer_get_time() - dnsstart);
+    }
+    int resumed = 0;
+    int64_t connstart = esp_timer_get_time();
+    sc->h = submitbe->connect(d, sd->host, sd->port, &resumed, &err, submitbe->bectx);
+    if (sc->h == NULL) {
+      submit_countcode(m, err);
+      return err;
+    }
+    int64_t hsus = esp_timer_get_time() - connstart;
+    submit_histadd(m, (resumed) ? SUBMITPHASE_RESUME : SUBMITPHASE_CONNECT, hsus);
+    sc->connectedthisreq = 1;
+    ESP_LOGI("submit.c", "%s: new connection took %lld ms (%s).", sd->name,
+             (long long)(hsus / 1000), (resumed) ? "resumed TLS session" : "full TLS handshake");
+  }
+  int64_t reqstart = esp_timer_get_time();
+  err = submitbe->write(sc->h, reqhead, headlen, submitbe->bectx);
+  if (err == ESP_OK) {
+    err = submitbe->write(sc->h, post_data, postlen, submitbe->bectx);
+  }
+  if (err == ESP_OK) {
+    err = submit_readreply(sd, r);
+  }
+  if (err == ESP_OK) {
+    submit_histadd(m, SUBMITPHASE_REQUEST, esp_timer_get_time() - reqstart);
+    submit_countcode(m, r->status);
+  } else {
+    submit_countcode(m, err);
+  }
+  if ((err != ESP_OK) || (!r->keepalive)) {
+    submit_closeconn(sd);
+  }
+  return err;
+}
+
+/* Runs a request on the persistent connection of a destination. If
+ * the request fails on a connection that we reused before anything
+ * came back, the server has most likely closed the idle connection on
+ * its side. In that case we retry exactly once, which will then
+ * connect anew. If the request failed on a fresh connection, or the
+ * server already started replying, retrying is pointless. */
+static esp_err_t submit_perform(struct submitdest * sd, int d, const char * reqhead,
+                                size_t headlen, size_t postlen, struct submitreply * r)
+{
+  struct submitconn * sc = &sd->conn;
+  int wasconnected = (sc->h != NULL);
+  esp_err_t err = submit_perform1(sd, d, reqhead, headlen, postlen, r);
+  if ((err != ESP_OK) && (wasconnected) && (!sc->gotreply)) {
+    ESP_LOGI("submit.c", "Request to %s on kept-alive connection failed (%s), reconnecting.",
+             sd->name, esp_err_to_name(err));
+    err = submit_perform1(sd, d, reqhead, headlen, postlen, r);
+  }
+  return err;
+}
+
+/* Sends an array of values to destination d in one HTTPS request.
+ * Returns 0 on success. */
+static int submit_send(int d, int arraysize, const struct osm * aoosm)
+{
+  struct submitdest * sd = &submitdests[d];
+  int res = 0;
+  struct sbuf sb;
+  sbuf_init(&sb, post_data, sizeof(post_data));
+  sd->encode(&sb, arraysize, aoosm);
+  if (sb.overflow) {
+    ESP_LOGE("submit.c", "%s-payload does not fit into %u bytes, not sending.", sd->name, (unsigned)sizeof(post_data));
+    return 1;
+  }
+  ESP_LOGI("submit.c", "%s-payload: %u bytes: '%s'", sd->name, (unsigned)sb.len, post_data);
+  char url[200];
+  snprintf(url, sizeof(url), sd->urltemplate, sd->urlarg);
+  /* The host is what is between "://" and the next '/' or ':', the
+   * path everything from the '/' on. */
+  const char * h = strstr(url, "://");
+  h = (h != NULL) ? (h + 3) : url;
+  size_t hl = strcspn(h, "/:");
+  const char * path = h + hl + strcspn(h + hl, "/");
+  if ((hl == 0) || (hl >= sizeof(sd->host)) || (*path == 0)) {
+    ESP_LOGE("submit.c", "Cannot make sense of the URL for %s: %s", sd->name, url);
+    return 1;
+  }
+  memcpy(sd->host, h, hl);
+  sd->host[hl] = 0;
+  sd->port = (h[hl] == ':') ? atoi(h + hl + 1) : 443;
+  char reqhead[512];
+  struct sbuf hb;
+  sbuf_init(&hb, reqhead, sizeof(reqhead));
+  sbuf_puts(&hb, "POST ");
+  sbuf_puts(&hb, path);
+  sbuf_puts(&hb, " HTTP/1.1\r\nHost: ");
+  sbuf_puts(&hb, sd->host);
+  sbuf_puts(&hb, "\r\nUser-Agent: ZAMDACH2022/0.1 (ESP32)\r\n"
+                 "Content-Type: application/json\r\nContent-Length: ");
+  sbuf_putll(&hb, sb.len);
+  if (strcmp(sd->authtoken, "") != 0) {
+    sbuf_puts(&hb, "\r\n");
+    sbuf_puts(&hb, sd->authheader);
+    sbuf_puts(&hb, ": ");
+    sbuf_puts(&hb, sd->authtoken);
+  }
+  sbuf_puts(&hb, "\r\n\r\n");
+  if (hb.overflow) {
+    ESP_LOGE("submit.c", "Request header for %s does not fit into %u bytes.", sd->name, (unsigned)sizeof(reqhead));
     return 1;
   }
-  aoosm[0].sensorid = sensorid;
-  aoosm[0].value = value;
-  return submit_to_wpd_multi(1, aoosm);
+  struct submitreply r;
+  esp_err_t err = submit_perform(sd, d, reqhead, hb.len, sb.len, &r);
+  if (err == ESP_OK) {
+      ESP_LOGI("submit.c", "HTTP POST to %s: Status = %d, content_length = %lld",
+                    sd->name, r.status, r.contentlength);
+      /* Server errors are worth retrying later, client errors are not. */
+      if (r.status >= 500) { res = 1; }
+  } else {
+      ESP_LOGE("submit.c", "HTTP POST request to %s failed: %s", sd->name, esp_err_to_name(err));
+      res = 1;
+  }
+  if (res == 0) {
+    sd->metrics.successes++;
+  } else {
+    sd->metrics.failures++;
+  }
+  return res;
+}
+
+/* How many batches the queue to the uploader task can hold. If the
+ * uplink is down for longer than this many measurement cycles, the
+ * oldest batches get dropped. */
+#define SUBMIT_QUEUEDEPTH 8
+
+static QueueHandle_t submitqueue = NULL;
+static struct submitstats sstats;
+static portMUX_TYPE sstatsspinlock = portMUX_INITIALIZER_UNLOCKED;
+
+/* How many batches from the backlog we send in one request. */
+#define SUBMIT_REPLAYBATCHES 3
+
+void submitbatch_init(struct submitbatch * b, time_t ts)
+{
+  b->ts = ts;
+  b->valid = 0;
 }
 
-int submit_to_opensensemap_multi(char * boxid, int arraysize, struct osm * arrayofosm)
+void submitbatch_add(struct submitbatch * b, enum submitfield f, float value)
 {
-    int res = 1;
-    /* No check for authentication token because not having one can be perfectly
-     * valid for opensensemap */
-    if (strcmp(boxid, "") == 0) {
-      ESP_LOGI("submit.c", "Not sending data to opensensemap because boxid is not set.");
-      return 1;
+  b->values[f] = value;
+  b->valid |= (1 << f);
+}
+
+/* Is destination d configured at all? If not, there is no point in
+ * trying to send anything there, or in keeping a backlog for it. */
+static int submit_destconfigured(int d)
+{
+  const struct submitdest * sd = &submitdests[d];
+  if ((strstr(sd->urltemplate, "%s") != NULL) && (strcmp(sd->urlarg, "") == 0)) {
+    return 0;
+  }
+  if ((sd->authrequired)
+   && ((strcmp(sd->authtoken, "") == 0)
+    || (strcmp(sd->authtoken, SUBMIT_TOKENPLACEHOLDER) == 0))) {
+    return 0;
+  }
+  return 1;
+}
+
+/* Converts batches into the struct osm array for destination d.
+ * If withts is set, every value carries the timestamp of its batch.
+ * Returns the number of array elements filled. */
+static int submit_tosmarray(int d, const struct submitbatch * b, int nb,
+                            int withts, struct osm * aoosm, int maxosm)
+{
+  int n = 0;
+  for (int i = 0; i < nb; i++) {
+    for (int f = 0; f < SUBMITFIELD_COUNT; f++) {
+      const char * sid = submitdests[d].sids[f];
+      if (((b[i].valid & (1 << f)) == 0) || (sid == NULL) || (strcmp(sid, "") == 0)) {
+        continue;
+      }
+      if (n >= maxosm) {
+        return n;
+      }
+      aoosm[n].sensorid = sid;
+      aoosm[n].value = b[i].values[f];
+      aoosm[n].ts = (withts) ? b[i].ts : 0;
+      n++;
     }
-    /* Send HTTP POST to api.opensensemap.org */
-    char post_data[500];
-    strcpy(post_data, "[");
-    for (int i = 0; i < arraysize; i++) {
-      if (strcmp(arrayofosm[i].sensorid, "") != 0) {
-        sprintf(&post_data[strlen(post_data)],
-                "{\"sensor\":\"%s\",\"value\":\"%.3f\"},",
-                arrayofosm[i].sensorid, arrayofosm[i].value);
+  }
+  return n;
+}
+
+/* Updates the latency statistics for destination d */
+static void submit_updatedeststats(int d, int64_t startts, int failed)
+{
+  long lat = (esp_timer_get_time() - startts) / 1000;
+  taskENTER_CRITICAL(&sstatsspinlock);
+  sstats.dest[d].requests++;
+  if (failed) { sstats.dest[d].failures++; }
+  sstats.dest[d].lastlatms = lat;
+  if (lat > sstats.dest[d].maxlatms) { sstats.dest[d].maxlatms = lat; }
+  sstats.dest[d].totallatms += lat;
+  sstats.dest[d].consecfails = submitdests[d].consecfails;
+  sstats.dest[d].nextattempt = submitdests[d].nextattempt;
+  taskEXIT_CRITICAL(&sstatsspinlock);
+}
+
+/* Sends values to destination d, unless the destination is known
+ * to be down and we are still waiting for the next attempt, in
+ * which case this fails right away. Returns 0 on success. */
+static int submit_todest(int d, int arraysize, struct osm * aoosm)
+{
+  struct submitdest * sd = &submitdests[d];
+  int64_t startts = esp_timer_get_time();
+  if (startts < sd->nextattempt) {
+    ESP_LOGI("submit.c", "Not trying %s, it failed %d times in a row. Next attempt in %lld s.",
+             sd->name, sd->consecfails, (long long)((sd->nextattempt - startts) / 1000000));
+    taskENTER_CRITICAL(&sstatsspinlock);
+    sstats.dest[d].skipped++;
+    taskEXIT_CRITICAL(&sstatsspinlock);
+    return 1;
+  }
+  int r = submit_send(d, arraysize, aoosm);
+  if (r == 0) {
+    if (sd->consecfails >= SUBMIT_BREAKERTHRESHOLD) {
+      ESP_LOGI("submit.c", "%s is back after %d failed attempts.", sd->name, sd->consecfails);
+    }
+    sd->consecfails = 0;
+    sd->nextattempt = 0;
+  } else {
+    sd->consecfails++;
+    if (sd->consecfails >= SUBMIT_BREAKERTHRESHOLD) {
+      int64_t pause = SUBMIT_BACKOFFMAX;
+      int sh = sd->consecfails - SUBMIT_BREAKERTHRESHOLD;
+      if (sh < 16) {
+        pause = (int64_t)SUBMIT_BACKOFFMIN << sh;
+        if (pause > SUBMIT_BACKOFFMAX) { pause = SUBMIT_BACKOFFMAX; }
       }
+      sd->nextattempt = esp_timer_get_time() + pause * 1000000;
+      ESP_LOGW("submit.c", "%s failed %d times in a row, pausing it for %lld s.",
+               sd->name, sd->consecfails, (long long)pause);
+    }
+  }
+  submit_updatedeststats(d, startts, r);
+  return r;
+}
+
+int submit_batch(struct submitbatch * b)
+{
+  int res = 0;
+  struct osm aoosm[SUBMITFIELD_COUNT];
+  for (int d = 0; d < SUBMITDEST_COUNT; d++) {
+    if (!submit_destconfigured(d)) {
+      continue;
     }
-    post_data[strlen(post_data)-1] = ']'; // We overwrite the ',' after the last entry
-    ESP_LOGI("submit.c", "opensensemap-payload: %d bytes: '%s'", strlen(post_data), post_data);
-    char apiurl[200];
-    sprintf(apiurl, "https://api.opensensemap.org/boxes/%s/data", boxid);
-    esp_http_client_config_t httpcc = {
-      .url = apiurl,
-      .crt_bundle_attach = esp_crt_bundle_attach,
-      .method = HTTP_METHOD_POST,
-      .timeout_ms = 5000,
-      .user_agent = "ZAMDACH2022/0.1 (ESP32)"
-    };
-    esp_http_client_handle_t httpcl = esp_http_client_init(&httpcc);
-    esp_http_client_set_header(httpcl, "Content-Type", "application/json");
-    if (strcmp(ZAMDACH_OSMTOKEN, "") != 0) {
-      esp_http_client_set_header(httpcl, "Authorization", ZAMDACH_OSMTOKEN);
-    }
-    esp_http_client_set_post_field(httpcl, post_data, strlen(post_data));
-    esp_err_t err = esp_http_client_perform(httpcl);
-    if (err == ESP_OK) {
-        ESP_LOGI("submit.c", "HTTP POST Status = %d, content_length = %lld",
-                      esp_http_client_get_status_code(httpcl),
-                      esp_http_client_get_content_length(httpcl));
-    } else {
-        ESP_LOGE("submit.c", "HTTP POST request failed: %s", esp_err_to_name(err));
-        res = 1;
-    }
-    esp_http_client_cleanup(httpcl);
-    return res;
-}
-
-int submit_to_opensensemap(char * boxid, char * sensorid, float value)
-{
-  struct osm aoosm[1];
-  if (strcmp(sensorid, "") == 0) {
-    ESP_LOGI("submit.c", "Not sending data to opensensemap because sensorid is not set.");
+    int n = submit_tosmarray(d, b, 1, 0, aoosm, SUBMITFIELD_COUNT);
+    if (n > 0) {
+      if (submit_todest(d, n, aoosm) != 0) { res |= (1 << d); }
+    }
+  }
+  return res;
+}
+
+/* Sends batches from the backlog to destination d, oldest first,
+ * with their original timestamps. Stops when the backlog is empty,
+ * a request fails, or there is a new batch waiting in the queue. */
+static void submit_replaybacklog(int d)
+{
+  static struct submitbatch rb[SUBMIT_REPLAYBATCHES];
+  static struct osm aoosm[SUBMIT_REPLAYBATCHES * SUBMITFIELD_COUNT];
+  uint32_t handles[SUBMIT_REPLAYBATCHES];
+  while ((backlog_pending(d) > 0) && (uxQueueMessagesWaiting(submitqueue) == 0)) {
+    int nb = backlog_peek(d, rb, handles, SUBMIT_REPLAYBATCHES);
+    if (nb <= 0) {
+      break;
+    }
+    int n = submit_tosmarray(d, rb, nb, 1, aoosm, SUBMIT_REPLAYBATCHES * SUBMITFIELD_COUNT);
+    if (n > 0) {
+      ESP_LOGI("submit.c", "Replaying %d batches from the backlog to %s, %ld still pending.",
+               nb, sstats.dest[d].name, backlog_pending(d));
+      if (submit_todest(d, n, aoosm) != 0) {
+        break;
+      }
+    }
+    backlog_marksent(d, handles, nb);
+    taskENTER_CRITICAL(&sstatsspinlock);
+    sstats.replayed[d] += nb;
+    taskEXIT_CRITICAL(&sstatsspinlock);
+  }
+}
+
+static void submit_uploadertask(void * arg)
+{
+  struct submitbatch b;
+  while (1) {
+    if (xQueueReceive(submitqueue, &b, portMAX_DELAY) != pdTRUE) {
+      continue;
+    }
+    /* We need a working network connection. Wait for up to 10
+     * seconds if we do not have an IP address yet, and just try
+     * anyways after that. */
+    xEventGroupWaitBits(network_event_group, NETWORK_CONNECTED_BIT,
+                        pdFALSE, pdFALSE,
+                        (10000 / portTICK_PERIOD_MS));
+    /* The DNS lookup for influx.c is done here, so that it never
+     * holds up the measurements in the main task. */
+    influx_resolve();
+    long age = time(NULL) - b.ts;
+    taskENTER_CRITICAL(&sstatsspinlock);
+    if (age > sstats.maxbatchage) { sstats.maxbatchage = age; }
+    taskEXIT_CRITICAL(&sstatsspinlock);
+    int failed = submit_batch(&b);
+    int keep = 0;
+    for (int d = 0; d < SUBMITDEST_COUNT; d++) {
+      if ((failed & (1 << d)) && (submitdests[d].replay)) { keep |= (1 << d); }
+    }
+    if (keep != 0) {
+      /* Keep what could not be sent, so that we can backfill it later. */
+      if (backlog_append(&b, keep) == ESP_OK) {
+        taskENTER_CRITICAL(&sstatsspinlock);
+        for (int d = 0; d < SUBMITDEST_COUNT; d++) {
+          if (keep & (1 << d)) { sstats.backlogged[d]++; }
+        }
+        taskEXIT_CRITICAL(&sstatsspinlock);
+      }
+    }
+    for (int d = 0; d < SUBMITDEST_COUNT; d++) {
+      /* If this destination just worked, the uplink has recovered,
+       * so now is a good time to send what has piled up. */
+      if ((submit_destconfigured(d)) && (submitdests[d].replay)
+       && ((failed & (1 << d)) == 0)) {
+        submit_replaybacklog(d);
+      }
+    }
+  }
+}
+
+void submit_start(void)
+{
+  memset(&sstats, 0, sizeof(sstats));
+  for (int d = 0; d < SUBMITDEST_COUNT; d++) {
+    sstats.dest[d].name = submitdests[d].name;
+    sstats.dest[d].configured = submit_destconfigured(d);
+  }
+  sstats.queuesize = SUBMIT_QUEUEDEPTH;
+  /* If this fails, we just run without a backlog. */
+  backlog_init();
+  submitqueue = xQueueCreate(SUBMIT_QUEUEDEPTH, sizeof(struct submitbatch));
+  if (submitqueue == NULL) {
+    ESP_LOGE("submit.c", "Failed to create the submit queue. Measurements will not be submitted.");
+    return;
+  }
+  /* Doing HTTPS needs quite a bit of stack. */
+  xTaskCreate(&submit_uploadertask, "uploader", 6144, NULL, 5, NULL);
+}
+
+int submit_enqueue(struct submitbatch * b)
+{
+  int res = 0;
+  if (submitqueue == NULL) {
     return 1;
   }
-  aoosm[0].sensorid = sensorid;
-  aoosm[0].value = value;
-  return submit_to_opensensemap_multi(boxid, 1, aoosm);
+  if (xQueueSend(submitqueue, b, 0) != pdTRUE) {
+    /* The queue is full. Throw away the oldest batch to make
+     * room - the newest data is the most interesting. */
+    struct submitbatch old;
+    if (xQueueReceive(submitqueue, &old, 0) == pdTRUE) {
+      ESP_LOGW("submit.c", "Upload queue full, dropped batch from %lld.", (long long)old.ts);
+      taskENTER_CRITICAL(&sstatsspinlock);
+      sstats.dropped++;
+      taskEXIT_CRITICAL(&sstatsspinlock);
+    }
+    res = 1;
+    if (xQueueSend(submitqueue, b, 0) != pdTRUE) {
+      ESP_LOGW("submit.c", "Upload queue full, dropped batch from %lld.", (long long)b->ts);
+      taskENTER_CRITICAL(&sstatsspinlock);
+      sstats.dropped++;
+      taskEXIT_CRITICAL(&sstatsspinlock);
+    }
+  }
+  int qd = uxQueueMessagesWaiting(submitqueue);
+  taskENTER_CRITICAL(&sstatsspinlock);
+  sstats.enqueued++;
+  if (qd > sstats.maxqueuedepth) { sstats.maxqueuedepth = qd; }
+  taskEXIT_CRITICAL(&sstatsspinlock);
+  return res;
+}
+
+void submit_getstats(struct submitstats * st)
+{
+  taskENTER_CRITICAL(&sstatsspinlock);
+  *st = sstats;
+  taskEXIT_CRITICAL(&sstatsspinlock);
+  st->queuedepth = (submitqueue != NULL) ? uxQueueMessagesWaiting(submitqueue) : 0;
 }
 
@@ -2,30 +2,173 @@
 #ifndef _SUBMIT_H_
 #define _SUBMIT_H_
 
-/* An array of the following structs is handed to the
- * submit_to_opensensemap_multi or submit_to_wpd_multi
- * functions. Note that the value of sensorid for both
- * APIs is very different though. */
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <esp_err.h>
+
+/* The destinations we submit to. They are described in the
+ * submitdests table in submit.c. */
+#define SUBMITDEST_WPD 0
+#define SUBMITDEST_OSM 1
+#define SUBMITDEST_COUNT 2
+
+/* Internally, a batch is turned into an array of the following
+ * structs for each destination, which the payload encoders take.
+ * Note that the value of sensorid for both APIs is very
+ * different though.
+ * ts is the time the value was measured. If it is 0, no
+ * timestamp is sent and the server will just use the time
+ * it received the value. wetter.poempelfox.de always does
+ * that, ts is ignored there. */
 struct osm {
   const char * sensorid;
   float value;
+  time_t ts;
+};
+
+/* The things we measure. The mapping to the sensor IDs of the
+ * various destinations is done in submit.c.
+ * These numbers are stored in flash (in the backlog), so never
+ * change the order, only add new ones at the end. */
+enum submitfield {
+  SUBMITFIELD_PRESSURE = 0,
+  SUBMITFIELD_RAIN,
+  SUBMITFIELD_WINDSPEED,
+  SUBMITFIELD_WINDSPMAX,
+  SUBMITFIELD_WINDDIR,
+  SUBMITFIELD_TEMPERATURE,
+  SUBMITFIELD_HUMIDITY,
+  SUBMITFIELD_PM010,
+  SUBMITFIELD_PM025,
+  SUBMITFIELD_PM040,
+  SUBMITFIELD_PM100,
+  SUBMITFIELD_UV,
+  SUBMITFIELD_ILLUMINANCE,
+  SUBMITFIELD_COUNT
+};
+
+/* A batch of all measurements from one measurement cycle.
+ * Sensors add their values with submitbatch_add(), and at the end
+ * of the cycle the whole batch is sent with submit_batch(), which
+ * does exactly one request per destination. */
+struct submitbatch {
+  time_t ts;
+  uint16_t valid; /* Bitmask: which of the values are set */
+  float values[SUBMITFIELD_COUNT];
 };
 
-/* Submits multiple values to the wetter.poempelfox.de API
- * in one HTTPS request */
-int submit_to_wpd_multi(int arraysize, struct osm * arrayofosm);
+/* Empties the batch and sets the timestamp of the measurement cycle. */
+void submitbatch_init(struct submitbatch * b, time_t ts);
+
+/* Sets the value for one of the fields in the batch. */
+void submitbatch_add(struct submitbatch * b, enum submitfield f, float value);
+
+/* Submits the whole batch, with one request per destination.
+ * Returns 0 if all requests succeeded, otherwise a bitmask with
+ * (1 << SUBMITDEST_xxx) set for every destination that failed.
+ * This blocks until all requests are done, so you probably want
+ * submit_enqueue(). */
+int submit_batch(struct submitbatch * b);
 
-/* This is a convenience function, calling ..._wpd_multi
- * with a size 1 array internally. */
-int submit_to_wpd(char * sensorid, float value);
+/* Creates the queue and starts the uploader task, which takes
+ * batches from the queue and submits them. */
+void submit_start(void);
 
-/* Submits multiple values to the opensensemap-API
- * (api.opensensemap.org) in one HTTPS request */
-int submit_to_opensensemap_multi(char * boxid, int arraysize, struct osm * arrayofosm);
+/* Hands a copy of the batch to the uploader task. This never blocks:
+ * If the queue is full, the oldest queued batch is dropped.
+ * Returns 0 if nothing had to be dropped. */
+int submit_enqueue(struct submitbatch * b);
+
+/* Statistics about the uploads, for display in the webinterface. */
+struct submitdeststats {
+  const char * name;
+  int configured;
+  long requests;
+  long failures;
+  long skipped; /* not tried because the destination is considered down */
+  int consecfails;
+  int64_t nextattempt; /* esp_timer time, 0 if not paused */
+  long lastlatms;
+  long maxlatms;
+  long long totallatms;
+};
+struct submitstats {
+  int queuesize;
+  int queuedepth;
+  int maxqueuedepth;
+  long enqueued;
+  long dropped;
+  long maxbatchage;
+  struct submitdeststats dest[SUBMITDEST_COUNT];
+  long backlogged[SUBMITDEST_COUNT]; /* batches written to the backlog */
+  long replayed[SUBMITDEST_COUNT]; /* batches successfully sent from the backlog */
+};
+
+/* Gets a consistent copy of the current upload statistics. */
+void submit_getstats(struct submitstats * st);
+
+/* More detailed metrics per destination. These are only ever written
+ * by the uploader task, and all fields are 32 bits, so they can be read
+ * from anywhere without locking - a reader might just see one counter
+ * already updated and another one not yet.
+ * The latency histograms have fixed buckets: bucket i counts everything
+ * up to submit_histbounds[i] ms, the last bucket everything above. */
+#define SUBMIT_HISTBUCKETS 10
+extern const uint32_t submit_histbounds[SUBMIT_HISTBUCKETS - 1];
+enum submitphase {
+  SUBMITPHASE_DNS = 0, /* DNS lookup, only done for new connections */
+  SUBMITPHASE_CONNECT, /* TCP connect and full TLS handshake. esp-tls does both in one call, so they cannot be timed separately. */
+  SUBMITPHASE_RESUME, /* The same, but offering the TLS session of the last connection */
+  SUBMITPHASE_REQUEST, /* Sending the request and receiving the reply */
+  SUBMITPHASE_COUNT
+};
+extern const char * const submit_phasenames[SUBMITPHASE_COUNT];
+/* How often each outcome was seen: code is either a HTTP status
+ * (100-599) or an esp_err_t if there was no HTTP reply. 0 marks an
+ * unused slot. Anything that does not fit is counted in othercodes. */
+#define SUBMIT_MAXCODES 8
+struct submitcodecount {
+  int32_t code;
+  uint32_t count;
+};
+struct submitmetrics {
+  uint32_t attempts; /* HTTP requests, including retries after a reused connection was closed */
+  uint32_t successes;
+  uint32_t failures;
+  uint32_t bytessent; /* payload bytes; wraps after 4 GB */
+  struct submitcodecount codes[SUBMIT_MAXCODES];
+  uint32_t othercodes;
+  uint32_t hist[SUBMITPHASE_COUNT][SUBMIT_HISTBUCKETS];
+  uint32_t histsum[SUBMITPHASE_COUNT]; /* total of everything in hist, in ms */
+};
+
+/* Returns a pointer to the live metrics of destination d. */
+const struct submitmetrics * submit_getmetrics(int d);
+
+/* The backend that carries our HTTPS requests: a connection is just
+ * a stream of bytes, the HTTP is done in submit.c. The default backend
+ * uses esp-tls, but it can be replaced, e.g. by a simulated server. */
+struct submitbackend {
+  /* Looks up host in DNS, so that the time this takes can be measured
+   * separately from the connect. May be NULL. */
+  void (*resolve)(const char * host, void * bectx);
+  /* Opens a connection for destination d. Returns a handle for it, or
+   * NULL with the reason in *err. Sets *resumed if it tried to resume
+   * an earlier TLS session instead of doing a full handshake. */
+  void * (*connect)(int d, const char * host, int port, int * resumed,
+                    esp_err_t * err, void * bectx);
+  /* Sends all of data. */
+  esp_err_t (*write)(void * h, const char * data, size_t len, void * bectx);
+  /* Reads up to len bytes. Returns how many, 0 if the other side
+   * has closed the connection, or -1 on errors and timeouts. */
+  int (*read)(void * h, char * buf, size_t len, void * bectx);
+  void (*close)(void * h, void * bectx);
+  void * bectx;
+};
 
-/* This is a convenience function, calling ..._opensensemap_multi
- * with a size 1 array internally. */
-int submit_to_opensensemap(char * boxid, char * sensorid, float value);
+/* Replaces the backend. Call before submit_start(). */
+void submit_setbackend(const struct submitbackend * be);
 
 #endif /* _SUBMIT_H_ */
 
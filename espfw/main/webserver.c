@@ -1,158 +1,159 @@
 
 #include <esp_http_server.h>
 #include <esp_log.h>
+#include <stddef.h>
 #include <time.h>
 #include <esp_ota_ops.h>
-#include <esp_http_client.h>
-#include <esp_https_ota.h>
-#include <esp_crt_bundle.h>
 #include <esp_netif.h>
 #include <esp_timer.h>
+#include <esp_system.h>
+#include <rom/miniz.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <lwip/sockets.h>
+#include "backlog.h"
+#include "evstore.h"
+#include "history.h"
+#include "i2cbus.h"
+#include "ota.h"
+#include "otaupload.h"
+#include "ratelimit.h"
+#include "sbuf.h"
+#include "sched.h"
+#include "submit.h"
 #include "webserver.h"
+#include "websnap.h"
 #include "secrets.h"
 
 /* These are in zamdach2022_main.c */
 extern char chipid[30];
-extern struct ev evs[2];
-extern int activeevs;
 extern int pendingfwverify;
 extern long too_wet_ctr;
 extern int forcesht4xheater;
 /* This is in network.c */
 extern esp_netif_t * mainnetif;
 
-static const char startp_p1[] = R"EOSP1(
-<!DOCTYPE html>
-
-<html><head><title>ZAMDACH2022 - die Sensoren auf dem Dach des ZAM</title>
-<style type="text/css">
-body { background-color:#000000;color:#cccccc; }
-table, th, td { border:1px solid #aaaaff;border-collapse:collapse;padding:5px; }
-th { text-align:left; }
-td { text-align:right; }
-a:link, a:visited, a:hover { color:#ccccff; }
-</style>
-</head><body>
-<h1>ZAMDACH2022</h1>
-<noscript>Because JavaScript is disabled, the values shown will not update automatically -
- you will need to reload the page to see the current values.<br></noscript>
-)EOSP1";
-
-static const char startp_p2[] = R"EOSP2(
-<script type="text/javascript">
-var getJSON = function(url, callback) {
-    var xhr = new XMLHttpRequest();
-    xhr.open('GET', url, true);
-    xhr.responseType = 'json';
-    xhr.onload = function() {
-      var status = xhr.status;
-      if (status === 200) {
-        callback(null, xhr.response);
-      } else {
-        callback(status, xhr.response);
-      }
-    };
-    xhr.send();
-};
-function updrcvd(err, data) {
-  if (err != null) {
-    document.getElementById("ts").innerHTML = "Update failed.";
+/* The start page is static, it is in www/index.html. The build
+ * gzips it and embeds it into the firmware, see CMakeLists.txt. */
+extern const uint8_t startp_gz_start[] asm("_binary_index_html_gz_start");
+extern const uint8_t startp_gz_end[] asm("_binary_index_html_gz_end");
+
+/********************************************************
+ * End of embedded webpages definition                  *
+ ********************************************************/
+
+static httpd_handle_t webserver = NULL;
+static void sse_push(void * arg);
+
+/* Gets the IP of the other end of socket fd, as an IPv6 address
+ * (IPv4-mapped for IPv4). Returns 0 on success. */
+static int webserver_peerip(int fd, uint8_t ip[16])
+{
+  struct sockaddr_storage sa;
+  socklen_t salen = sizeof(sa);
+  memset(ip, 0, 16);
+  if (getpeername(fd, (struct sockaddr *)&sa, &salen) != 0) {
+    return 1;
+  }
+  if (sa.ss_family == AF_INET6) {
+    memcpy(ip, ((struct sockaddr_in6 *)&sa)->sin6_addr.s6_addr, 16);
+  } else if (sa.ss_family == AF_INET) {
+    ip[10] = 0xff;
+    ip[11] = 0xff;
+    memcpy(&ip[12], &((struct sockaddr_in *)&sa)->sin_addr.s_addr, 4);
   } else {
-    for (let k in data) {
-      if (document.getElementById(k) != null) {
-        if ((k === "ts") || (k === "lastsht4xheat")) {
-          var jsts = new Date(data[k] * 1000);
-          document.getElementById(k).innerHTML = data[k] + " (" + ((data[k] == 0) ? "NEVER" : jsts.toISOString()) + ")";
-        } else {
-          document.getElementById(k).innerHTML = data[k];
-        }
-      }
-    }
+    return 1;
   }
+  return 0;
 }
-function updatethings() {
-  getJSON('/json', updrcvd);
+
+/* Every handler starts with this. It returns 0 if the request may
+ * proceed. Otherwise the client has used up its budget (see
+ * ratelimit.h), and it has already been sent a 429. */
+static int webserver_admit(httpd_req_t * req, int cost)
+{
+  uint8_t ip[16];
+  if (webserver_peerip(httpd_req_to_sockfd(req), ip) != 0) {
+    return 0;
+  }
+  if (ratelimit_request(ip, cost) == 0) {
+    return 0;
+  }
+  httpd_resp_set_status(req, "429 Too Many Requests");
+  httpd_resp_set_hdr(req, "Retry-After", "5");
+  httpd_resp_send(req, "Too many requests, slow down.", HTTPD_RESP_USE_STRLEN);
+  return 1;
 }
-var myrefresher = setInterval(updatethings, 30000);
-</script>
-<br>The recommended way for using this data in scripts is to query
- <a href="/json">the JSON-output under /json</a>.<br><br>
-Current firmware version:
-)EOSP2";
-
-static const char startp_fww[] = R"EOSPFWW(
-<br>A new firmware has been flashed, and booted up - but it has not been marked as &quot;good&quot; yet.
-Unless you mark the new firmware as &quot;good&quot;, on the next reset the old firmware will be
-restored.
-)EOSPFWW";
-
-static const char startp_p3[] = R"EOSP3(
-<h3>Admin-Actions:</h3>
-<form action="/adminaction" method="POST">
-Admin-Password:
-<input type="text" name="updatepw">
-<select name="action">
-<option value="flashupdate">Flash Firmware Update</option>
-<option value="reboot" selected>Reboot the Microcontroller</option>
-<option value="forcesht4xheater">Force SHT4x Heater On</option>
-)EOSP3";
-
-static const char startp_p4[] = R"EOSP4(
-</select>
-<input type="submit" name="su" value="Execute Action"><br>
-URL for firmware Update:
-<input type="text" name="updateurl" value="https://www.poempelfox.de/espfw/zamdach2022.bin">
-</form>
-BE PATIENT after clicking "Flash Firmware Update" - it will take at
-least 30 seconds before the webserver will show any sort of reply.
-</body></html>
-)EOSP4";
 
-/********************************************************
- * End of embedded webpages definition                  *
- ********************************************************/
+void webserver_publish(const struct ev * e)
+{
+  evstore_put(e);
+  websnap_publish(e);
+  if (webserver != NULL) {
+    httpd_queue_work(webserver, sse_push, NULL);
+  }
+}
+
+/* For the rare client that does not accept gzip, the start page is
+ * inflated into a temporary buffer with the inflater in ROM. The gzip
+ * header is always 10 bytes (see www/gzipasset.py), the 8 byte
+ * trailer ends with the uncompressed size. */
+static esp_err_t startp_sendinflated(httpd_req_t * req)
+{
+  const uint8_t * gz = startp_gz_start;
+  size_t gzlen = startp_gz_end - startp_gz_start;
+  esp_err_t res = ESP_FAIL;
+  if ((gzlen < 18) || (gz[0] != 0x1f) || (gz[1] != 0x8b) || (gz[3] != 0)) {
+    ESP_LOGE("webserver.c", "Embedded start page is not in the expected format.");
+    return httpd_resp_send_500(req);
+  }
+  size_t outlen = gz[gzlen - 4] | (gz[gzlen - 3] << 8)
+                | (gz[gzlen - 2] << 16) | ((size_t)gz[gzlen - 1] << 24);
+  /* The decompressor is about 11 KB, too much for our stack. */
+  tinfl_decompressor * dec = malloc(sizeof(tinfl_decompressor));
+  uint8_t * out = malloc(outlen);
+  if ((dec != NULL) && (out != NULL)) {
+    size_t inlen = gzlen - 18;
+    size_t ol = outlen;
+    tinfl_init(dec);
+    tinfl_status st = tinfl_decompress(dec, &gz[10], &inlen, out, out, &ol,
+                                       TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF);
+    if ((st == TINFL_STATUS_DONE) && (ol == outlen)) {
+      res = httpd_resp_send(req, (const char *)out, ol);
+    } else {
+      ESP_LOGE("webserver.c", "Failed to inflate the start page: %d", st);
+    }
+  } else {
+    ESP_LOGE("webserver.c", "Not enough memory to inflate the start page.");
+  }
+  free(out);
+  free(dec);
+  if (res != ESP_OK) {
+    httpd_resp_send_500(req);
+  }
+  return ESP_OK;
+}
 
 esp_err_t get_startpage_handler(httpd_req_t * req) {
-  char myresponse[sizeof(startp_p1) + sizeof(startp_p2) + sizeof(startp_fww) + sizeof(startp_p3) + sizeof(startp_p4) + 2000];
-  char * pfp;
-  int e = activeevs;
-  strcpy(myresponse, startp_p1);
-  pfp = myresponse + strlen(startp_p1);
-  pfp += sprintf(pfp, "<table><tr><th>UpdateTS</th><td id=\"ts\">%lld</td></tr>", evs[e].lastupd);
-  pfp += sprintf(pfp, "<tr><th>LastSHT4xHeaterTS</th><td id=\"lastsht4xheat\">%lld</td></tr>", evs[e].lastsht4xheat);
-  pfp += sprintf(pfp, "<tr><th>Temperature (C)</th><td id=\"temp\">%.2f</td></tr>", evs[e].temp);
-  pfp += sprintf(pfp, "<tr><th>Humidity (%%)</th><td id=\"hum\">%.1f</td></tr>", evs[e].hum);
-  pfp += sprintf(pfp, "<tr><th>PM 1.0 (&micro;g/m&sup3;)</th><td id=\"pm010\">%.1f</td></tr>", evs[e].pm010);
-  pfp += sprintf(pfp, "<tr><th>PM 2.5 (&micro;g/m&sup3;)</th><td id=\"pm025\">%.1f</td></tr>", evs[e].pm025);
-  pfp += sprintf(pfp, "<tr><th>PM 4.0 (&micro;g/m&sup3;)</th><td id=\"pm040\">%.1f</td></tr>", evs[e].pm040);
-  pfp += sprintf(pfp, "<tr><th>PM 10.0 (&micro;g/m&sup3;)</th><td id=\"pm100\">%.1f</td></tr>", evs[e].pm100);
-  pfp += sprintf(pfp, "<tr><th>Pressure (hPa)</th><td id=\"press\">%.3f</td></tr>", evs[e].press);
-  pfp += sprintf(pfp, "<tr><th>Illuminance (lux)</th><td id=\"lux\">%.2f</td></tr>", evs[e].lux);
-  pfp += sprintf(pfp, "<tr><th>UV-Index</th><td id=\"uvind\">%.2f</td></tr>", evs[e].uvind);
-  pfp += sprintf(pfp, "<tr><th>Rain (mm/min)</th><td id=\"raing\">%.2f</td></tr>", evs[e].raing);
-  pfp += sprintf(pfp, "<tr><th>Wind speed (km/h)</th><td id=\"windspeed\">%.1f</td></tr>", evs[e].windspeed);
-  pfp += sprintf(pfp, "<tr><th>Wind speed max / gusts (km/h)</th><td id=\"windspmax\">%.1f</td></tr>", evs[e].windspmax);
-  pfp += sprintf(pfp, "<tr><th>Wind direction</th><td id=\"winddirtxt\">%s</td></tr>", evs[e].winddirtxt);
-  pfp += sprintf(pfp, "</table>");
-  const esp_app_desc_t * appd = esp_app_get_description();
-  strcat(myresponse, startp_p2);
-  pfp = myresponse + strlen(myresponse);
-  pfp += sprintf(pfp, "%s version %s compiled %s %s",
-                 appd->project_name, appd->version, appd->date, appd->time);
-  if (pendingfwverify > 0) {
-    strcat(myresponse, startp_fww);
-  }
-  strcat(myresponse, startp_p3);
-  if (pendingfwverify > 0) {
-    strcat(myresponse, "<option value=\"markfwasgood\">Mark Firmware as Good</option>");
-  }
-  strcat(myresponse, startp_p4);
+  char ae[120];
+  esp_err_t r;
+  if (webserver_admit(req, 1) != 0) {
+    return ESP_OK;
+  }
   /* The following two lines are the default und thus redundant. */
   httpd_resp_set_status(req, "200 OK");
   httpd_resp_set_type(req, "text/html");
   httpd_resp_set_hdr(req, "Cache-Control", "public, max-age=29");
-  httpd_resp_send(req, myresponse, HTTPD_RESP_USE_STRLEN);
-  return ESP_OK;
+  httpd_resp_set_hdr(req, "Vary", "Accept-Encoding");
+  /* A truncated header still tells us what we need to know. */
+  r = httpd_req_get_hdr_value_str(req, "Accept-Encoding", ae, sizeof(ae));
+  if (((r == ESP_OK) || (r == ESP_ERR_HTTPD_RESULT_TRUNC))
+   && (strstr(ae, "gzip") != NULL)) {
+    httpd_resp_set_hdr(req, "Content-Encoding", "gzip");
+    return httpd_resp_send(req, (const char *)startp_gz_start,
+                           startp_gz_end - startp_gz_start);
+  }
+  return startp_sendinflated(req);
 }
 
 static httpd_uri_t uri_startpage = {
@@ -163,33 +164,10 @@ static httpd_uri_t uri_startpage = {
 };
 
 esp_err_t get_json_handler(httpd_req_t * req) {
-  char myresponse[1100];
-  char * pfp;
-  int e = activeevs;
-  strcpy(myresponse, "");
-  pfp = myresponse;
-  pfp += sprintf(pfp, "{\"ts\":\"%lld\",", evs[e].lastupd);
-  pfp += sprintf(pfp, "\"lastsht4xheat\":\"%lld\",", evs[e].lastsht4xheat);
-  pfp += sprintf(pfp, "\"temp\":\"%.2f\",", evs[e].temp);
-  pfp += sprintf(pfp, "\"hum\":\"%.1f\",", evs[e].hum);
-  pfp += sprintf(pfp, "\"pm010\":\"%.1f\",", evs[e].pm010);
-  pfp += sprintf(pfp, "\"pm025\":\"%.1f\",", evs[e].pm025);
-  pfp += sprintf(pfp, "\"pm040\":\"%.1f\",", evs[e].pm040);
-  pfp += sprintf(pfp, "\"pm100\":\"%.1f\",", evs[e].pm100);
-  pfp += sprintf(pfp, "\"press\":\"%.3f\",", evs[e].press);
-  pfp += sprintf(pfp, "\"lux\":\"%.2f\",", evs[e].lux);
-  pfp += sprintf(pfp, "\"uvind\":\"%.2f\",", evs[e].uvind);
-  pfp += sprintf(pfp, "\"raing\":\"%.2f\",", evs[e].raing);
-  pfp += sprintf(pfp, "\"windspeed\":\"%.1f\",", evs[e].windspeed);
-  pfp += sprintf(pfp, "\"windspmax\":\"%.1f\",", evs[e].windspmax);
-  pfp += sprintf(pfp, "\"winddirdeg\":\"%.1f\",", evs[e].winddirdeg);
-  pfp += sprintf(pfp, "\"winddirtxt\":\"%s\"}", evs[e].winddirtxt);
-  /* The following line is the default und thus redundant. */
-  httpd_resp_set_status(req, "200 OK");
-  httpd_resp_set_type(req, "application/json");
-  httpd_resp_set_hdr(req, "Cache-Control", "public, max-age=29");
-  httpd_resp_send(req, myresponse, HTTPD_RESP_USE_STRLEN);
-  return ESP_OK;
+  if (webserver_admit(req, 1) != 0) {
+    return ESP_OK;
+  }
+  return websnap_sendjson(req);
 }
 
 static httpd_uri_t uri_json = {
@@ -199,49 +177,785 @@ static httpd_uri_t uri_json = {
   .user_ctx = NULL
 };
 
+/* Server-Sent Events: Clients that GET /stream keep the connection
+ * open, and we push every new snapshot to them as one event. There
+ * is no response object for that in esp_http_server, so after
+ * sending the headers we write to the sockets directly. Everything
+ * here runs in the webserver task (handlers, queued work, close_fn),
+ * so the list of subscribers needs no locking. */
+#define SSE_MAXCLIENTS 4
+static int ssefds[SSE_MAXCLIENTS] = { -1, -1, -1, -1 };
+static const char sse_hdr[] = "HTTP/1.1 200 OK\r\n"
+                              "Content-Type: text/event-stream\r\n"
+                              "Cache-Control: no-cache\r\n"
+                              "Connection: keep-alive\r\n"
+                              "\r\n"
+                              "retry: 10000\n\n";
+
+/* Sends the current snapshot as one event. */
+static int sse_sendsnap(int fd)
+{
+  const struct websnapshot * snap = websnap_get();
+  if (httpd_socket_send(webserver, fd, "data: ", 6, 0) < 0) { return 1; }
+  if (httpd_socket_send(webserver, fd, snap->json, snap->jsonlen, 0) < 0) { return 1; }
+  if (httpd_socket_send(webserver, fd, "\n\n", 2, 0) < 0) { return 1; }
+  return 0;
+}
+
+static void sse_remove(int fd)
+{
+  for (int i = 0; i < SSE_MAXCLIENTS; i++) {
+    if (ssefds[i] == fd) {
+      ssefds[i] = -1;
+    }
+  }
+}
+
+/* Queued from webserver_publish(), runs in the webserver task. */
+static void sse_push(void * arg)
+{
+  for (int i = 0; i < SSE_MAXCLIENTS; i++) {
+    if (ssefds[i] < 0) { continue; }
+    int fd = ssefds[i];
+    if (sse_sendsnap(fd) != 0) {
+      ESP_LOGI("webserver.c", "SSE client on socket %d is gone.", fd);
+      ssefds[i] = -1;
+      httpd_sess_trigger_close(webserver, fd);
+    }
+  }
+}
+
+esp_err_t get_stream_handler(httpd_req_t * req) {
+  if (webserver_admit(req, 1) != 0) {
+    return ESP_OK;
+  }
+  int fd = httpd_req_to_sockfd(req);
+  int slot = -1;
+  for (int i = 0; i < SSE_MAXCLIENTS; i++) {
+    if (ssefds[i] == fd) { ssefds[i] = -1; } /* should not happen, but... */
+    if ((slot < 0) && (ssefds[i] < 0)) { slot = i; }
+  }
+  if (slot < 0) {
+    /* The page falls back to polling if it gets this. */
+    httpd_resp_set_status(req, "503 Service Unavailable");
+    httpd_resp_send(req, "Too many clients", HTTPD_RESP_USE_STRLEN);
+    return ESP_OK;
+  }
+  if ((httpd_socket_send(webserver, fd, sse_hdr, sizeof(sse_hdr) - 1, 0) < 0)
+   || (sse_sendsnap(fd) != 0)) {
+    return ESP_FAIL;
+  }
+  ssefds[slot] = fd;
+  /* We do not send a response through the normal API - the connection
+   * just stays open, and the webserver waits for a next request on it
+   * that will never come. */
+  return ESP_OK;
+}
+
+static httpd_uri_t uri_stream = {
+  .uri      = "/stream",
+  .method   = HTTP_GET,
+  .handler  = get_stream_handler,
+  .user_ctx = NULL
+};
+
+/* Called by the webserver whenever it closes a socket. Since we set
+ * this, closing the socket is our job. */
+static void webserver_closefn(httpd_handle_t hd, int fd)
+{
+  sse_remove(fd);
+  ratelimit_connclose(fd);
+  close(fd);
+}
+
+/* Called by the webserver for every new connection. If we return an
+ * error, it closes it right away, so one client cannot take all the
+ * sockets (and, with lru_purge_enable, push everyone else out). */
+static esp_err_t webserver_openfn(httpd_handle_t hd, int fd)
+{
+  uint8_t ip[16];
+  if (webserver_peerip(fd, ip) != 0) {
+    return ESP_OK;
+  }
+  if (ratelimit_connopen(fd, ip) != 0) {
+    ESP_LOGI("webserver.c", "Refusing connection on socket %d, client has too many open.", fd);
+    return ESP_FAIL;
+  }
+  return ESP_OK;
+}
+
+/* Sends the collected output as one chunk once the buffer is getting
+ * full - or always, if force is set. Whatever is appended between two
+ * calls must fit into 250 bytes. Never sends an empty chunk, as that
+ * would end the response. */
+static void webserver_flushchunk(httpd_req_t * req, struct sbuf * sb, int force)
+{
+  if (((force) || (sb->len > (sb->cap - 250))) && (sb->len > 0)) {
+    if (sb->overflow) {
+      ESP_LOGE("webserver.c", "%s output got truncated.", req->uri);
+    }
+    httpd_resp_send_chunk(req, sb->buf, sb->len);
+    sbuf_init(sb, sb->buf, sb->cap);
+  }
+}
+
+/* Helpers for /debug: text followed by a number, a number with at
+ * least two digits, and a table cell with a number. */
+static void debug_putnum(struct sbuf * sb, const char * text, long long v)
+{
+  sbuf_puts(sb, text);
+  sbuf_putll(sb, v);
+}
+
+static void debug_put2(struct sbuf * sb, long long v)
+{
+  if (v < 10) { sbuf_putc(sb, '0'); }
+  sbuf_putll(sb, v);
+}
+
+static void debug_td(struct sbuf * sb, long long v)
+{
+  debug_putnum(sb, "<td>", v);
+  sbuf_puts(sb, "</td>");
+}
+
 esp_err_t get_publicdebug_handler(httpd_req_t * req) {
-  char myresponse[2000];
-  char * pfp;
-  strcpy(myresponse, "");
-  pfp = myresponse;
-  pfp += sprintf(pfp, "<html><head><title>Debug info (public part)</title></head><body>");
-  pfp += sprintf(pfp, "too_wet_ctr: %ld<br>", too_wet_ctr);
-  pfp += sprintf(pfp, "chipid: %s<br>", chipid);
+  char outbuf[1000];
+  char tmp[64];
+  struct sbuf sb;
+  if (webserver_admit(req, RATELIMIT_HEAVY) != 0) {
+    return ESP_OK;
+  }
+  sbuf_init(&sb, outbuf, sizeof(outbuf));
+  /* The following line is the default und thus redundant. */
+  httpd_resp_set_status(req, "200 OK");
+  httpd_resp_set_type(req, "text/html");
+  httpd_resp_set_hdr(req, "Cache-Control", "public, max-age=29");
+  sbuf_puts(&sb, "<html><head><title>Debug info (public part)</title></head><body>");
+  debug_putnum(&sb, "too_wet_ctr: ", too_wet_ctr);
+  sbuf_puts(&sb, "<br>chipid: ");
+  sbuf_puts(&sb, chipid);
+  sbuf_puts(&sb, "<br>My IP addresses:<br><ul>");
   esp_netif_ip_info_t ip_info;
-  pfp += sprintf(pfp, "My IP addresses:<br><ul>");
   if (esp_netif_get_ip_info(mainnetif, &ip_info) == ESP_OK) {
-    pfp += sprintf(pfp, "<li>IPv4: " IPSTR "/" IPSTR " GW " IPSTR "</li>",
-                   IP2STR(&ip_info.ip), IP2STR(&ip_info.netmask),
-                   IP2STR(&ip_info.gw));
+    snprintf(tmp, sizeof(tmp), IPSTR "/" IPSTR, IP2STR(&ip_info.ip), IP2STR(&ip_info.netmask));
+    sbuf_puts(&sb, "<li>IPv4: ");
+    sbuf_puts(&sb, tmp);
+    snprintf(tmp, sizeof(tmp), IPSTR, IP2STR(&ip_info.gw));
+    sbuf_puts(&sb, " GW ");
+    sbuf_puts(&sb, tmp);
+    sbuf_puts(&sb, "</li>");
   } else {
-    pfp += sprintf(pfp, "<li>Failed to get IPv4 address information :(</li>");
+    sbuf_puts(&sb, "<li>Failed to get IPv4 address information :(</li>");
   }
   esp_ip6_addr_t v6addrs[CONFIG_LWIP_IPV6_NUM_ADDRESSES + 2];
   int nv6ips = esp_netif_get_all_ip6(mainnetif, v6addrs);
   if (nv6ips > 0) {
     for (int i = 0; i < nv6ips; i++) {
-      pfp += sprintf(pfp, "<li>IPv6: " IPV6STR "</li>",
-             IPV62STR(v6addrs[i]));
+      webserver_flushchunk(req, &sb, 0);
+      snprintf(tmp, sizeof(tmp), IPV6STR, IPV62STR(v6addrs[i]));
+      sbuf_puts(&sb, "<li>IPv6: ");
+      sbuf_puts(&sb, tmp);
+      sbuf_puts(&sb, "</li>");
     }
   } else {
-    pfp += sprintf(pfp, "<li>No IPv6 addresses, not even link-local :(</li>");
-  }
-  pfp += sprintf(pfp, "</ul>");
-  pfp += sprintf(pfp, "Last reset reason: %d<br>", esp_reset_reason());
-  int64_t ts = esp_timer_get_time() / 1000000;;
-  pfp += sprintf(pfp, "Uptime: %lld days, ", (ts / 86400));
-  ts = ts % 86400;
-  pfp += sprintf(pfp, "%02lld:", (ts / 3600));
-  ts = ts % 3600;
-  pfp += sprintf(pfp, "%02lld:%02lld<br>", (ts / 60), (ts % 60));
-  /* The following line is the default und thus redundant. */
-  httpd_resp_set_status(req, "200 OK");
-  httpd_resp_set_type(req, "text/html");
-  httpd_resp_set_hdr(req, "Cache-Control", "public, max-age=29");
-  httpd_resp_send(req, myresponse, HTTPD_RESP_USE_STRLEN);
+    sbuf_puts(&sb, "<li>No IPv6 addresses, not even link-local :(</li>");
+  }
+  sbuf_puts(&sb, "</ul>");
+  webserver_flushchunk(req, &sb, 0);
+  debug_putnum(&sb, "Last reset reason: ", esp_reset_reason());
+  int64_t ts = esp_timer_get_time() / 1000000;
+  debug_putnum(&sb, "<br>Uptime: ", ts / 86400);
+  sbuf_puts(&sb, " days, ");
+  debug_put2(&sb, (ts % 86400) / 3600);
+  sbuf_putc(&sb, ':');
+  debug_put2(&sb, (ts % 3600) / 60);
+  sbuf_putc(&sb, ':');
+  debug_put2(&sb, ts % 60);
+  /* This handler runs in the webserver task, so this is its stack. */
+  debug_putnum(&sb, "<br>Webserver task: ", uxTaskGetStackHighWaterMark(NULL));
+  sbuf_puts(&sb, " bytes of stack never used<br>");
+  webserver_flushchunk(req, &sb, 0);
+  sbuf_puts(&sb, "Sensor jobs:<br><table><tr><th>job</th><th>cycles</th><th>overruns</th><th>steps</th><th>max. late (ms)</th><th>avg. late (ms)</th><th>longest step (ms)</th></tr>");
+  const char * jobname;
+  struct schedjobstats jst;
+  for (int i = 0; sched_getstats(i, &jobname, &jst) == 0; i++) {
+    webserver_flushchunk(req, &sb, 0);
+    sbuf_puts(&sb, "<tr><td>");
+    sbuf_puts(&sb, jobname);
+    sbuf_puts(&sb, "</td>");
+    debug_td(&sb, jst.cycles);
+    debug_td(&sb, jst.overruns);
+    debug_td(&sb, jst.steps);
+    debug_td(&sb, jst.maxlatems);
+    debug_td(&sb, (jst.steps > 0) ? (long long)(jst.totallatems / jst.steps) : 0);
+    debug_td(&sb, jst.maxstepms);
+    sbuf_puts(&sb, "</tr>");
+  }
+  sbuf_puts(&sb, "</table>");
+  webserver_flushchunk(req, &sb, 0);
+  struct schedwindowstats wst;
+  sched_getwindow(&wst);
+  debug_putnum(&sb, "Measurement window: last ", wst.lastms);
+  debug_putnum(&sb, " ms, max. ", wst.maxms);
+  debug_putnum(&sb, " ms, avg. ",
+               (wst.cycles > wst.timeouts) ? (long long)(wst.totalms / (wst.cycles - wst.timeouts)) : 0);
+  debug_putnum(&sb, " ms over ", wst.cycles);
+  debug_putnum(&sb, " cycles, ", wst.timeouts);
+  sbuf_puts(&sb, " timeouts<br>");
+  struct i2cbusstats ist;
+  for (int port = 0; i2cbus_getstats(port, &ist) == 0; port++) {
+    webserver_flushchunk(req, &sb, 0);
+    debug_putnum(&sb, "I2C port ", port);
+    debug_putnum(&sb, ": ", ist.transactions);
+    debug_putnum(&sb, " transactions, ", ist.errors);
+    debug_putnum(&sb, " errors, ", ist.timeouts);
+    debug_putnum(&sb, " timeouts, ", ist.queuefull);
+    debug_putnum(&sb, " refused (queue full), on the bus last ", ist.lastus);
+    debug_putnum(&sb, " us, max. ", ist.maxus);
+    debug_putnum(&sb, " us, avg. ",
+                 (ist.transactions > 0) ? (long long)(ist.totalus / ist.transactions) : 0);
+    debug_putnum(&sb, " us, max. wait in queue ", ist.maxwaitus);
+    sbuf_puts(&sb, " us<br>");
+    webserver_flushchunk(req, &sb, 0);
+    debug_putnum(&sb, "I2C port ", port);
+    debug_putnum(&sb, ": ", ist.recoveries);
+    debug_putnum(&sb, " recoveries (", ist.recoveryfails);
+    debug_putnum(&sb, " failed), last one took ", ist.lastrecoveryus);
+    sbuf_puts(&sb, " us<br>");
+  }
+  webserver_flushchunk(req, &sb, 0);
+  sbuf_puts(&sb, "I2C devices:<br><table><tr><th>port</th><th>device</th><th>address</th><th>OK</th><th>NACKs</th><th>timeouts</th><th>CRC errors</th><th>reinits</th></tr>");
+  struct i2cdevstats idst;
+  for (int port = 0; port < I2CBUS_PORTS; port++) {
+    for (int i = 0; i2cbus_getdevstats(port, i, &idst) == 0; i++) {
+      webserver_flushchunk(req, &sb, 0);
+      sbuf_puts(&sb, "<tr>");
+      debug_td(&sb, port);
+      sbuf_puts(&sb, "<td>");
+      sbuf_puts(&sb, idst.name);
+      snprintf(tmp, sizeof(tmp), "</td><td>0x%02x</td>", idst.addr);
+      sbuf_puts(&sb, tmp);
+      debug_td(&sb, idst.ok);
+      debug_td(&sb, idst.nacks);
+      debug_td(&sb, idst.timeouts);
+      debug_td(&sb, idst.crcerrors);
+      debug_td(&sb, idst.reinits);
+      sbuf_puts(&sb, "</tr>");
+    }
+  }
+  sbuf_puts(&sb, "</table>");
+  webserver_flushchunk(req, &sb, 0);
+  struct ratelimitstats rst;
+  ratelimit_getstats(&rst);
+  debug_putnum(&sb, "Rate limiting: ", rst.allowed);
+  debug_putnum(&sb, " requests allowed, ", rst.limited);
+  debug_putnum(&sb, " refused, ", rst.connsrejected);
+  debug_putnum(&sb, " connections refused, ", rst.clients);
+  debug_putnum(&sb, " clients tracked, ", rst.evictions);
+  sbuf_puts(&sb, " forgotten<br>");
+  webserver_flushchunk(req, &sb, 0);
+  struct submitstats sst;
+  submit_getstats(&sst);
+  debug_putnum(&sb, "Upload queue: ", sst.queuedepth);
+  debug_putnum(&sb, " of ", sst.queuesize);
+  debug_putnum(&sb, " used, max. ", sst.maxqueuedepth);
+  debug_putnum(&sb, ", ", sst.enqueued);
+  debug_putnum(&sb, " batches queued, ", sst.dropped);
+  debug_putnum(&sb, " dropped, max. age when sent ", sst.maxbatchage);
+  sbuf_puts(&sb, " s<br>Uploads:<br><ul>");
+  int64_t now = esp_timer_get_time();
+  for (int i = 0; i < SUBMITDEST_COUNT; i++) {
+    webserver_flushchunk(req, &sb, 0);
+    sbuf_puts(&sb, "<li>");
+    sbuf_puts(&sb, sst.dest[i].name);
+    if (!sst.dest[i].configured) {
+      sbuf_puts(&sb, ": not configured</li>");
+      continue;
+    }
+    debug_putnum(&sb, ": ", sst.dest[i].requests);
+    debug_putnum(&sb, " requests, ", sst.dest[i].failures);
+    debug_putnum(&sb, " failed, ", sst.dest[i].skipped);
+    debug_putnum(&sb, " skipped, latency last ", sst.dest[i].lastlatms);
+    debug_putnum(&sb, " ms, max. ", sst.dest[i].maxlatms);
+    debug_putnum(&sb, " ms, avg. ",
+                 (sst.dest[i].requests > 0) ? (sst.dest[i].totallatms / sst.dest[i].requests) : 0);
+    sbuf_puts(&sb, " ms");
+    if (sst.dest[i].nextattempt > now) {
+      debug_putnum(&sb, " - DOWN after ", sst.dest[i].consecfails);
+      debug_putnum(&sb, " failures, next attempt in ", (sst.dest[i].nextattempt - now) / 1000000);
+      sbuf_puts(&sb, " s");
+    }
+    webserver_flushchunk(req, &sb, 0);
+    const struct submitmetrics * m = submit_getmetrics(i);
+    debug_putnum(&sb, "<br>", m->attempts);
+    debug_putnum(&sb, " attempts, ", m->successes);
+    debug_putnum(&sb, " succeeded, ", m->failures);
+    debug_putnum(&sb, " failed, ", m->bytessent);
+    sbuf_puts(&sb, " bytes sent. Results:");
+    for (int c = 0; c < SUBMIT_MAXCODES; c++) {
+      if (m->codes[c].code == 0) { break; }
+      webserver_flushchunk(req, &sb, 0);
+      if (m->codes[c].code < 1000) { /* HTTP status */
+        debug_putnum(&sb, " HTTP ", m->codes[c].code);
+      } else {
+        sbuf_putc(&sb, ' ');
+        sbuf_puts(&sb, esp_err_to_name(m->codes[c].code));
+      }
+      debug_putnum(&sb, ": ", m->codes[c].count);
+      sbuf_putc(&sb, ',');
+    }
+    debug_putnum(&sb, " other: ", m->othercodes);
+    webserver_flushchunk(req, &sb, 0);
+    sbuf_puts(&sb, "<table><tr><th>ms</th>");
+    for (int b = 0; b < SUBMIT_HISTBUCKETS; b++) {
+      if (b < (SUBMIT_HISTBUCKETS - 1)) {
+        debug_putnum(&sb, "<th>&le;", submit_histbounds[b]);
+        sbuf_puts(&sb, "</th>");
+      } else {
+        sbuf_puts(&sb, "<th>more</th>");
+      }
+    }
+    sbuf_puts(&sb, "</tr>");
+    for (int p = 0; p < SUBMITPHASE_COUNT; p++) {
+      webserver_flushchunk(req, &sb, 0);
+      sbuf_puts(&sb, "<tr><th>");
+      sbuf_puts(&sb, submit_phasenames[p]);
+      sbuf_puts(&sb, "</th>");
+      for (int b = 0; b < SUBMIT_HISTBUCKETS; b++) {
+        debug_td(&sb, m->hist[p][b]);
+      }
+      sbuf_puts(&sb, "</tr>");
+    }
+    sbuf_puts(&sb, "</table></li>");
+  }
+  sbuf_puts(&sb, "</ul>");
+  webserver_flushchunk(req, &sb, 0);
+  struct backlogstats bst;
+  backlog_getstats(&bst);
+  if (bst.available) {
+    debug_putnum(&sb, "Backlog: ", bst.slots);
+    debug_putnum(&sb, " slots, pending ", bst.pending[SUBMITDEST_WPD]);
+    sbuf_puts(&sb, " (");
+    sbuf_puts(&sb, sst.dest[SUBMITDEST_WPD].name);
+    debug_putnum(&sb, ") / ", bst.pending[SUBMITDEST_OSM]);
+    sbuf_puts(&sb, " (");
+    sbuf_puts(&sb, sst.dest[SUBMITDEST_OSM].name);
+    debug_putnum(&sb, "), backlogged ", sst.backlogged[SUBMITDEST_WPD]);
+    debug_putnum(&sb, " / ", sst.backlogged[SUBMITDEST_OSM]);
+    webserver_flushchunk(req, &sb, 0);
+    debug_putnum(&sb, ", replayed ", sst.replayed[SUBMITDEST_WPD]);
+    debug_putnum(&sb, " / ", sst.replayed[SUBMITDEST_OSM]);
+    debug_putnum(&sb, ", ", bst.overwritten);
+    debug_putnum(&sb, " lost because full, ", bst.erases);
+    sbuf_puts(&sb, " sector erases since boot<br>");
+  } else {
+    sbuf_puts(&sb, "Backlog: not available (no backlog partition?)<br>");
+  }
+  webserver_flushchunk(req, &sb, 1);
+  /* An empty chunk marks the end of the response. */
+  httpd_resp_send_chunk(req, NULL, 0);
   return ESP_OK;
 }
 
+/* The upload metrics from submit.c in machine readable form. Like
+ * /metrics, this is sent in chunks from one small buffer. */
+esp_err_t get_uploadstats_handler(httpd_req_t * req) {
+  char outbuf[1000];
+  struct sbuf sb;
+  if (webserver_admit(req, RATELIMIT_HEAVY) != 0) {
+    return ESP_OK;
+  }
+  sbuf_init(&sb, outbuf, sizeof(outbuf));
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+  sbuf_puts(&sb, "{\"histbounds\":[");
+  for (int b = 0; b < (SUBMIT_HISTBUCKETS - 1); b++) {
+    if (b != 0) { sbuf_putc(&sb, ','); }
+    sbuf_putll(&sb, submit_histbounds[b]);
+  }
+  sbuf_puts(&sb, "],\"destinations\":[");
+  struct submitstats sst;
+  submit_getstats(&sst);
+  for (int i = 0; i < SUBMITDEST_COUNT; i++) {
+    const struct submitmetrics * m = submit_getmetrics(i);
+    webserver_flushchunk(req, &sb, 0);
+    if (i != 0) { sbuf_putc(&sb, ','); }
+    sbuf_puts(&sb, "{\"name\":\"");
+    sbuf_puts(&sb, sst.dest[i].name);
+    sbuf_puts(&sb, "\",\"configured\":");
+    sbuf_putll(&sb, sst.dest[i].configured);
+    sbuf_puts(&sb, ",\"attempts\":");
+    sbuf_putll(&sb, m->attempts);
+    sbuf_puts(&sb, ",\"successes\":");
+    sbuf_putll(&sb, m->successes);
+    sbuf_puts(&sb, ",\"failures\":");
+    sbuf_putll(&sb, m->failures);
+    sbuf_puts(&sb, ",\"skipped\":");
+    sbuf_putll(&sb, sst.dest[i].skipped);
+    sbuf_puts(&sb, ",\"bytessent\":");
+    sbuf_putll(&sb, m->bytessent);
+    sbuf_puts(&sb, ",\"results\":{");
+    for (int c = 0; c < SUBMIT_MAXCODES; c++) {
+      if (m->codes[c].code == 0) { break; }
+      webserver_flushchunk(req, &sb, 0);
+      sbuf_putc(&sb, '"');
+      if (m->codes[c].code < 1000) { /* HTTP status */
+        sbuf_putll(&sb, m->codes[c].code);
+      } else {
+        sbuf_puts(&sb, esp_err_to_name(m->codes[c].code));
+      }
+      sbuf_puts(&sb, "\":");
+      sbuf_putll(&sb, m->codes[c].count);
+      sbuf_putc(&sb, ',');
+    }
+    sbuf_puts(&sb, "\"other\":");
+    sbuf_putll(&sb, m->othercodes);
+    sbuf_puts(&sb, "}");
+    for (int p = 0; p < SUBMITPHASE_COUNT; p++) {
+      webserver_flushchunk(req, &sb, 0);
+      sbuf_puts(&sb, ",\"");
+      sbuf_puts(&sb, submit_phasenames[p]);
+      sbuf_puts(&sb, "hist\":[");
+      for (int b = 0; b < SUBMIT_HISTBUCKETS; b++) {
+        if (b != 0) { sbuf_putc(&sb, ','); }
+        sbuf_putll(&sb, m->hist[p][b]);
+      }
+      sbuf_putc(&sb, ']');
+    }
+    sbuf_putc(&sb, '}');
+  }
+  sbuf_puts(&sb, "]}");
+  webserver_flushchunk(req, &sb, 1);
+  httpd_resp_send_chunk(req, NULL, 0);
+  return ESP_OK;
+}
+
+static httpd_uri_t uri_uploadstats = {
+  .uri      = "/uploadstats",
+  .method   = HTTP_GET,
+  .handler  = get_uploadstats_handler,
+  .user_ctx = NULL
+};
+
+/* The values from struct ev that are exported via /metrics. */
+struct metricsfield {
+  const char * name;
+  const char * help;
+  size_t offset;
+  int decimals;
+};
+static const struct metricsfield metricsfields[] = {
+  { "zamdach_temperature_celsius", "Temperature", offsetof(struct ev, temp), 2 },
+  { "zamdach_humidity_percent", "Relative humidity", offsetof(struct ev, hum), 2 },
+  { "zamdach_pressure_hpa", "Air pressure", offsetof(struct ev, press), 3 },
+  { "zamdach_pm010_ugm3", "Particulate matter < 1.0 um", offsetof(struct ev, pm010), 1 },
+  { "zamdach_pm025_ugm3", "Particulate matter < 2.5 um", offsetof(struct ev, pm025), 1 },
+  { "zamdach_pm040_ugm3", "Particulate matter < 4.0 um", offsetof(struct ev, pm040), 1 },
+  { "zamdach_pm100_ugm3", "Particulate matter < 10 um", offsetof(struct ev, pm100), 1 },
+  { "zamdach_illuminance_lux", "Ambient light", offsetof(struct ev, lux), 2 },
+  { "zamdach_uv_index", "UV index", offsetof(struct ev, uvind), 2 },
+  { "zamdach_rain_gauge_mm", "Rain gauge", offsetof(struct ev, raing), 2 },
+  { "zamdach_wind_speed_kmh", "Average wind speed", offsetof(struct ev, windspeed), 1 },
+  { "zamdach_wind_speed_max_kmh", "Maximum wind speed", offsetof(struct ev, windspmax), 1 },
+  { "zamdach_wind_direction_degrees", "Wind direction, -1 if unknown", offsetof(struct ev, winddirdeg), 1 },
+};
+
+/* Appends the HELP and TYPE lines for a metric. */
+static void metrics_head(httpd_req_t * req, struct sbuf * sb, const char * name,
+                         const char * type, const char * help)
+{
+  webserver_flushchunk(req, sb, 0);
+  sbuf_puts(sb, "# HELP ");
+  sbuf_puts(sb, name);
+  sbuf_putc(sb, ' ');
+  sbuf_puts(sb, help);
+  sbuf_puts(sb, "\n# TYPE ");
+  sbuf_puts(sb, name);
+  sbuf_putc(sb, ' ');
+  sbuf_puts(sb, type);
+  sbuf_putc(sb, '\n');
+}
+
+/* Appends one sample of an integer metric without labels. */
+static void metrics_int(httpd_req_t * req, struct sbuf * sb, const char * name,
+                        const char * type, const char * help, long long v)
+{
+  metrics_head(req, sb, name, type, help);
+  sbuf_puts(sb, name);
+  sbuf_putc(sb, ' ');
+  sbuf_putll(sb, v);
+  sbuf_putc(sb, '\n');
+}
+
+/* Starts a sample line for destination d: name{dest="..." */
+static void metrics_destsample(httpd_req_t * req, struct sbuf * sb,
+                               const char * name, const char * destname)
+{
+  webserver_flushchunk(req, sb, 0);
+  sbuf_puts(sb, name);
+  sbuf_puts(sb, "{dest=\"");
+  sbuf_puts(sb, destname);
+  sbuf_putc(sb, '"');
+}
+
+/* Exports one counter per upload destination. offset is the offset
+ * of a uint32_t in struct submitmetrics if frommetrics is set, and
+ * of a long in struct submitdeststats otherwise. */
+static void metrics_destcounter(httpd_req_t * req, struct sbuf * sb,
+                                const struct submitstats * sst,
+                                const char * name, const char * help,
+                                int frommetrics, size_t offset)
+{
+  metrics_head(req, sb, name, "counter", help);
+  for (int d = 0; d < SUBMITDEST_COUNT; d++) {
+    long long v;
+    if (frommetrics) {
+      v = *(const uint32_t *)((const char *)submit_getmetrics(d) + offset);
+    } else {
+      v = *(const long *)((const char *)&sst->dest[d] + offset);
+    }
+    metrics_destsample(req, sb, name, sst->dest[d].name);
+    sbuf_puts(sb, "} ");
+    sbuf_putll(sb, v);
+    sbuf_putc(sb, '\n');
+  }
+}
+
+/* Everything in the Prometheus text exposition format. The output
+ * is generated directly into one small buffer that is sent as a
+ * chunk whenever it fills up. */
+esp_err_t get_metrics_handler(httpd_req_t * req) {
+  char outbuf[1000];
+  struct sbuf sb;
+  if (webserver_admit(req, RATELIMIT_HEAVY) != 0) {
+    return ESP_OK;
+  }
+  struct ev e;
+  evstore_get(&e);
+  sbuf_init(&sb, outbuf, sizeof(outbuf));
+  httpd_resp_set_type(req, "text/plain; version=0.0.4");
+  httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+  for (int i = 0; i < (sizeof(metricsfields) / sizeof(metricsfields[0])); i++) {
+    const struct metricsfield * mf = &metricsfields[i];
+    metrics_head(req, &sb, mf->name, "gauge", mf->help);
+    sbuf_puts(&sb, mf->name);
+    sbuf_putc(&sb, ' ');
+    /* Prometheus understands "nan" for values we could not read. */
+    sbuf_putfloat(&sb, *(const float *)((const char *)&e + mf->offset), mf->decimals);
+    sbuf_putc(&sb, '\n');
+  }
+  metrics_head(req, &sb, "zamdach_wind_direction_info", "gauge", "Wind direction as text");
+  sbuf_puts(&sb, "zamdach_wind_direction_info{direction=\"");
+  sbuf_puts(&sb, e.winddirtxt);
+  sbuf_puts(&sb, "\"} 1\n");
+  metrics_int(req, &sb, "zamdach_last_update_timestamp_seconds", "gauge",
+              "When the values were last updated", e.lastupd);
+  metrics_int(req, &sb, "zamdach_sht4x_heater_last_timestamp_seconds", "gauge",
+              "When the SHT4x heater was last turned on", e.lastsht4xheat);
+  metrics_int(req, &sb, "zamdach_too_wet_ctr", "gauge",
+              "Counter for turning on the SHT4x heater", too_wet_ctr);
+  metrics_int(req, &sb, "zamdach_uptime_seconds", "counter",
+              "Time since boot", esp_timer_get_time() / 1000000);
+  metrics_int(req, &sb, "zamdach_heap_free_bytes", "gauge",
+              "Free heap", esp_get_free_heap_size());
+  metrics_int(req, &sb, "zamdach_heap_min_free_bytes", "gauge",
+              "Lowest free heap since boot", esp_get_minimum_free_heap_size());
+  metrics_int(req, &sb, "zamdach_reset_reason", "gauge",
+              "Reason of the last reset (esp_reset_reason_t)", esp_reset_reason());
+  const char * jobname;
+  struct schedjobstats jst;
+  static const char * const jobmetrics[][3] = {
+    { "zamdach_sched_cycles_total", "counter", "Cycles run by the sensor job" },
+    { "zamdach_sched_overruns_total", "counter", "Cycles of the sensor job skipped because the previous one was not done" },
+    { "zamdach_sched_late_milliseconds_total", "counter", "Total delay of the steps of the sensor job" },
+    { "zamdach_sched_steps_total", "counter", "Steps run by the sensor job" },
+    { "zamdach_sched_late_max_milliseconds", "gauge", "Largest delay of a step of the sensor job" },
+    { "zamdach_sched_step_max_milliseconds", "gauge", "Longest step of the sensor job" },
+  };
+  for (int m = 0; m < (sizeof(jobmetrics) / sizeof(jobmetrics[0])); m++) {
+    metrics_head(req, &sb, jobmetrics[m][0], jobmetrics[m][1], jobmetrics[m][2]);
+    for (int i = 0; sched_getstats(i, &jobname, &jst) == 0; i++) {
+      long long v[] = { jst.cycles, jst.overruns, jst.totallatems, jst.steps, jst.maxlatems, jst.maxstepms };
+      webserver_flushchunk(req, &sb, 0);
+      sbuf_puts(&sb, jobmetrics[m][0]);
+      sbuf_puts(&sb, "{job=\"");
+      sbuf_puts(&sb, jobname);
+      sbuf_puts(&sb, "\"} ");
+      sbuf_putll(&sb, v[m]);
+      sbuf_putc(&sb, '\n');
+    }
+  }
+  struct schedwindowstats wst;
+  sched_getwindow(&wst);
+  metrics_int(req, &sb, "zamdach_sched_window_cycles_total", "counter",
+              "Measurement cycles completed", wst.cycles);
+  metrics_int(req, &sb, "zamdach_sched_window_timeouts_total", "counter",
+              "Measurement cycles where not all sensors delivered in time", wst.timeouts);
+  metrics_int(req, &sb, "zamdach_sched_window_milliseconds", "gauge",
+              "Time from the start of the last cycle until all sensors were read", wst.lastms);
+  metrics_int(req, &sb, "zamdach_sched_window_max_milliseconds", "gauge",
+              "Longest measurement window since boot", wst.maxms);
+  metrics_int(req, &sb, "zamdach_sched_window_milliseconds_total", "counter",
+              "Sum of all measurement windows, without the timeouts", wst.totalms);
+  struct i2cbusstats ist;
+  static const char * const i2cmetrics[][3] = {
+    { "zamdach_i2c_transactions_total", "counter", "I2C transactions executed" },
+    { "zamdach_i2c_errors_total", "counter", "I2C transactions that failed, other than by timeout" },
+    { "zamdach_i2c_timeouts_total", "counter", "I2C transactions that timed out" },
+    { "zamdach_i2c_queue_full_total", "counter", "I2C transactions refused because the queue was full" },
+    { "zamdach_i2c_bus_microseconds_total", "counter", "Total time I2C transactions spent on the bus" },
+    { "zamdach_i2c_bus_max_microseconds", "gauge", "Longest time an I2C transaction spent on the bus" },
+    { "zamdach_i2c_wait_max_microseconds", "gauge", "Longest time an I2C transaction waited in the queue" },
+    { "zamdach_i2c_recoveries_total", "counter", "Times the I2C bus was found wedged and recovered" },
+    { "zamdach_i2c_recovery_failures_total", "counter", "I2C bus recoveries that did not free the bus" },
+    { "zamdach_i2c_recovery_last_microseconds", "gauge", "How long the last I2C bus recovery took" },
+  };
+  for (int m = 0; m < (sizeof(i2cmetrics) / sizeof(i2cmetrics[0])); m++) {
+    metrics_head(req, &sb, i2cmetrics[m][0], i2cmetrics[m][1], i2cmetrics[m][2]);
+    for (int port = 0; i2cbus_getstats(port, &ist) == 0; port++) {
+      long long v[] = { ist.transactions, ist.errors, ist.timeouts, ist.queuefull,
+                        ist.totalus, ist.maxus, ist.maxwaitus,
+                        ist.recoveries, ist.recoveryfails, ist.lastrecoveryus };
+      webserver_flushchunk(req, &sb, 0);
+      sbuf_puts(&sb, i2cmetrics[m][0]);
+      sbuf_puts(&sb, "{port=\"");
+      sbuf_putll(&sb, port);
+      sbuf_puts(&sb, "\"} ");
+      sbuf_putll(&sb, v[m]);
+      sbuf_putc(&sb, '\n');
+    }
+  }
+  struct i2cdevstats idst;
+  static const char * const i2cdevmetrics[][3] = {
+    { "zamdach_i2c_device_ok_total", "counter", "Successful I2C transactions with the device" },
+    { "zamdach_i2c_device_nacks_total", "counter", "I2C transactions the device did not acknowledge" },
+    { "zamdach_i2c_device_timeouts_total", "counter", "I2C transactions with the device that timed out" },
+    { "zamdach_i2c_device_crc_errors_total", "counter", "Data from the device with a bad CRC" },
+    { "zamdach_i2c_device_reinits_total", "counter", "Times the device was set up again after a bus recovery" },
+  };
+  for (int m = 0; m < (sizeof(i2cdevmetrics) / sizeof(i2cdevmetrics[0])); m++) {
+    metrics_head(req, &sb, i2cdevmetrics[m][0], i2cdevmetrics[m][1], i2cdevmetrics[m][2]);
+    for (int port = 0; port < I2CBUS_PORTS; port++) {
+      for (int i = 0; i2cbus_getdevstats(port, i, &idst) == 0; i++) {
+        long long v[] = { idst.ok, idst.nacks, idst.timeouts, idst.crcerrors, idst.reinits };
+        webserver_flushchunk(req, &sb, 0);
+        sbuf_puts(&sb, i2cdevmetrics[m][0]);
+        sbuf_puts(&sb, "{port=\"");
+        sbuf_putll(&sb, port);
+        sbuf_puts(&sb, "\",device=\"");
+        sbuf_puts(&sb, idst.name);
+        sbuf_puts(&sb, "\"} ");
+        sbuf_putll(&sb, v[m]);
+        sbuf_putc(&sb, '\n');
+      }
+    }
+  }
+  struct ratelimitstats rst;
+  ratelimit_getstats(&rst);
+  metrics_int(req, &sb, "zamdach_http_requests_allowed_total", "counter",
+              "Requests to the webserver that were served", rst.allowed);
+  metrics_int(req, &sb, "zamdach_http_requests_limited_total", "counter",
+              "Requests to the webserver refused with 429", rst.limited);
+  metrics_int(req, &sb, "zamdach_http_connections_rejected_total", "counter",
+              "Connections closed because the client had too many open", rst.connsrejected);
+  metrics_int(req, &sb, "zamdach_http_clients_forgotten_total", "counter",
+              "Clients dropped from the rate limiting table", rst.evictions);
+  metrics_int(req, &sb, "zamdach_http_clients_tracked", "gauge",
+              "Clients in the rate limiting table", rst.clients);
+  struct submitstats sst;
+  submit_getstats(&sst);
+  metrics_int(req, &sb, "zamdach_upload_queue_depth", "gauge",
+              "Batches waiting in the upload queue", sst.queuedepth);
+  metrics_int(req, &sb, "zamdach_upload_enqueued_total", "counter",
+              "Batches put into the upload queue", sst.enqueued);
+  metrics_int(req, &sb, "zamdach_upload_dropped_total", "counter",
+              "Batches dropped because the upload queue was full", sst.dropped);
+  metrics_destcounter(req, &sb, &sst, "zamdach_upload_attempts_total",
+                      "HTTP requests, including retries", 1,
+                      offsetof(struct submitmetrics, attempts));
+  metrics_destcounter(req, &sb, &sst, "zamdach_upload_successes_total",
+                      "Successful HTTP requests", 1,
+                      offsetof(struct submitmetrics, successes));
+  metrics_destcounter(req, &sb, &sst, "zamdach_upload_failures_total",
+                      "Failed HTTP requests", 1,
+                      offsetof(struct submitmetrics, failures));
+  metrics_destcounter(req, &sb, &sst, "zamdach_upload_sent_bytes_total",
+                      "Payload bytes sent", 1,
+                      offsetof(struct submitmetrics, bytessent));
+  metrics_destcounter(req, &sb, &sst, "zamdach_upload_skipped_total",
+                      "Uploads not tried because the destination is down", 0,
+                      offsetof(struct submitdeststats, skipped));
+  metrics_head(req, &sb, "zamdach_upload_results_total", "counter",
+               "Results of HTTP requests, HTTP status or ESP-IDF error");
+  for (int d = 0; d < SUBMITDEST_COUNT; d++) {
+    const struct submitmetrics * m = submit_getmetrics(d);
+    for (int c = 0; c < SUBMIT_MAXCODES; c++) {
+      if (m->codes[c].code == 0) { break; }
+      metrics_destsample(req, &sb, "zamdach_upload_results_total", sst.dest[d].name);
+      sbuf_puts(&sb, ",result=\"");
+      if (m->codes[c].code < 1000) { /* HTTP status */
+        sbuf_putll(&sb, m->codes[c].code);
+      } else {
+        sbuf_puts(&sb, esp_err_to_name(m->codes[c].code));
+      }
+      sbuf_puts(&sb, "\"} ");
+      sbuf_putll(&sb, m->codes[c].count);
+      sbuf_putc(&sb, '\n');
+    }
+    metrics_destsample(req, &sb, "zamdach_upload_results_total", sst.dest[d].name);
+    sbuf_puts(&sb, ",result=\"other\"} ");
+    sbuf_putll(&sb, m->othercodes);
+    sbuf_putc(&sb, '\n');
+  }
+  metrics_head(req, &sb, "zamdach_upload_duration_seconds", "histogram",
+               "Duration of the phases of uploads");
+  for (int d = 0; d < SUBMITDEST_COUNT; d++) {
+    const struct submitmetrics * m = submit_getmetrics(d);
+    for (int p = 0; p < SUBMITPHASE_COUNT; p++) {
+      /* Prometheus buckets are cumulative, ours are not. */
+      uint32_t cum = 0;
+      for (int b = 0; b < SUBMIT_HISTBUCKETS; b++) {
+        cum += m->hist[p][b];
+        metrics_destsample(req, &sb, "zamdach_upload_duration_seconds_bucket", sst.dest[d].name);
+        sbuf_puts(&sb, ",phase=\"");
+        sbuf_puts(&sb, submit_phasenames[p]);
+        sbuf_puts(&sb, "\",le=\"");
+        if (b < (SUBMIT_HISTBUCKETS - 1)) {
+          sbuf_putfloat(&sb, submit_histbounds[b] / 1000.0, 3);
+        } else {
+          sbuf_puts(&sb, "+Inf");
+        }
+        sbuf_puts(&sb, "\"} ");
+        sbuf_putll(&sb, cum);
+        sbuf_putc(&sb, '\n');
+      }
+      metrics_destsample(req, &sb, "zamdach_upload_duration_seconds_sum", sst.dest[d].name);
+      sbuf_puts(&sb, ",phase=\"");
+      sbuf_puts(&sb, submit_phasenames[p]);
+      sbuf_puts(&sb, "\"} ");
+      sbuf_putfloat(&sb, m->histsum[p] / 1000.0, 3);
+      sbuf_putc(&sb, '\n');
+      metrics_destsample(req, &sb, "zamdach_upload_duration_seconds_count", sst.dest[d].name);
+      sbuf_puts(&sb, ",phase=\"");
+      sbuf_puts(&sb, submit_phasenames[p]);
+      sbuf_puts(&sb, "\"} ");
+      sbuf_putll(&sb, cum);
+      sbuf_putc(&sb, '\n');
+    }
+  }
+  webserver_flushchunk(req, &sb, 1);
+  httpd_resp_send_chunk(req, NULL, 0);
+  return ESP_OK;
+}
+
+static httpd_uri_t uri_metrics = {
+  .uri      = "/metrics",
+  .method   = HTTP_GET,
+  .handler  = get_metrics_handler,
+  .user_ctx = NULL
+};
+
 static httpd_uri_t uri_debug = {
   .uri      = "/debug",
   .method   = HTTP_GET,
@@ -263,6 +977,8 @@ void unescapeuestring(char * s) {
       *wp = ':'; rp += 3; wp += 1;
     } else if (strncmp(rp, "%2F", 3) == 0) {
       *wp = '/'; rp += 3; wp += 1;
+    } else if (strncmp(rp, "%2C", 3) == 0) {
+      *wp = ','; rp += 3; wp += 1;
     } else {
       *wp = *rp; wp++; rp++;
     }
@@ -270,114 +986,271 @@ void unescapeuestring(char * s) {
   *wp = 0;
 }
 
+/* For history_query(): sends a chunk whenever the buffer gets full. */
+static void history_flush(struct sbuf * sb, void * ctx)
+{
+  webserver_flushchunk((httpd_req_t *)ctx, sb, 0);
+}
+
+/* Serves the history from history.c. Query parameters (all optional):
+ * from, to: unix timestamps, only rows with from <= ts <= to are sent.
+ * fields: comma separated list of the fields wanted, e.g. temp,hum.
+ *   The names are the same as in /json. Default is all.
+ * format: csv (default) or bin.
+ * The binary format is little endian throughout: "ZDH1", number of
+ * fields (1 byte), then for every field the length of the name
+ * (1 byte), the name, scale and offset (int32 each) and the width
+ * of its values (1 byte, 2 or 4). Then follow the rows until the end,
+ * each row being the timestamp (uint32) and the raw values of the
+ * fields. value = raw / scale + offset, and the smallest possible
+ * raw value (-32768 / -2147483648) means "invalid". */
+esp_err_t get_history_handler(httpd_req_t * req) {
+  char query[200];
+  char tmp[120];
+  char outbuf[600];
+  struct sbuf sb;
+  struct histquery q = { .from = 0, .to = UINT32_MAX, .binary = 0, .nf = 0 };
+  if (webserver_admit(req, RATELIMIT_HEAVY) != 0) {
+    return ESP_OK;
+  }
+  if (httpd_req_get_url_query_str(req, query, sizeof(query)) != ESP_OK) {
+    strcpy(query, "");
+  }
+  if (httpd_query_key_value(query, "from", tmp, sizeof(tmp)) == ESP_OK) {
+    q.from = strtoul(tmp, NULL, 10);
+  }
+  if (httpd_query_key_value(query, "to", tmp, sizeof(tmp)) == ESP_OK) {
+    q.to = strtoul(tmp, NULL, 10);
+  }
+  if (httpd_query_key_value(query, "format", tmp, sizeof(tmp)) == ESP_OK) {
+    q.binary = (strcmp(tmp, "bin") == 0);
+  }
+  if (httpd_query_key_value(query, "fields", tmp, sizeof(tmp)) == ESP_OK) {
+    /* httpd does not decode the query string, so the commas might
+     * arrive as %2C */
+    unescapeuestring(tmp);
+    const char * p = tmp;
+    while (*p != 0) {
+      size_t l = strcspn(p, ",");
+      int f = history_fieldbyname(p, l);
+      if (f < 0) {
+        httpd_resp_set_status(req, "400 Bad Request");
+        httpd_resp_send(req, "Unknown field", HTTPD_RESP_USE_STRLEN);
+        return ESP_OK;
+      }
+      if (q.nf < HISTFIELD_COUNT) { q.fields[q.nf++] = f; }
+      p += l;
+      if (*p == ',') { p++; }
+    }
+  }
+  if (q.nf == 0) {
+    for (int f = 0; f < HISTFIELD_COUNT; f++) { q.fields[q.nf++] = f; }
+  }
+  httpd_resp_set_type(req, (q.binary) ? "application/octet-stream" : "text/csv");
+  httpd_resp_set_hdr(req, "Cache-Control", "public, max-age=29");
+  sbuf_init(&sb, outbuf, sizeof(outbuf));
+  history_query(&q, &sb, history_flush, req);
+  webserver_flushchunk(req, &sb, 1);
+  httpd_resp_send_chunk(req, NULL, 0);
+  return ESP_OK;
+}
+
+static httpd_uri_t uri_history = {
+  .uri      = "/history",
+  .method   = HTTP_GET,
+  .handler  = get_history_handler,
+  .user_ctx = NULL
+};
+
+/* Takes a firmware image pushed to us as the raw body of a POST,
+ * e.g. with
+ *   curl -H "X-Updatepw: <password>" --data-binary @zamdach2022.bin http://<ip>/otaupload
+ * The image is written to the OTA partition chunk by chunk while it is
+ * being received, it never is in RAM as a whole. */
+esp_err_t post_otaupload_handler(httpd_req_t * req) {
+  int reboot;
+  if (webserver_admit(req, RATELIMIT_HEAVY) != 0) {
+    return ESP_OK;
+  }
+  esp_err_t res = otaupload_recv(req, &reboot);
+  if (reboot) {
+    vTaskDelay(3 * (1000 / portTICK_PERIOD_MS));
+    esp_restart();
+  }
+  return res;
+}
+
+static httpd_uri_t uri_otaupload = {
+  .uri      = "/otaupload",
+  .method   = HTTP_POST,
+  .handler  = post_otaupload_handler,
+  .user_ctx = NULL
+};
+
+/* Shown after starting an update, polls /otastatus. */
+static const char otap_progress[] = R"EOOTAP(<html><head><title>Firmware update</title></head><body>
+The firmware update was started in the background.<br>
+<span id="otast">Waiting for status...</span>
+<script type="text/javascript">
+function otapoll() {
+  var xhr = new XMLHttpRequest();
+  xhr.open('GET', '/otastatus', true);
+  xhr.responseType = 'json';
+  xhr.onload = function() {
+    var st = xhr.response;
+    if ((xhr.status !== 200) || (st == null)) { return; }
+    var t = "State: " + st.state + ", " + st.bytesdone + " of "
+          + ((st.imagesize < 0) ? "?" : st.imagesize) + " bytes, "
+          + st.bytespersec + " bytes/s";
+    if (st.state === "failed") { t += ", error: " + st.error; }
+    if (st.state === "success") { t += " - rebooting now."; }
+    document.getElementById("otast").innerHTML = t;
+  };
+  xhr.send();
+}
+setInterval(otapoll, 2000);
+otapoll();
+</script>
+</body></html>
+)EOOTAP";
+
+/* State and progress of the last firmware update, as JSON. */
+esp_err_t get_otastatus_handler(httpd_req_t * req) {
+  char myresponse[400];
+  struct sbuf sb;
+  struct otastatus ost;
+  if (webserver_admit(req, 1) != 0) {
+    return ESP_OK;
+  }
+  ota_getstatus(&ost);
+  int64_t endts = (ost.endts != 0) ? ost.endts : esp_timer_get_time();
+  int64_t elapsedms = (ost.state == OTASTATE_IDLE) ? 0 : ((endts - ost.startts) / 1000);
+  sbuf_init(&sb, myresponse, sizeof(myresponse));
+  sbuf_puts(&sb, "{\"state\":\"");
+  sbuf_puts(&sb, ota_statename(ost.state));
+  sbuf_puts(&sb, "\",\"bytesdone\":");
+  sbuf_putll(&sb, ost.bytesdone);
+  sbuf_puts(&sb, ",\"imagesize\":");
+  sbuf_putll(&sb, ost.imagesize);
+  sbuf_puts(&sb, ",\"elapsedms\":");
+  sbuf_putll(&sb, elapsedms);
+  sbuf_puts(&sb, ",\"bytespersec\":");
+  sbuf_putll(&sb, (elapsedms > 0) ? ((long long)ost.bytesdone * 1000 / elapsedms) : 0);
+  /* errmsg is an esp_err name or one of the fixed messages in ota.c,
+   * nothing that would need escaping. */
+  sbuf_puts(&sb, ",\"error\":\"");
+  sbuf_puts(&sb, ost.errmsg);
+  sbuf_puts(&sb, "\"}");
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+  httpd_resp_send(req, myresponse, sb.len);
+  return ESP_OK;
+}
+
+static httpd_uri_t uri_otastatus = {
+  .uri      = "/otastatus",
+  .method   = HTTP_GET,
+  .handler  = get_otastatus_handler,
+  .user_ctx = NULL
+};
+
 esp_err_t post_adminaction(httpd_req_t * req) {
+  /* This runs on the webserver task, so go easy on the stack. tmp1
+   * gets one value at a time, still URL-encoded. That leaves plenty
+   * of room for the encoding of an update URL, which has to fit into
+   * struct otastatus (200 bytes) once decoded. */
   char postcontent[600];
-  char myresponse[1000];
-  char tmp1[600];
+  char tmp1[400];
+  if (webserver_admit(req, RATELIMIT_HEAVY) != 0) {
+    return ESP_OK;
+  }
   //ESP_LOGI("webserver.c", "POST request with length: %d", req->content_len);
   if (req->content_len >= sizeof(postcontent)) {
     httpd_resp_set_status(req, "500 Internal Server Error");
-    strcpy(myresponse, "Sorry, your request was too large. Try a shorter update URL?");
-    httpd_resp_send(req, myresponse, HTTPD_RESP_USE_STRLEN);
+    httpd_resp_send(req, "Sorry, your request was too large. Try a shorter update URL?", HTTPD_RESP_USE_STRLEN);
     return ESP_OK;
   }
   int ret = httpd_req_recv(req, postcontent, req->content_len);
   if (ret < req->content_len) {
     httpd_resp_set_status(req, "500 Internal Server Error");
-    strcpy(myresponse, "Your request was incompletely received.");
-    httpd_resp_send(req, myresponse, HTTPD_RESP_USE_STRLEN);
+    httpd_resp_send(req, "Your request was incompletely received.", HTTPD_RESP_USE_STRLEN);
     return ESP_OK;
   }
   postcontent[req->content_len] = 0;
   ESP_LOGI("webserver.c", "Received data: '%s'", postcontent);
   if (httpd_query_key_value(postcontent, "updatepw", tmp1, sizeof(tmp1)) != ESP_OK) {
     httpd_resp_set_status(req, "400 Bad Request");
-    strcpy(myresponse, "No updatepw submitted.");
-    httpd_resp_send(req, myresponse, HTTPD_RESP_USE_STRLEN);
+    httpd_resp_send(req, "No updatepw submitted.", HTTPD_RESP_USE_STRLEN);
     return ESP_OK;
   }
   unescapeuestring(tmp1);
   if (strcmp(tmp1, ZAMDACH_WEBIFADMINPW) != 0) {
     ESP_LOGI("webserver.c", "Incorrect AdminPW - UE: '%s'", tmp1);
     httpd_resp_set_status(req, "403 Forbidden");
-    strcpy(myresponse, "Admin-Password incorrect.");
-    httpd_resp_send(req, myresponse, HTTPD_RESP_USE_STRLEN);
+    httpd_resp_send(req, "Admin-Password incorrect.", HTTPD_RESP_USE_STRLEN);
     return ESP_OK;
   }
   if (httpd_query_key_value(postcontent, "action", tmp1, sizeof(tmp1)) != ESP_OK) {
     httpd_resp_set_status(req, "400 Bad Request");
-    strcpy(myresponse, "No adminaction selected.");
-    httpd_resp_send(req, myresponse, HTTPD_RESP_USE_STRLEN);
+    httpd_resp_send(req, "No adminaction selected.", HTTPD_RESP_USE_STRLEN);
     return ESP_OK;
   }
   if (strcmp(tmp1, "flashupdate") == 0) {
-    if (httpd_query_key_value(postcontent, "updateurl", tmp1, sizeof(tmp1)) != ESP_OK) {
+    esp_err_t r = httpd_query_key_value(postcontent, "updateurl", tmp1, sizeof(tmp1));
+    if (r == ESP_ERR_HTTPD_RESULT_TRUNC) {
+      httpd_resp_set_status(req, "400 Bad Request");
+      httpd_resp_send(req, "Sorry, that update URL is too long.", HTTPD_RESP_USE_STRLEN);
+      return ESP_OK;
+    }
+    if (r != ESP_OK) {
       httpd_resp_set_status(req, "400 Bad Request");
-      strcpy(myresponse, "No updateurl submitted.");
-      httpd_resp_send(req, myresponse, HTTPD_RESP_USE_STRLEN);
+      httpd_resp_send(req, "No updateurl submitted.", HTTPD_RESP_USE_STRLEN);
       return ESP_OK;
     }
     unescapeuestring(tmp1);
     ESP_LOGI("webserver.c", "UE UpdateURL: '%s'", tmp1);
-    sprintf(myresponse, "OK, will try to update from: %s'<br>", tmp1);
-    esp_http_client_config_t httpccfg = {
-        .url = tmp1,
-        .timeout_ms = 60000,
-        .keep_alive_enable = true,
-        .crt_bundle_attach = esp_crt_bundle_attach
-    };
-    esp_https_ota_config_t otacfg = {
-        .http_config = &httpccfg
-    };
-    ret = esp_https_ota(&otacfg);
-    if (ret == ESP_OK) {
-      ESP_LOGI("webserver.c", "OTA Succeed, Rebooting...");
-      strcat(myresponse, "OTA Update reported success. Will reboot.");
-      httpd_resp_send(req, myresponse, HTTPD_RESP_USE_STRLEN);
-      vTaskDelay(3 * (1000 / portTICK_PERIOD_MS)); 
-      esp_restart();
-    } else {
-      ESP_LOGE("webserver.c", "Firmware upgrade failed");
-      strcat(myresponse, "OTA Update reported failure.");
-      httpd_resp_send(req, myresponse, HTTPD_RESP_USE_STRLEN);
+    if (strlen(tmp1) >= sizeof(((struct otastatus *)0)->url)) {
+      httpd_resp_set_status(req, "400 Bad Request");
+      httpd_resp_send(req, "Sorry, that update URL is too long.", HTTPD_RESP_USE_STRLEN);
       return ESP_OK;
     }
-    /* This should not be reached. */
+    if (ota_start(tmp1) != 0) {
+      httpd_resp_set_status(req, "503 Service Unavailable");
+      httpd_resp_send(req, "Could not start the update - is there already one running?", HTTPD_RESP_USE_STRLEN);
+      return ESP_OK;
+    }
+    /* The update runs in the background, the page just watches it. */
+    httpd_resp_send(req, otap_progress, sizeof(otap_progress) - 1);
+    return ESP_OK;
   } else if (strcmp(tmp1, "reboot") == 0) {
     ESP_LOGI("webserver.c", "Reboot requested by admin, Rebooting...");
-    strcpy(myresponse, "OK, will reboot in 3 seconds.");
-    httpd_resp_send(req, myresponse, HTTPD_RESP_USE_STRLEN);
+    httpd_resp_send(req, "OK, will reboot in 3 seconds.", HTTPD_RESP_USE_STRLEN);
     vTaskDelay(3 * (1000 / portTICK_PERIOD_MS)); 
     esp_restart();
     /* This should not be reached */
   } else if (strcmp(tmp1, "forcesht4xheater") == 0) {
     ESP_LOGI("webserver.c", "Forced SHT4x heating cycle requested by admin.");
     forcesht4xheater = 1;
-    strcpy(myresponse, "OK, will do a SHT4x heating cycle after the next polling iteration.");
-    httpd_resp_send(req, myresponse, HTTPD_RESP_USE_STRLEN);
+    httpd_resp_send(req, "OK, will do a SHT4x heating cycle after the next polling iteration.", HTTPD_RESP_USE_STRLEN);
     return ESP_OK;
   } else if (strcmp(tmp1, "markfwasgood") == 0) {
     if (pendingfwverify == 0) {
       httpd_resp_set_status(req, "400 Bad Request");
-      strcpy(myresponse, "You're trying to mark an already marked firmware.");
-      httpd_resp_send(req, myresponse, HTTPD_RESP_USE_STRLEN);
+      httpd_resp_send(req, "You're trying to mark an already marked firmware.", HTTPD_RESP_USE_STRLEN);
       return ESP_OK;
     }
     ret = esp_ota_mark_app_valid_cancel_rollback();
     if (ret == ESP_OK) {
       ESP_LOGI("webserver.c", "markfirmwareasgood: Updated firmware is now marked as good.");
-      strcpy(myresponse, "New firmware was successfully marked as good.");
-      httpd_resp_send(req, myresponse, HTTPD_RESP_USE_STRLEN);
+      httpd_resp_send(req, "New firmware was successfully marked as good.", HTTPD_RESP_USE_STRLEN);
     } else {
       ESP_LOGE("webserver.c", "markfirmwareasgood: Failed to mark updated firmware as good, will rollback on next reboot.");
-      strcpy(myresponse, "Failed to mark updated firmware as good, will rollback on next reboot.");
-      httpd_resp_send(req, myresponse, HTTPD_RESP_USE_STRLEN);
+      httpd_resp_send(req, "Failed to mark updated firmware as good, will rollback on next reboot.", HTTPD_RESP_USE_STRLEN);
     }
     pendingfwverify = 0;
   } else {
     httpd_resp_set_status(req, "400 Bad Request");
-    strcpy(myresponse, "Unknown adminaction requested.");
-    httpd_resp_send(req, myresponse, HTTPD_RESP_USE_STRLEN);
+    httpd_resp_send(req, "Unknown adminaction requested.", HTTPD_RESP_USE_STRLEN);
   }
   return ESP_OK;
 }
@@ -392,13 +1265,26 @@ static httpd_uri_t uri_adminaction = {
 void webserver_start(void) {
   httpd_handle_t server = NULL;
   httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+  config.open_fn = webserver_openfn;
+  config.close_fn = webserver_closefn;
   /* Documentation is - as usual - a bit patchy, but I assume
    * the following drops the oldest connection if the ESP runs
    * out of connections. */
   config.lru_purge_enable = true;
   config.server_port = 80;
-  /* The default is undocumented, but seems to be only 4k. */
-  config.stack_size = 10000;
+  /* The webserver itself needs 3 of the LWIP_MAX_SOCKETS, and we need
+   * a few for uploads, DNS and the UDP output. */
+  config.max_open_sockets = 10;
+  /* The default of 8 is getting tight */
+  config.max_uri_handlers = 16;
+  /* The default is undocumented, but seems to be only 4k. This used
+   * to be 10000 for the TLS connection of firmware updates, which now
+   * run in their own task. /debug shows how much of this is used. */
+  config.stack_size = 6144;
+  /* So that there is something to serve before the first measurement. */
+  struct ev e;
+  evstore_get(&e);
+  webserver_publish(&e);
   ESP_LOGI("webserver.c", "Starting webserver on port %d", config.server_port);
   if (httpd_start(&server, &config) != ESP_OK) {
     ESP_LOGE("webserver.c", "Failed to start HTTP server.");
@@ -407,6 +1293,13 @@ void webserver_start(void) {
   httpd_register_uri_handler(server, &uri_startpage);
   httpd_register_uri_handler(server, &uri_json);
   httpd_register_uri_handler(server, &uri_debug);
+  httpd_register_uri_handler(server, &uri_uploadstats);
+  httpd_register_uri_handler(server, &uri_metrics);
+  httpd_register_uri_handler(server, &uri_otastatus);
+  httpd_register_uri_handler(server, &uri_otaupload);
   httpd_register_uri_handler(server, &uri_adminaction);
+  httpd_register_uri_handler(server, &uri_stream);
+  httpd_register_uri_handler(server, &uri_history);
+  webserver = server;
 }
 
@@ -27,5 +27,11 @@ struct ev {
 /* Initialize and start the Webserver. */
 void webserver_start(void);
 
+/* Tells the webserver that there are new values. It renders
+ * what it serves from them right away, so this has to be called
+ * from the task that updates the values. Other tasks can get
+ * them with evstore_get(). */
+void webserver_publish(const struct ev * e);
+
 #endif /* _WEBSERVER_H_ */
 
@@ -0,0 +1,149 @@
+/* ZAMDACH2022
+ * The JSON with the current values, rendered once per update. */
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <esp_app_desc.h>
+#include <esp_log.h>
+#include "sbuf.h"
+#include "websnap.h"
+
+/* This is in zamdach2022_main.c */
+extern int pendingfwverify;
+
+/* Double-buffered: New values are rendered into the inactive snapshot,
+ * which is then switched to. Handlers that are still sending from the
+ * previous snapshot have almost a minute before that one gets
+ * overwritten. */
+static struct websnapshot snaps[2];
+static atomic_int activesnap = 0;
+static unsigned long snapversion = 0;
+
+/* The release store when switching snapshots makes sure a reader
+ * never sees the new index before the contents it points to. */
+const struct websnapshot * websnap_get(void)
+{
+  return &snaps[atomic_load_explicit(&activesnap, memory_order_acquire)];
+}
+
+/* Appends one "key":"value", pair to the JSON output. */
+static void json_field(struct sbuf * sb, const char * key, float value, int decimals)
+{
+  sbuf_putc(sb, '"');
+  sbuf_puts(sb, key);
+  sbuf_puts(sb, "\":\"");
+  sbuf_putfloat(sb, value, decimals);
+  sbuf_puts(sb, "\",");
+}
+
+static void websnap_render(struct websnapshot * snap, const struct ev * e)
+{
+  struct sbuf sb;
+  const esp_app_desc_t * appd = esp_app_get_description();
+  snap->version = ++snapversion;
+  /* lastupd makes this unique across reboots, the version makes it
+   * unique if the clock has not been set yet. */
+  snprintf(snap->etag, sizeof(snap->etag), "\"%lld-%lu\"",
+           (long long)e->lastupd, snap->version);
+
+  sbuf_init(&sb, snap->json, sizeof(snap->json));
+  sbuf_puts(&sb, "{\"ts\":\"");
+  sbuf_putll(&sb, e->lastupd);
+  sbuf_puts(&sb, "\",\"lastsht4xheat\":\"");
+  sbuf_putll(&sb, e->lastsht4xheat);
+  sbuf_puts(&sb, "\",");
+  json_field(&sb, "temp", e->temp, 2);
+  json_field(&sb, "hum", e->hum, 1);
+  json_field(&sb, "pm010", e->pm010, 1);
+  json_field(&sb, "pm025", e->pm025, 1);
+  json_field(&sb, "pm040", e->pm040, 1);
+  json_field(&sb, "pm100", e->pm100, 1);
+  json_field(&sb, "press", e->press, 3);
+  json_field(&sb, "lux", e->lux, 2);
+  json_field(&sb, "uvind", e->uvind, 2);
+  json_field(&sb, "raing", e->raing, 2);
+  json_field(&sb, "windspeed", e->windspeed, 1);
+  json_field(&sb, "windspmax", e->windspmax, 1);
+  json_field(&sb, "winddirdeg", e->winddirdeg, 1);
+  sbuf_puts(&sb, "\"winddirtxt\":\"");
+  sbuf_puts(&sb, e->winddirtxt);
+  /* These two are for the start page, which is static. */
+  sbuf_puts(&sb, "\",\"fwversion\":\"");
+  sbuf_puts(&sb, appd->project_name);
+  sbuf_puts(&sb, " version ");
+  sbuf_puts(&sb, appd->version);
+  sbuf_puts(&sb, " compiled ");
+  sbuf_puts(&sb, appd->date);
+  sbuf_putc(&sb, ' ');
+  sbuf_puts(&sb, appd->time);
+  sbuf_puts(&sb, "\",\"fwpending\":\"");
+  sbuf_putc(&sb, (pendingfwverify > 0) ? '1' : '0');
+  sbuf_puts(&sb, "\"}");
+  if (sb.overflow) {
+    ESP_LOGE("websnap.c", "JSON output got truncated to %u bytes.", (unsigned)sb.len);
+  }
+  snap->jsonlen = sb.len;
+}
+
+void websnap_publish(const struct ev * e)
+{
+  int ns = (atomic_load_explicit(&activesnap, memory_order_relaxed) == 0) ? 1 : 0;
+  websnap_render(&snaps[ns], e);
+  atomic_store_explicit(&activesnap, ns, memory_order_release);
+}
+
+/* If-None-Match is "*" or a comma separated list of entity tags, which
+ * may be weak (W/"..."). It is compared the weak way, so a weak tag
+ * matches our strong one if the part in quotes is the same. */
+int websnap_etagmatch(const char * inm, const char * etag)
+{
+  size_t el = strlen(etag);
+  const char * p = inm;
+  while (*p != 0) {
+    while ((*p == ' ') || (*p == '\t') || (*p == ',')) { p++; }
+    if (*p == '*') {
+      return 1;
+    }
+    if ((p[0] == 'W') && (p[1] == '/')) { p += 2; }
+    if (*p != '"') {
+      return 0; /* not a valid list, so nothing matches */
+    }
+    const char * end = strchr(p + 1, '"');
+    if (end == NULL) {
+      return 0;
+    }
+    end++;
+    if (((size_t)(end - p) == el) && (memcmp(p, etag, el) == 0)) {
+      return 1;
+    }
+    p = end;
+  }
+  return 0;
+}
+
+esp_err_t websnap_sendjson(httpd_req_t * req)
+{
+  const struct websnapshot * snap = websnap_get();
+  char inm[120];
+  esp_err_t r;
+  httpd_resp_set_hdr(req, "ETag", snap->etag);
+  httpd_resp_set_hdr(req, "Cache-Control", "public, max-age=29");
+  /* If a long list got truncated, the tags that are left can still
+   * match. The one that got cut off has lost its closing quote, so
+   * it cannot. If the match was in the part that is gone, the client
+   * just gets the whole thing. */
+  r = httpd_req_get_hdr_value_str(req, "If-None-Match", inm, sizeof(inm));
+  if (((r == ESP_OK) || (r == ESP_ERR_HTTPD_RESULT_TRUNC))
+   && (websnap_etagmatch(inm, snap->etag))) {
+    /* The client already has exactly this. */
+    httpd_resp_set_status(req, "304 Not Modified");
+    httpd_resp_send(req, NULL, 0);
+    return ESP_OK;
+  }
+  /* The following line is the default und thus redundant. */
+  httpd_resp_set_status(req, "200 OK");
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_send(req, snap->json, snap->jsonlen);
+  return ESP_OK;
+}
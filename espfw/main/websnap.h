@@ -0,0 +1,38 @@
+/* ZAMDACH2022
+ * The JSON with the current values, as served on /json and pushed to
+ * /stream. It only changes when the main loop publishes new values,
+ * so it is rendered once at that point and then just copied out for
+ * every request. */
+
+#ifndef _WEBSNAP_H_
+#define _WEBSNAP_H_
+
+#include <stddef.h>
+#include <time.h>
+#include <esp_err.h>
+#include <esp_http_server.h>
+#include "webserver.h" /* for struct ev */
+
+struct websnapshot {
+  unsigned long version;
+  char etag[40]; /* strong ETag, including the quotes */
+  char json[1100];
+  size_t jsonlen;
+};
+
+/* Renders e into a new snapshot and makes it the current one. There
+ * must only ever be one task calling this. */
+void websnap_publish(const struct ev * e);
+
+/* The current snapshot. Can be called from any task. It stays valid
+ * until the next but one websnap_publish(), i.e. for about a minute. */
+const struct websnapshot * websnap_get(void);
+
+/* Returns 1 if the value of an If-None-Match header matches etag. */
+int websnap_etagmatch(const char * inm, const char * etag);
+
+/* Sends the current snapshot as the response to req, or a 304 Not
+ * Modified if the client already has it. */
+esp_err_t websnap_sendjson(httpd_req_t * req);
+
+#endif /* _WEBSNAP_H_ */
@@ -9,6 +9,12 @@
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
 #include <sys/time.h>
+#include "sdkconfig.h"
+#ifdef CONFIG_ZAMDACH_WSPCNT
+#include <driver/mcpwm_cap.h>
+#include <driver/pulse_cnt.h>
+#include "wscount.h"
+#endif
 #include "windsens.h"
 
 /* See the docs/ directory for instructions on how to wire up the
@@ -46,6 +52,127 @@ static adc_cali_handle_t adc_calhan;
 static adc_oneshot_unit_handle_t ws_adchan;
 
 static portMUX_TYPE wsspinlock = portMUX_INITIALIZER_UNLOCKED;
+
+#ifdef CONFIG_ZAMDACH_WSPCNT
+
+/* The hardware glitch filter of the PCNT can filter at most 1023 APB
+ * clock cycles, i.e. 12.8 us. That takes care of noise on the slow
+ * edges that the RC filter in front of the pin makes, while the RC
+ * filter takes care of the contact bounce, which lasts up to about a
+ * millisecond. See the Kconfig help and docs/brainstorming.md. */
+#define WSGLITCHNS 12700
+
+static pcnt_unit_handle_t ws_pcntunit;
+/* The edges the capture unit saw, debounced in wscount.h. This is
+ * where the peak wind speed comes from. Its count is only used to
+ * check the PCNT count: if the PCNT counts a lot more, the signal is
+ * bouncing, i.e. the RC filter is missing. */
+static struct wscount ws_count;
+
+/* Called from the ISR of the MCPWM capture unit for every edge. The
+ * capture value is latched by the hardware at the edge, so interrupt
+ * latency does not matter. */
+static bool IRAM_ATTR ws_capturecb(mcpwm_cap_channel_handle_t capchan,
+                                   const mcpwm_capture_event_data_t * edata,
+                                   void * arg)
+{
+  int64_t now = esp_timer_get_time();
+  taskENTER_CRITICAL_ISR(&wsspinlock);
+  wscount_edge(&ws_count, (edata->cap_edge == MCPWM_CAP_EDGE_POS),
+               edata->cap_value, now);
+  taskEXIT_CRITICAL_ISR(&wsspinlock);
+  return false;
+}
+
+static void ws_initanemometer(void)
+{
+    /* Counting: The PCNT counts falling edges, i.e. 1/3 turns. We read
+     * and clear it once per measurement cycle, at most a few thousand
+     * counts, so the limit is never reached. */
+    pcnt_unit_config_t uc = {
+      .high_limit = 32767,
+      .low_limit = -1,
+    };
+    ESP_ERROR_CHECK(pcnt_new_unit(&uc, &ws_pcntunit));
+    pcnt_glitch_filter_config_t fc = {
+      .max_glitch_ns = WSGLITCHNS,
+    };
+    ESP_ERROR_CHECK(pcnt_unit_set_glitch_filter(ws_pcntunit, &fc));
+    pcnt_chan_config_t cc = {
+      .edge_gpio_num = WSPORT,
+      .level_gpio_num = -1,
+    };
+    pcnt_channel_handle_t pcntchan;
+    ESP_ERROR_CHECK(pcnt_new_channel(ws_pcntunit, &cc, &pcntchan));
+    ESP_ERROR_CHECK(pcnt_channel_set_edge_action(pcntchan,
+                      PCNT_CHANNEL_EDGE_ACTION_HOLD, PCNT_CHANNEL_EDGE_ACTION_INCREASE));
+    ESP_ERROR_CHECK(pcnt_unit_enable(ws_pcntunit));
+    ESP_ERROR_CHECK(pcnt_unit_clear_count(ws_pcntunit));
+    ESP_ERROR_CHECK(pcnt_unit_start(ws_pcntunit));
+    /* Timestamps for the peak wind speed: the MCPWM capture unit
+     * latches a timer on every edge and calls us for it. That is one
+     * short interrupt per edge, without the debounce timer of the
+     * GPIO interrupt based counting. */
+    mcpwm_cap_timer_handle_t captimer;
+    mcpwm_capture_timer_config_t tc = {
+      .group_id = 0,
+      .clk_src = MCPWM_CAPTURE_CLK_SRC_DEFAULT,
+    };
+    ESP_ERROR_CHECK(mcpwm_new_capture_timer(&tc, &captimer));
+    uint32_t capres = 0;
+    ESP_ERROR_CHECK(mcpwm_capture_timer_get_resolution(captimer, &capres));
+    wscount_init(&ws_count, capres);
+    mcpwm_cap_channel_handle_t capchan;
+    mcpwm_capture_channel_config_t chc = {
+      .gpio_num = WSPORT,
+      .prescale = 1,
+      /* The rising edges are needed for the debouncing. */
+      .flags.neg_edge = true,
+      .flags.pos_edge = true,
+    };
+    ESP_ERROR_CHECK(mcpwm_new_capture_channel(captimer, &chc, &capchan));
+    mcpwm_capture_event_callbacks_t cbs = {
+      .on_cap = ws_capturecb,
+    };
+    ESP_ERROR_CHECK(mcpwm_capture_channel_register_event_callbacks(capchan, &cbs, NULL));
+    ESP_ERROR_CHECK(mcpwm_capture_channel_enable(capchan));
+    ESP_ERROR_CHECK(mcpwm_capture_timer_enable(captimer));
+    ESP_ERROR_CHECK(mcpwm_capture_timer_start(captimer));
+    ESP_LOGI("windsens.c", "Anemometer is counted by PCNT, capture timer runs at %lu Hz.",
+             (unsigned long)capres);
+}
+
+uint16_t ws_readanemometer(void)
+{
+    int cnt = 0;
+    /* A pulse between these two is lost, but at most a few us pass. */
+    pcnt_unit_get_count(ws_pcntunit, &cnt);
+    pcnt_unit_clear_count(ws_pcntunit);
+    taskENTER_CRITICAL(&wsspinlock);
+    uint32_t capcnt = wscount_takecount(&ws_count);
+    uint32_t bounces = ws_count.bounces;
+    taskEXIT_CRITICAL(&wsspinlock);
+    /* The two are not read at exactly the same time, so allow for a
+     * pulse or two of difference. */
+    if ((uint32_t)cnt > (capcnt + 2 + (capcnt / 10))) {
+      ESP_LOGW("windsens.c", "Anemometer: PCNT counted %d pulses, but only %lu were long enough"
+               " - the signal is bouncing, is the RC filter missing?", cnt, (unsigned long)capcnt);
+    }
+    ESP_LOGI("windsens.c", "Anemometer: %d pulses, %lu bounces ignored by the peak detection since boot.",
+             cnt, (unsigned long)bounces);
+    return cnt;
+}
+
+float ws_readpeakws(void)
+{
+    taskENTER_CRITICAL(&wsspinlock);
+    float res = wscount_takepeak(&ws_count);
+    taskEXIT_CRITICAL(&wsspinlock);
+    return res;
+}
+
+#else /* !CONFIG_ZAMDACH_WSPCNT */
+
 static long wscounter = 0;
 static int lastwsstate = 1;
 static int64_t lastwsts = -1;
@@ -98,15 +225,8 @@ void ws_windspeedirq(void * arg)
   }
 }
 
-void ws_init(void)
+static void ws_initanemometer(void)
 {
-    /* Initialize the GPIO for the wind speed sensor */
-    /* The wind speed sensor is connected to GPI34.
-     * That pin is also connected to the button on the ESP32-POE-ISO,
-     * and pulled high by a 10k resistor on the board.
-     * Thus, we should normally read a "1" on the GPIO, and it
-     * will temporarily be pulled to 0 on every 1/3rd of an
-     * anemometer rotation. */
     esp_timer_create_args_t tca = {
       .callback = ws_windspeedtimercb,
       .arg = NULL,
@@ -128,6 +248,42 @@ void ws_init(void)
       .intr_type = GPIO_INTR_ANYEDGE,
     };
     ESP_ERROR_CHECK(gpio_config(&wss));
+}
+
+uint16_t ws_readanemometer(void)
+{
+    taskENTER_CRITICAL(&wsspinlock);
+    uint16_t res = wscounter;
+    wscounter = 0;
+    taskEXIT_CRITICAL(&wsspinlock);
+    return res;
+}
+
+float ws_readpeakws(void)
+{
+    taskENTER_CRITICAL(&wsspinlock);
+    int64_t td = minwstsdiff;
+    minwstsdiff = -1;
+    taskEXIT_CRITICAL(&wsspinlock);
+    float res = 0.0;
+    if (td > 0) {
+      res = (1000000.0 / (double)td) * 2.4;
+    }
+    return res;
+}
+
+#endif /* CONFIG_ZAMDACH_WSPCNT */
+
+void ws_init(void)
+{
+    /* Initialize the GPIO for the wind speed sensor */
+    /* The wind speed sensor is connected to GPI34.
+     * That pin is also connected to the button on the ESP32-POE-ISO,
+     * and pulled high by a 10k resistor on the board.
+     * Thus, we should normally read a "1" on the GPIO, and it
+     * will temporarily be pulled to 0 on every 1/3rd of an
+     * anemometer rotation. */
+    ws_initanemometer();
 
     /* Initialize the ADC for the wind direction sensor */
     /* 12 bit width. */
@@ -160,28 +316,6 @@ void ws_init(void)
     }
 }
 
-uint16_t ws_readanemometer(void)
-{
-    taskENTER_CRITICAL(&wsspinlock);
-    uint16_t res = wscounter;
-    wscounter = 0;
-    taskEXIT_CRITICAL(&wsspinlock);
-    return res;
-}
-
-float ws_readpeakws(void)
-{
-    taskENTER_CRITICAL(&wsspinlock);
-    int64_t td = minwstsdiff;
-    minwstsdiff = -1;
-    taskEXIT_CRITICAL(&wsspinlock);
-    float res = 0.0;
-    if (td > 0) {
-      res = (1000000.0 / (double)td) * 2.4;
-    }
-    return res;
-}
-
 uint8_t ws_readwinddirection(void)
 {
     uint8_t res = 99;
@@ -0,0 +1,101 @@
+/* ZAMDACH2022
+ * Debouncing of the anemometer pulses for the peak wind speed with
+ * PCNT based counting (CONFIG_ZAMDACH_WSPCNT). The capture unit gives
+ * us a timestamp for every edge, latched by the hardware, and this
+ * decides which of them are real. It is all inline, so that the
+ * capture ISR can run it from IRAM, and so that it can be tested on
+ * simulated pulse trains on the host. */
+
+#ifndef _WSCOUNT_H_
+#define _WSCOUNT_H_
+
+#include <stdint.h>
+#include <esp_attr.h>
+
+/* The reed contact bounces both when it closes and when it opens. A
+ * falling edge only counts if the line was high for at least this long
+ * before it, which is what the GPIO interrupt based counting checks
+ * with its 1 ms debounce timer too. */
+#define WSCOUNT_MINHIGHUS 1000
+/* The capture timer wraps after less than a minute, so the previous
+ * edge is ignored if it was longer ago than this (measured with the
+ * coarser esp_timer). */
+#define WSCOUNT_MAXGAPUS 10000000
+
+struct wscount {
+  uint32_t tickspersec; /* of the capture timer */
+  uint32_t minhighticks;
+  int haverise;
+  uint32_t risecap;
+  int64_t risets;
+  int havefall;
+  uint32_t fallcap;
+  int64_t fallts;
+  /* These are what the readers want. */
+  uint32_t count; /* falling edges that counted */
+  uint32_t bounces; /* falling edges that were ignored */
+  uint32_t mindiff; /* shortest time between two that counted, in ticks, 0 = none */
+};
+
+FORCE_INLINE_ATTR void wscount_init(struct wscount * wc, uint32_t tickspersec)
+{
+  wc->tickspersec = tickspersec;
+  wc->minhighticks = (uint32_t)(((uint64_t)tickspersec * WSCOUNT_MINHIGHUS) / 1000000);
+  wc->haverise = 0;
+  wc->havefall = 0;
+  wc->count = 0;
+  wc->bounces = 0;
+  wc->mindiff = 0;
+}
+
+/* Handles an edge that the capture unit latched at cap (in timer
+ * ticks). nowus is the esp_timer time, it only needs to be roughly
+ * right. */
+FORCE_INLINE_ATTR void wscount_edge(struct wscount * wc, int rising, uint32_t cap, int64_t nowus)
+{
+  if (rising) {
+    wc->haverise = 1;
+    wc->risecap = cap;
+    wc->risets = nowus;
+    return;
+  }
+  if ((wc->haverise) && ((nowus - wc->risets) < WSCOUNT_MAXGAPUS)
+   && ((uint32_t)(cap - wc->risecap) < wc->minhighticks)) {
+    /* Not high for long enough, so this is bounce. */
+    wc->bounces++;
+    return;
+  }
+  wc->count++;
+  if ((wc->havefall) && ((nowus - wc->fallts) < WSCOUNT_MAXGAPUS)) {
+    uint32_t diff = cap - wc->fallcap;
+    if ((diff > 0) && ((wc->mindiff == 0) || (diff < wc->mindiff))) {
+      wc->mindiff = diff;
+    }
+  }
+  wc->havefall = 1;
+  wc->fallcap = cap;
+  wc->fallts = nowus;
+}
+
+/* Gets the number of pulses counted, and resets it. */
+FORCE_INLINE_ATTR uint32_t wscount_takecount(struct wscount * wc)
+{
+  uint32_t res = wc->count;
+  wc->count = 0;
+  return res;
+}
+
+/* Gets the peak wind speed in km/h since the last call, from the
+ * shortest time between two pulses, and resets it. 1 pulse per second
+ * is 2.4 km/h. */
+static inline float wscount_takepeak(struct wscount * wc)
+{
+  uint32_t md = wc->mindiff;
+  wc->mindiff = 0;
+  if ((md == 0) || (wc->tickspersec == 0)) {
+    return 0.0;
+  }
+  return ((double)wc->tickspersec / (double)md) * 2.4;
+}
+
+#endif /* _WSCOUNT_H_ */
@@ -0,0 +1,27 @@
+#!/usr/bin/env python3
+# ZAMDACH2022
+# Compresses a static web asset for embedding into the firmware, and
+# writes a line about the sizes to a report file.
+# Usage: gzipasset.py <input> <output.gz> <reportfile>
+# The output is reproducible (no file name, mtime 0), and its gzip
+# header is always exactly 10 bytes long, which webserver.c relies on
+# when it has to inflate the asset for clients that do not accept gzip.
+
+import gzip
+import os
+import sys
+
+if len(sys.argv) != 4:
+    sys.exit("Usage: %s <input> <output.gz> <reportfile>" % sys.argv[0])
+inname, outname, reportname = sys.argv[1:4]
+with open(inname, "rb") as f:
+    data = f.read()
+with open(outname, "wb") as f:
+    with gzip.GzipFile(filename="", fileobj=f, mode="wb", compresslevel=9, mtime=0) as gz:
+        gz.write(data)
+outsize = os.path.getsize(outname)
+line = "%s: %d bytes, %d bytes gzipped (%.1f%%)" % (
+    os.path.basename(inname), len(data), outsize, 100.0 * outsize / max(len(data), 1))
+print(line)
+with open(reportname, "w") as f:
+    f.write(line + "\n")
@@ -17,12 +17,16 @@
 #include <time.h>
 #include <esp_ota_ops.h>
 #include <esp_sntp.h>
+#include <esp_timer.h>
 #include "secrets.h"
+#include "history.h"
 #include "i2c.h"
+#include "influx.h"
 #include "lps25hb.h"
 #include "ltr390.h"
 #include "network.h"
 #include "rg15.h"
+#include "sched.h"
 #include "sen50.h"
 #include "sht4x.h"
 #include "submit.h"
@@ -32,10 +36,8 @@
 static const char *TAG = "zamdach2022";
 
 /* Global / Exported variables, used to provide the webserver.
- * struct ev is defined in webserver.h for practical reasons. */
+ * The measured values are handed over with webserver_publish(). */
 char chipid[30] = "ZAMDACH-UNSET";
-struct ev evs[2];
-int activeevs = 0;
 /* Has the firmware been marked as "good" yet, or is ist still pending
  * verification? */
 int pendingfwverify = 0;
@@ -67,12 +69,362 @@ double reducedairpressurecalc(double press)
 }
 
 
+/* The results of the sensor jobs. The jobs run in several lane tasks,
+ * and the main task collects the results while they might already be
+ * measuring for the next record, so everything in here is protected by
+ * sresspinlock. Every result is tagged with the record cycle of the job
+ * run that produced it (see sched_waitcycle()). A result with an older
+ * tag is stale: the sensor did not deliver anything in time, so it shows
+ * up as missing instead of with an old value. */
+enum sresslot {
+  SRES_PRESS = 0,
+  SRES_RAIN,
+  SRES_UV,
+  SRES_LUX,
+  SRES_TEMPHUM,
+  SRES_PM,
+  SRES_WIND,
+  SRES_WINDDIR,
+  SRES_COUNT
+};
+struct sresults {
+  double press;
+  float raing;
+  float uvind;
+  float lux;
+  struct sht4xdata temphum;
+  struct sen50data pmdata;
+  int windvalid;
+  float windspeed;
+  float windspmax;
+  uint8_t wsdir;
+  uint32_t cycle[SRES_COUNT];
+};
+static struct sresults sres;
+static portMUX_TYPE sresspinlock = portMUX_INITIALIZER_UNLOCKED;
+static time_t lastsht4xheat = 0;
+static time_t lastanemomread = 0;
+
+/* Gets a copy of the results for record cycle cycle, with everything
+ * stale marked as invalid. */
+static void sres_take(uint32_t cycle, struct sresults * r)
+{
+  taskENTER_CRITICAL(&sresspinlock);
+  *r = sres;
+  taskEXIT_CRITICAL(&sresspinlock);
+  if (r->cycle[SRES_PRESS] != cycle) { r->press = -1.0; }
+  if (r->cycle[SRES_RAIN] != cycle) { r->raing = -99999.9; }
+  if (r->cycle[SRES_UV] != cycle) { r->uvind = -1.0; }
+  if (r->cycle[SRES_LUX] != cycle) { r->lux = -1.0; }
+  if (r->cycle[SRES_TEMPHUM] != cycle) { r->temphum.valid = 0; }
+  if (r->cycle[SRES_PM] != cycle) { r->pmdata.valid = 0; }
+  if (r->cycle[SRES_WIND] != cycle) { r->windvalid = 0; }
+  if (r->cycle[SRES_WINDDIR] != cycle) { r->wsdir = 99; }
+}
+
+/* The sensor jobs, see sched.h. Most sensors need to be told to
+ * measure and can be read some time later; the scheduler runs the
+ * other jobs in between instead of waiting. */
+static int job_lps25hb(const struct schedjob * j, int stepno)
+{
+  double press = lps25hb_readpressure();
+  taskENTER_CRITICAL(&sresspinlock);
+  sres.press = press;
+  sres.cycle[SRES_PRESS] = j->cycle;
+  taskEXIT_CRITICAL(&sresspinlock);
+  return SCHED_DONE;
+}
+
+/* The RG15 replies within a few hundred ms. We read the reply as soon
+ * as it is complete, i.e. when no more bytes have arrived for a bit
+ * (at 9600 baud, one byte takes about 1 ms), but wait at most 1111 ms. */
+static int64_t rg15reqts;
+static int rg15lastpending;
+static int job_rg15(const struct schedjob * j, int stepno)
+{
+  if (stepno == 0) {
+    rg15_requestread();
+    rg15reqts = esp_timer_get_time();
+    rg15lastpending = 0;
+    return 50;
+  }
+  int pending = rg15_pendingbytes();
+  if (((pending == 0) || (pending != rg15lastpending))
+   && ((esp_timer_get_time() - rg15reqts) < 1111000)) {
+    rg15lastpending = pending;
+    return 30;
+  }
+  float raing = rg15_readraincount();
+  taskENTER_CRITICAL(&sresspinlock);
+  sres.raing = raing;
+  sres.cycle[SRES_RAIN] = j->cycle;
+  taskEXIT_CRITICAL(&sresspinlock);
+  return SCHED_DONE;
+}
+
+static int job_ltr390(const struct schedjob * j, int stepno)
+{
+  if (stepno == 0) {
+    /* Read UV index and switch to ambient light measurement */
+    float uvind = ltr390_readuv();
+    taskENTER_CRITICAL(&sresspinlock);
+    sres.uvind = uvind;
+    sres.cycle[SRES_UV] = j->cycle;
+    taskEXIT_CRITICAL(&sresspinlock);
+    ltr390_startalmeas();
+    /* If it is not quite done by then, ltr390_readal() waits. */
+    return 410;
+  }
+  /* Read Ambient Light in Lux and switch right back to UV mode */
+  float lux = ltr390_readal();
+  taskENTER_CRITICAL(&sresspinlock);
+  sres.lux = lux;
+  sres.cycle[SRES_LUX] = j->cycle;
+  taskEXIT_CRITICAL(&sresspinlock);
+  ltr390_startuvmeas();
+  return SCHED_DONE;
+}
+
+static int job_sen50(const struct schedjob * j, int stepno)
+{
+  struct sen50data pmdata;
+  sen50_read(&pmdata);
+  taskENTER_CRITICAL(&sresspinlock);
+  sres.pmdata = pmdata;
+  sres.cycle[SRES_PM] = j->cycle;
+  taskEXIT_CRITICAL(&sresspinlock);
+  return SCHED_DONE;
+}
+
+static int job_wind(const struct schedjob * j, int stepno)
+{
+  uint16_t wsctr = ws_readanemometer();
+  /* We'll need this extra timestamp to calculate windspeed from number of pulses */
+  time_t curanemomread = time(NULL);
+  if ((lastanemomread != 0) && (curanemomread > lastanemomread)) {
+    /* Ignore the first read on startup, but other than that, we
+     * really have no way of telling if a reading is valid or not.
+     * Calculate Wind Speed in km/h from the number of impulses and
+     * the timestamp difference */
+    float windspeed = 2.4 * wsctr / (curanemomread - lastanemomread);
+    float windspmax = ws_readpeakws();
+    taskENTER_CRITICAL(&sresspinlock);
+    sres.windspeed = windspeed;
+    sres.windspmax = windspmax;
+    sres.windvalid = 1;
+    sres.cycle[SRES_WIND] = j->cycle;
+    taskEXIT_CRITICAL(&sresspinlock);
+  }
+  lastanemomread = curanemomread;
+  uint8_t wsdir = ws_readwinddirection();
+  taskENTER_CRITICAL(&sresspinlock);
+  sres.wsdir = wsdir;
+  sres.cycle[SRES_WINDDIR] = j->cycle;
+  taskEXIT_CRITICAL(&sresspinlock);
+  return SCHED_DONE;
+}
+
+/* Step 0 starts a measurement, step 1 reads it. */
+static int sht4xwantheat = 0;
+static int job_sht4x(const struct schedjob * j, int stepno)
+{
+  if (stepno == 0) {
+    sht4x_startmeas();
+    /* A high precision measurement takes 8.3 ms. */
+    return 10;
+  }
+  struct sht4xdata temphum;
+  sht4x_read(&temphum);
+  taskENTER_CRITICAL(&sresspinlock);
+  sres.temphum = temphum;
+  sres.cycle[SRES_TEMPHUM] = j->cycle;
+  taskEXIT_CRITICAL(&sresspinlock);
+  if (temphum.valid <= 0) {
+    return SCHED_DONE;
+  }
+  if (temphum.hum >= TOOWETTHRESHOLD) { /* This will cause creep */
+    too_wet_ctr++;
+  }
+  /* creep mitigation through the integrated heater in the SHT4x.
+   * This is inside temphum.valid on purpose: If we cannot communicate
+   * with the sensor to read it, we probably cannot tell it to heat
+   * either... */
+  if (((too_wet_ctr > 60)
+    && (temphum.temp >= 4.0) && (temphum.temp <= 60.0)
+    && (temphum.hum <= 75.0)
+    && ((time(NULL) - lastsht4xheat) > 10))
+   || (forcesht4xheater > 0)) {
+    /* It has been very wet for a long time, temperature is suitable
+     * for heating, and heater has not been on in last 10 minutes.
+     * Or someone clicked on 'force heater on' in the Web-Interface. */
+    sht4xwantheat = 1;
+  }
+  return SCHED_DONE;
+}
+
+/* The heater cycles, if the SHT4x job decided they are needed. This is
+ * a job of its own that starts well after the measurements, so it
+ * cannot delay the record, and it runs in the same lane as the SHT4x
+ * job, so it can never overlap with a measurement. */
+static int job_sht4xheat(const struct schedjob * j, int stepno)
+{
+  if (sht4xwantheat == 0) {
+    return SCHED_DONE;
+  }
+  sht4x_heatercycle();
+  if (stepno < (HEATERITS - 1)) {
+    return 1500;
+  }
+  lastsht4xheat = time(NULL);
+  too_wet_ctr -= 30;
+  forcesht4xheater = 0;
+  sht4xwantheat = 0;
+  return SCHED_DONE;
+}
+
+/* Collects the results of all the sensor jobs for record cycle cycle
+ * into one record, and hands that to everyone who wants it. */
+static void makerecord(uint32_t cycle)
+{
+  struct sresults r;
+  sres_take(cycle, &r);
+  time_t lastmeasts = time(NULL);
+  /* struct ev is defined in webserver.h for practical reasons. */
+  struct ev nev;
+  nev.lastupd = lastmeasts;
+  /* The heater job only turns on the heater after this, so it cannot
+   * affect this measurement, only the next one. And the whole point
+   * of that timestamp is to allow users to see whether a heating
+   * might have influenced the measurements. */
+  nev.lastsht4xheat = lastsht4xheat;
+
+  /* All measurements of this cycle are collected in this batch,
+   * and then submitted in one go at the end of the cycle. */
+  struct submitbatch sb;
+  submitbatch_init(&sb, lastmeasts);
+  if (r.press > 0) {
+    ESP_LOGI(TAG, "Measured pressure: %.3f hPa, calculated pressure at sea level (FIXME better formula): %.3f hPa",
+                  r.press, reducedairpressurecalc(r.press));
+    /* submit that measurement */
+    nev.press = r.press;
+    submitbatch_add(&sb, SUBMITFIELD_PRESSURE, r.press);
+  } else {
+    nev.press = NAN;
+  }
+
+  if (r.raing > -0.1) {
+    ESP_LOGI(TAG, "Rain: %.3f mm", r.raing);
+    submitbatch_add(&sb, SUBMITFIELD_RAIN, r.raing);
+    nev.raing = r.raing;
+  } else {
+    nev.raing = NAN;
+  }
+
+  if (r.windvalid) {
+    ESP_LOGI(TAG, "Wind speed: %.2f km/h, Peak: %.2f km/h", r.windspeed, r.windspmax);
+    submitbatch_add(&sb, SUBMITFIELD_WINDSPEED, r.windspeed);
+    submitbatch_add(&sb, SUBMITFIELD_WINDSPMAX, r.windspmax);
+    nev.windspeed = r.windspeed;
+    nev.windspmax = r.windspmax;
+  } else {
+    nev.windspeed = NAN;
+    nev.windspmax = NAN;
+  }
+
+  if (r.wsdir < 16) { /* Only Range 0-15 is valid */
+    char * winddirmap[16] = { "N", "NNE", "NE", "ENE", "E", "ESE", "SE", "SSE", "S", "SSW", "SW", "WSW", "W", "WNW", "NW", "NNW" };
+    ESP_LOGI(TAG, "Wind direction: %d (%s)", r.wsdir, winddirmap[r.wsdir]);
+    submitbatch_add(&sb, SUBMITFIELD_WINDDIR, (float)r.wsdir * 22.5);
+    nev.winddirdeg = (float)r.wsdir * 22.5;
+    strcpy(nev.winddirtxt, winddirmap[r.wsdir]);
+  } else {
+    nev.winddirdeg = -1;
+    strcpy(nev.winddirtxt, "N/A");
+  }
+
+  if (r.temphum.valid > 0) {
+    ESP_LOGI(TAG, "Temperature: %.2f degC (raw: %x)", r.temphum.temp, r.temphum.tempraw);
+    ESP_LOGI(TAG, "Humidity: %.2f %% (raw: %x)", r.temphum.hum, r.temphum.humraw);
+    submitbatch_add(&sb, SUBMITFIELD_TEMPERATURE, r.temphum.temp);
+    submitbatch_add(&sb, SUBMITFIELD_HUMIDITY, r.temphum.hum);
+    nev.temp = r.temphum.temp;
+    nev.hum = r.temphum.hum;
+  } else {
+    nev.temp = NAN;
+    nev.hum = NAN;
+  }
+
+  if (r.pmdata.valid > 0) {
+    ESP_LOGI(TAG, "PM 1.0: %.1f (raw: %x)", r.pmdata.pm010, r.pmdata.pm010raw);
+    ESP_LOGI(TAG, "PM 2.5: %.1f (raw: %x)", r.pmdata.pm025, r.pmdata.pm025raw);
+    ESP_LOGI(TAG, "PM 4.0: %.1f (raw: %x)", r.pmdata.pm040, r.pmdata.pm040raw);
+    ESP_LOGI(TAG, "PM10.0: %.1f (raw: %x)", r.pmdata.pm100, r.pmdata.pm100raw);
+    submitbatch_add(&sb, SUBMITFIELD_PM010, r.pmdata.pm010);
+    submitbatch_add(&sb, SUBMITFIELD_PM025, r.pmdata.pm025);
+    submitbatch_add(&sb, SUBMITFIELD_PM040, r.pmdata.pm040);
+    submitbatch_add(&sb, SUBMITFIELD_PM100, r.pmdata.pm100);
+    nev.pm010 = r.pmdata.pm010;
+    nev.pm025 = r.pmdata.pm025;
+    nev.pm040 = r.pmdata.pm040;
+    nev.pm100 = r.pmdata.pm100;
+  } else {
+    nev.pm010 = NAN;
+    nev.pm025 = NAN;
+    nev.pm040 = NAN;
+    nev.pm100 = NAN;
+  }
+
+  if (r.uvind >= 0.0) {
+    ESP_LOGI(TAG, "UV-Index: %.2f", r.uvind);
+    submitbatch_add(&sb, SUBMITFIELD_UV, r.uvind);
+    nev.uvind = r.uvind;
+  } else {
+    nev.uvind = NAN;
+  }
+
+  if (r.lux >= 0.0) {
+    ESP_LOGI(TAG, "Ambient light/Illuminance: %.2f lux", r.lux);
+    submitbatch_add(&sb, SUBMITFIELD_ILLUMINANCE, r.lux);
+    nev.lux = r.lux;
+  } else {
+    nev.lux = NAN;
+  }
+
+  /* Now hand the new values to the webserver */
+  webserver_publish(&nev);
+  history_add(&nev);
+
+  /* Local dashboards get the values right away, via UDP. */
+  influx_send(&nev);
+
+  /* Hand the measurements over to the uploader task. This does
+   * not wait for the network, so a flaky uplink cannot delay
+   * our next measurement. */
+  submit_enqueue(&sb);
+}
+
+/* All sensors are measured once per minute, all at the same time.
+ * The jobs are spread over lanes (tasks) so that both I2C buses and
+ * the UART can be busy at the same time. */
+#define MEASINTERVAL 60000
+#define HEATEROFFSET 5000
+enum schedlanes {
+  LANE_I2C0 = 0, /* SEN50 */
+  LANE_I2C1, /* LPS25HB, LTR390, SHT4x */
+  LANE_OTHER /* RG15 (UART), wind sensors (GPIO, ADC) */
+};
+static struct schedjob sensorjobs[] = {
+  { .name = "sen50",     .periodms = MEASINTERVAL, .offsetms = 0, .lane = LANE_I2C0, .feedsrecord = 1, .step = job_sen50 },
+  { .name = "ltr390",    .periodms = MEASINTERVAL, .offsetms = 0, .lane = LANE_I2C1, .feedsrecord = 1, .step = job_ltr390 },
+  { .name = "sht4x",     .periodms = MEASINTERVAL, .offsetms = 0, .lane = LANE_I2C1, .feedsrecord = 1, .step = job_sht4x },
+  { .name = "lps25hb",   .periodms = MEASINTERVAL, .offsetms = 0, .lane = LANE_I2C1, .feedsrecord = 1, .step = job_lps25hb },
+  { .name = "rg15",      .periodms = MEASINTERVAL, .offsetms = 0, .lane = LANE_OTHER, .feedsrecord = 1, .step = job_rg15 },
+  { .name = "wind",      .periodms = MEASINTERVAL, .offsetms = 0, .lane = LANE_OTHER, .feedsrecord = 1, .step = job_wind },
+  { .name = "sht4xheat", .periodms = MEASINTERVAL, .offsetms = HEATEROFFSET, .lane = LANE_I2C1, .feedsrecord = 0, .step = job_sht4xheat },
+};
+
 void app_main(void)
 {
-    memset(evs, 0, sizeof(evs));
-    time_t lastmeasts = 0;
-    time_t lastsht4xheat = 0;
-    time_t lastanemomread = 0;
     /* Initialize the windsensor. */
     ws_init();
     /* This is in all OTA-Update examples, so I consider it mandatory.
@@ -131,9 +483,15 @@ void app_main(void)
       }
     }
 
+    /* The history needs to exist before the webserver can serve it */
+    history_init();
+
     /* now start the webserver */
     webserver_start();
 
+    /* and the task that uploads our measurements in the background */
+    submit_start();
+
     vTaskDelay(pdMS_TO_TICKS(3000)); /* Mainly to give the RG15 a chance to */
     /* process our initialization sequence, though that doesn't always work. */
     /* Wait for up to 4 more seconds to connect to WiFi and get an IP */
@@ -147,221 +505,22 @@ void app_main(void)
       ESP_LOGW(TAG, "Warning: Could not connect to network. This is probably not good.");
     }
 
+    /* From now on, the measurements happen in the sensor jobs. */
+    for (int i = 0; i < (sizeof(sensorjobs) / sizeof(sensorjobs[0])); i++) {
+      sched_add(&sensorjobs[i]);
+    }
+    sched_start();
+
     while (1) {
-      if (lastmeasts > time(NULL)) { /* This should not be possible, but we've
-         * seen time(NULL) temporarily report insane timestamps far in the
-         * future - not sure why, possibly after a watchdog reset, but in any
-         * case, lets try to work around it: */
-        ESP_LOGE(TAG, "Lets do the time warp again: Time jumped backwards - trying to cope.");
-        lastmeasts = time(NULL); // We should return to normal measurements in 60s
-      }
-      if (((time(NULL) - lastmeasts) >= 60)
-        || (lastmeasts == 0)) { /* time() starts at 0 on startup, so we need this special case. */
-        lastmeasts = time(NULL);
-
-        /* Request update from the sensors that don't autoupdate all the time */
-        rg15_requestread();
-        sht4x_startmeas();
-        /* Read UV index and switch to ambient light measurement */
-        float uvind = ltr390_readuv();
-        ltr390_startalmeas();
-
-        /* slight delay to allow the RG15 to reply */
-        vTaskDelay(pdMS_TO_TICKS(1111));
-
-        /* Read all the sensors */
-        float press = lps25hb_readpressure();
-        float raing = rg15_readraincount();
-        uint16_t wsctr = ws_readanemometer();
-        /* We'll need this extra timestamp to calculate windspeed from number of pulses */
-        time_t curanemomread = time(NULL);
-        uint8_t wsdir = ws_readwinddirection();
-        struct sht4xdata temphum;
-        sht4x_read(&temphum);
-        struct sen50data pmdata;
-        sen50_read(&pmdata);
-        /* Read Ambient Light in Lux (may block for up to 500 ms!) and switch
-         * right back to UV mode */
-        float lux = ltr390_readal();
-        ltr390_startuvmeas();
-
-        int naevs = (activeevs == 0) ? 1 : 0;
-        evs[naevs].lastupd = lastmeasts;
-        /* The following is before we potentially turn on the heater and update
-         * lastsht4xheat on purpose: We will only turn on the heater AFTER the
-         * measurements, so it cannot affect that measurement, only the next
-         * one. And the whole point of that timestamp is to allow users to
-         * see whether a heating might have influenced the measurements. */
-        evs[naevs].lastsht4xheat = lastsht4xheat;
-
-        /* We will now start to submit our measurements, so we need
-         * a working network connection. Potentially wait for up to
-         * 4 more seconds if we haven't got an IP address yet */
-        xEventGroupWaitBits(network_event_group, NETWORK_CONNECTED_BIT,
-                            pdFALSE, pdFALSE,
-                            (4000 / portTICK_PERIOD_MS));
-        if (press > 0) {
-          ESP_LOGI(TAG, "Measured pressure: %.3f hPa, calculated pressure at sea level (FIXME better formula): %.3f hPa",
-                        press, reducedairpressurecalc(press));
-          /* submit that measurement */
-          evs[naevs].press = press;
-          submit_to_wpd(CONFIG_ZAMDACH_WPDSID_PRESSURE, press);
-          submit_to_opensensemap(CONFIG_ZAMDACH_OSM_BOXID, CONFIG_ZAMDACH_OSMSID_PRESSURE, press);
-        } else {
-          evs[naevs].press = NAN;
-        }
-
-        if (raing > -0.1) {
-          ESP_LOGI(TAG, "Rain: %.3f mm", raing);
-          submit_to_wpd(CONFIG_ZAMDACH_WPDSID_RAINGAUGE1, raing);
-          //FIXME not yet, values not sane
-          //submit_to_opensensemap(CONFIG_ZAMDACH_OSM_BOXID, CONFIG_ZAMDACH_OSMSID_RAINGAUGE1, raing);
-          evs[naevs].raing = raing;
-        } else {
-          evs[naevs].raing = NAN;
-        }
-
-        if (lastanemomread != 0) { /* Ignore the first read on startup, but other */
-          /* than that, we really have no way of telling if a reading is valid or not */
-          int tsdif = curanemomread - lastanemomread;
-          /* calculate Wind Speed in km/h from the number of impulses and the timestamp difference */
-          float windspeed = 2.4 * wsctr / tsdif;
-          float peakws = ws_readpeakws();
-          ESP_LOGI(TAG, "Wind speed: %.2f km/h, Peak: %.2f km/h", windspeed, peakws);
-          struct osm wsosm[2];
-          wsosm[0].sensorid = CONFIG_ZAMDACH_WPDSID_WINDSPEED;
-          wsosm[0].value = windspeed;
-          wsosm[1].sensorid = CONFIG_ZAMDACH_WPDSID_WINDSPMAX;
-          wsosm[1].value = peakws;
-          submit_to_wpd_multi(2, wsosm);
-          /* We just reuse the struct, overwriting just the sensorid. */
-          wsosm[0].sensorid = CONFIG_ZAMDACH_OSMSID_WINDSPEED;
-          wsosm[1].sensorid = CONFIG_ZAMDACH_OSMSID_WINDSPMAX;
-          submit_to_opensensemap_multi(CONFIG_ZAMDACH_OSM_BOXID, 2, wsosm);
-          evs[naevs].windspeed = windspeed;
-          evs[naevs].windspmax = peakws;
-        } else {
-          evs[naevs].windspeed = NAN;
-          evs[naevs].windspmax = NAN;
-        }
-        lastanemomread = curanemomread;
-
-        if (wsdir < 16) { /* Only Range 0-15 is valid */
-          char * winddirmap[16] = { "N", "NNE", "NE", "ENE", "E", "ESE", "SE", "SSE", "S", "SSW", "SW", "WSW", "W", "WNW", "NW", "NNW" };
-          ESP_LOGI(TAG, "Wind direction: %d (%s)", wsdir, winddirmap[wsdir]);
-          submit_to_wpd(CONFIG_ZAMDACH_WPDSID_WINDDIR, (float)wsdir * 22.5);
-          submit_to_opensensemap(CONFIG_ZAMDACH_OSM_BOXID, CONFIG_ZAMDACH_OSMSID_WINDDIR, (float)wsdir * 22.5);
-          evs[naevs].winddirdeg = (float)wsdir * 22.5;
-          strcpy(evs[naevs].winddirtxt, winddirmap[wsdir]);
-        } else {
-          evs[naevs].winddirdeg = -1;
-          strcpy(evs[naevs].winddirtxt, "N/A");
-        }
-
-        if (temphum.valid > 0) {
-          ESP_LOGI(TAG, "Temperature: %.2f degC (raw: %x)", temphum.temp, temphum.tempraw);
-          ESP_LOGI(TAG, "Humidity: %.2f %% (raw: %x)", temphum.hum, temphum.humraw);
-          if (temphum.hum >= TOOWETTHRESHOLD) { /* This will cause creep */
-            too_wet_ctr++;
-          }
-          /* creep mitigation through the integrated heater in the SHT4x.
-           * This is inside temphum.valid on purpose: If we cannot communicate
-           * with the sensor to read it, we probably cannot tell it to heat
-           * either... */
-          if (((too_wet_ctr > 60)
-            && (temphum.temp >= 4.0) && (temphum.temp <= 60.0)
-            && (temphum.hum <= 75.0)
-            && ((time(NULL) - lastsht4xheat) > 10))
-           || (forcesht4xheater > 0)) {
-            /* It has been very wet for a long time, temperature is suitable
-             * for heating, and heater has not been on in last 10 minutes.
-             * Or someone clicked on 'force heater on' in the Web-Interface. */
-            for (int i = 0; i < HEATERITS; i++) {
-              if (i != 0) { vTaskDelay(pdMS_TO_TICKS(1500)); }
-              sht4x_heatercycle();
-            }
-            lastsht4xheat = time(NULL);
-            too_wet_ctr -= 30;
-            forcesht4xheater = 0;
-          }
-          struct osm thosm[2];
-          thosm[0].sensorid = CONFIG_ZAMDACH_WPDSID_TEMPERATURE;
-          thosm[0].value = temphum.temp;
-          thosm[1].sensorid = CONFIG_ZAMDACH_WPDSID_HUMIDITY;
-          thosm[1].value = temphum.hum;
-          submit_to_wpd_multi(2, thosm);
-          /* We'll just reuse the struct. No need to set 'value' again. */
-          thosm[0].sensorid = CONFIG_ZAMDACH_OSMSID_TEMPERATURE;
-          thosm[1].sensorid = CONFIG_ZAMDACH_OSMSID_HUMIDITY;
-          submit_to_opensensemap_multi(CONFIG_ZAMDACH_OSM_BOXID, 2, thosm);
-          evs[naevs].temp = temphum.temp;
-          evs[naevs].hum = temphum.hum;
-        } else {
-          evs[naevs].temp = NAN;
-          evs[naevs].hum = NAN;
-        }
-
-        if (pmdata.valid > 0) {
-          ESP_LOGI(TAG, "PM 1.0: %.1f (raw: %x)", pmdata.pm010, pmdata.pm010raw);
-          ESP_LOGI(TAG, "PM 2.5: %.1f (raw: %x)", pmdata.pm025, pmdata.pm025raw);
-          ESP_LOGI(TAG, "PM 4.0: %.1f (raw: %x)", pmdata.pm040, pmdata.pm040raw);
-          ESP_LOGI(TAG, "PM10.0: %.1f (raw: %x)", pmdata.pm100, pmdata.pm100raw);
-          struct osm pmdosm[4];
-          pmdosm[0].sensorid = CONFIG_ZAMDACH_WPDSID_PM010;
-          pmdosm[0].value = pmdata.pm010;
-          pmdosm[1].sensorid = CONFIG_ZAMDACH_WPDSID_PM025;
-          pmdosm[1].value = pmdata.pm025;
-          pmdosm[2].sensorid = CONFIG_ZAMDACH_WPDSID_PM040;
-          pmdosm[2].value = pmdata.pm040;
-          pmdosm[3].sensorid = CONFIG_ZAMDACH_WPDSID_PM100;
-          pmdosm[3].value = pmdata.pm100;
-          submit_to_wpd_multi(4, pmdosm);
-          /* We'll just reuse the struct. No need to set 'value' again. */
-          pmdosm[0].sensorid = CONFIG_ZAMDACH_OSMSID_PM010;
-          pmdosm[1].sensorid = CONFIG_ZAMDACH_OSMSID_PM025;
-          pmdosm[2].sensorid = CONFIG_ZAMDACH_OSMSID_PM040;
-          pmdosm[3].sensorid = CONFIG_ZAMDACH_OSMSID_PM100;
-          submit_to_opensensemap_multi(CONFIG_ZAMDACH_OSM_BOXID, 4, pmdosm);
-          evs[naevs].pm010 = pmdata.pm010;
-          evs[naevs].pm025 = pmdata.pm025;
-          evs[naevs].pm040 = pmdata.pm040;
-          evs[naevs].pm100 = pmdata.pm100;
-        } else {
-          evs[naevs].pm010 = NAN;
-          evs[naevs].pm025 = NAN;
-          evs[naevs].pm040 = NAN;
-          evs[naevs].pm100 = NAN;
-        }
-
-        if (uvind >= 0.0) {
-          ESP_LOGI(TAG, "UV-Index: %.2f", uvind);
-          submit_to_wpd(CONFIG_ZAMDACH_WPDSID_UV, uvind);
-          //FIXME not yet, values not sane
-          //submit_to_opensensemap(CONFIG_ZAMDACH_OSM_BOXID, CONFIG_ZAMDACH_OSMSID_UV, uvind);
-          evs[naevs].uvind = uvind;
-        } else {
-          evs[naevs].uvind = NAN;
-        }
-
-        if (lux >= 0.0) {
-          ESP_LOGI(TAG, "Ambient light/Illuminance: %.2f lux", lux);
-          submit_to_wpd(CONFIG_ZAMDACH_WPDSID_ILLUMINANCE, lux);
-          submit_to_opensensemap(CONFIG_ZAMDACH_OSM_BOXID, CONFIG_ZAMDACH_OSMSID_ILLUMINANCE, lux);
-          evs[naevs].lux = lux;
-        } else {
-          evs[naevs].lux = NAN;
-        }
-
-        /* Now mark the updated values as the current ones for the webserver */
-        activeevs = naevs;
-
-        long howmuchtosleep = (lastmeasts + 60) - time(NULL) - 1;
-        if ((howmuchtosleep < 0) || (howmuchtosleep > 60)) { howmuchtosleep = 60; }
-        ESP_LOGI(TAG, "will now wait for %ld seconds before doing the next update", howmuchtosleep);
-        vTaskDelay(pdMS_TO_TICKS(howmuchtosleep * 1000));
-      } else { // Delay for a short time
-        vTaskDelay(pdMS_TO_TICKS(1000));
+      /* Normally, this returns a few hundred ms after the start of
+       * every cycle. If a sensor hangs, we make the record without it. */
+      uint32_t cycle;
+      if (sched_waitcycle(MEASINTERVAL + 10000, &cycle) != 0) {
+        ESP_LOGW(TAG, "Not all sensors delivered in time, making the record without them.");
       }
+      struct schedwindowstats win;
+      sched_getwindow(&win);
+      ESP_LOGI(TAG, "Measurement window: %lu ms", (unsigned long)win.lastms);
+      makerecord(cycle);
     }
 }
-
@@ -0,0 +1,89 @@
+/* ZAMDACH2022 host tests
+ * Micro-benchmark: how long a /history query takes with a full ring
+ * (24 hours), from the first row to the last chunk. The chunks are
+ * copied into a send buffer the way webserver_flushchunk() hands them
+ * to httpd_resp_send_chunk(). This runs on the PC, so only the ratios
+ * mean anything. An ESP32 at 80 MHz is a few hundred times slower in
+ * absolute terms. */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "history.h"
+
+#define ROUNDS 200
+
+static char sendbuf[1500];
+/* Keeps the compiler from optimizing the loops away. */
+static volatile size_t sink;
+
+/* Same condition as webserver_flushchunk() */
+static void flush(struct sbuf * sb, void * ctx)
+{
+  if (sb->len > (sb->cap - 250)) {
+    memcpy(sendbuf, sb->buf, sb->len);
+    sink += sb->len;
+    sbuf_init(sb, sb->buf, sb->cap);
+  }
+}
+
+/* Returns ns per query, and the bytes one query sends in *bytes. */
+static double bench(const struct histquery * q, size_t * bytes)
+{
+  char outbuf[600];
+  struct sbuf sb;
+  struct timespec t0, t1;
+  size_t s0 = sink;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (int i = 0; i < ROUNDS; i++) {
+    sbuf_init(&sb, outbuf, sizeof(outbuf));
+    history_query(q, &sb, flush, NULL);
+    memcpy(sendbuf, sb.buf, sb.len);
+    sink += sb.len;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  *bytes = (sink - s0) / ROUNDS;
+  return ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) / ROUNDS;
+}
+
+static void report(const char * name, const struct histquery * q)
+{
+  size_t bytes;
+  double ns = bench(q, &bytes);
+  printf("%-26s %8.0f us per query, %7zu bytes, %6.0f ns per stored row\n",
+         name, ns / 1000.0, bytes, ns / HISTORY_ROWS);
+}
+
+int main(void)
+{
+  struct ev e;
+  history_init();
+  memset(&e, 0, sizeof(e));
+  for (int i = 0; i < HISTORY_ROWS; i++) {
+    e.lastupd = 1700000000 + i * 60;
+    e.temp = 15.0 + (i % 100) / 10.0;
+    e.hum = 60.0 + (i % 37) / 3.0;
+    e.press = 1013.25 - (i % 50) / 7.0;
+    e.pm010 = 1.2; e.pm025 = 2.5; e.pm040 = 4.1; e.pm100 = 10.3;
+    e.lux = (i % 720) * 100.5;
+    e.uvind = (i % 720) / 100.0;
+    e.raing = (i % 10) * 0.25;
+    e.windspeed = (i % 30) / 2.0;
+    e.windspmax = (i % 30) / 1.5;
+    e.winddirdeg = (i * 7) % 360;
+    history_add(&e);
+  }
+  struct histquery all = { .from = 0, .to = UINT32_MAX, .nf = HISTFIELD_COUNT };
+  for (int f = 0; f < HISTFIELD_COUNT; f++) { all.fields[f] = f; }
+  report("all fields, CSV", &all);
+  all.binary = 1;
+  report("all fields, binary", &all);
+  /* A narrow query: one field, the last hour. All rows are still
+   * looked at. */
+  struct histquery one = { .from = 1700000000 + (HISTORY_ROWS - 60) * 60, .to = UINT32_MAX,
+                           .nf = 1, .fields = { HISTFIELD_TEMP } };
+  report("temp, last hour, CSV", &one);
+  one.binary = 1;
+  report("temp, last hour, binary", &one);
+  return 0;
+}
@@ -0,0 +1,89 @@
+/* ZAMDACH2022 host tests
+ * Micro-benchmark: builds an opensensemap payload with all our fields
+ * the way submit.c did it before sbuf (strcat and sprintf into the end
+ * of the string, so every append rescans what is already there), and
+ * with sbuf. This runs on the PC, so only the ratio means anything.
+ * An ESP32 at 80 MHz is a few hundred times slower in absolute terms. */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "sbuf.h"
+
+#define NVALUES 13
+#define ROUNDS 200000
+
+static const char * sids[NVALUES];
+static float values[NVALUES];
+static char out[1024];
+/* Keeps the compiler from optimizing the loops away. */
+static volatile size_t sink;
+
+static void build_old(void)
+{
+  strcpy(out, "[");
+  for (int i = 0; i < NVALUES; i++) {
+    sprintf(&out[strlen(out)], "{\"sensor\":\"%s\",\"value\":\"%.3f\"},",
+            sids[i], values[i]);
+  }
+  out[strlen(out) - 1] = ']';
+  sink += strlen(out);
+}
+
+static void build_sbuf(void)
+{
+  struct sbuf sb;
+  sbuf_init(&sb, out, sizeof(out));
+  sbuf_putc(&sb, '[');
+  for (int i = 0; i < NVALUES; i++) {
+    if (i != 0) { sbuf_putc(&sb, ','); }
+    sbuf_puts(&sb, "{\"sensor\":\"");
+    sbuf_puts(&sb, sids[i]);
+    sbuf_puts(&sb, "\",\"value\":\"");
+    sbuf_putfloat(&sb, values[i], 3);
+    sbuf_puts(&sb, "\"}");
+  }
+  sbuf_putc(&sb, ']');
+  sink += sb.len;
+}
+
+static double nowns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (ts.tv_sec * 1.0e9) + ts.tv_nsec;
+}
+
+static double bench(const char * name, void (*fn)(void))
+{
+  double start = nowns();
+  for (int r = 0; r < ROUNDS; r++) {
+    fn();
+  }
+  double ns = (nowns() - start) / ROUNDS;
+  printf("%-8s %8.0f ns per payload (%u bytes)\n", name, ns, (unsigned)strlen(out));
+  return ns;
+}
+
+int main(void)
+{
+  static char sidbuf[NVALUES][25];
+  for (int i = 0; i < NVALUES; i++) {
+    snprintf(sidbuf[i], sizeof(sidbuf[i]), "5f3c%020d", i * 7919);
+    sids[i] = sidbuf[i];
+    values[i] = -12.345f + (i * 83.21f);
+  }
+  /* Both have to produce the same payload, or comparing is pointless. */
+  char ref[sizeof(out)];
+  build_old();
+  strcpy(ref, out);
+  build_sbuf();
+  if (strcmp(ref, out) != 0) {
+    printf("payloads differ:\n%s\n%s\n", ref, out);
+    return 1;
+  }
+  double told = bench("strcat", build_old);
+  double tnew = bench("sbuf", build_sbuf);
+  printf("sbuf takes %.0f%% of the time of strcat/sprintf\n", 100.0 * tnew / told);
+  return 0;
+}
@@ -0,0 +1,282 @@
+/* ZAMDACH2022 host tests
+ * Benchmark: what TLS session resumption saves per new connection.
+ * submit.c talks to a local TLS server through a backend that does
+ * with OpenSSL what the esp-tls backend does with mbedTLS: keep the
+ * session of the last connection to every destination, and offer it
+ * on the next connect. esp-tls cannot run on the PC, so this cannot
+ * be the real backend. The server says "Connection: close" after
+ * every reply, so every request needs a new connection - the worst
+ * case, which is what the uploads see when a server drops idle
+ * connections between our measurement cycles.
+ * Like on the device, this is TLS 1.2 with an ECDSA P-256 certificate
+ * that the client verifies. This runs on the PC, so only the ratio
+ * means anything: an ESP32 at 80 MHz needs about a second for the
+ * full handshake, nearly all of it the asymmetric crypto that a
+ * resumed session skips. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+#include "backlog.h"
+#include "network.h"
+#include "submit.h"
+
+#define CYCLES 300
+
+/* submit.c waits for the network on this. */
+EventGroupHandle_t network_event_group;
+/* influx.c, which the uploader task calls, puts this into its lines. */
+char chipid[30] = "testchip";
+
+/* No backlog partition on the host. */
+esp_err_t backlog_init(void)
+{
+  return ESP_ERR_NOT_FOUND;
+}
+
+static EVP_PKEY * key;
+static X509 * cert;
+static SSL_CTX * srvctx;
+static SSL_CTX * clictx;
+static int srvport;
+
+static int64_t nowus(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Otherwise Nagle and delayed ACKs make every request take 40 ms. */
+static void nodelay(int fd)
+{
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+static void die(const char * what)
+{
+  fprintf(stderr, "bench_tlsresume: %s failed\n", what);
+  ERR_print_errors_fp(stderr);
+  exit(1);
+}
+
+/* A self-signed certificate for the server, which the client trusts. */
+static void mkcert(void)
+{
+  key = EVP_EC_gen("P-256");
+  cert = X509_new();
+  if ((key == NULL) || (cert == NULL)) { die("key generation"); }
+  X509_set_version(cert, 2);
+  ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+  X509_gmtime_adj(X509_getm_notBefore(cert), -3600);
+  X509_gmtime_adj(X509_getm_notAfter(cert), 86400);
+  X509_NAME * name = X509_get_subject_name(cert);
+  X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char *)"localhost", -1, -1, 0);
+  X509_set_issuer_name(cert, name);
+  X509_set_pubkey(cert, key);
+  if (X509_sign(cert, key, EVP_sha256()) == 0) { die("X509_sign"); }
+}
+
+/* The server: one connection at a time, one request per connection. */
+static void * server(void * arg)
+{
+  int ls = *(int *)arg;
+  char buf[8192];
+  while (1) {
+    int fd = accept(ls, NULL, NULL);
+    if (fd < 0) { continue; }
+    nodelay(fd);
+    SSL * ssl = SSL_new(srvctx);
+    SSL_set_fd(ssl, fd);
+    if (SSL_accept(ssl) == 1) {
+      size_t len = 0;
+      char * eoh = NULL;
+      long clen = -1;
+      while (len < sizeof(buf) - 1) {
+        int n = SSL_read(ssl, &buf[len], sizeof(buf) - 1 - len);
+        if (n <= 0) { break; }
+        len += n;
+        buf[len] = 0;
+        if (eoh == NULL) {
+          eoh = strstr(buf, "\r\n\r\n");
+          if (eoh != NULL) {
+            char * cl = strstr(buf, "\r\nContent-Length: ");
+            clen = (cl != NULL) ? strtol(cl + 18, NULL, 10) : 0;
+          }
+        }
+        if ((eoh != NULL) && (len >= (size_t)(eoh + 4 - buf) + clen)) {
+          static const char reply[] = "HTTP/1.1 200 OK\r\n"
+                                      "Content-Length: 0\r\n"
+                                      "Connection: close\r\n\r\n";
+          SSL_write(ssl, reply, strlen(reply));
+          break;
+        }
+      }
+      SSL_shutdown(ssl);
+    }
+    SSL_free(ssl);
+    close(fd);
+  }
+  return NULL;
+}
+
+static void startserver(void)
+{
+  srvctx = SSL_CTX_new(TLS_server_method());
+  SSL_CTX_set_max_proto_version(srvctx, TLS1_2_VERSION);
+  if ((SSL_CTX_use_certificate(srvctx, cert) != 1)
+   || (SSL_CTX_use_PrivateKey(srvctx, key) != 1)) {
+    die("server setup");
+  }
+  static int ls;
+  ls = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in sa = { .sin_family = AF_INET };
+  sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t salen = sizeof(sa);
+  if ((bind(ls, (struct sockaddr *)&sa, salen) != 0)
+   || (listen(ls, 4) != 0)
+   || (getsockname(ls, (struct sockaddr *)&sa, &salen) != 0)) {
+    die("listen");
+  }
+  srvport = ntohs(sa.sin_port);
+  pthread_t t;
+  pthread_create(&t, NULL, server, &ls);
+  pthread_detach(t);
+}
+
+/* The client backend. */
+struct benchconn {
+  SSL * ssl;
+  int fd;
+};
+static struct benchconn conns[SUBMITDEST_COUNT];
+static SSL_SESSION * sessions[SUBMITDEST_COUNT];
+static int usesessions;
+/* Connects and the time they took, full handshakes and resumed ones */
+static long nconn[2];
+static int64_t connus[2];
+
+static void * bench_connect(int d, const char * host, int port, int * resumed,
+                            esp_err_t * err, void * bectx)
+{
+  struct benchconn * bc = &conns[d];
+  int64_t start = nowus();
+  bc->fd = socket(AF_INET, SOCK_STREAM, 0);
+  nodelay(bc->fd);
+  struct sockaddr_in sa = { .sin_family = AF_INET, .sin_port = htons(srvport) };
+  sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(bc->fd, (struct sockaddr *)&sa, sizeof(sa)) != 0) {
+    close(bc->fd);
+    *err = ESP_FAIL;
+    return NULL;
+  }
+  bc->ssl = SSL_new(clictx);
+  SSL_set_fd(bc->ssl, bc->fd);
+  SSL_set_tlsext_host_name(bc->ssl, host);
+  if (usesessions && (sessions[d] != NULL)) {
+    SSL_set_session(bc->ssl, sessions[d]);
+  }
+  if (SSL_connect(bc->ssl) != 1) {
+    SSL_free(bc->ssl);
+    close(bc->fd);
+    *err = ESP_FAIL;
+    return NULL;
+  }
+  /* Unlike esp-tls, OpenSSL can tell whether the server took it. */
+  *resumed = SSL_session_reused(bc->ssl);
+  nconn[*resumed]++;
+  connus[*resumed] += nowus() - start;
+  return bc;
+}
+
+static esp_err_t bench_write(void * h, const char * data, size_t len, void * bectx)
+{
+  struct benchconn * bc = h;
+  return (SSL_write(bc->ssl, data, len) == (int)len) ? ESP_OK : ESP_FAIL;
+}
+
+static int bench_read(void * h, char * buf, size_t len, void * bectx)
+{
+  struct benchconn * bc = h;
+  int n = SSL_read(bc->ssl, buf, len);
+  if (n > 0) { return n; }
+  return (SSL_get_error(bc->ssl, n) == SSL_ERROR_ZERO_RETURN) ? 0 : -1;
+}
+
+static void bench_close(void * h, void * bectx)
+{
+  struct benchconn * bc = h;
+  int d = bc - conns;
+  if (usesessions) {
+    SSL_SESSION * s = SSL_get1_session(bc->ssl);
+    if (s != NULL) {
+      SSL_SESSION_free(sessions[d]);
+      sessions[d] = s;
+    }
+  }
+  SSL_shutdown(bc->ssl);
+  SSL_free(bc->ssl);
+  close(bc->fd);
+}
+
+static const struct submitbackend benchbackend = {
+  .connect = bench_connect,
+  .write = bench_write,
+  .read = bench_read,
+  .close = bench_close,
+};
+
+/* Returns the total time in microseconds. */
+static int64_t run(const char * what, int withsessions)
+{
+  usesessions = withsessions;
+  memset(nconn, 0, sizeof(nconn));
+  memset(connus, 0, sizeof(connus));
+  struct submitbatch b;
+  submitbatch_init(&b, 1700000000);
+  for (int f = 0; f < SUBMITFIELD_COUNT; f++) {
+    submitbatch_add(&b, f, 10.0 + f);
+  }
+  int64_t start = nowus();
+  for (int i = 0; i < CYCLES; i++) {
+    if (submit_batch(&b) != 0) {
+      fprintf(stderr, "bench_tlsresume: upload failed\n");
+      exit(1);
+    }
+  }
+  int64_t total = nowus() - start;
+  printf("%-20s %8.1f cycles/s, %ld full handshakes (avg. %lld us), %ld resumed (avg. %lld us)\n",
+         what, CYCLES * 1e6 / total,
+         nconn[0], (nconn[0] > 0) ? (long long)(connus[0] / nconn[0]) : 0LL,
+         nconn[1], (nconn[1] > 0) ? (long long)(connus[1] / nconn[1]) : 0LL);
+  return total;
+}
+
+int main(void)
+{
+  network_event_group = xEventGroupCreate();
+  mkcert();
+  startserver();
+  clictx = SSL_CTX_new(TLS_client_method());
+  SSL_CTX_set_max_proto_version(clictx, TLS1_2_VERSION);
+  SSL_CTX_set_verify(clictx, SSL_VERIFY_PEER, NULL);
+  X509_STORE_add_cert(SSL_CTX_get_cert_store(clictx), cert);
+  submit_setbackend(&benchbackend);
+  int64_t tfull = run("full handshakes:", 0);
+  int64_t tres = run("resumed sessions:", 1);
+  printf("with resumed sessions, uploads take %lld%% of the time\n",
+         (long long)(tres * 100 / tfull));
+  return 0;
+}
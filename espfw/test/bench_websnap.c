@@ -0,0 +1,102 @@
+/* ZAMDACH2022 host tests
+ * Micro-benchmark: what the /json handler does per request, the way
+ * it did before the snapshot (16 sprintf calls with float formatting
+ * into a buffer on the stack), and now (take the current snapshot and
+ * copy it out). Both end with copying the response into a send
+ * buffer, which is what httpd_resp_send() does with it. This runs on
+ * the PC, so only the ratio means anything. An ESP32 at 80 MHz is a
+ * few hundred times slower in absolute terms. */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "websnap.h"
+
+#define ROUNDS 200000
+
+/* websnap.c reports this in the JSON. */
+int pendingfwverify = 0;
+
+static struct ev ev;
+static char sendbuf[1500];
+/* Keeps the compiler from optimizing the loops away. */
+static volatile size_t sink;
+
+static void request_old(void)
+{
+  char myresponse[1100];
+  char * pfp;
+  strcpy(myresponse, "");
+  pfp = myresponse;
+  pfp += sprintf(pfp, "{\"ts\":\"%lld\",", (long long)ev.lastupd);
+  pfp += sprintf(pfp, "\"lastsht4xheat\":\"%lld\",", (long long)ev.lastsht4xheat);
+  pfp += sprintf(pfp, "\"temp\":\"%.2f\",", ev.temp);
+  pfp += sprintf(pfp, "\"hum\":\"%.1f\",", ev.hum);
+  pfp += sprintf(pfp, "\"pm010\":\"%.1f\",", ev.pm010);
+  pfp += sprintf(pfp, "\"pm025\":\"%.1f\",", ev.pm025);
+  pfp += sprintf(pfp, "\"pm040\":\"%.1f\",", ev.pm040);
+  pfp += sprintf(pfp, "\"pm100\":\"%.1f\",", ev.pm100);
+  pfp += sprintf(pfp, "\"press\":\"%.3f\",", ev.press);
+  pfp += sprintf(pfp, "\"lux\":\"%.2f\",", ev.lux);
+  pfp += sprintf(pfp, "\"uvind\":\"%.2f\",", ev.uvind);
+  pfp += sprintf(pfp, "\"raing\":\"%.2f\",", ev.raing);
+  pfp += sprintf(pfp, "\"windspeed\":\"%.1f\",", ev.windspeed);
+  pfp += sprintf(pfp, "\"windspmax\":\"%.1f\",", ev.windspmax);
+  pfp += sprintf(pfp, "\"winddirdeg\":\"%.1f\",", ev.winddirdeg);
+  pfp += sprintf(pfp, "\"winddirtxt\":\"%s\"}", ev.winddirtxt);
+  /* HTTPD_RESP_USE_STRLEN */
+  size_t len = strlen(myresponse);
+  memcpy(sendbuf, myresponse, len);
+  sink += len;
+}
+
+static void request_snap(void)
+{
+  const struct websnapshot * s = websnap_get();
+  memcpy(sendbuf, s->json, s->jsonlen);
+  sink += s->jsonlen;
+}
+
+static double bench(void (*fn)(void))
+{
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (int i = 0; i < ROUNDS; i++) {
+    fn();
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  return ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) / ROUNDS;
+}
+
+int main(void)
+{
+  ev.lastupd = 1700000000;
+  ev.lastsht4xheat = 1699999400;
+  ev.temp = 21.456;
+  ev.hum = 55.5;
+  ev.pm010 = 1.2;
+  ev.pm025 = 2.5;
+  ev.pm040 = 4.1;
+  ev.pm100 = 10.3;
+  ev.press = 1013.25;
+  ev.lux = 12345.678;
+  ev.uvind = 3.14;
+  ev.raing = 0.25;
+  ev.windspeed = 12.3;
+  ev.windspmax = 23.4;
+  ev.winddirdeg = 270.0;
+  strcpy(ev.winddirtxt, "W");
+  /* The render itself only happens once a minute. */
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  websnap_publish(&ev);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  double nsold = bench(request_old);
+  double nssnap = bench(request_snap);
+  printf("sprintf  %8.0f ns per request, %10.0f requests/s\n", nsold, 1e9 / nsold);
+  printf("snapshot %8.0f ns per request, %10.0f requests/s (plus %ld ns once per update)\n",
+         nssnap, 1e9 / nssnap,
+         (long)((t1.tv_sec - t0.tv_sec) * 1000000000L + (t1.tv_nsec - t0.tv_nsec)));
+  printf("a request from the snapshot takes %.1f%% of the time\n", nssnap * 100.0 / nsold);
+  return 0;
+}
@@ -0,0 +1,25 @@
+/* ZAMDACH2022 host tests
+ * The GPIO functions the firmware sources use. They do nothing. */
+
+#ifndef _HOST_DRIVER_GPIO_H_
+#define _HOST_DRIVER_GPIO_H_
+
+#include <stdint.h>
+#include "esp_err.h"
+
+typedef int gpio_num_t;
+typedef enum {
+  GPIO_MODE_INPUT,
+  GPIO_MODE_OUTPUT,
+  GPIO_MODE_INPUT_OUTPUT_OD,
+} gpio_mode_t;
+typedef enum {
+  GPIO_PULLUP_DISABLE = 0,
+  GPIO_PULLUP_ENABLE = 1,
+} gpio_pullup_t;
+
+int gpio_get_level(gpio_num_t pin);
+esp_err_t gpio_set_level(gpio_num_t pin, uint32_t level);
+esp_err_t gpio_set_direction(gpio_num_t pin, gpio_mode_t mode);
+
+#endif /* _HOST_DRIVER_GPIO_H_ */
@@ -0,0 +1,43 @@
+/* ZAMDACH2022 host tests
+ * The old I2C driver API, as far as i2cbus.c uses it. None of these
+ * do anything, the tests replace the backend with a simulated bus. */
+
+#ifndef _HOST_DRIVER_I2C_H_
+#define _HOST_DRIVER_I2C_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "driver/gpio.h"
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+
+typedef void * i2c_cmd_handle_t;
+typedef enum { I2C_MODE_SLAVE = 0, I2C_MODE_MASTER } i2c_mode_t;
+#define I2C_MASTER_WRITE 0
+#define I2C_MASTER_READ 1
+#define I2C_MASTER_LAST_NACK 2
+#define I2C_LINK_RECOMMENDED_SIZE(n) (2 * (n) * 20)
+
+typedef struct {
+  i2c_mode_t mode;
+  int sda_io_num;
+  int scl_io_num;
+  gpio_pullup_t sda_pullup_en;
+  gpio_pullup_t scl_pullup_en;
+  struct { uint32_t clk_speed; } master;
+} i2c_config_t;
+
+esp_err_t i2c_param_config(int port, const i2c_config_t * conf);
+esp_err_t i2c_driver_install(int port, i2c_mode_t mode, size_t rxlen, size_t txlen, int flags);
+esp_err_t i2c_driver_delete(int port);
+i2c_cmd_handle_t i2c_cmd_link_create_static(uint8_t * buf, uint32_t size);
+void i2c_cmd_link_delete_static(i2c_cmd_handle_t cmd);
+esp_err_t i2c_master_start(i2c_cmd_handle_t cmd);
+esp_err_t i2c_master_stop(i2c_cmd_handle_t cmd);
+esp_err_t i2c_master_write_byte(i2c_cmd_handle_t cmd, uint8_t b, bool ack);
+esp_err_t i2c_master_write(i2c_cmd_handle_t cmd, const uint8_t * d, size_t len, bool ack);
+esp_err_t i2c_master_read(i2c_cmd_handle_t cmd, uint8_t * d, size_t len, int ack);
+esp_err_t i2c_master_cmd_begin(int port, i2c_cmd_handle_t cmd, TickType_t ticks);
+
+#endif /* _HOST_DRIVER_I2C_H_ */
@@ -0,0 +1,17 @@
+/* ZAMDACH2022 host tests
+ * The firmware description, as the build would fill it in. */
+
+#ifndef _HOST_ESP_APP_DESC_H_
+#define _HOST_ESP_APP_DESC_H_
+
+typedef struct {
+  char version[32];
+  char project_name[32];
+  char time[16];
+  char date[16];
+} esp_app_desc_t;
+
+/* Returns "zamdach2022", "testversion", "Jan  1 2024", "12:00:00". */
+const esp_app_desc_t * esp_app_get_description(void);
+
+#endif /* _HOST_ESP_APP_DESC_H_ */
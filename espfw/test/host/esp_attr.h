@@ -0,0 +1,9 @@
+/* ZAMDACH2022 host tests */
+
+#ifndef _HOST_ESP_ATTR_H_
+#define _HOST_ESP_ATTR_H_
+
+#define IRAM_ATTR
+#define FORCE_INLINE_ATTR static inline __attribute__((always_inline))
+
+#endif /* _HOST_ESP_ATTR_H_ */
@@ -0,0 +1,10 @@
+/* ZAMDACH2022 host tests */
+
+#ifndef _HOST_ESP_CRT_BUNDLE_H_
+#define _HOST_ESP_CRT_BUNDLE_H_
+
+#include "esp_err.h"
+
+esp_err_t esp_crt_bundle_attach(void * conf);
+
+#endif /* _HOST_ESP_CRT_BUNDLE_H_ */
@@ -0,0 +1,9 @@
+/* ZAMDACH2022 host tests
+ * Only what the headers of the firmware need from esp_event.h. */
+
+#ifndef _HOST_ESP_EVENT_H_
+#define _HOST_ESP_EVENT_H_
+
+#define BIT0 0x00000001
+
+#endif /* _HOST_ESP_EVENT_H_ */
@@ -0,0 +1,16 @@
+/* ZAMDACH2022 host tests */
+
+#ifndef _HOST_ESP_HTTP_CLIENT_H_
+#define _HOST_ESP_HTTP_CLIENT_H_
+
+#include <stdbool.h>
+#include "esp_err.h"
+
+typedef struct {
+  const char * url;
+  int timeout_ms;
+  bool keep_alive_enable;
+  esp_err_t (*crt_bundle_attach)(void * conf);
+} esp_http_client_config_t;
+
+#endif /* _HOST_ESP_HTTP_CLIENT_H_ */
@@ -0,0 +1,81 @@
+/* ZAMDACH2022 host tests
+ * Just enough of esp_http_server.h to run request handlers on a PC.
+ * A request is a struct hostreq that the test fills in, and the
+ * response ends up in the same struct. */
+
+#ifndef _HOST_ESP_HTTP_SERVER_H_
+#define _HOST_ESP_HTTP_SERVER_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+#include "esp_err.h"
+
+#define ESP_ERR_HTTPD_BASE 0xb000
+#define ESP_ERR_HTTPD_RESULT_TRUNC (ESP_ERR_HTTPD_BASE + 4)
+
+#define HTTPD_RESP_USE_STRLEN -1
+/* What httpd_req_recv() returns when nothing came in time */
+#define HTTPD_SOCK_ERR_FAIL -1
+#define HTTPD_SOCK_ERR_TIMEOUT -3
+
+typedef void * httpd_handle_t;
+typedef enum { HTTP_GET = 1, HTTP_POST = 3 } httpd_method_t;
+typedef enum {
+  HTTPD_400_BAD_REQUEST = 400,
+  HTTPD_408_REQ_TIMEOUT = 408,
+  HTTPD_500_INTERNAL_SERVER_ERROR = 500,
+} httpd_err_code_t;
+
+#define HOSTREQ_MAXHDRS 8
+
+struct hostreq {
+  /* Set by the test */
+  const char * hdrs; /* request headers, "Name: value\r\n" each */
+  const char * body;
+  size_t bodylen;
+  size_t maxrecv; /* hand out at most this much per recv, 0 = all */
+  int recvtimeouts; /* the next this many recvs time out */
+  /* Filled in by the handler */
+  size_t bodypos;
+  const char * status;
+  const char * type;
+  int nhdrs;
+  const char * hdrname[HOSTREQ_MAXHDRS];
+  const char * hdrval[HOSTREQ_MAXHDRS];
+  char * resp; /* malloc()ed, 0-terminated, free it with hostreq_free() */
+  size_t resplen;
+  int sends; /* httpd_resp_send() calls */
+  int chunks; /* httpd_resp_send_chunk() calls with data */
+  int finished; /* the empty chunk that ends a chunked response */
+};
+
+typedef struct httpd_req {
+  httpd_handle_t handle;
+  int method;
+  char uri[512];
+  size_t content_len;
+  void * user_ctx;
+  struct hostreq * host;
+} httpd_req_t;
+
+esp_err_t httpd_resp_set_status(httpd_req_t * r, const char * status);
+esp_err_t httpd_resp_set_type(httpd_req_t * r, const char * type);
+esp_err_t httpd_resp_set_hdr(httpd_req_t * r, const char * field, const char * value);
+esp_err_t httpd_resp_send(httpd_req_t * r, const char * buf, ssize_t len);
+esp_err_t httpd_resp_send_chunk(httpd_req_t * r, const char * buf, ssize_t len);
+esp_err_t httpd_resp_send_err(httpd_req_t * r, httpd_err_code_t error, const char * msg);
+esp_err_t httpd_resp_send_500(httpd_req_t * r);
+size_t httpd_req_get_hdr_value_len(httpd_req_t * r, const char * field);
+esp_err_t httpd_req_get_hdr_value_str(httpd_req_t * r, const char * field, char * val, size_t val_size);
+int httpd_req_recv(httpd_req_t * r, char * buf, size_t buf_len);
+int httpd_req_to_sockfd(httpd_req_t * r);
+
+/* For the tests: sets up r for a request to uri with the given
+ * headers and body, both may be NULL. */
+void hostreq_init(httpd_req_t * r, struct hostreq * h, int method, const char * uri,
+                  const char * hdrs, const char * body, size_t bodylen);
+/* The value of response header name, or NULL */
+const char * hostreq_resphdr(const struct hostreq * h, const char * name);
+void hostreq_free(struct hostreq * h);
+
+#endif /* _HOST_ESP_HTTP_SERVER_H_ */
@@ -0,0 +1,27 @@
+/* ZAMDACH2022 host tests
+ * Updates from a URL are not tested on the host, these all abort(). */
+
+#ifndef _HOST_ESP_HTTPS_OTA_H_
+#define _HOST_ESP_HTTPS_OTA_H_
+
+#include <stdbool.h>
+#include "esp_err.h"
+#include "esp_http_client.h"
+
+#define ESP_ERR_HTTPS_OTA_BASE 0x9000
+#define ESP_ERR_HTTPS_OTA_IN_PROGRESS (ESP_ERR_HTTPS_OTA_BASE + 1)
+
+typedef void * esp_https_ota_handle_t;
+typedef struct {
+  const esp_http_client_config_t * http_config;
+} esp_https_ota_config_t;
+
+esp_err_t esp_https_ota_begin(const esp_https_ota_config_t * cfg, esp_https_ota_handle_t * h);
+esp_err_t esp_https_ota_perform(esp_https_ota_handle_t h);
+int esp_https_ota_get_image_len_read(esp_https_ota_handle_t h);
+int esp_https_ota_get_image_size(esp_https_ota_handle_t h);
+bool esp_https_ota_is_complete_data_received(esp_https_ota_handle_t h);
+esp_err_t esp_https_ota_abort(esp_https_ota_handle_t h);
+esp_err_t esp_https_ota_finish(esp_https_ota_handle_t h);
+
+#endif /* _HOST_ESP_HTTPS_OTA_H_ */
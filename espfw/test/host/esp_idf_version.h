@@ -0,0 +1,11 @@
+/* ZAMDACH2022 host tests
+ * Pretends to be ESP-IDF 5.1, i.e. the last version with only the old
+ * I2C driver. The host tests never use the real driver anyways. */
+
+#ifndef _HOST_ESP_IDF_VERSION_H_
+#define _HOST_ESP_IDF_VERSION_H_
+
+#define ESP_IDF_VERSION_VAL(major, minor, patch) (((major) << 16) | ((minor) << 8) | (patch))
+#define ESP_IDF_VERSION ESP_IDF_VERSION_VAL(5, 1, 0)
+
+#endif /* _HOST_ESP_IDF_VERSION_H_ */
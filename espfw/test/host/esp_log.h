@@ -0,0 +1,23 @@
+/* ZAMDACH2022 host tests
+ * The log macros. Errors and warnings go to stderr if the environment
+ * variable HOSTLOG is set, everything else is thrown away. */
+
+#ifndef _HOST_ESP_LOG_H_
+#define _HOST_ESP_LOG_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define HOSTLOG(lvl, tag, fmt, ...) \
+  do { \
+    if (getenv("HOSTLOG") != NULL) { \
+      fprintf(stderr, "%c (%s) " fmt "\n", lvl, tag, ##__VA_ARGS__); \
+    } \
+  } while (0)
+
+#define ESP_LOGE(tag, fmt, ...) HOSTLOG('E', tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGW(tag, fmt, ...) HOSTLOG('W', tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGI(tag, fmt, ...) do { if (0) { printf(fmt, ##__VA_ARGS__); } } while (0)
+#define ESP_LOGD(tag, fmt, ...) do { if (0) { printf(fmt, ##__VA_ARGS__); } } while (0)
+
+#endif /* _HOST_ESP_LOG_H_ */
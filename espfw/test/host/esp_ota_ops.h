@@ -0,0 +1,29 @@
+/* ZAMDACH2022 host tests
+ * The part of the app_update API that ota.c uses. Tests that need
+ * these provide them, with a simulated flash. */
+
+#ifndef _HOST_ESP_OTA_OPS_H_
+#define _HOST_ESP_OTA_OPS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+#define ESP_ERR_OTA_BASE 0x1500
+#define ESP_ERR_OTA_VALIDATE_FAILED (ESP_ERR_OTA_BASE + 0x03)
+#define OTA_WITH_SEQUENTIAL_WRITES 0xfffffffe
+
+typedef uint32_t esp_ota_handle_t;
+typedef struct {
+  const char * label;
+  uint32_t size;
+} esp_partition_t;
+
+const esp_partition_t * esp_ota_get_next_update_partition(const esp_partition_t * start);
+esp_err_t esp_ota_begin(const esp_partition_t * part, size_t imagesize, esp_ota_handle_t * h);
+esp_err_t esp_ota_write(esp_ota_handle_t h, const void * data, size_t size);
+esp_err_t esp_ota_end(esp_ota_handle_t h);
+esp_err_t esp_ota_abort(esp_ota_handle_t h);
+esp_err_t esp_ota_set_boot_partition(const esp_partition_t * part);
+
+#endif /* _HOST_ESP_OTA_OPS_H_ */
@@ -0,0 +1,10 @@
+/* ZAMDACH2022 host tests */
+
+#ifndef _HOST_ESP_ROM_SYS_H_
+#define _HOST_ESP_ROM_SYS_H_
+
+#include <stdint.h>
+
+void esp_rom_delay_us(uint32_t us);
+
+#endif /* _HOST_ESP_ROM_SYS_H_ */
@@ -0,0 +1,9 @@
+/* ZAMDACH2022 host tests */
+
+#ifndef _HOST_ESP_SYSTEM_H_
+#define _HOST_ESP_SYSTEM_H_
+
+/* There is nothing to reboot, this abort()s. */
+void esp_restart(void);
+
+#endif /* _HOST_ESP_SYSTEM_H_ */
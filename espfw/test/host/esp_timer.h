@@ -0,0 +1,12 @@
+/* ZAMDACH2022 host tests
+ * esp_timer_get_time() on top of the monotonic clock. */
+
+#ifndef _HOST_ESP_TIMER_H_
+#define _HOST_ESP_TIMER_H_
+
+#include <stdint.h>
+
+/* Microseconds since some point in the past. */
+int64_t esp_timer_get_time(void);
+
+#endif /* _HOST_ESP_TIMER_H_ */
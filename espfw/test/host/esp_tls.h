@@ -0,0 +1,38 @@
+/* ZAMDACH2022 host tests
+ * The esp-tls API, as far as submit.c uses it. None of these do
+ * anything, the tests replace the backend with a simulated server. */
+
+#ifndef _HOST_ESP_TLS_H_
+#define _HOST_ESP_TLS_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+#include "esp_err.h"
+#include "sdkconfig.h"
+
+typedef struct esp_tls esp_tls_t;
+typedef struct esp_tls_last_error * esp_tls_error_handle_t;
+typedef struct esp_tls_client_session esp_tls_client_session_t;
+
+typedef struct {
+  esp_err_t (*crt_bundle_attach)(void * conf);
+  int timeout_ms;
+#ifdef CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+  esp_tls_client_session_t * client_session;
+#endif
+} esp_tls_cfg_t;
+
+esp_tls_t * esp_tls_init(void);
+int esp_tls_conn_new_sync(const char * hostname, int hostlen, int port,
+                          const esp_tls_cfg_t * cfg, esp_tls_t * tls);
+ssize_t esp_tls_conn_write(esp_tls_t * tls, const void * data, size_t datalen);
+ssize_t esp_tls_conn_read(esp_tls_t * tls, void * data, size_t datalen);
+int esp_tls_conn_destroy(esp_tls_t * tls);
+esp_err_t esp_tls_get_error_handle(esp_tls_t * tls, esp_tls_error_handle_t * eh);
+esp_err_t esp_tls_get_and_clear_last_error(esp_tls_error_handle_t eh, int * code, int * flags);
+#ifdef CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+esp_tls_client_session_t * esp_tls_get_client_session(esp_tls_t * tls);
+void esp_tls_free_client_session(esp_tls_client_session_t * cs);
+#endif
+
+#endif /* _HOST_ESP_TLS_H_ */
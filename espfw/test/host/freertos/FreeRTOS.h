@@ -0,0 +1,38 @@
+/* ZAMDACH2022 host tests
+ * A small part of the FreeRTOS API on top of pthreads, enough to run
+ * the firmware modules that use tasks, queues and spinlocks on a PC.
+ * Ticks are milliseconds. Task priorities and stack sizes are ignored,
+ * so unlike on the ESP, tasks really run in parallel. */
+
+#ifndef _HOST_FREERTOS_H_
+#define _HOST_FREERTOS_H_
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef long BaseType_t;
+typedef unsigned long UBaseType_t;
+typedef uint32_t TickType_t;
+
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdPASS 1
+#define pdFAIL 0
+#define portMAX_DELAY ((TickType_t)0xffffffffUL)
+#define portTICK_PERIOD_MS 1
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+
+/* Critical sections are a plain mutex. */
+typedef pthread_mutex_t portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED PTHREAD_MUTEX_INITIALIZER
+#define taskENTER_CRITICAL(mux) pthread_mutex_lock(mux)
+#define taskEXIT_CRITICAL(mux) pthread_mutex_unlock(mux)
+
+typedef struct hosttask * TaskHandle_t;
+typedef void (*TaskFunction_t)(void *);
+typedef struct hostqueue * QueueHandle_t;
+typedef uint32_t EventBits_t;
+typedef struct hostevg * EventGroupHandle_t;
+
+#endif /* _HOST_FREERTOS_H_ */
@@ -0,0 +1,14 @@
+/* ZAMDACH2022 host tests */
+
+#ifndef _HOST_FREERTOS_EVENT_GROUPS_H_
+#define _HOST_FREERTOS_EVENT_GROUPS_H_
+
+#include "freertos/FreeRTOS.h"
+
+EventGroupHandle_t xEventGroupCreate(void);
+EventBits_t xEventGroupSetBits(EventGroupHandle_t evg, EventBits_t bits);
+EventBits_t xEventGroupClearBits(EventGroupHandle_t evg, EventBits_t bits);
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t evg, EventBits_t bits,
+                                BaseType_t clear, BaseType_t all, TickType_t ticks);
+
+#endif /* _HOST_FREERTOS_EVENT_GROUPS_H_ */
@@ -0,0 +1,14 @@
+/* ZAMDACH2022 host tests */
+
+#ifndef _HOST_FREERTOS_QUEUE_H_
+#define _HOST_FREERTOS_QUEUE_H_
+
+#include "freertos/FreeRTOS.h"
+
+QueueHandle_t xQueueCreate(UBaseType_t len, UBaseType_t itemsize);
+void vQueueDelete(QueueHandle_t q);
+BaseType_t xQueueSend(QueueHandle_t q, const void * item, TickType_t ticks);
+BaseType_t xQueueReceive(QueueHandle_t q, void * item, TickType_t ticks);
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t q);
+
+#endif /* _HOST_FREERTOS_QUEUE_H_ */
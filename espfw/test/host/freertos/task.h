@@ -0,0 +1,17 @@
+/* ZAMDACH2022 host tests */
+
+#ifndef _HOST_FREERTOS_TASK_H_
+#define _HOST_FREERTOS_TASK_H_
+
+#include "freertos/FreeRTOS.h"
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char * name, uint32_t stacksize,
+                       void * param, UBaseType_t prio, TaskHandle_t * handle);
+TaskHandle_t xTaskGetCurrentTaskHandle(void);
+void vTaskDelay(TickType_t ticks);
+/* Only for the calling task (task == NULL) */
+void vTaskDelete(TaskHandle_t task);
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t ticks);
+BaseType_t xTaskNotifyGive(TaskHandle_t task);
+
+#endif /* _HOST_FREERTOS_TASK_H_ */
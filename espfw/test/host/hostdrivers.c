@@ -0,0 +1,55 @@
+/* ZAMDACH2022 host tests
+ * The GPIO, (old) I2C driver, esp-tls and esp_https_ota functions that
+ * the firmware sources reference. The tests replace these backends with
+ * simulated ones, so none of these should ever be called. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "driver/gpio.h"
+#include "driver/i2c.h"
+#include "esp_crt_bundle.h"
+#include "esp_https_ota.h"
+#include "esp_system.h"
+#include "esp_tls.h"
+
+static void host_nohw(const char * fn)
+{
+  fprintf(stderr, "%s() called, but there is no hardware in host tests.\n", fn);
+  abort();
+}
+
+int gpio_get_level(gpio_num_t pin) { host_nohw(__func__); return 0; }
+esp_err_t gpio_set_level(gpio_num_t pin, uint32_t level) { host_nohw(__func__); return ESP_FAIL; }
+esp_err_t gpio_set_direction(gpio_num_t pin, gpio_mode_t mode) { host_nohw(__func__); return ESP_FAIL; }
+
+esp_err_t i2c_param_config(int port, const i2c_config_t * conf) { host_nohw(__func__); return ESP_FAIL; }
+esp_err_t i2c_driver_install(int port, i2c_mode_t mode, size_t rxlen, size_t txlen, int flags) { host_nohw(__func__); return ESP_FAIL; }
+esp_err_t i2c_driver_delete(int port) { host_nohw(__func__); return ESP_FAIL; }
+i2c_cmd_handle_t i2c_cmd_link_create_static(uint8_t * buf, uint32_t size) { host_nohw(__func__); return NULL; }
+void i2c_cmd_link_delete_static(i2c_cmd_handle_t cmd) { host_nohw(__func__); }
+esp_err_t i2c_master_start(i2c_cmd_handle_t cmd) { host_nohw(__func__); return ESP_FAIL; }
+esp_err_t i2c_master_stop(i2c_cmd_handle_t cmd) { host_nohw(__func__); return ESP_FAIL; }
+esp_err_t i2c_master_write_byte(i2c_cmd_handle_t cmd, uint8_t b, bool ack) { host_nohw(__func__); return ESP_FAIL; }
+esp_err_t i2c_master_write(i2c_cmd_handle_t cmd, const uint8_t * d, size_t len, bool ack) { host_nohw(__func__); return ESP_FAIL; }
+esp_err_t i2c_master_read(i2c_cmd_handle_t cmd, uint8_t * d, size_t len, int ack) { host_nohw(__func__); return ESP_FAIL; }
+esp_err_t i2c_master_cmd_begin(int port, i2c_cmd_handle_t cmd, TickType_t ticks) { host_nohw(__func__); return ESP_FAIL; }
+
+esp_err_t esp_crt_bundle_attach(void * conf) { host_nohw(__func__); return ESP_FAIL; }
+esp_tls_t * esp_tls_init(void) { host_nohw(__func__); return NULL; }
+int esp_tls_conn_new_sync(const char * hostname, int hostlen, int port, const esp_tls_cfg_t * cfg, esp_tls_t * tls) { host_nohw(__func__); return -1; }
+ssize_t esp_tls_conn_write(esp_tls_t * tls, const void * data, size_t datalen) { host_nohw(__func__); return -1; }
+ssize_t esp_tls_conn_read(esp_tls_t * tls, void * data, size_t datalen) { host_nohw(__func__); return -1; }
+int esp_tls_conn_destroy(esp_tls_t * tls) { host_nohw(__func__); return -1; }
+esp_err_t esp_tls_get_error_handle(esp_tls_t * tls, esp_tls_error_handle_t * eh) { host_nohw(__func__); return ESP_FAIL; }
+esp_err_t esp_tls_get_and_clear_last_error(esp_tls_error_handle_t eh, int * code, int * flags) { host_nohw(__func__); return ESP_FAIL; }
+esp_tls_client_session_t * esp_tls_get_client_session(esp_tls_t * tls) { host_nohw(__func__); return NULL; }
+void esp_tls_free_client_session(esp_tls_client_session_t * cs) { host_nohw(__func__); }
+
+esp_err_t esp_https_ota_begin(const esp_https_ota_config_t * cfg, esp_https_ota_handle_t * h) { host_nohw(__func__); return ESP_FAIL; }
+esp_err_t esp_https_ota_perform(esp_https_ota_handle_t h) { host_nohw(__func__); return ESP_FAIL; }
+int esp_https_ota_get_image_len_read(esp_https_ota_handle_t h) { host_nohw(__func__); return -1; }
+int esp_https_ota_get_image_size(esp_https_ota_handle_t h) { host_nohw(__func__); return -1; }
+bool esp_https_ota_is_complete_data_received(esp_https_ota_handle_t h) { host_nohw(__func__); return false; }
+esp_err_t esp_https_ota_abort(esp_https_ota_handle_t h) { host_nohw(__func__); return ESP_FAIL; }
+esp_err_t esp_https_ota_finish(esp_https_ota_handle_t h) { host_nohw(__func__); return ESP_FAIL; }
+void esp_restart(void) { host_nohw(__func__); }
@@ -0,0 +1,176 @@
+/* ZAMDACH2022 host tests
+ * The esp_http_server functions from esp_http_server.h in this
+ * directory. There is no server: the test calls the handler with a
+ * request it made with hostreq_init(), and looks at what got sent. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "esp_http_server.h"
+
+void hostreq_init(httpd_req_t * r, struct hostreq * h, int method, const char * uri,
+                  const char * hdrs, const char * body, size_t bodylen)
+{
+  memset(r, 0, sizeof(httpd_req_t));
+  memset(h, 0, sizeof(struct hostreq));
+  r->method = method;
+  snprintf(r->uri, sizeof(r->uri), "%s", uri);
+  r->content_len = bodylen;
+  r->host = h;
+  h->hdrs = (hdrs != NULL) ? hdrs : "";
+  h->body = body;
+  h->bodylen = bodylen;
+  h->status = "200 OK";
+  h->type = "text/html";
+}
+
+const char * hostreq_resphdr(const struct hostreq * h, const char * name)
+{
+  for (int i = 0; i < h->nhdrs; i++) {
+    if (strcasecmp(h->hdrname[i], name) == 0) {
+      return h->hdrval[i];
+    }
+  }
+  return NULL;
+}
+
+void hostreq_free(struct hostreq * h)
+{
+  free(h->resp);
+  h->resp = NULL;
+  h->resplen = 0;
+}
+
+static void hostreq_append(struct hostreq * h, const char * buf, ssize_t len)
+{
+  if (len == HTTPD_RESP_USE_STRLEN) {
+    len = (buf != NULL) ? (ssize_t)strlen(buf) : 0;
+  }
+  h->resp = realloc(h->resp, h->resplen + len + 1);
+  if (len > 0) {
+    memcpy(&h->resp[h->resplen], buf, len);
+  }
+  h->resplen += len;
+  h->resp[h->resplen] = 0;
+}
+
+/* Like the real thing, this only keeps the pointers. */
+esp_err_t httpd_resp_set_status(httpd_req_t * r, const char * status)
+{
+  r->host->status = status;
+  return ESP_OK;
+}
+
+esp_err_t httpd_resp_set_type(httpd_req_t * r, const char * type)
+{
+  r->host->type = type;
+  return ESP_OK;
+}
+
+esp_err_t httpd_resp_set_hdr(httpd_req_t * r, const char * field, const char * value)
+{
+  struct hostreq * h = r->host;
+  if (h->nhdrs >= HOSTREQ_MAXHDRS) {
+    return ESP_FAIL;
+  }
+  h->hdrname[h->nhdrs] = field;
+  h->hdrval[h->nhdrs] = value;
+  h->nhdrs++;
+  return ESP_OK;
+}
+
+esp_err_t httpd_resp_send(httpd_req_t * r, const char * buf, ssize_t len)
+{
+  r->host->sends++;
+  hostreq_append(r->host, buf, len);
+  return ESP_OK;
+}
+
+esp_err_t httpd_resp_send_chunk(httpd_req_t * r, const char * buf, ssize_t len)
+{
+  if ((buf == NULL) || (len == 0)) {
+    r->host->finished++;
+    hostreq_append(r->host, NULL, 0);
+    return ESP_OK;
+  }
+  r->host->chunks++;
+  hostreq_append(r->host, buf, len);
+  return ESP_OK;
+}
+
+esp_err_t httpd_resp_send_err(httpd_req_t * r, httpd_err_code_t error, const char * msg)
+{
+  static char status[16];
+  snprintf(status, sizeof(status), "%d", (int)error);
+  r->host->status = status;
+  return httpd_resp_send(r, msg, HTTPD_RESP_USE_STRLEN);
+}
+
+esp_err_t httpd_resp_send_500(httpd_req_t * r)
+{
+  return httpd_resp_send_err(r, HTTPD_500_INTERNAL_SERVER_ERROR, "Internal Server Error");
+}
+
+/* Finds the value of header field in the request, and its length. */
+static const char * hostreq_findhdr(httpd_req_t * r, const char * field, size_t * len)
+{
+  const char * p = r->host->hdrs;
+  size_t fl = strlen(field);
+  while (*p != 0) {
+    const char * eol = strstr(p, "\r\n");
+    if (eol == NULL) { eol = p + strlen(p); }
+    if ((strncasecmp(p, field, fl) == 0) && (p[fl] == ':')) {
+      const char * v = p + fl + 1;
+      while (*v == ' ') { v++; }
+      *len = eol - v;
+      return v;
+    }
+    p = (*eol != 0) ? eol + 2 : eol;
+  }
+  return NULL;
+}
+
+size_t httpd_req_get_hdr_value_len(httpd_req_t * r, const char * field)
+{
+  size_t len = 0;
+  return (hostreq_findhdr(r, field, &len) != NULL) ? len : 0;
+}
+
+esp_err_t httpd_req_get_hdr_value_str(httpd_req_t * r, const char * field, char * val, size_t val_size)
+{
+  size_t len;
+  const char * v = hostreq_findhdr(r, field, &len);
+  if (v == NULL) {
+    return ESP_ERR_NOT_FOUND;
+  }
+  if (val_size == 0) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  /* Like the real thing, a value that does not fit is truncated. */
+  size_t n = (len < val_size - 1) ? len : val_size - 1;
+  memcpy(val, v, n);
+  val[n] = 0;
+  return (n < len) ? ESP_ERR_HTTPD_RESULT_TRUNC : ESP_OK;
+}
+
+int httpd_req_recv(httpd_req_t * r, char * buf, size_t buf_len)
+{
+  struct hostreq * h = r->host;
+  if (h->recvtimeouts > 0) {
+    h->recvtimeouts--;
+    return HTTPD_SOCK_ERR_TIMEOUT;
+  }
+  size_t n = h->bodylen - h->bodypos;
+  if (n > buf_len) { n = buf_len; }
+  if ((h->maxrecv > 0) && (n > h->maxrecv)) { n = h->maxrecv; }
+  memcpy(buf, &h->body[h->bodypos], n);
+  h->bodypos += n;
+  return n;
+}
+
+/* There are no sockets. */
+int httpd_req_to_sockfd(httpd_req_t * r)
+{
+  return -1;
+}
@@ -0,0 +1,301 @@
+/* ZAMDACH2022 host tests
+ * The FreeRTOS and ESP-IDF functions declared in the headers in this
+ * directory, implemented with pthreads. */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "esp_app_desc.h"
+#include "esp_rom_sys.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+
+struct hosttask {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  uint32_t notify;
+  TaskFunction_t fn;
+  void * param;
+};
+
+struct hostqueue {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  size_t len;
+  size_t itemsize;
+  size_t head;
+  size_t count;
+  uint8_t * items;
+};
+
+struct hostevg {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  EventBits_t bits;
+};
+
+int64_t esp_timer_get_time(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((int64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+void esp_rom_delay_us(uint32_t us)
+{
+  usleep(us);
+}
+
+const esp_app_desc_t * esp_app_get_description(void)
+{
+  static const esp_app_desc_t appd = {
+    .version = "testversion",
+    .project_name = "zamdach2022",
+    .time = "12:00:00",
+    .date = "Jan  1 2024",
+  };
+  return &appd;
+}
+
+/* Turns a timeout in ticks into an absolute time for
+ * pthread_cond_timedwait(). Returns 0 for portMAX_DELAY. */
+static int host_deadline(TickType_t ticks, struct timespec * ts)
+{
+  if (ticks == portMAX_DELAY) {
+    return 0;
+  }
+  clock_gettime(CLOCK_REALTIME, ts);
+  ts->tv_sec += ticks / 1000;
+  ts->tv_nsec += (long)(ticks % 1000) * 1000000;
+  if (ts->tv_nsec >= 1000000000) {
+    ts->tv_sec++;
+    ts->tv_nsec -= 1000000000;
+  }
+  return 1;
+}
+
+/* Waits on cond until woken up or the deadline. Returns 0 on timeout. */
+static int host_wait(pthread_cond_t * cond, pthread_mutex_t * lock, int hasdl,
+                     const struct timespec * dl)
+{
+  if (!hasdl) {
+    pthread_cond_wait(cond, lock);
+    return 1;
+  }
+  return (pthread_cond_timedwait(cond, lock, dl) != ETIMEDOUT);
+}
+
+static __thread struct hosttask * hostcurtask = NULL;
+
+static struct hosttask * host_newtask(void)
+{
+  struct hosttask * t = calloc(1, sizeof(struct hosttask));
+  pthread_mutex_init(&t->lock, NULL);
+  pthread_cond_init(&t->cond, NULL);
+  return t;
+}
+
+static void * host_taskmain(void * arg)
+{
+  struct hosttask * t = arg;
+  hostcurtask = t;
+  t->fn(t->param);
+  return NULL;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char * name, uint32_t stacksize,
+                       void * param, UBaseType_t prio, TaskHandle_t * handle)
+{
+  pthread_t th;
+  struct hosttask * t = host_newtask();
+  t->fn = fn;
+  t->param = param;
+  if (pthread_create(&th, NULL, host_taskmain, t) != 0) {
+    free(t);
+    return pdFAIL;
+  }
+  pthread_detach(th);
+  if (handle != NULL) {
+    *handle = t;
+  }
+  return pdPASS;
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+  /* Threads that were not created by xTaskCreate (e.g. main) get
+   * their task struct on first use. */
+  if (hostcurtask == NULL) {
+    hostcurtask = host_newtask();
+  }
+  return hostcurtask;
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+  usleep((useconds_t)ticks * 1000);
+}
+
+void vTaskDelete(TaskHandle_t task)
+{
+  if (task != NULL) {
+    fprintf(stderr, "vTaskDelete() of another task is not supported on the host.\n");
+    abort();
+  }
+  pthread_exit(NULL);
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t ticks)
+{
+  struct hosttask * t = xTaskGetCurrentTaskHandle();
+  struct timespec dl;
+  int hasdl = host_deadline(ticks, &dl);
+  pthread_mutex_lock(&t->lock);
+  while ((t->notify == 0) && (ticks != 0)) {
+    if (!host_wait(&t->cond, &t->lock, hasdl, &dl)) {
+      break;
+    }
+  }
+  uint32_t res = t->notify;
+  if (res > 0) {
+    t->notify = (clear) ? 0 : (t->notify - 1);
+  }
+  pthread_mutex_unlock(&t->lock);
+  return res;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t t)
+{
+  pthread_mutex_lock(&t->lock);
+  t->notify++;
+  pthread_cond_broadcast(&t->cond);
+  pthread_mutex_unlock(&t->lock);
+  return pdPASS;
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t len, UBaseType_t itemsize)
+{
+  struct hostqueue * q = calloc(1, sizeof(struct hostqueue));
+  q->items = calloc(len, itemsize);
+  q->len = len;
+  q->itemsize = itemsize;
+  pthread_mutex_init(&q->lock, NULL);
+  pthread_cond_init(&q->cond, NULL);
+  return q;
+}
+
+void vQueueDelete(QueueHandle_t q)
+{
+  free(q->items);
+  free(q);
+}
+
+BaseType_t xQueueSend(QueueHandle_t q, const void * item, TickType_t ticks)
+{
+  struct timespec dl;
+  int hasdl = host_deadline(ticks, &dl);
+  pthread_mutex_lock(&q->lock);
+  while ((q->count >= q->len) && (ticks != 0)) {
+    if (!host_wait(&q->cond, &q->lock, hasdl, &dl)) {
+      break;
+    }
+  }
+  if (q->count >= q->len) {
+    pthread_mutex_unlock(&q->lock);
+    return pdFALSE;
+  }
+  memcpy(&q->items[((q->head + q->count) % q->len) * q->itemsize], item, q->itemsize);
+  q->count++;
+  pthread_cond_broadcast(&q->cond);
+  pthread_mutex_unlock(&q->lock);
+  return pdTRUE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t q, void * item, TickType_t ticks)
+{
+  struct timespec dl;
+  int hasdl = host_deadline(ticks, &dl);
+  pthread_mutex_lock(&q->lock);
+  while ((q->count == 0) && (ticks != 0)) {
+    if (!host_wait(&q->cond, &q->lock, hasdl, &dl)) {
+      break;
+    }
+  }
+  if (q->count == 0) {
+    pthread_mutex_unlock(&q->lock);
+    return pdFALSE;
+  }
+  memcpy(item, &q->items[q->head * q->itemsize], q->itemsize);
+  q->head = (q->head + 1) % q->len;
+  q->count--;
+  pthread_cond_broadcast(&q->cond);
+  pthread_mutex_unlock(&q->lock);
+  return pdTRUE;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t q)
+{
+  pthread_mutex_lock(&q->lock);
+  UBaseType_t res = q->count;
+  pthread_mutex_unlock(&q->lock);
+  return res;
+}
+
+EventGroupHandle_t xEventGroupCreate(void)
+{
+  struct hostevg * evg = calloc(1, sizeof(struct hostevg));
+  pthread_mutex_init(&evg->lock, NULL);
+  pthread_cond_init(&evg->cond, NULL);
+  return evg;
+}
+
+EventBits_t xEventGroupSetBits(EventGroupHandle_t evg, EventBits_t bits)
+{
+  pthread_mutex_lock(&evg->lock);
+  evg->bits |= bits;
+  EventBits_t res = evg->bits;
+  pthread_cond_broadcast(&evg->cond);
+  pthread_mutex_unlock(&evg->lock);
+  return res;
+}
+
+EventBits_t xEventGroupClearBits(EventGroupHandle_t evg, EventBits_t bits)
+{
+  pthread_mutex_lock(&evg->lock);
+  EventBits_t res = evg->bits;
+  evg->bits &= ~bits;
+  pthread_mutex_unlock(&evg->lock);
+  return res;
+}
+
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t evg, EventBits_t bits,
+                                BaseType_t clear, BaseType_t all, TickType_t ticks)
+{
+  struct timespec dl;
+  int hasdl = host_deadline(ticks, &dl);
+  pthread_mutex_lock(&evg->lock);
+  while (1) {
+    EventBits_t got = evg->bits & bits;
+    if ((all) ? (got == bits) : (got != 0)) {
+      break;
+    }
+    if ((ticks == 0) || (!host_wait(&evg->cond, &evg->lock, hasdl, &dl))) {
+      break;
+    }
+  }
+  /* Like FreeRTOS, this returns the bits as they were before clearing,
+   * and only clears them if the wait condition was met. */
+  EventBits_t res = evg->bits;
+  EventBits_t got = res & bits;
+  if ((clear) && ((all) ? (got == bits) : (got != 0))) {
+    evg->bits &= ~bits;
+  }
+  pthread_mutex_unlock(&evg->lock);
+  return res;
+}
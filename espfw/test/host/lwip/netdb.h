@@ -0,0 +1,4 @@
+/* ZAMDACH2022 host tests
+ * lwIP has the same names as the C library of the PC. */
+
+#include <netdb.h>
@@ -0,0 +1,7 @@
+/* ZAMDACH2022 host tests
+ * lwIP has the same names as the C library of the PC. */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
@@ -0,0 +1,46 @@
+/* ZAMDACH2022 host tests
+ * The configuration the firmware sources are built with in the tests.
+ * Sensor IDs are made up, but every field has one, so that a test can
+ * see all of them arrive. */
+
+#ifndef _HOST_SDKCONFIG_H_
+#define _HOST_SDKCONFIG_H_
+
+#define CONFIG_ZAMDACH_WPDSID_HUMIDITY "19"
+#define CONFIG_ZAMDACH_WPDSID_PRESSURE "13"
+#define CONFIG_ZAMDACH_WPDSID_RAINGAUGE1 "14"
+#define CONFIG_ZAMDACH_WPDSID_TEMPERATURE "20"
+#define CONFIG_ZAMDACH_WPDSID_UV "21"
+#define CONFIG_ZAMDACH_WPDSID_WINDDIR "22"
+#define CONFIG_ZAMDACH_WPDSID_WINDSPEED "23"
+#define CONFIG_ZAMDACH_WPDSID_WINDSPMAX "77"
+#define CONFIG_ZAMDACH_WPDSID_ILLUMINANCE "24"
+#define CONFIG_ZAMDACH_WPDSID_PM010 "25"
+#define CONFIG_ZAMDACH_WPDSID_PM025 "26"
+#define CONFIG_ZAMDACH_WPDSID_PM040 "27"
+#define CONFIG_ZAMDACH_WPDSID_PM100 "28"
+#define CONFIG_ZAMDACH_OSM_BOXID "testbox"
+#define CONFIG_ZAMDACH_OSMSID_HUMIDITY "osmhum"
+#define CONFIG_ZAMDACH_OSMSID_PRESSURE "osmpress"
+#define CONFIG_ZAMDACH_OSMSID_RAINGAUGE1 "osmrain"
+#define CONFIG_ZAMDACH_OSMSID_TEMPERATURE "osmtemp"
+#define CONFIG_ZAMDACH_OSMSID_UV "osmuv"
+#define CONFIG_ZAMDACH_OSMSID_WINDDIR "osmwinddir"
+#define CONFIG_ZAMDACH_OSMSID_WINDSPEED "osmwind"
+#define CONFIG_ZAMDACH_OSMSID_WINDSPMAX "osmwindmax"
+#define CONFIG_ZAMDACH_OSMSID_ILLUMINANCE "osmlux"
+#define CONFIG_ZAMDACH_OSMSID_PM010 "osmpm010"
+#define CONFIG_ZAMDACH_OSMSID_PM025 "osmpm025"
+#define CONFIG_ZAMDACH_OSMSID_PM040 "osmpm040"
+#define CONFIG_ZAMDACH_OSMSID_PM100 "osmpm100"
+#define CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS 1
+/* Only test_influx sets these, for everything else the UDP output is
+ * off. */
+#ifndef CONFIG_ZAMDACH_INFLUX_HOST
+#define CONFIG_ZAMDACH_INFLUX_HOST ""
+#endif
+#ifndef CONFIG_ZAMDACH_INFLUX_PORT
+#define CONFIG_ZAMDACH_INFLUX_PORT 8089
+#endif
+
+#endif /* _HOST_SDKCONFIG_H_ */
@@ -0,0 +1,12 @@
+/* ZAMDACH2022 host tests
+ * Made up tokens, so that all destinations count as configured. */
+
+#ifndef _SECRETS_H_
+#define _SECRETS_H_
+
+#define ZAMDACH_WIFIPASSWORD "password"
+#define ZAMDACH_WPDTOKEN "wpdtesttoken"
+#define ZAMDACH_OSMTOKEN "osmtesttoken"
+#define ZAMDACH_WEBIFADMINPW "adminpw"
+
+#endif /* _SECRETS_H_ */
@@ -0,0 +1,22 @@
+/* ZAMDACH2022 host tests
+ * The C library of ESP-IDF has strlcpy(), glibc only got it in 2.38. */
+
+#ifndef _HOST_STRING_H_
+#define _HOST_STRING_H_
+
+#include_next <string.h>
+
+#if defined(__GLIBC__) && ((__GLIBC__ < 2) || ((__GLIBC__ == 2) && (__GLIBC_MINOR__ < 38)))
+static inline size_t strlcpy(char * dst, const char * src, size_t size)
+{
+  size_t len = strlen(src);
+  if (size > 0) {
+    size_t n = (len < size - 1) ? len : size - 1;
+    memcpy(dst, src, n);
+    dst[n] = 0;
+  }
+  return len;
+}
+#endif
+
+#endif /* _HOST_STRING_H_ */
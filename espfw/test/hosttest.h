@@ -0,0 +1,43 @@
+/* ZAMDACH2022 host tests
+ * The few helpers all the tests share. Every test is a plain program
+ * that returns 0 if everything passed. */
+
+#ifndef _HOSTTEST_H_
+#define _HOSTTEST_H_
+
+#include <stdio.h>
+#include <string.h>
+
+static int hosttest_failures = 0;
+
+#define CHECK(cond) \
+  do { \
+    if (!(cond)) { \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+      hosttest_failures++; \
+    } \
+  } while (0)
+
+#define CHECKSTR(got, exp) \
+  do { \
+    const char * hosttest_got = (got); \
+    const char * hosttest_exp = (exp); \
+    if (strcmp(hosttest_got, hosttest_exp) != 0) { \
+      fprintf(stderr, "%s:%d: got \"%s\", expected \"%s\"\n", \
+              __FILE__, __LINE__, hosttest_got, hosttest_exp); \
+      hosttest_failures++; \
+    } \
+  } while (0)
+
+/* Prints the summary line, returns the exit code for main(). */
+static inline int hosttest_done(const char * name)
+{
+  if (hosttest_failures > 0) {
+    printf("%s: %d checks FAILED\n", name, hosttest_failures);
+    return 1;
+  }
+  printf("%s: all passed\n", name);
+  return 0;
+}
+
+#endif /* _HOSTTEST_H_ */
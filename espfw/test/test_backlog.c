@@ -0,0 +1,345 @@
+/* ZAMDACH2022 host tests
+ * Tests for the flash ring log in backlog.c, on a file that behaves
+ * like NOR flash: erasing sets everything to 0xff, and writing can only
+ * clear bits. A "reboot" is simply another backlog_init_flash() on the
+ * same file. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "backlog.h"
+#include "hosttest.h"
+
+/* Three sectors: the smallest backlog that can wrap around without
+ * erasing everything at once, with some room to spare. */
+#define FLASHSIZE (3 * BACKLOG_SECTORSIZE)
+#define SLOTS ((FLASHSIZE / BACKLOG_SECTORSIZE) * 32)
+/* The first timestamp backlog.c accepts is 2023-01-01. */
+#define TS0 1700000000
+
+struct fileflash {
+  FILE * f;
+  long erases;
+  /* If >= 0, a write stops after that many more bytes, as if the
+   * power went out in the middle of it. */
+  long powerfailafter;
+};
+
+static esp_err_t ff_read(void * ctx, size_t offset, void * buf, size_t len)
+{
+  struct fileflash * ff = ctx;
+  if (((offset + len) > FLASHSIZE)
+   || (fseek(ff->f, offset, SEEK_SET) != 0)
+   || (fread(buf, 1, len, ff->f) != len)) {
+    return ESP_FAIL;
+  }
+  return ESP_OK;
+}
+
+static esp_err_t ff_write(void * ctx, size_t offset, const void * buf, size_t len)
+{
+  struct fileflash * ff = ctx;
+  uint8_t old[BACKLOG_SECTORSIZE];
+  const uint8_t * nb = buf;
+  if ((len > sizeof(old)) || (ff_read(ctx, offset, old, len) != ESP_OK)) {
+    return ESP_FAIL;
+  }
+  size_t n = len;
+  if ((ff->powerfailafter >= 0) && ((size_t)ff->powerfailafter < n)) {
+    n = ff->powerfailafter;
+  }
+  for (size_t i = 0; i < n; i++) {
+    old[i] &= nb[i]; /* NOR flash can only clear bits */
+  }
+  if ((fseek(ff->f, offset, SEEK_SET) != 0) || (fwrite(old, 1, len, ff->f) != len)) {
+    return ESP_FAIL;
+  }
+  fflush(ff->f);
+  if (ff->powerfailafter >= 0) {
+    ff->powerfailafter -= n;
+    if (n < len) {
+      return ESP_FAIL;
+    }
+  }
+  return ESP_OK;
+}
+
+static esp_err_t ff_erase(void * ctx, size_t offset, size_t len)
+{
+  struct fileflash * ff = ctx;
+  uint8_t blank[BACKLOG_SECTORSIZE];
+  if (((offset % BACKLOG_SECTORSIZE) != 0) || ((len % BACKLOG_SECTORSIZE) != 0)) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  memset(blank, 0xff, sizeof(blank));
+  for (size_t o = offset; o < (offset + len); o += sizeof(blank)) {
+    if ((fseek(ff->f, o, SEEK_SET) != 0) || (fwrite(blank, 1, sizeof(blank), ff->f) != sizeof(blank))) {
+      return ESP_FAIL;
+    }
+  }
+  fflush(ff->f);
+  ff->erases++;
+  return ESP_OK;
+}
+
+static struct fileflash ff;
+static struct backlogflash fl = {
+  .ctx = &ff,
+  .size = FLASHSIZE,
+  .read = ff_read,
+  .write = ff_write,
+  .erase = ff_erase,
+};
+
+/* Starts with a completely erased flash. */
+static void freshflash(void)
+{
+  if (ff.f != NULL) {
+    fclose(ff.f);
+  }
+  ff.f = tmpfile();
+  ff.erases = 0;
+  ff.powerfailafter = -1;
+  ff_erase(&ff, 0, FLASHSIZE);
+}
+
+/* Batch number i has timestamp TS0 + 60 * i and i in its values. */
+static void mkbatch(struct submitbatch * b, int i)
+{
+  submitbatch_init(b, TS0 + (60 * i));
+  submitbatch_add(b, SUBMITFIELD_TEMPERATURE, i * 0.5f);
+  submitbatch_add(b, SUBMITFIELD_PRESSURE, 1000.0f + i);
+}
+
+static int batchno(const struct submitbatch * b)
+{
+  return (int)((b->ts - TS0) / 60);
+}
+
+/* The same as the functions in submit.c, so the tests can link without it. */
+void submitbatch_init(struct submitbatch * b, time_t ts)
+{
+  b->ts = ts;
+  b->valid = 0;
+}
+
+void submitbatch_add(struct submitbatch * b, enum submitfield f, float value)
+{
+  b->values[f] = value;
+  b->valid |= (1 << f);
+}
+
+/* Fetches everything pending for d, checks that it comes oldest first
+ * and is intact, and returns the number of the first and last batch. */
+static int drain(int d, int marksent, int * first, int * last)
+{
+  struct submitbatch out[4];
+  uint32_t handles[4];
+  int total = 0;
+  int prev = -1;
+  *first = -1;
+  *last = -1;
+  while (1) {
+    int n = backlog_peek(d, out, handles, 4);
+    if (n <= 0) {
+      break;
+    }
+    for (int i = 0; i < n; i++) {
+      int no = batchno(&out[i]);
+      CHECK(no > prev);
+      CHECK(out[i].values[SUBMITFIELD_TEMPERATURE] == (no * 0.5f));
+      CHECK(out[i].values[SUBMITFIELD_PRESSURE] == (1000.0f + no));
+      CHECK(out[i].valid == ((1 << SUBMITFIELD_TEMPERATURE) | (1 << SUBMITFIELD_PRESSURE)));
+      if (*first < 0) { *first = no; }
+      *last = no;
+      prev = no;
+    }
+    total += n;
+    if (!marksent) {
+      break;
+    }
+    backlog_marksent(d, handles, n);
+  }
+  return total;
+}
+
+static void test_basic(void)
+{
+  struct submitbatch b;
+  int first, last;
+  freshflash();
+  CHECK(backlog_init_flash(&fl) == ESP_OK);
+  CHECK(backlog_pending(SUBMITDEST_WPD) == 0);
+  CHECK(backlog_pending(SUBMITDEST_OSM) == 0);
+  /* Batches without NTP time are refused. */
+  submitbatch_init(&b, 12345);
+  CHECK(backlog_append(&b, 3) == ESP_ERR_INVALID_ARG);
+  for (int i = 0; i < 10; i++) {
+    mkbatch(&b, i);
+    /* Only every second batch failed for WPD. */
+    int mask = (1 << SUBMITDEST_OSM) | ((i % 2) ? (1 << SUBMITDEST_WPD) : 0);
+    CHECK(backlog_append(&b, mask) == ESP_OK);
+  }
+  CHECK(backlog_pending(SUBMITDEST_OSM) == 10);
+  CHECK(backlog_pending(SUBMITDEST_WPD) == 5);
+  CHECK(drain(SUBMITDEST_OSM, 1, &first, &last) == 10);
+  CHECK((first == 0) && (last == 9));
+  CHECK(backlog_pending(SUBMITDEST_OSM) == 0);
+  /* That did not touch what is pending for the other destination. */
+  CHECK(backlog_pending(SUBMITDEST_WPD) == 5);
+  CHECK(drain(SUBMITDEST_WPD, 1, &first, &last) == 5);
+  CHECK((first == 1) && (last == 9));
+  CHECK(backlog_pending(SUBMITDEST_WPD) == 0);
+}
+
+/* Writing far more than fits: the oldest batches are overwritten, one
+ * sector at a time, and every sector is only erased when the ring
+ * wraps into it. */
+static void test_wraparound(void)
+{
+  struct submitbatch b;
+  struct backlogstats st;
+  int first, last;
+  const int total = (3 * SLOTS) + 10;
+  freshflash();
+  CHECK(backlog_init_flash(&fl) == ESP_OK);
+  for (int i = 0; i < total; i++) {
+    mkbatch(&b, i);
+    CHECK(backlog_append(&b, (1 << SUBMITDEST_OSM)) == ESP_OK);
+    CHECK(backlog_pending(SUBMITDEST_OSM) <= SLOTS);
+  }
+  backlog_getstats(&st);
+  /* One erase per 32 records written, and nothing else. */
+  CHECK(st.erases == ((total + 31) / 32));
+  CHECK(ff.erases == (st.erases + 1)); /* +1 for freshflash() */
+  /* What survives is everything since the start of the oldest sector
+   * that was not erased yet. */
+  long pending = backlog_pending(SUBMITDEST_OSM);
+  CHECK(pending > (SLOTS - 32));
+  CHECK(st.overwritten == (total - pending));
+  CHECK(drain(SUBMITDEST_OSM, 0, &first, &last) > 0);
+  CHECK(first == (total - pending));
+  /* Sending some in the middle of the ring, then wrapping again: what
+   * was sent must not be counted as lost. */
+  CHECK(drain(SUBMITDEST_OSM, 1, &first, &last) == pending);
+  CHECK(last == (total - 1));
+  backlog_getstats(&st);
+  long lost = st.overwritten;
+  for (int i = total; i < (total + SLOTS); i++) {
+    mkbatch(&b, i);
+    CHECK(backlog_append(&b, (1 << SUBMITDEST_OSM)) == ESP_OK);
+  }
+  backlog_getstats(&st);
+  CHECK(st.overwritten - lost < 32);
+}
+
+/* A record that only got written halfway must be ignored, and must not
+ * be mistaken for a free slot either. */
+static void test_tornrecord(void)
+{
+  struct submitbatch b;
+  int first, last;
+  freshflash();
+  CHECK(backlog_init_flash(&fl) == ESP_OK);
+  for (int i = 0; i < 5; i++) {
+    mkbatch(&b, i);
+    CHECK(backlog_append(&b, (1 << SUBMITDEST_OSM)) == ESP_OK);
+  }
+  /* The power goes out 20 bytes into the sixth record: magic and seq
+   * are there, but values and CRC are not. */
+  ff.powerfailafter = 20;
+  mkbatch(&b, 5);
+  CHECK(backlog_append(&b, (1 << SUBMITDEST_OSM)) != ESP_OK);
+  ff.powerfailafter = -1;
+  /* Reboot. */
+  CHECK(backlog_init_flash(&fl) == ESP_OK);
+  CHECK(backlog_pending(SUBMITDEST_OSM) == 5);
+  /* A record that is complete but has a flipped bit is rejected too. */
+  uint8_t byte;
+  size_t off = (2 * 128) + 19; /* the top byte of the pressure in batch 2 */
+  CHECK(ff_read(&ff, off, &byte, 1) == ESP_OK);
+  CHECK(byte != 0);
+  byte &= (byte - 1); /* clears the lowest bit that is set */
+  CHECK(ff_write(&ff, off, &byte, 1) == ESP_OK);
+  CHECK(backlog_init_flash(&fl) == ESP_OK);
+  CHECK(backlog_pending(SUBMITDEST_OSM) == 4);
+  /* The next record goes behind the torn one, not on top of it. */
+  mkbatch(&b, 6);
+  CHECK(backlog_append(&b, (1 << SUBMITDEST_OSM)) == ESP_OK);
+  CHECK(backlog_init_flash(&fl) == ESP_OK);
+  CHECK(backlog_pending(SUBMITDEST_OSM) == 5);
+  CHECK(drain(SUBMITDEST_OSM, 1, &first, &last) == 5);
+  CHECK((first == 0) && (last == 6));
+}
+
+/* After a reboot, the backlog has to know again where to write and
+ * what is still pending, also when the ring has wrapped and the
+ * newest record is not at the end. */
+static void test_reboot(void)
+{
+  struct submitbatch b;
+  struct submitbatch out[4];
+  uint32_t handles[4];
+  int first, last;
+  freshflash();
+  CHECK(backlog_init_flash(&fl) == ESP_OK);
+  const int total = SLOTS + 40;
+  for (int i = 0; i < total; i++) {
+    mkbatch(&b, i);
+    CHECK(backlog_append(&b, (1 << SUBMITDEST_OSM) | (1 << SUBMITDEST_WPD)) == ESP_OK);
+  }
+  /* Send the oldest 10 to OSM. */
+  int n = 0;
+  while (n < 10) {
+    int got = backlog_peek(SUBMITDEST_OSM, out, handles, 2);
+    CHECK(got == 2);
+    if (got <= 0) { break; }
+    backlog_marksent(SUBMITDEST_OSM, handles, got);
+    n += got;
+  }
+  long osmpending = backlog_pending(SUBMITDEST_OSM);
+  long wpdpending = backlog_pending(SUBMITDEST_WPD);
+  CHECK(osmpending == (wpdpending - 10));
+  /* Reboot: the counts come back from the flash. */
+  CHECK(backlog_init_flash(&fl) == ESP_OK);
+  CHECK(backlog_pending(SUBMITDEST_OSM) == osmpending);
+  CHECK(backlog_pending(SUBMITDEST_WPD) == wpdpending);
+  /* New records go behind the newest one, not over pending ones. */
+  for (int i = total; i < (total + 3); i++) {
+    mkbatch(&b, i);
+    CHECK(backlog_append(&b, (1 << SUBMITDEST_OSM)) == ESP_OK);
+  }
+  CHECK(backlog_pending(SUBMITDEST_OSM) == (osmpending + 3));
+  CHECK(drain(SUBMITDEST_WPD, 0, &first, &last) > 0);
+  CHECK(first == (total - wpdpending));
+  CHECK(drain(SUBMITDEST_OSM, 1, &first, &last) == (osmpending + 3));
+  CHECK(first == (total - wpdpending + 10));
+  CHECK(last == (total + 2));
+  /* And once more, with everything sent for OSM. */
+  CHECK(backlog_init_flash(&fl) == ESP_OK);
+  CHECK(backlog_pending(SUBMITDEST_OSM) == 0);
+  CHECK(backlog_pending(SUBMITDEST_WPD) == wpdpending);
+}
+
+static void test_toosmall(void)
+{
+  struct backlogflash small = fl;
+  small.size = BACKLOG_SECTORSIZE;
+  CHECK(backlog_init_flash(&small) == ESP_ERR_INVALID_SIZE);
+  /* Without a usable flash, everything else does nothing. */
+  struct submitbatch b;
+  mkbatch(&b, 0);
+  CHECK(backlog_append(&b, 3) == ESP_ERR_INVALID_STATE);
+  CHECK(backlog_pending(SUBMITDEST_OSM) == 0);
+}
+
+int main(void)
+{
+  test_basic();
+  test_wraparound();
+  test_tornrecord();
+  test_reboot();
+  test_toosmall();
+  return hosttest_done("test_backlog");
+}
@@ -0,0 +1,128 @@
+/* ZAMDACH2022 host tests
+ * Stress test for the seqlock in evstore.c: one writer publishes as
+ * fast as it can, several readers copy at the same time, and every copy
+ * has to be one complete set of values. Every set the writer publishes
+ * has the same number in all fields, so a torn copy shows up as a mix
+ * of numbers. Note that x86 never reorders stores against stores, so a
+ * missing fence only shows up on CPUs with a weaker memory model (like
+ * ARM); a logic error in the sequence handling shows up everywhere. */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "evstore.h"
+#include "hosttest.h"
+
+#define READERS 4
+#define WRITES 2000000
+
+static atomic_int stop = 0;
+
+static void mkev(struct ev * e, long n)
+{
+  float f = (float)(n % 1000000);
+  memset(e, 0, sizeof(struct ev));
+  e->lastupd = n;
+  e->lastsht4xheat = n;
+  e->hum = f;
+  e->lux = f;
+  e->pm010 = f;
+  e->pm025 = f;
+  e->pm040 = f;
+  e->pm100 = f;
+  e->press = f;
+  e->raing = f;
+  e->temp = f;
+  e->uvind = f;
+  e->windspeed = f;
+  e->windspmax = f;
+  e->winddirdeg = f;
+  snprintf(e->winddirtxt, sizeof(e->winddirtxt), "%07lu", (unsigned long)(n % 10000000));
+}
+
+/* Returns 1 if all fields of e belong to the same set. */
+static int evconsistent(const struct ev * e)
+{
+  struct ev exp;
+  mkev(&exp, e->lastupd);
+  return (memcmp(e, &exp, sizeof(struct ev)) == 0);
+}
+
+struct readerres {
+  long reads;
+  long torn;
+  long backwards;
+  long changes;
+};
+
+static void * writer(void * arg)
+{
+  struct ev e;
+  for (long n = 1; n <= WRITES; n++) {
+    mkev(&e, n);
+    evstore_put(&e);
+    /* Without a short break, readers hardly ever get a copy through
+     * while the writer is busy, and then they are mostly testing the
+     * retry. With one, copies start and end at all sorts of points. */
+    for (volatile int i = 0; i < (n % 64); i++) { }
+  }
+  atomic_store(&stop, 1);
+  return NULL;
+}
+
+static void * reader(void * arg)
+{
+  struct readerres * rr = arg;
+  struct ev e;
+  long last = 0;
+  while (!atomic_load(&stop)) {
+    evstore_get(&e);
+    rr->reads++;
+    if (!evconsistent(&e)) {
+      rr->torn++;
+    }
+    /* There is only one writer, so the values can only get newer. */
+    if (e.lastupd < last) {
+      rr->backwards++;
+    } else if (e.lastupd > last) {
+      rr->changes++;
+    }
+    last = e.lastupd;
+  }
+  return NULL;
+}
+
+int main(void)
+{
+  pthread_t wt;
+  pthread_t rt[READERS];
+  struct readerres rr[READERS];
+  struct ev e;
+  memset(rr, 0, sizeof(rr));
+  mkev(&e, 0);
+  evstore_put(&e);
+  for (int i = 0; i < READERS; i++) {
+    pthread_create(&rt[i], NULL, reader, &rr[i]);
+  }
+  pthread_create(&wt, NULL, writer, NULL);
+  pthread_join(wt, NULL);
+  long reads = 0;
+  long changes = 0;
+  for (int i = 0; i < READERS; i++) {
+    pthread_join(rt[i], NULL);
+    CHECK(rr[i].torn == 0);
+    CHECK(rr[i].backwards == 0);
+    reads += rr[i].reads;
+    changes += rr[i].changes;
+  }
+  /* If the readers never saw a change, they did not really run at the
+   * same time as the writer, and the test proves nothing. */
+  CHECK(changes > 100);
+  printf("test_evstore: %ld reads by %d readers during %d writes, %ld saw new values\n",
+         reads, READERS, WRITES, changes);
+  evstore_get(&e);
+  CHECK((e.lastupd == WRITES) && evconsistent(&e));
+  return hosttest_done("test_evstore");
+}
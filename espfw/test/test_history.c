@@ -0,0 +1,278 @@
+/* ZAMDACH2022 host tests
+ * Tests for history.c: the fixed point encoding (rounding, saturation,
+ * the invalid marker), the ring wrapping around, rows keeping their
+ * number while new ones are added, what /history sends, and a reader
+ * that runs while rows are being added. */
+
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "history.h"
+#include "hosttest.h"
+
+static void mkev(struct ev * e, time_t ts)
+{
+  memset(e, 0, sizeof(struct ev));
+  e->lastupd = ts;
+  e->temp = (ts % 1000) / 10.0;
+  e->hum = 50.0;
+  e->press = 1000.0;
+  e->winddirdeg = 90.0;
+}
+
+static void add(time_t ts)
+{
+  struct ev e;
+  mkev(&e, ts);
+  history_add(&e);
+}
+
+static int32_t lastraw(int f)
+{
+  uint32_t first, end, ts;
+  int32_t raw[HISTFIELD_COUNT];
+  history_range(&first, &end);
+  CHECK(history_getraw(end - 1, &ts, raw) == 0);
+  return raw[f];
+}
+
+/* What a query sends, collected into one buffer. If addts is set,
+ * every flush also adds a row, the way the main task can while the
+ * webserver is sending. */
+static char qout[256 * 1024];
+static size_t qlen;
+static time_t addts;
+
+static void collect(struct sbuf * sb, void * ctx)
+{
+  CHECK(sb->overflow == 0);
+  CHECK(qlen + sb->len < sizeof(qout));
+  memcpy(&qout[qlen], sb->buf, sb->len);
+  qlen += sb->len;
+  qout[qlen] = 0;
+  sbuf_init(sb, sb->buf, sb->cap);
+  if (addts != 0) {
+    add(addts++);
+  }
+}
+
+static void query(const struct histquery * q)
+{
+  char buf[600];
+  struct sbuf sb;
+  qlen = 0;
+  sbuf_init(&sb, buf, sizeof(buf));
+  history_query(q, &sb, collect, NULL);
+  collect(&sb, NULL);
+}
+
+static void test_encoding(void)
+{
+  struct ev e;
+  mkev(&e, 100);
+  e.temp = 21.456;
+  e.press = 1013.25;
+  e.lux = 123.456;
+  e.winddirdeg = -1.0; /* no wind direction */
+  e.uvind = NAN;
+  history_add(&e);
+  CHECK(lastraw(HISTFIELD_TEMP) == 2146);
+  CHECK(lastraw(HISTFIELD_PRESS) == 1325);
+  CHECK(lastraw(HISTFIELD_LUX) == 12346);
+  CHECK(lastraw(HISTFIELD_HUM) == 5000);
+  CHECK(!history_rawisvalid(HISTFIELD_WINDDIRDEG, lastraw(HISTFIELD_WINDDIRDEG)));
+  CHECK(!history_rawisvalid(HISTFIELD_UVIND, lastraw(HISTFIELD_UVIND)));
+  CHECK(lastraw(HISTFIELD_UVIND) == INT16_MIN);
+  /* Saturation: to the largest / smallest value that is not the
+   * invalid marker. */
+  mkev(&e, 101);
+  e.temp = 400.0;
+  e.hum = -400.0;
+  e.press = 500.0;
+  e.lux = 1e9;
+  e.pm025 = INFINITY;
+  e.pm100 = -INFINITY;
+  history_add(&e);
+  CHECK(lastraw(HISTFIELD_TEMP) == INT16_MAX);
+  CHECK(lastraw(HISTFIELD_HUM) == INT16_MIN + 1);
+  CHECK(history_rawisvalid(HISTFIELD_HUM, lastraw(HISTFIELD_HUM)));
+  CHECK(lastraw(HISTFIELD_PRESS) == INT16_MIN + 1);
+  CHECK(lastraw(HISTFIELD_LUX) == INT32_MAX);
+  CHECK(lastraw(HISTFIELD_PM025) == INT16_MAX);
+  CHECK(lastraw(HISTFIELD_PM100) == INT16_MIN + 1);
+  mkev(&e, 102);
+  e.lux = -1e9;
+  e.winddirdeg = 359.94;
+  history_add(&e);
+  CHECK(lastraw(HISTFIELD_LUX) == INT32_MIN + 1);
+  CHECK(history_rawisvalid(HISTFIELD_LUX, lastraw(HISTFIELD_LUX)));
+  CHECK(lastraw(HISTFIELD_WINDDIRDEG) == 3599);
+  /* The CSV shows invalid values as empty, and the rest decoded. */
+  struct histquery q = { .from = 100, .to = 100, .nf = 3,
+                         .fields = { HISTFIELD_TEMP, HISTFIELD_UVIND, HISTFIELD_PRESS } };
+  query(&q);
+  CHECKSTR(qout, "ts,temp,uvind,press\n100,21.46,,1013.25\n");
+}
+
+/* More rows than fit: the oldest are overwritten, the numbers keep
+ * counting up. */
+static void test_wrap(void)
+{
+  uint32_t first0, end0, first, end, ts;
+  int32_t raw[HISTFIELD_COUNT];
+  history_range(&first0, &end0);
+  for (int i = 0; i < HISTORY_ROWS + 100; i++) {
+    add(10000 + i);
+  }
+  CHECK(history_count() == HISTORY_ROWS);
+  history_range(&first, &end);
+  CHECK(end == end0 + HISTORY_ROWS + 100);
+  CHECK(end - first == HISTORY_ROWS);
+  CHECK(history_getraw(first, &ts, raw) == 0);
+  CHECK(ts == 10100);
+  CHECK(history_getraw(end - 1, &ts, raw) == 0);
+  CHECK(ts == 10000 + HISTORY_ROWS + 99);
+  CHECK(raw[HISTFIELD_TEMP] == (int32_t)((ts % 1000) * 10));
+  CHECK(history_getraw(first - 1, &ts, raw) == 1);
+  CHECK(history_getraw(end, &ts, raw) == 1);
+  CHECK(history_getraw(first0, &ts, raw) == 1);
+  /* Every row is where it should be, also across the end of the
+   * arrays. */
+  int bad = 0;
+  for (uint32_t s = first; s != end; s++) {
+    if ((history_getraw(s, &ts, raw) != 0) || (ts != 10000 + (s - end0))
+     || (raw[HISTFIELD_TEMP] != (int32_t)((ts % 1000) * 10))) {
+      bad++;
+    }
+  }
+  CHECK(bad == 0);
+}
+
+/* A row keeps its number while rows are added: it is either still the
+ * same row, or gone - never a different one. */
+static void test_seqstable(void)
+{
+  uint32_t first, end, ts;
+  int32_t raw[HISTFIELD_COUNT];
+  history_range(&first, &end);
+  CHECK(history_getraw(first + 10, &ts, raw) == 0);
+  uint32_t ts10 = ts;
+  for (int i = 0; i < 10; i++) {
+    add(50000 + i);
+  }
+  CHECK(history_getraw(first, &ts, raw) == 1);
+  CHECK(history_getraw(first + 9, &ts, raw) == 1);
+  CHECK(history_getraw(first + 10, &ts, raw) == 0);
+  CHECK(ts == ts10);
+}
+
+static void test_query(void)
+{
+  struct histquery q = { .from = 50003, .to = 50005, .nf = 2,
+                         .fields = { HISTFIELD_HUM, HISTFIELD_TEMP } };
+  query(&q);
+  CHECKSTR(qout, "ts,hum,temp\n50003,50.00,0.30\n50004,50.00,0.40\n50005,50.00,0.50\n");
+  /* The same in binary */
+  q.binary = 1;
+  query(&q);
+  static const char hdr[] = "ZDH1\x02"
+                            "\x03hum" "\x64\0\0\0" "\0\0\0\0" "\x02"
+                            "\x04temp" "\x64\0\0\0" "\0\0\0\0" "\x02";
+  CHECK(qlen == (sizeof(hdr) - 1) + 3 * 8);
+  CHECK(memcmp(qout, hdr, sizeof(hdr) - 1) == 0);
+  const uint8_t * row = (const uint8_t *)&qout[sizeof(hdr) - 1];
+  CHECK((row[0] | (row[1] << 8) | (row[2] << 16) | ((uint32_t)row[3] << 24)) == 50003);
+  CHECK((int16_t)(row[4] | (row[5] << 8)) == 5000);
+  CHECK((int16_t)(row[6] | (row[7] << 8)) == 30);
+  /* Everything, all fields: one line per row plus the header. */
+  struct histquery all = { .from = 0, .to = UINT32_MAX, .nf = HISTFIELD_COUNT };
+  for (int f = 0; f < HISTFIELD_COUNT; f++) { all.fields[f] = f; }
+  query(&all);
+  int lines = 0;
+  for (size_t i = 0; i < qlen; i++) { lines += (qout[i] == '\n'); }
+  CHECK(lines == HISTORY_ROWS + 1);
+}
+
+/* A query running while rows are added - on the device, /history is
+ * sent by the webserver while the main task adds a row every minute.
+ * The answer has to be consistent: every row complete, in order, none
+ * twice, and no gaps - only the oldest rows may be missing, if they
+ * got overwritten while the query was running. The timestamps count
+ * up by one, so all of that can be checked from them. */
+static volatile int writing;
+
+/* Checks what a binary query with just the temperature sent, and
+ * returns the number of rows that were wrong. */
+static int checkrows(void)
+{
+  const size_t hdrlen = 5 + 1 + 4 + 4 + 4 + 1;
+  uint32_t prevts = 0;
+  int bad = 0;
+  for (size_t p = hdrlen; p + 6 <= qlen; p += 6) {
+    const uint8_t * row = (const uint8_t *)&qout[p];
+    uint32_t ts = row[0] | (row[1] << 8) | (row[2] << 16) | ((uint32_t)row[3] << 24);
+    int16_t temp = row[4] | (row[5] << 8);
+    if (((prevts != 0) && (ts != prevts + 1))
+     || (temp != (int16_t)((ts % 1000) * 10))) {
+      bad++;
+    }
+    prevts = ts;
+  }
+  return bad;
+}
+
+static void * writer(void * arg)
+{
+  for (int i = 0; i < 20000; i++) {
+    add(200000 + i);
+  }
+  writing = 0;
+  return NULL;
+}
+
+static void test_concurrent(void)
+{
+  pthread_t t;
+  struct histquery q = { .from = 0, .to = UINT32_MAX, .binary = 1, .nf = 1,
+                         .fields = { HISTFIELD_TEMP } };
+  int queries = 0;
+  int bad = 0;
+  for (int i = 0; i < HISTORY_ROWS; i++) {
+    add(100000 + i);
+  }
+  /* First the same thing without relying on the scheduler: a row is
+   * added after every row sent. That overwrites the oldest rows ahead
+   * of the reader, so it gets about half of them. */
+  addts = 100000 + HISTORY_ROWS;
+  query(&q);
+  addts = 0;
+  CHECK(checkrows() == 0);
+  CHECK(qlen > (HISTORY_ROWS / 3) * 6);
+  /* Then really from another task. */
+  for (int i = 0; i < HISTORY_ROWS; i++) {
+    add(200000 - HISTORY_ROWS + i);
+  }
+  writing = 1;
+  pthread_create(&t, NULL, writer, NULL);
+  do {
+    query(&q);
+    queries++;
+    bad += checkrows();
+  } while (writing);
+  pthread_join(t, NULL);
+  CHECK(bad == 0);
+  printf("test_history: %d queries while adding rows\n", queries);
+}
+
+int main(void)
+{
+  history_init();
+  test_encoding();
+  test_wrap();
+  test_seqstable();
+  test_query();
+  test_concurrent();
+  return hosttest_done("test_history");
+}
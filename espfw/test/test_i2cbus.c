@@ -0,0 +1,384 @@
+/* ZAMDACH2022 host tests
+ * Tests for i2cbus.c, with a simulated bus as the backend: it logs
+ * every transaction the worker executes, and it can be told to NACK,
+ * to time out, or to wedge (hold SDA low). That covers the queueing,
+ * how results end up in the health counters, the recovery of a wedged
+ * bus, and rerunning the device inits after a recovery - including a
+ * bus that wedges again while the inits run. */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include "i2cbus.h"
+#include "hosttest.h"
+
+#define PORT 0
+#define ADDR_A 0x44 /* a device with an init that has to be rerun */
+#define ADDR_B 0x23 /* a device without */
+#define ADDR_NONE 0x50 /* nobody there */
+
+#define LOGLEN 64
+
+/* The simulated bus. Everything in here is protected by lock. */
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int hold; /* while set, exec waits before doing anything */
+  int inexec; /* exec is waiting because of hold */
+  int sdastuck;
+  int timeouts; /* the next this many transactions time out */
+  int recoverok; /* does a recovery unstick SDA? */
+  int rewedge; /* wedge again on the next this many transactions */
+  int recovers; /* how often recover was called */
+  int execs; /* transactions the worker has started */
+  int nlog;
+  uint8_t logaddr[LOGLEN];
+  uint8_t logtag[LOGLEN]; /* the first byte written, 0xff if none */
+} fb = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .cond = PTHREAD_COND_INITIALIZER,
+  .recoverok = 1,
+};
+
+static esp_err_t fake_exec(int port, struct i2ctrans * t, void * bectx)
+{
+  esp_err_t res = ESP_OK;
+  pthread_mutex_lock(&fb.lock);
+  fb.execs++;
+  fb.inexec = 1;
+  pthread_cond_broadcast(&fb.cond);
+  while (fb.hold) {
+    pthread_cond_wait(&fb.cond, &fb.lock);
+  }
+  fb.inexec = 0;
+  if (fb.nlog < LOGLEN) {
+    fb.logaddr[fb.nlog] = t->ops[0].addr;
+    fb.logtag[fb.nlog] = (t->ops[0].wrlen > 0) ? t->ops[0].wr[0] : 0xff;
+    fb.nlog++;
+  }
+  if (fb.sdastuck) {
+    res = ESP_ERR_TIMEOUT;
+  } else if (fb.rewedge > 0) {
+    fb.rewedge--;
+    fb.sdastuck = 1;
+    res = ESP_ERR_TIMEOUT;
+  } else if (fb.timeouts > 0) {
+    fb.timeouts--;
+    res = ESP_ERR_TIMEOUT;
+  } else {
+    for (int i = 0; i < t->nops; i++) {
+      if ((t->ops[i].addr != ADDR_A) && (t->ops[i].addr != ADDR_B)) {
+        res = ESP_FAIL; /* NACK */
+        break;
+      }
+      for (size_t j = 0; j < t->ops[i].rdlen; j++) {
+        t->ops[i].rd[j] = t->ops[i].addr + j;
+      }
+    }
+  }
+  pthread_mutex_unlock(&fb.lock);
+  return res;
+}
+
+static int fake_sdastuck(int port, void * bectx)
+{
+  pthread_mutex_lock(&fb.lock);
+  int res = fb.sdastuck;
+  pthread_mutex_unlock(&fb.lock);
+  return res;
+}
+
+static int fake_recover(int port, void * bectx)
+{
+  pthread_mutex_lock(&fb.lock);
+  fb.recovers++;
+  if (fb.recoverok) {
+    fb.sdastuck = 0;
+  }
+  int res = fb.sdastuck;
+  pthread_mutex_unlock(&fb.lock);
+  return res;
+}
+
+static const struct i2cbackend fakebackend = {
+  .exec = fake_exec,
+  .sdastuck = fake_sdastuck,
+  .recover = fake_recover,
+};
+
+static void fake_reset(void)
+{
+  pthread_mutex_lock(&fb.lock);
+  fb.hold = 0;
+  fb.sdastuck = 0;
+  fb.timeouts = 0;
+  fb.recoverok = 1;
+  fb.rewedge = 0;
+  fb.recovers = 0;
+  fb.execs = 0;
+  fb.nlog = 0;
+  pthread_mutex_unlock(&fb.lock);
+}
+
+static void fake_hold(int hold)
+{
+  pthread_mutex_lock(&fb.lock);
+  fb.hold = hold;
+  pthread_cond_broadcast(&fb.cond);
+  pthread_mutex_unlock(&fb.lock);
+}
+
+/* Waits until the worker is sitting in exec because of hold. */
+static void fake_waitinexec(void)
+{
+  pthread_mutex_lock(&fb.lock);
+  while (!fb.inexec) {
+    pthread_cond_wait(&fb.cond, &fb.lock);
+  }
+  pthread_mutex_unlock(&fb.lock);
+}
+
+/* Waits until the worker has started n transactions since the last
+ * fake_reset(), i.e. has taken them out of the queue. */
+static void fake_waitexecs(int n)
+{
+  pthread_mutex_lock(&fb.lock);
+  while (fb.execs < n) {
+    pthread_cond_wait(&fb.cond, &fb.lock);
+  }
+  pthread_mutex_unlock(&fb.lock);
+}
+
+/* The reinit of device A: writes its three config registers, the way
+ * a sensor driver would. */
+static int reinitcalls = 0;
+static int reinitdepth = 0;
+static int reinitmaxdepth = 0;
+static esp_err_t reinitres[3];
+
+static void deva_reinit(void)
+{
+  static const uint8_t cfg[3][2] = { { 0xc1, 0x01 }, { 0xc2, 0x02 }, { 0xc3, 0x03 } };
+  reinitcalls++;
+  reinitdepth++;
+  if (reinitdepth > reinitmaxdepth) {
+    reinitmaxdepth = reinitdepth;
+  }
+  for (int i = 0; i < 3; i++) {
+    reinitres[i] = i2cbus_write(PORT, ADDR_A, cfg[i], 2, 10);
+  }
+  reinitdepth--;
+}
+
+static void getdev(uint8_t addr, struct i2cdevstats * st)
+{
+  for (int i = 0; i2cbus_getdevstats(PORT, i, st) == 0; i++) {
+    if (st->addr == addr) {
+      return;
+    }
+  }
+  memset(st, 0, sizeof(struct i2cdevstats));
+}
+
+static int donecount = 0;
+static void countdone(struct i2ctrans * t)
+{
+  /* Only ever called from the worker task, so no lock needed. */
+  donecount++;
+}
+
+/* Transactions are executed in the order they were submitted, and
+ * the queue refuses what does not fit. */
+static void test_ordering(void)
+{
+  struct i2ctrans t[I2CBUS_QUEUELEN + 2];
+  uint8_t tags[I2CBUS_QUEUELEN + 2];
+  struct i2cbusstats before, after;
+  fake_reset();
+  i2cbus_getstats(PORT, &before);
+  fake_hold(1);
+  memset(t, 0, sizeof(t));
+  for (int i = 0; i < I2CBUS_QUEUELEN + 2; i++) {
+    tags[i] = i;
+    t[i].nops = 1;
+    t[i].ops[0].addr = (i & 1) ? ADDR_B : ADDR_A;
+    t[i].ops[0].wr = &tags[i];
+    t[i].ops[0].wrlen = 1;
+    t[i].timeoutms = 10;
+    t[i].done = countdone;
+  }
+  /* The first one is taken by the worker, which then blocks in exec,
+   * the next QUEUELEN fill the queue, the last one does not fit. */
+  CHECK(i2cbus_submit(PORT, &t[0]) == 0);
+  fake_waitinexec();
+  for (int i = 1; i <= I2CBUS_QUEUELEN; i++) {
+    CHECK(i2cbus_submit(PORT, &t[i]) == 0);
+  }
+  CHECK(i2cbus_submit(PORT, &t[I2CBUS_QUEUELEN + 1]) == 1);
+  fake_hold(0);
+  /* A synchronous transaction goes to the back of the queue, so once
+   * it is done, everything before it is done too. It has to wait for
+   * the worker to make room first, or it is refused as well. */
+  fake_waitexecs(2);
+  uint8_t rd[2];
+  CHECK(i2cbus_read(PORT, ADDR_B, rd, 2, 10) == ESP_OK);
+  CHECK((rd[0] == ADDR_B) && (rd[1] == ADDR_B + 1));
+  CHECK(donecount == I2CBUS_QUEUELEN + 1);
+  CHECK(fb.nlog == I2CBUS_QUEUELEN + 2);
+  for (int i = 0; i <= I2CBUS_QUEUELEN; i++) {
+    CHECK(fb.logtag[i] == i);
+    CHECK(t[i].res == ESP_OK);
+  }
+  i2cbus_getstats(PORT, &after);
+  CHECK(after.queuefull == before.queuefull + 1);
+  CHECK(after.transactions == before.transactions + I2CBUS_QUEUELEN + 2);
+}
+
+/* OK, NACK and timeout end up in the right counters. */
+static void test_results(void)
+{
+  struct i2cdevstats a0, a1, n0, n1;
+  struct i2cbusstats s0, s1;
+  uint8_t b = 0x42;
+  fake_reset();
+  getdev(ADDR_A, &a0);
+  getdev(ADDR_NONE, &n0);
+  i2cbus_getstats(PORT, &s0);
+  CHECK(i2cbus_write(PORT, ADDR_A, &b, 1, 10) == ESP_OK);
+  CHECK(i2cbus_write(PORT, ADDR_NONE, &b, 1, 10) == ESP_FAIL);
+  fb.timeouts = 1;
+  CHECK(i2cbus_write(PORT, ADDR_A, &b, 1, 10) == ESP_ERR_TIMEOUT);
+  getdev(ADDR_A, &a1);
+  getdev(ADDR_NONE, &n1);
+  i2cbus_getstats(PORT, &s1);
+  CHECK(a1.ok == a0.ok + 1);
+  CHECK(a1.timeouts == a0.timeouts + 1);
+  CHECK(a1.nacks == a0.nacks);
+  CHECK(n1.nacks == n0.nacks + 1);
+  CHECK(s1.errors == s0.errors + 1);
+  CHECK(s1.timeouts == s0.timeouts + 1);
+  /* One timeout is not a wedged bus. */
+  CHECK(s1.recoveries == s0.recoveries);
+  /* Neither is a bad transaction. */
+  struct i2ctrans t;
+  memset(&t, 0, sizeof(t));
+  CHECK(i2cbus_exec(PORT, &t) == ESP_ERR_INVALID_STATE);
+}
+
+/* Timeouts in a row count as wedged, and a successful recovery makes
+ * device A rerun its init before its next transaction, but not B. */
+static void test_timeoutrecovery(void)
+{
+  struct i2cbusstats s0, s1;
+  struct i2cdevstats a0, a1, b0, b1;
+  uint8_t b = 0x42;
+  fake_reset();
+  reinitcalls = 0;
+  i2cbus_getstats(PORT, &s0);
+  getdev(ADDR_A, &a0);
+  getdev(ADDR_B, &b0);
+  fb.timeouts = I2CBUS_WEDGETIMEOUTS;
+  for (int i = 0; i < I2CBUS_WEDGETIMEOUTS; i++) {
+    CHECK(i2cbus_write(PORT, ADDR_B, &b, 1, 10) == ESP_ERR_TIMEOUT);
+  }
+  i2cbus_getstats(PORT, &s1);
+  CHECK(s1.recoveries == s0.recoveries + 1);
+  CHECK(s1.recoveryfails == s0.recoveryfails);
+  CHECK(fb.recovers == 1);
+  CHECK(reinitcalls == 0); /* nobody talked to A yet */
+  CHECK(i2cbus_write(PORT, ADDR_B, &b, 1, 10) == ESP_OK);
+  CHECK(reinitcalls == 0);
+  fb.nlog = 0;
+  CHECK(i2cbus_write(PORT, ADDR_A, &b, 1, 10) == ESP_OK);
+  CHECK(reinitcalls == 1);
+  /* The init went onto the bus first, then the transaction. */
+  CHECK(fb.nlog == 4);
+  CHECK((fb.logtag[0] == 0xc1) && (fb.logtag[2] == 0xc3) && (fb.logtag[3] == 0x42));
+  CHECK(i2cbus_write(PORT, ADDR_A, &b, 1, 10) == ESP_OK);
+  CHECK(reinitcalls == 1); /* only once */
+  getdev(ADDR_A, &a1);
+  getdev(ADDR_B, &b1);
+  CHECK(a1.reinits == a0.reinits + 1);
+  CHECK(b1.reinits == b0.reinits);
+}
+
+/* SDA held low and the recovery does not help: every failed
+ * transaction tries another recovery, but the inits are not rerun while
+ * the bus is still stuck. Once it recovers, they are, once. */
+static void test_wedged(void)
+{
+  struct i2cbusstats s0, s1;
+  uint8_t b = 0x42;
+  fake_reset();
+  reinitcalls = 0;
+  reinitmaxdepth = 0;
+  i2cbus_getstats(PORT, &s0);
+  fb.sdastuck = 1;
+  fb.recoverok = 0;
+  for (int i = 0; i < 3; i++) {
+    CHECK(i2cbus_write(PORT, ADDR_A, &b, 1, 10) == ESP_ERR_TIMEOUT);
+  }
+  i2cbus_getstats(PORT, &s1);
+  CHECK(s1.recoveries == s0.recoveries + 3);
+  CHECK(s1.recoveryfails == s0.recoveryfails + 3);
+  CHECK(reinitcalls == 0);
+  CHECK(fb.nlog == 3);
+  pthread_mutex_lock(&fb.lock);
+  fb.recoverok = 1;
+  pthread_mutex_unlock(&fb.lock);
+  CHECK(i2cbus_write(PORT, ADDR_A, &b, 1, 10) == ESP_ERR_TIMEOUT);
+  i2cbus_getstats(PORT, &s1);
+  CHECK(s1.recoveryfails == s0.recoveryfails + 3);
+  CHECK(i2cbus_write(PORT, ADDR_A, &b, 1, 10) == ESP_OK);
+  CHECK(reinitcalls == 1);
+  CHECK(reinitmaxdepth == 1);
+  CHECK((reinitres[0] == ESP_OK) && (reinitres[2] == ESP_OK));
+}
+
+/* The nasty case: the recovery works, but the bus wedges again while
+ * the init of device A runs. That recovery flags A again, but the init
+ * must not be started from within itself - it is rerun before the next
+ * transaction instead. */
+static void test_rewedgeinreinit(void)
+{
+  uint8_t b = 0x42;
+  fake_reset();
+  reinitcalls = 0;
+  reinitmaxdepth = 0;
+  /* Get A flagged. */
+  fb.sdastuck = 1;
+  CHECK(i2cbus_write(PORT, ADDR_B, &b, 1, 10) == ESP_ERR_TIMEOUT);
+  CHECK(fb.recovers == 1);
+  /* Each of the three writes of the init wedges the bus again, and
+   * each time the recovery succeeds and flags A. */
+  fb.rewedge = 3;
+  CHECK(i2cbus_write(PORT, ADDR_A, &b, 1, 10) == ESP_OK);
+  CHECK(reinitcalls == 1);
+  CHECK(reinitmaxdepth == 1);
+  CHECK((reinitres[0] == ESP_ERR_TIMEOUT) && (reinitres[2] == ESP_ERR_TIMEOUT));
+  CHECK(fb.recovers == 4);
+  /* The transaction that started it all went through, and the init
+   * that failed is rerun before the next one. */
+  CHECK(i2cbus_write(PORT, ADDR_A, &b, 1, 10) == ESP_OK);
+  CHECK(reinitcalls == 2);
+  CHECK(reinitmaxdepth == 1);
+  CHECK((reinitres[0] == ESP_OK) && (reinitres[2] == ESP_OK));
+  CHECK(i2cbus_write(PORT, ADDR_A, &b, 1, 10) == ESP_OK);
+  CHECK(reinitcalls == 2);
+}
+
+int main(void)
+{
+  struct i2cbusconfig conf = { .sdapin = 21, .sclpin = 22, .sclhz = 100000 };
+  i2cbus_setbackend(PORT, &fakebackend);
+  CHECK(i2cbus_adddevice(PORT, ADDR_A, "A", 100000, deva_reinit) == 0);
+  CHECK(i2cbus_init(PORT, &conf) == 0);
+  CHECK(i2cbus_adddevice(PORT, ADDR_B, "B", 100000, NULL) == 0);
+  CHECK(i2cbus_adddevice(PORT, ADDR_NONE, "none", 100000, NULL) == 0);
+  test_ordering();
+  test_results();
+  test_timeoutrecovery();
+  test_wedged();
+  test_rewedgeinreinit();
+  return hosttest_done("test_i2cbus");
+}
@@ -0,0 +1,104 @@
+/* ZAMDACH2022 host tests
+ * Tests for influx.c: the line protocol it sends, received on a local
+ * UDP socket. The Makefile points CONFIG_ZAMDACH_INFLUX_HOST/_PORT at
+ * that socket. */
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include <lwip/sockets.h>
+#include "influx.h"
+#include "sdkconfig.h"
+#include "hosttest.h"
+
+/* influx.c puts this into its lines. */
+char chipid[30] = "testchip";
+
+static int rsock;
+
+/* Receives one datagram into buf, returns its length, or -1 if none
+ * arrived within 200 ms. */
+static int receive(char * buf, size_t len)
+{
+  int r = recv(rsock, buf, len - 1, 0);
+  buf[(r > 0) ? r : 0] = 0;
+  return r;
+}
+
+static void mkev(struct ev * e)
+{
+  memset(e, 0, sizeof(struct ev));
+  e->lastupd = 1700000000;
+  e->lastsht4xheat = 1699999400;
+  e->temp = 21.456;
+  e->hum = 55.5;
+  e->press = 1013.25;
+  e->pm010 = 1.2;
+  e->pm025 = 2.5;
+  e->pm040 = 4.1;
+  e->pm100 = 10.3;
+  e->lux = 12345.678;
+  e->uvind = 3.14;
+  e->raing = 0.25;
+  e->windspeed = 12.3;
+  e->windspmax = 23.4;
+  e->winddirdeg = 270.0;
+}
+
+static void test_lines(void)
+{
+  char buf[1024];
+  struct ev e;
+  mkev(&e);
+  /* Before the lookup, nothing is sent - and nothing is looked up. */
+  influx_send(&e);
+  CHECK(receive(buf, sizeof(buf)) < 0);
+  influx_resolve();
+  influx_send(&e);
+  CHECK(receive(buf, sizeof(buf)) > 0);
+  CHECKSTR(buf, "zamdach,chipid=testchip temp=21.46,hum=55.50,press=1013.250,"
+                "pm010=1.2,pm025=2.5,pm040=4.1,pm100=10.3,lux=12345.68,uvind=3.14,"
+                "raing=0.25,windspeed=12.3,windspmax=23.4,winddirdeg=270.0,"
+                "lastsht4xheat=1699999400i 1700000000000000000\n");
+  /* Values that are not there are left out, also the first one. */
+  e.temp = NAN;
+  e.uvind = NAN;
+  e.winddirdeg = -1.0;
+  e.lastupd = 0;
+  influx_send(&e);
+  CHECK(receive(buf, sizeof(buf)) > 0);
+  CHECKSTR(buf, "zamdach,chipid=testchip hum=55.50,press=1013.250,"
+                "pm010=1.2,pm025=2.5,pm040=4.1,pm100=10.3,lux=12345.68,"
+                "raing=0.25,windspeed=12.3,windspmax=23.4,"
+                "lastsht4xheat=1699999400i\n");
+  /* A line without any field is not valid, so nothing is sent. */
+  e.hum = e.press = e.pm010 = e.pm025 = e.pm040 = e.pm100 = NAN;
+  e.lux = e.raing = e.windspeed = e.windspmax = NAN;
+  influx_send(&e);
+  CHECK(receive(buf, sizeof(buf)) < 0);
+  /* Looking up again does not change anything. */
+  influx_resolve();
+  mkev(&e);
+  influx_send(&e);
+  CHECK(receive(buf, sizeof(buf)) > 0);
+  CHECK(strncmp(buf, "zamdach,chipid=testchip temp=21.46,", 35) == 0);
+  CHECK(receive(buf, sizeof(buf)) < 0);
+}
+
+int main(void)
+{
+  struct sockaddr_in sa = { .sin_family = AF_INET,
+                            .sin_port = htons(CONFIG_ZAMDACH_INFLUX_PORT) };
+  struct timeval tv = { .tv_sec = 0, .tv_usec = 200000 };
+  inet_pton(AF_INET, CONFIG_ZAMDACH_INFLUX_HOST, &sa.sin_addr);
+  rsock = socket(AF_INET, SOCK_DGRAM, 0);
+  if ((rsock < 0) || (bind(rsock, (struct sockaddr *)&sa, sizeof(sa)) != 0)) {
+    printf("test_influx: cannot listen on UDP port %d\n", CONFIG_ZAMDACH_INFLUX_PORT);
+    return 1;
+  }
+  setsockopt(rsock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  test_lines();
+  close(rsock);
+  return hosttest_done("test_influx");
+}
@@ -0,0 +1,271 @@
+/* ZAMDACH2022 host tests
+ * Tests for POST /otaupload (otaupload.c) and the writer task in
+ * ota.c, on a simulated flash. The flash only takes images that start
+ * like an ESP32 app image, and notes which task writes to it: that
+ * must never be the webserver task, which has too little stack for
+ * esp_ota_write() and esp_ota_end(). */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <esp_ota_ops.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include "ota.h"
+#include "otaupload.h"
+#include "hosttest.h"
+
+#define IMAGEMAX (256 * 1024)
+
+static const esp_partition_t fakepart = { .label = "ota_1", .size = IMAGEMAX };
+
+static struct {
+  uint8_t image[IMAGEMAX];
+  size_t len;
+  int open; /* between esp_ota_begin() and esp_ota_end() / _abort() */
+  int begins;
+  int aborts;
+  int ends;
+  int bootset;
+  int writes;
+  size_t maxwrite;
+  int onwebserver; /* calls from the task that runs the handler */
+  TaskHandle_t webservertask;
+  int writedelayus; /* how long a write takes */
+  int failbegin;
+  int failend; /* the image does not verify */
+} ff;
+
+static void fake_reset(void)
+{
+  memset(&ff, 0, sizeof(ff));
+  ff.webservertask = xTaskGetCurrentTaskHandle();
+}
+
+static void fake_notewebserver(void)
+{
+  if (xTaskGetCurrentTaskHandle() == ff.webservertask) {
+    ff.onwebserver++;
+  }
+}
+
+const esp_partition_t * esp_ota_get_next_update_partition(const esp_partition_t * start)
+{
+  return &fakepart;
+}
+
+esp_err_t esp_ota_begin(const esp_partition_t * part, size_t imagesize, esp_ota_handle_t * h)
+{
+  fake_notewebserver();
+  ff.begins++;
+  if (ff.failbegin) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  CHECK(!ff.open);
+  ff.open = 1;
+  ff.len = 0;
+  *h = 42;
+  return ESP_OK;
+}
+
+esp_err_t esp_ota_write(esp_ota_handle_t h, const void * data, size_t size)
+{
+  fake_notewebserver();
+  CHECK(ff.open && (h == 42));
+  ff.writes++;
+  if (size > ff.maxwrite) { ff.maxwrite = size; }
+  if ((ff.len == 0) && (((const uint8_t *)data)[0] != 0xE9)) {
+    return ESP_ERR_OTA_VALIDATE_FAILED;
+  }
+  if (ff.len + size > IMAGEMAX) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+  if (ff.writedelayus > 0) {
+    usleep(ff.writedelayus);
+  }
+  memcpy(&ff.image[ff.len], data, size);
+  ff.len += size;
+  return ESP_OK;
+}
+
+esp_err_t esp_ota_end(esp_ota_handle_t h)
+{
+  fake_notewebserver();
+  CHECK(ff.open);
+  ff.open = 0;
+  ff.ends++;
+  return (ff.failend) ? ESP_ERR_OTA_VALIDATE_FAILED : ESP_OK;
+}
+
+esp_err_t esp_ota_abort(esp_ota_handle_t h)
+{
+  fake_notewebserver();
+  CHECK(ff.open);
+  ff.open = 0;
+  ff.aborts++;
+  return ESP_OK;
+}
+
+esp_err_t esp_ota_set_boot_partition(const esp_partition_t * part)
+{
+  fake_notewebserver();
+  CHECK(part == &fakepart);
+  ff.bootset++;
+  return ESP_OK;
+}
+
+static char * mkimage(size_t len)
+{
+  char * img = malloc(len);
+  for (size_t i = 0; i < len; i++) {
+    img[i] = (char)((i * 7919) >> 3);
+  }
+  img[0] = (char)0xE9;
+  return img;
+}
+
+/* POSTs body to /otaupload. Returns what otaupload_recv() returned. */
+static esp_err_t post(httpd_req_t * r, struct hostreq * h, const char * hdrs,
+                      const char * body, size_t len, int * reboot)
+{
+  hostreq_init(r, h, HTTP_POST, "/otaupload", hdrs, body, len);
+  return otaupload_recv(r, reboot);
+}
+
+static const char * pwhdr = "X-Updatepw: adminpw\r\n";
+
+/* A slow sender and a slow flash: the image arrives in odd sized
+ * pieces with timeouts in between, and still gets written in full
+ * buffers, by the writer task. */
+static void test_ok(void)
+{
+  httpd_req_t r;
+  struct hostreq h;
+  struct otastatus st;
+  int reboot;
+  size_t len = 100000;
+  char * img = mkimage(len);
+  fake_reset();
+  ff.writedelayus = 200;
+  hostreq_init(&r, &h, HTTP_POST, "/otaupload", pwhdr, img, len);
+  h.maxrecv = 1000;
+  h.recvtimeouts = 4;
+  CHECK(otaupload_recv(&r, &reboot) == ESP_OK);
+  CHECK(reboot == 1);
+  CHECKSTR(h.status, "200 OK");
+  CHECK(strncmp(h.resp, "OK, received and verified 100000 bytes", 38) == 0);
+  CHECK((ff.len == len) && (memcmp(ff.image, img, len) == 0));
+  CHECK((ff.begins == 1) && (ff.ends == 1) && (ff.bootset == 1) && (ff.aborts == 0));
+  CHECK(ff.maxwrite == OTA_PUSHBUFSIZE);
+  CHECK(ff.writes == (int)((len + OTA_PUSHBUFSIZE - 1) / OTA_PUSHBUFSIZE));
+  CHECK(ff.onwebserver == 0);
+  ota_getstatus(&st);
+  CHECK(st.state == OTASTATE_SUCCESS);
+  CHECK((st.bytesdone == (long)len) && (st.imagesize == (long)len));
+  hostreq_free(&h);
+  free(img);
+}
+
+static void test_refused(void)
+{
+  httpd_req_t r;
+  struct hostreq h;
+  int reboot;
+  char * img = mkimage(10000);
+  fake_reset();
+  CHECK(post(&r, &h, NULL, img, 10000, &reboot) == ESP_OK);
+  CHECKSTR(h.status, "403 Forbidden");
+  hostreq_free(&h);
+  CHECK(post(&r, &h, "X-Updatepw: adminpwx\r\n", img, 10000, &reboot) == ESP_OK);
+  CHECKSTR(h.status, "403 Forbidden");
+  hostreq_free(&h);
+  CHECK(post(&r, &h, pwhdr, img, 0, &reboot) == ESP_OK);
+  CHECKSTR(h.status, "400 Bad Request");
+  CHECK(reboot == 0);
+  hostreq_free(&h);
+  CHECK(ff.begins == 0);
+  /* Only one update at a time */
+  CHECK(ota_pushbegin(10000) == 0);
+  CHECK(post(&r, &h, pwhdr, img, 10000, &reboot) == ESP_OK);
+  CHECKSTR(h.status, "503 Service Unavailable");
+  CHECK(reboot == 0);
+  hostreq_free(&h);
+  CHECK(ota_pushfinish(1) == 1);
+  CHECK(ff.aborts == 1);
+  /* The flash cannot be written */
+  fake_reset();
+  ff.failbegin = 1;
+  CHECK(post(&r, &h, pwhdr, img, 10000, &reboot) == ESP_OK);
+  CHECKSTR(h.status, "503 Service Unavailable");
+  CHECK(ff.begins == 1);
+  hostreq_free(&h);
+  free(img);
+}
+
+/* Things that go wrong halfway. Every time, the update has to be
+ * aborted, and the next one has to work. */
+static void test_failures(void)
+{
+  httpd_req_t r;
+  struct hostreq h;
+  struct otastatus st;
+  int reboot;
+  size_t len = 50000;
+  char * img = mkimage(len);
+
+  /* Not a firmware image */
+  fake_reset();
+  img[0] = 0;
+  CHECK(post(&r, &h, pwhdr, img, len, &reboot) == ESP_OK);
+  CHECKSTR(h.status, "400 Bad Request");
+  CHECK(strstr(h.resp, "Writing the image failed") != NULL);
+  CHECK((reboot == 0) && (ff.aborts == 1) && (ff.bootset == 0) && (!ff.open));
+  ota_getstatus(&st);
+  CHECK(st.state == OTASTATE_FAILED);
+  hostreq_free(&h);
+  img[0] = (char)0xE9;
+
+  /* Does not verify */
+  fake_reset();
+  ff.failend = 1;
+  CHECK(post(&r, &h, pwhdr, img, len, &reboot) == ESP_OK);
+  CHECKSTR(h.status, "400 Bad Request");
+  CHECK(strstr(h.resp, "failed verification") != NULL);
+  CHECK((reboot == 0) && (ff.ends == 1) && (ff.bootset == 0));
+  hostreq_free(&h);
+
+  /* The sender goes away: less body than announced */
+  fake_reset();
+  hostreq_init(&r, &h, HTTP_POST, "/otaupload", pwhdr, img, len);
+  r.content_len = len + 1;
+  CHECK(otaupload_recv(&r, &reboot) == ESP_FAIL);
+  CHECKSTR(h.status, "408");
+  CHECK((reboot == 0) && (ff.aborts == 1) && (!ff.open));
+  hostreq_free(&h);
+
+  /* The sender stops sending */
+  fake_reset();
+  hostreq_init(&r, &h, HTTP_POST, "/otaupload", pwhdr, img, len);
+  h.recvtimeouts = 5;
+  CHECK(otaupload_recv(&r, &reboot) == ESP_FAIL);
+  CHECKSTR(h.status, "408");
+  CHECK((ff.aborts == 1) && (!ff.open));
+  hostreq_free(&h);
+
+  CHECK(ff.onwebserver == 0);
+  /* After all that */
+  fake_reset();
+  CHECK(post(&r, &h, pwhdr, img, len, &reboot) == ESP_OK);
+  CHECK((reboot == 1) && (ff.len == len) && (ff.bootset == 1));
+  hostreq_free(&h);
+  free(img);
+}
+
+int main(void)
+{
+  test_ok();
+  test_refused();
+  test_failures();
+  return hosttest_done("test_otaupload");
+}
@@ -0,0 +1,215 @@
+/* ZAMDACH2022 host tests
+ * Tests for the admission control in ratelimit.c: the token bucket
+ * per client, the limit on connections per client, what happens when
+ * there are more clients than the table has room for, and that one
+ * greedy client cannot take away from the others. The clock is
+ * simulated, so nothing here actually waits. */
+
+#include <stdio.h>
+#include <string.h>
+#include "ratelimit.h"
+#include "hosttest.h"
+
+/* The simulated clock for ratelimit.c, in microseconds. */
+static int64_t nowus = 1000000000LL;
+
+int64_t esp_timer_get_time(void)
+{
+  return nowus;
+}
+
+static void advancems(int64_t ms)
+{
+  nowus += ms * 1000;
+}
+
+/* Makes IPv4-mapped address 10.0.x.y */
+static void mkip(uint8_t ip[16], int n)
+{
+  memset(ip, 0, 16);
+  ip[10] = 0xff;
+  ip[11] = 0xff;
+  ip[12] = 10;
+  ip[13] = 0;
+  ip[14] = n >> 8;
+  ip[15] = n & 0xff;
+}
+
+/* Sends n requests right after another, returns how many got through. */
+static int burst(const uint8_t ip[16], int n, int cost)
+{
+  int ok = 0;
+  for (int i = 0; i < n; i++) {
+    if (ratelimit_request(ip, cost) == 0) { ok++; }
+  }
+  return ok;
+}
+
+/* A new client gets its burst, and not one request more. */
+static void test_burst(void)
+{
+  uint8_t ip[16];
+  struct ratelimitstats s0, s1;
+  ratelimit_getstats(&s0);
+  mkip(ip, 1);
+  CHECK(burst(ip, RATELIMIT_BURST + 10, 1) == RATELIMIT_BURST);
+  ratelimit_getstats(&s1);
+  CHECK(s1.allowed == s0.allowed + RATELIMIT_BURST);
+  CHECK(s1.limited == s0.limited + 10);
+  /* The expensive pages use up the burst faster. A heavy request
+   * that does not fit is refused even if a cheap one would fit. */
+  mkip(ip, 2);
+  CHECK(burst(ip, 100, RATELIMIT_HEAVY) == RATELIMIT_BURST / RATELIMIT_HEAVY);
+  CHECK(burst(ip, 100, 1) == RATELIMIT_BURST % RATELIMIT_HEAVY);
+  advancems(10000);
+}
+
+/* Tokens come back at RATELIMIT_PERSEC, also if the client asks
+ * every few milliseconds, and never beyond the burst. */
+static void test_refill(void)
+{
+  uint8_t ip[16];
+  const int64_t pertoken = 1000 / RATELIMIT_PERSEC;
+  mkip(ip, 3);
+  CHECK(burst(ip, RATELIMIT_BURST, 1) == RATELIMIT_BURST);
+  CHECK(ratelimit_request(ip, 1) == 1);
+  advancems(pertoken - 1);
+  CHECK(ratelimit_request(ip, 1) == 1);
+  advancems(1);
+  CHECK(ratelimit_request(ip, 1) == 0);
+  CHECK(ratelimit_request(ip, 1) == 1);
+  /* Asking every millisecond must not lose the fractions. */
+  int ok = 0;
+  for (int i = 0; i < 10000; i++) {
+    advancems(1);
+    ok += (ratelimit_request(ip, 1) == 0);
+  }
+  CHECK(ok == 10 * RATELIMIT_PERSEC);
+  /* A long break fills the bucket, but only up to the burst. */
+  advancems(3600 * 1000);
+  CHECK(burst(ip, 1000, 1) == RATELIMIT_BURST);
+  advancems(10000);
+}
+
+/* At most RATELIMIT_MAXCONNS connections per client, independent of
+ * other clients, and closing one makes room again. */
+static void test_conncap(void)
+{
+  uint8_t a[16], b[16];
+  struct ratelimitstats s0, s1;
+  mkip(a, 4);
+  mkip(b, 5);
+  ratelimit_getstats(&s0);
+  for (int i = 0; i < RATELIMIT_MAXCONNS; i++) {
+    CHECK(ratelimit_connopen(100 + i, a) == 0);
+  }
+  CHECK(ratelimit_connopen(100 + RATELIMIT_MAXCONNS, a) == 1);
+  CHECK(ratelimit_connopen(110, b) == 0);
+  ratelimit_getstats(&s1);
+  CHECK(s1.connsrejected == s0.connsrejected + 1);
+  /* Closing something we never tracked, or twice, changes nothing. */
+  ratelimit_connclose(100 + RATELIMIT_MAXCONNS);
+  ratelimit_connclose(999);
+  CHECK(ratelimit_connopen(111, a) == 1);
+  ratelimit_connclose(101);
+  ratelimit_connclose(101);
+  CHECK(ratelimit_connopen(111, a) == 0);
+  CHECK(ratelimit_connopen(112, a) == 1);
+  for (int i = 0; i < RATELIMIT_MAXCONNS; i++) {
+    ratelimit_connclose(100 + i);
+  }
+  ratelimit_connclose(110);
+  ratelimit_connclose(111);
+  advancems(10000);
+}
+
+/* More clients than the table holds: the one that has been quiet the
+ * longest is forgotten, but never one with connections open, and a
+ * client that is busy being limited is not forgotten either. */
+static void test_eviction(void)
+{
+  uint8_t a[16], greedy[16], ip[16];
+  struct ratelimitstats s0, s1;
+  /* a has a connection open and is the quietest of them all. */
+  mkip(a, 6);
+  CHECK(ratelimit_connopen(120, a) == 0);
+  CHECK(burst(a, RATELIMIT_BURST, 1) == RATELIMIT_BURST);
+  advancems(1000);
+  mkip(greedy, 7);
+  CHECK(burst(greedy, RATELIMIT_BURST, 1) == RATELIMIT_BURST);
+  ratelimit_getstats(&s0);
+  /* Lots of new clients, each once. greedy keeps asking. */
+  for (int n = 0; n < 4 * RATELIMIT_CLIENTS; n++) {
+    advancems(100);
+    mkip(ip, 1000 + n);
+    CHECK(ratelimit_request(ip, 1) == 0);
+    ratelimit_request(greedy, 1);
+  }
+  ratelimit_getstats(&s1);
+  CHECK(s1.evictions >= s0.evictions + 4 * RATELIMIT_CLIENTS - RATELIMIT_CLIENTS);
+  CHECK(s1.clients <= RATELIMIT_CLIENTS);
+  /* Neither of them got a fresh burst from being forgotten. */
+  CHECK(ratelimit_request(greedy, 1) == 1);
+  CHECK(burst(a, 100, 1) < RATELIMIT_BURST);
+  /* a's connection still counts. */
+  for (int i = 1; i < RATELIMIT_MAXCONNS; i++) {
+    CHECK(ratelimit_connopen(120 + i, a) == 0);
+  }
+  CHECK(ratelimit_connopen(120 + RATELIMIT_MAXCONNS, a) == 1);
+  for (int i = 0; i < RATELIMIT_MAXCONNS; i++) {
+    ratelimit_connclose(120 + i);
+  }
+  advancems(10000);
+}
+
+/* Many clients at the same time, one of them greedy. The others get
+ * everything they ask for, the greedy one gets its burst plus the
+ * refill rate, no matter how many others there are. */
+static void fairness(int nclients)
+{
+  uint8_t greedy[16], ip[16];
+  const int secs = 60;
+  int ok[64] = { 0 };
+  int asked[64] = { 0 };
+  int greedyok = 0;
+  mkip(greedy, 2000 + nclients);
+  /* 10 ms steps. The greedy client asks 20 times per second, every
+   * other client once per second, spread out over the second. */
+  for (int step = 0; step < secs * 100; step++) {
+    advancems(10);
+    if ((step % 5) == 0) {
+      greedyok += (ratelimit_request(greedy, 1) == 0);
+    }
+    for (int c = 0; c < nclients; c++) {
+      if ((step % 100) == (c * 100 / nclients)) {
+        mkip(ip, 3000 + 100 * nclients + c);
+        ok[c] += (ratelimit_request(ip, 1) == 0);
+        asked[c]++;
+      }
+    }
+  }
+  for (int c = 0; c < nclients; c++) {
+    CHECK(ok[c] == asked[c]);
+  }
+  int expect = RATELIMIT_BURST + secs * RATELIMIT_PERSEC;
+  CHECK((greedyok >= expect - 1) && (greedyok <= expect + 1));
+  advancems(10000);
+}
+
+static void test_fairness(void)
+{
+  /* All fit into the table. */
+  fairness(RATELIMIT_CLIENTS - 1);
+  /* Far more than fit: they are forgotten and come back all the time. */
+  fairness(8 * RATELIMIT_CLIENTS);
+}
+
+int main(void)
+{
+  test_burst();
+  test_refill();
+  test_conncap();
+  test_eviction();
+  test_fairness();
+  return hosttest_done("test_ratelimit");
+}
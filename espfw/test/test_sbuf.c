@@ -0,0 +1,180 @@
+/* ZAMDACH2022 host tests
+ * Tests for the append-only string buffer in sbuf.c. */
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include "hosttest.h"
+#include "sbuf.h"
+
+/* A buffer with guard bytes behind it, to catch writes past cap. */
+#define GUARD 16
+static char gbuf[256 + GUARD];
+
+static void guardinit(size_t cap)
+{
+  memset(gbuf, 'X', sizeof(gbuf));
+  (void)cap;
+}
+
+static int guardok(size_t cap)
+{
+  for (size_t i = cap; i < (cap + GUARD); i++) {
+    if (gbuf[i] != 'X') { return 0; }
+  }
+  return 1;
+}
+
+static void test_exactfit(void)
+{
+  struct sbuf sb;
+  /* "hello" and the terminating 0 fill 6 bytes exactly. */
+  guardinit(6);
+  sbuf_init(&sb, gbuf, 6);
+  sbuf_puts(&sb, "hel");
+  sbuf_putc(&sb, 'l');
+  sbuf_putn(&sb, "ox", 1);
+  CHECKSTR(sb.buf, "hello");
+  CHECK(sb.len == 5);
+  CHECK(sb.overflow == 0);
+  CHECK(guardok(6));
+  /* Appending nothing to a full buffer is fine too. */
+  sbuf_puts(&sb, "");
+  CHECK(sb.overflow == 0);
+  /* But one more character is not. */
+  sbuf_putc(&sb, '!');
+  CHECKSTR(sb.buf, "hello");
+  CHECK(sb.overflow == 1);
+  CHECK(guardok(6));
+  /* A capacity of 1 only holds the terminating 0. */
+  guardinit(1);
+  sbuf_init(&sb, gbuf, 1);
+  sbuf_putll(&sb, 7);
+  CHECKSTR(sb.buf, "");
+  CHECK(sb.overflow == 1);
+  CHECK(guardok(1));
+}
+
+static void test_overflow(void)
+{
+  struct sbuf sb;
+  guardinit(8);
+  sbuf_init(&sb, gbuf, 8);
+  sbuf_puts(&sb, "abcdef");
+  sbuf_puts(&sb, "ghijkl");
+  /* As much as fits, and always terminated. */
+  CHECKSTR(sb.buf, "abcdefg");
+  CHECK(sb.len == 7);
+  CHECK(sb.overflow == 1);
+  CHECK(guardok(8));
+  /* The flag stays set, even if later appends would fit. */
+  sbuf_puts(&sb, "");
+  CHECKSTR(sb.buf, "abcdefg");
+  CHECK(sb.overflow == 1);
+  /* Numbers get truncated like strings. */
+  guardinit(5);
+  sbuf_init(&sb, gbuf, 5);
+  sbuf_putll(&sb, -123456);
+  CHECKSTR(sb.buf, "-123");
+  CHECK(sb.overflow == 1);
+  CHECK(guardok(5));
+  guardinit(4);
+  sbuf_init(&sb, gbuf, 4);
+  sbuf_putfloat(&sb, 3.25f, 2);
+  CHECKSTR(sb.buf, "3.2");
+  CHECK(sb.overflow == 1);
+  CHECK(guardok(4));
+}
+
+static void test_putll(void)
+{
+  char buf[64];
+  struct sbuf sb;
+  const long long vals[] = { 0, 1, -1, 9, 10, 1672531200LL, -2147483648LL,
+                             9223372036854775807LL, (-9223372036854775807LL - 1) };
+  for (size_t i = 0; i < (sizeof(vals) / sizeof(vals[0])); i++) {
+    char exp[64];
+    snprintf(exp, sizeof(exp), "%lld", vals[i]);
+    sbuf_init(&sb, buf, sizeof(buf));
+    sbuf_putll(&sb, vals[i]);
+    CHECKSTR(sb.buf, exp);
+  }
+}
+
+/* sbuf_putfloat is supposed to print exactly what printf prints. */
+static int floatmatches(float v, int decimals)
+{
+  char buf[64];
+  char exp[64];
+  struct sbuf sb;
+  sbuf_init(&sb, buf, sizeof(buf));
+  sbuf_putfloat(&sb, v, decimals);
+  snprintf(exp, sizeof(exp), "%.*f", decimals, (double)v);
+  if (strcmp(buf, exp) != 0) {
+    fprintf(stderr, "sbuf_putfloat(%.9g, %d): got \"%s\", printf says \"%s\"\n",
+            (double)v, decimals, buf, exp);
+    return 0;
+  }
+  return 1;
+}
+
+static void test_putfloat(void)
+{
+  char buf[64];
+  struct sbuf sb;
+  const float vals[] = { 0.0f, -0.0f, 1.0f, -1.0f, 0.5f, 1.5f, 2.5f, -2.5f,
+                         0.125f, 0.375f, -0.125f, 2.675f, 1.005f, 0.0005f,
+                         -0.0004f, 99.995f, -99.995f, 1013.25f, 1013.245f,
+                         -40.0f, -12.3456f, 0.999999f, -0.999999f, 123456.789f,
+                         9.9999995f, 1.0e-7f, 4294967296.0f, 999999999999.0f };
+  for (size_t i = 0; i < (sizeof(vals) / sizeof(vals[0])); i++) {
+    for (int d = 0; d <= 6; d++) {
+      CHECK(floatmatches(vals[i], d));
+    }
+  }
+  /* A sweep over the range our sensors deliver, in steps that hit a
+   * lot of values ending in 5. */
+  int bad = 0;
+  for (int i = -200000; i <= 200000; i++) {
+    float v = i * 0.0125f;
+    for (int d = 0; d <= 3; d++) {
+      if (!floatmatches(v, d)) { bad++; }
+    }
+    if (bad > 10) { break; }
+  }
+  CHECK(bad == 0);
+  /* Out of range decimals are clamped. */
+  sbuf_init(&sb, buf, sizeof(buf));
+  sbuf_putfloat(&sb, 1.5f, -3);
+  sbuf_putc(&sb, ' ');
+  sbuf_putfloat(&sb, 1.5f, 9);
+  CHECKSTR(sb.buf, "2 1.500000");
+  sbuf_init(&sb, buf, sizeof(buf));
+  sbuf_putfloat(&sb, NAN, 2);
+  sbuf_putc(&sb, ' ');
+  sbuf_putfloat(&sb, INFINITY, 2);
+  sbuf_putc(&sb, ' ');
+  sbuf_putfloat(&sb, -INFINITY, 2);
+  CHECKSTR(sb.buf, "nan inf -inf");
+}
+
+static void test_isotime(void)
+{
+  char buf[64];
+  struct sbuf sb;
+  sbuf_init(&sb, buf, sizeof(buf));
+  sbuf_putisotime(&sb, 0);
+  sbuf_putc(&sb, ' ');
+  sbuf_putisotime(&sb, 1704164645); /* 2024-01-02T03:04:05Z */
+  CHECKSTR(sb.buf, "1970-01-01T00:00:00Z 2024-01-02T03:04:05Z");
+}
+
+int main(void)
+{
+  test_exactfit();
+  test_overflow();
+  test_putll();
+  test_putfloat();
+  test_isotime();
+  return hosttest_done("test_sbuf");
+}
@@ -0,0 +1,382 @@
+/* ZAMDACH2022 host tests
+ * Tests for the HTTP client in submit.c, with a simulated server as
+ * the backend. The server parses every request it gets, counts
+ * connections (i.e. TLS handshakes on the real thing) and requests per
+ * destination, and can be told to close connections in various nasty
+ * ways, to answer in chunks, or to hand out its reply a few bytes at a
+ * time. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "backlog.h"
+#include "network.h"
+#include "submit.h"
+#include "hosttest.h"
+
+/* submit.c waits for the network on this. */
+EventGroupHandle_t network_event_group;
+/* influx.c, which the uploader task calls, puts this into its lines. */
+char chipid[30] = "testchip";
+
+/* There is no backlog partition on the host, so the backlog is not
+ * available, just like on a device with an old partition table. */
+esp_err_t backlog_init(void)
+{
+  return ESP_ERR_NOT_FOUND;
+}
+
+#define MAXCONNS 32
+
+struct fakeconn {
+  int d;
+  int srvclosed; /* the server has closed its end */
+  char req[8192]; /* what was received, 0-terminated */
+  size_t reqlen;
+  char reply[1024];
+  size_t replylen;
+  size_t replypos;
+};
+
+/* The simulated server. Only ever used from the thread that calls
+ * submit_batch(), so no locking needed. When that is the uploader
+ * task, the test waits for its stats, which are behind a lock. */
+static struct {
+  struct fakeconn conns[MAXCONNS];
+  int nconns;
+  int connects[SUBMITDEST_COUNT];
+  int requests[SUBMITDEST_COUNT];
+  int open; /* connections the client has not closed yet */
+  /* What the server does */
+  int failconnects; /* the next this many connects fail */
+  int closeidle; /* close every connection after replying, without saying so */
+  int dropnext; /* close the next connection without replying */
+  int sayclose; /* reply with "Connection: close" and close */
+  int chunked; /* send the reply body in chunks */
+  int status;
+  size_t maxread; /* hand out at most this many bytes per read */
+  /* The last request per destination */
+  char head[SUBMITDEST_COUNT][1024];
+  char body[SUBMITDEST_COUNT][4096];
+} fs;
+
+static void *
+fake_connect(int d, const char * host, int port, int * resumed,
+             esp_err_t * err, void * bectx)
+{
+  if ((fs.failconnects > 0) || (fs.nconns >= MAXCONNS)) {
+    if (fs.failconnects > 0) { fs.failconnects--; }
+    *err = ESP_ERR_TIMEOUT;
+    return NULL;
+  }
+  CHECK(port == 443);
+  CHECKSTR(host, (d == SUBMITDEST_WPD) ? "wetter.poempelfox.de" : "api.opensensemap.org");
+  struct fakeconn * c = &fs.conns[fs.nconns++];
+  memset(c, 0, sizeof(struct fakeconn));
+  c->d = d;
+  /* Like the esp-tls backend: once there was a connection, there is a
+   * session to offer. */
+  *resumed = (fs.connects[d] > 0);
+  fs.connects[d]++;
+  fs.open++;
+  return c;
+}
+
+/* Handles the request at the start of c->req once it is complete. */
+static void fake_serve(struct fakeconn * c)
+{
+  char * hend = strstr(c->req, "\r\n\r\n");
+  if (hend == NULL) {
+    return;
+  }
+  size_t hlen = hend + 4 - c->req;
+  const char * cl = strstr(c->req, "Content-Length: ");
+  size_t blen = ((cl != NULL) && (cl < hend)) ? strtoul(cl + 16, NULL, 10) : 0;
+  if (c->reqlen < hlen + blen) {
+    return;
+  }
+  fs.requests[c->d]++;
+  memcpy(fs.head[c->d], c->req, hlen);
+  fs.head[c->d][hlen] = 0;
+  memcpy(fs.body[c->d], c->req + hlen, blen);
+  fs.body[c->d][blen] = 0;
+  c->reqlen -= hlen + blen;
+  memmove(c->req, c->req + hlen + blen, c->reqlen + 1);
+  if (fs.dropnext) {
+    fs.dropnext = 0;
+    c->srvclosed = 1;
+    return;
+  }
+  const char * rbody = "{\"ok\":true}";
+  if (fs.chunked) {
+    c->replylen = snprintf(c->reply, sizeof(c->reply),
+                           "HTTP/1.1 %d Whatever\r\nTransfer-Encoding: chunked\r\n\r\n"
+                           "5\r\n{\"ok\"\r\n6;ext=1\r\n:true}\r\n0\r\nX-Trailer: 1\r\n\r\n",
+                           fs.status);
+  } else {
+    c->replylen = snprintf(c->reply, sizeof(c->reply),
+                           "HTTP/1.1 %d Whatever\r\ncontent-LENGTH: %zu\r\n%s\r\n%s",
+                           fs.status, strlen(rbody),
+                           (fs.sayclose) ? "Connection: close\r\n" : "", rbody);
+  }
+  c->replypos = 0;
+  if ((fs.closeidle) || (fs.sayclose)) {
+    c->srvclosed = 1;
+  }
+}
+
+static esp_err_t fake_write(void * h, const char * data, size_t len, void * bectx)
+{
+  struct fakeconn * c = h;
+  /* Like TCP, writing to a connection the other side has closed
+   * works, it is the read afterwards that fails. */
+  if ((c->srvclosed) || (c->reqlen + len >= sizeof(c->req))) {
+    return ESP_OK;
+  }
+  memcpy(c->req + c->reqlen, data, len);
+  c->reqlen += len;
+  c->req[c->reqlen] = 0;
+  fake_serve(c);
+  return ESP_OK;
+}
+
+static int fake_read(void * h, char * buf, size_t len, void * bectx)
+{
+  struct fakeconn * c = h;
+  size_t avail = c->replylen - c->replypos;
+  if (avail == 0) {
+    return (c->srvclosed) ? 0 : -1;
+  }
+  if (len > avail) { len = avail; }
+  if ((fs.maxread > 0) && (len > fs.maxread)) { len = fs.maxread; }
+  memcpy(buf, c->reply + c->replypos, len);
+  c->replypos += len;
+  return len;
+}
+
+static void fake_close(void * h, void * bectx)
+{
+  fs.open--;
+}
+
+static const struct submitbackend fakebackend = {
+  .connect = fake_connect,
+  .write = fake_write,
+  .read = fake_read,
+  .close = fake_close,
+};
+
+/* Server behaviour back to normal. The counters are kept. */
+static void fake_reset(void)
+{
+  fs.failconnects = 0;
+  fs.closeidle = 0;
+  fs.dropnext = 0;
+  fs.sayclose = 0;
+  fs.chunked = 0;
+  fs.status = 200;
+  fs.maxread = 0;
+}
+
+static void mkbatch(struct submitbatch * b, time_t ts)
+{
+  submitbatch_init(b, ts);
+  for (int f = 0; f < SUBMITFIELD_COUNT; f++) {
+    submitbatch_add(b, f, 10.0 + f);
+  }
+}
+
+/* Does one measurement cycle. Returns what submit_batch() returned. */
+static int cycle(void)
+{
+  struct submitbatch b;
+  mkbatch(&b, 1700000000);
+  return submit_batch(&b);
+}
+
+static uint32_t attempts(int d)
+{
+  return submit_getmetrics(d)->attempts;
+}
+
+/* How many connects went into the histogram of phase p */
+static uint32_t phasecount(int d, int p)
+{
+  uint32_t n = 0;
+  for (int b = 0; b < SUBMIT_HISTBUCKETS; b++) {
+    n += submit_getmetrics(d)->hist[p][b];
+  }
+  return n;
+}
+
+/* The requests look like they should. */
+static void test_request(void)
+{
+  fake_reset();
+  CHECK(cycle() == 0);
+  CHECK(strncmp(fs.head[SUBMITDEST_WPD], "POST /api/pushmeasurement/ HTTP/1.1\r\n", 37) == 0);
+  CHECK(strstr(fs.head[SUBMITDEST_WPD], "\r\nHost: wetter.poempelfox.de\r\n") != NULL);
+  CHECK(strstr(fs.head[SUBMITDEST_WPD], "\r\nX-Sensor: wpdtesttoken\r\n") != NULL);
+  CHECK(strncmp(fs.head[SUBMITDEST_OSM], "POST /boxes/testbox/data HTTP/1.1\r\n", 35) == 0);
+  CHECK(strstr(fs.head[SUBMITDEST_OSM], "\r\nAuthorization: osmtesttoken\r\n") != NULL);
+  CHECK(strstr(fs.body[SUBMITDEST_WPD], "{\"value_type\":\"13\",\"value\":\"10.000\"}") != NULL);
+  CHECK(strstr(fs.body[SUBMITDEST_OSM], "{\"sensor\":\"osmpress\",\"value\":\"10.000\"}") != NULL);
+}
+
+/* A kept-alive connection is used for everything: one handshake. */
+static void test_reuse(void)
+{
+  fake_reset();
+  int c0 = fs.connects[SUBMITDEST_WPD];
+  int r0 = fs.requests[SUBMITDEST_WPD];
+  uint32_t a0 = attempts(SUBMITDEST_WPD);
+  for (int i = 0; i < 5; i++) {
+    CHECK(cycle() == 0);
+  }
+  CHECK(fs.connects[SUBMITDEST_WPD] == c0);
+  CHECK(fs.connects[SUBMITDEST_OSM] == 1);
+  CHECK(fs.requests[SUBMITDEST_WPD] == r0 + 5);
+  CHECK(attempts(SUBMITDEST_WPD) == a0 + 5);
+  /* Also when the reply comes in chunks, a few bytes at a time - all
+   * of it has to be read, or the next request gets confused. */
+  fs.chunked = 1;
+  fs.maxread = 3;
+  for (int i = 0; i < 3; i++) {
+    CHECK(cycle() == 0);
+  }
+  fs.chunked = 0;
+  fs.maxread = 0;
+  CHECK(cycle() == 0);
+  CHECK(fs.connects[SUBMITDEST_WPD] == c0);
+  CHECK(attempts(SUBMITDEST_WPD) == a0 + 9);
+  /* A server error is a failure, but nothing is wrong with the
+   * connection. */
+  fs.status = 503;
+  CHECK(cycle() == ((1 << SUBMITDEST_WPD) | (1 << SUBMITDEST_OSM)));
+  fs.status = 200;
+  CHECK(cycle() == 0);
+  CHECK(fs.connects[SUBMITDEST_WPD] == c0);
+  CHECK(attempts(SUBMITDEST_WPD) == a0 + 11);
+}
+
+/* The server closes the connection after replying, and says so:
+ * the next request connects anew, without a failed attempt. */
+static void test_announcedclose(void)
+{
+  fake_reset();
+  int c0 = fs.connects[SUBMITDEST_WPD];
+  uint32_t a0 = attempts(SUBMITDEST_WPD);
+  fs.sayclose = 1;
+  CHECK(cycle() == 0); /* still on the old connection */
+  CHECK(cycle() == 0);
+  CHECK(cycle() == 0);
+  CHECK(fs.connects[SUBMITDEST_WPD] == c0 + 2);
+  /* Only the very first connection needed a full handshake, everything
+   * after that offered the session of the previous one. */
+  CHECK(phasecount(SUBMITDEST_WPD, SUBMITPHASE_CONNECT) == 1);
+  CHECK(phasecount(SUBMITDEST_WPD, SUBMITPHASE_RESUME) == (uint32_t)(c0 + 1));
+  CHECK(attempts(SUBMITDEST_WPD) == a0 + 3);
+  CHECK(fs.open == 0);
+}
+
+/* The server closes idle connections without saying so: a request on
+ * such a connection is retried exactly once, on a new connection. */
+static void test_silentclose(void)
+{
+  fake_reset();
+  CHECK(cycle() == 0); /* get a connection */
+  int c0 = fs.connects[SUBMITDEST_WPD];
+  int r0 = fs.requests[SUBMITDEST_WPD];
+  uint32_t a0 = attempts(SUBMITDEST_WPD);
+  fs.closeidle = 1;
+  CHECK(cycle() == 0); /* this one still works, then it is closed */
+  CHECK(cycle() == 0);
+  CHECK(fs.connects[SUBMITDEST_WPD] == c0 + 1);
+  CHECK(attempts(SUBMITDEST_WPD) == a0 + 3);
+  CHECK(fs.requests[SUBMITDEST_WPD] == r0 + 2);
+  /* And if the new connection cannot be made, there is no second
+   * retry. */
+  fs.failconnects = SUBMITDEST_COUNT;
+  uint32_t f0 = submit_getmetrics(SUBMITDEST_WPD)->failures;
+  CHECK(cycle() == ((1 << SUBMITDEST_WPD) | (1 << SUBMITDEST_OSM)));
+  CHECK(attempts(SUBMITDEST_WPD) == a0 + 5);
+  CHECK(submit_getmetrics(SUBMITDEST_WPD)->failures == f0 + 1);
+  CHECK(fs.open == 0);
+  fake_reset();
+  CHECK(cycle() == 0);
+}
+
+/* A fresh connection that dies is not retried: the server is not
+ * just tired of an idle connection, something is wrong. */
+static void test_freshfail(void)
+{
+  fake_reset();
+  fs.sayclose = 1;
+  CHECK(cycle() == 0); /* no connection left open */
+  fake_reset();
+  int c0 = fs.connects[SUBMITDEST_WPD];
+  uint32_t a0 = attempts(SUBMITDEST_WPD);
+  fs.dropnext = 1;
+  CHECK((cycle() & (1 << SUBMITDEST_WPD)) != 0);
+  CHECK(fs.connects[SUBMITDEST_WPD] == c0 + 1);
+  CHECK(attempts(SUBMITDEST_WPD) == a0 + 1);
+  CHECK(cycle() == 0);
+}
+
+static int countstr(const char * hay, const char * needle)
+{
+  int n = 0;
+  while ((hay = strstr(hay, needle)) != NULL) {
+    n++;
+    hay++;
+  }
+  return n;
+}
+
+/* The way the firmware does it: one batch per measurement cycle goes
+ * into the queue, the uploader task sends it. Every cycle has to end
+ * up as exactly one request per destination, with all the values. */
+static void test_onepercycle(void)
+{
+  fake_reset();
+  submit_start();
+  xEventGroupSetBits(network_event_group, NETWORK_CONNECTED_BIT);
+  for (int i = 0; i < 5; i++) {
+    int r0[SUBMITDEST_COUNT];
+    memcpy(r0, fs.requests, sizeof(r0));
+    struct submitbatch b;
+    mkbatch(&b, time(NULL));
+    CHECK(submit_enqueue(&b) == 0);
+    struct submitstats st;
+    for (int w = 0; w < 1000; w++) {
+      submit_getstats(&st);
+      if ((st.dest[SUBMITDEST_WPD].requests == i + 1)
+       && (st.dest[SUBMITDEST_OSM].requests == i + 1)) {
+        break;
+      }
+      usleep(1000);
+    }
+    CHECK(st.dest[SUBMITDEST_WPD].requests == i + 1);
+    CHECK(st.dest[SUBMITDEST_OSM].requests == i + 1);
+    for (int d = 0; d < SUBMITDEST_COUNT; d++) {
+      CHECK(fs.requests[d] == r0[d] + 1);
+    }
+    CHECK(countstr(fs.body[SUBMITDEST_WPD], "\"value_type\":") == SUBMITFIELD_COUNT);
+    /* Rain and UV are not sent to opensensemap. */
+    CHECK(countstr(fs.body[SUBMITDEST_OSM], "\"sensor\":") == SUBMITFIELD_COUNT - 2);
+  }
+}
+
+int main(void)
+{
+  network_event_group = xEventGroupCreate();
+  submit_setbackend(&fakebackend);
+  test_request();
+  test_reuse();
+  test_announcedclose();
+  test_silentclose();
+  test_freshfail();
+  test_onepercycle();
+  return hosttest_done("test_submit");
+}
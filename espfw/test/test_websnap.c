@@ -0,0 +1,168 @@
+/* ZAMDACH2022 host tests
+ * Tests for the /json snapshot in websnap.c: what gets rendered, that
+ * every update gets a new ETag, and that a client which already has
+ * the current snapshot gets a 304 without a body. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "websnap.h"
+#include "hosttest.h"
+
+/* websnap.c reports this in the JSON. */
+int pendingfwverify = 0;
+
+static void mkev(struct ev * e, time_t ts)
+{
+  memset(e, 0, sizeof(struct ev));
+  e->lastupd = ts;
+  e->lastsht4xheat = ts - 600;
+  e->temp = 21.456;
+  e->hum = 55.55;
+  e->pm010 = 1.0;
+  e->pm025 = 2.5;
+  e->pm040 = 4.0;
+  e->pm100 = 10.0;
+  e->press = 1013.2505;
+  e->lux = 12345.678;
+  e->uvind = 3.14159;
+  e->raing = 0.0;
+  e->windspeed = 12.34;
+  e->windspmax = 23.45;
+  e->winddirdeg = 270.0;
+  strcpy(e->winddirtxt, "W");
+}
+
+/* Does a GET /json with the given extra headers. */
+static void getjson(httpd_req_t * r, struct hostreq * h, const char * hdrs)
+{
+  hostreq_init(r, h, HTTP_GET, "/json", hdrs, NULL, 0);
+  CHECK(websnap_sendjson(r) == ESP_OK);
+  CHECK(h->sends == 1);
+}
+
+static void test_render(void)
+{
+  struct ev e;
+  mkev(&e, 1700000000);
+  websnap_publish(&e);
+  const struct websnapshot * s = websnap_get();
+  CHECK(s->jsonlen == strlen(s->json));
+  CHECKSTR(s->json,
+           "{\"ts\":\"1700000000\",\"lastsht4xheat\":\"1699999400\","
+           "\"temp\":\"21.46\",\"hum\":\"55.5\",\"pm010\":\"1.0\",\"pm025\":\"2.5\","
+           "\"pm040\":\"4.0\",\"pm100\":\"10.0\",\"press\":\"1013.250\","
+           "\"lux\":\"12345.68\",\"uvind\":\"3.14\",\"raing\":\"0.00\","
+           "\"windspeed\":\"12.3\",\"windspmax\":\"23.5\",\"winddirdeg\":\"270.0\","
+           "\"winddirtxt\":\"W\","
+           "\"fwversion\":\"zamdach2022 version testversion compiled Jan  1 2024 12:00:00\","
+           "\"fwpending\":\"0\"}");
+}
+
+/* Every publish is a new version with a new ETag, even with the same
+ * timestamp, and the previous snapshot stays intact. */
+static void test_versions(void)
+{
+  struct ev e;
+  mkev(&e, 1700000060);
+  websnap_publish(&e);
+  const struct websnapshot * s1 = websnap_get();
+  char etag1[40];
+  strcpy(etag1, s1->etag);
+  char json1[1100];
+  strcpy(json1, s1->json);
+  e.temp = -5.0;
+  websnap_publish(&e);
+  const struct websnapshot * s2 = websnap_get();
+  CHECK(s2 != s1);
+  CHECK(s2->version == s1->version + 1);
+  CHECK(strcmp(s2->etag, etag1) != 0);
+  CHECK(strstr(s2->json, "\"temp\":\"-5.00\"") != NULL);
+  /* Strong: no W/ */
+  CHECK(s2->etag[0] == '"');
+  CHECK(s2->etag[strlen(s2->etag) - 1] == '"');
+  /* Someone still sending from s1 is not disturbed. */
+  CHECKSTR(s1->etag, etag1);
+  CHECKSTR(s1->json, json1);
+}
+
+static void test_etagmatch(void)
+{
+  const char * et = "\"1700000000-7\"";
+  CHECK(websnap_etagmatch("\"1700000000-7\"", et) == 1);
+  CHECK(websnap_etagmatch("W/\"1700000000-7\"", et) == 1);
+  CHECK(websnap_etagmatch("\"a\", \"1700000000-7\"", et) == 1);
+  CHECK(websnap_etagmatch("\"a\",W/\"b\" ,\t\"1700000000-7\"", et) == 1);
+  CHECK(websnap_etagmatch("*", et) == 1);
+  CHECK(websnap_etagmatch("", et) == 0);
+  CHECK(websnap_etagmatch("\"1700000000-8\"", et) == 0);
+  /* Neither a prefix nor something that contains it */
+  CHECK(websnap_etagmatch("\"1700000000-77\"", et) == 0);
+  CHECK(websnap_etagmatch("\"1700000000-\"", et) == 0);
+  CHECK(websnap_etagmatch("\"x1700000000-7\"", et) == 0);
+  /* Without quotes, it is not an entity tag. */
+  CHECK(websnap_etagmatch("1700000000-7", et) == 0);
+  CHECK(websnap_etagmatch("\"1700000000-7", et) == 0);
+}
+
+/* The 200 carries the JSON and the ETag, sending that ETag back gets
+ * a 304 without a body, and after an update it is a 200 again. */
+static void test_304(void)
+{
+  struct ev e;
+  httpd_req_t r;
+  struct hostreq h;
+  char hdrs[200];
+  mkev(&e, 1700000120);
+  websnap_publish(&e);
+  const struct websnapshot * s = websnap_get();
+
+  getjson(&r, &h, NULL);
+  CHECKSTR(h.status, "200 OK");
+  CHECKSTR(h.type, "application/json");
+  CHECK((h.resplen == s->jsonlen) && (memcmp(h.resp, s->json, s->jsonlen) == 0));
+  const char * etag = hostreq_resphdr(&h, "ETag");
+  CHECK((etag != NULL) && (strcmp(etag, s->etag) == 0));
+  CHECK(hostreq_resphdr(&h, "Cache-Control") != NULL);
+  hostreq_free(&h);
+
+  snprintf(hdrs, sizeof(hdrs), "Accept: */*\r\nIf-None-Match: %s\r\n", s->etag);
+  getjson(&r, &h, hdrs);
+  CHECKSTR(h.status, "304 Not Modified");
+  CHECK(h.resplen == 0);
+  /* A 304 has to repeat the ETag and caching headers. */
+  etag = hostreq_resphdr(&h, "ETag");
+  CHECK((etag != NULL) && (strcmp(etag, s->etag) == 0));
+  CHECK(hostreq_resphdr(&h, "Cache-Control") != NULL);
+  hostreq_free(&h);
+
+  /* An outdated ETag gets the new data. */
+  e.temp = 30.0;
+  websnap_publish(&e);
+  getjson(&r, &h, hdrs);
+  CHECKSTR(h.status, "200 OK");
+  CHECK(strstr(h.resp, "\"temp\":\"30.00\"") != NULL);
+  hostreq_free(&h);
+
+  /* A list too long for the buffer still matches if our tag is in
+   * the part that fits, otherwise it is a 200. */
+  s = websnap_get();
+  char longhdrs[400];
+  snprintf(longhdrs, sizeof(longhdrs), "If-None-Match: %s, \"%0200d\"\r\n", s->etag, 0);
+  getjson(&r, &h, longhdrs);
+  CHECKSTR(h.status, "304 Not Modified");
+  hostreq_free(&h);
+  snprintf(longhdrs, sizeof(longhdrs), "If-None-Match: \"%0200d\", %s\r\n", 0, s->etag);
+  getjson(&r, &h, longhdrs);
+  CHECKSTR(h.status, "200 OK");
+  hostreq_free(&h);
+}
+
+int main(void)
+{
+  test_render();
+  test_versions();
+  test_etagmatch();
+  test_304();
+  return hosttest_done("test_websnap");
+}
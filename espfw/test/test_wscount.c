@@ -0,0 +1,167 @@
+/* ZAMDACH2022 host tests
+ * Runs the anemometer pulse logic from wscount.h on simulated pulse
+ * trains: clean ones, ones with contact bounce on closing and opening,
+ * gusts, and a capture timer that wraps around. */
+
+#include <math.h>
+#include <stdio.h>
+#include "hosttest.h"
+#include "wscount.h"
+
+/* The MCPWM capture timer runs at 80 MHz by default. */
+#define TICKSPERSEC 80000000ULL
+
+/* The simulated signal. Time is kept in ns. */
+struct sim {
+  struct wscount wc;
+  uint64_t t;
+  uint64_t tickoffset; /* to make the capture timer wrap */
+};
+
+static void edge(struct sim * s, int rising)
+{
+  uint32_t cap = (uint32_t)(((s->t * TICKSPERSEC) / 1000000000ULL) + s->tickoffset);
+  wscount_edge(&s->wc, rising, cap, (int64_t)(s->t / 1000) + 1000000);
+}
+
+static void siminit(struct sim * s, uint64_t tickoffset)
+{
+  wscount_init(&s->wc, TICKSPERSEC);
+  s->t = 0;
+  s->tickoffset = tickoffset;
+}
+
+/* A bounce: n short low pulses of 50 us, 100 us apart. Starts with the
+ * line high and ends with it high. */
+static void bounce(struct sim * s, int n)
+{
+  for (int i = 0; i < n; i++) {
+    edge(s, 0);
+    s->t += 50000;
+    edge(s, 1);
+    s->t += 50000;
+  }
+}
+
+/* One pulse from the anemometer: the contact closes for lowns, then
+ * opens again, and the pulse takes periodns in total. With bouncy set,
+ * the contact bounces three times on closing and twice on opening. */
+static void pulse(struct sim * s, uint64_t periodns, uint64_t lowns, int bouncy)
+{
+  uint64_t start = s->t;
+  edge(s, 0);
+  if (bouncy) {
+    s->t += 30000;
+    edge(s, 1);
+    s->t += 20000;
+    bounce(s, 2);
+    edge(s, 0);
+  }
+  s->t = start + lowns;
+  edge(s, 1);
+  if (bouncy) {
+    s->t += 40000;
+    bounce(s, 2);
+  }
+  s->t = start + periodns;
+}
+
+/* Pulses per second for a wind speed in km/h. */
+static uint64_t periodfor(double kmh)
+{
+  return (uint64_t)(1.0e9 / (kmh / 2.4));
+}
+
+static int near(double a, double b)
+{
+  return (fabs(a - b) < (0.001 * b));
+}
+
+static void test_clean(void)
+{
+  struct sim s;
+  siminit(&s, 0);
+  /* 60 s at 24 km/h, i.e. 10 pulses per second. */
+  for (int i = 0; i < 600; i++) {
+    pulse(&s, periodfor(24.0), 5000000, 0);
+  }
+  CHECK(wscount_takecount(&s.wc) == 600);
+  CHECK(near(wscount_takepeak(&s.wc), 24.0));
+  CHECK(s.wc.bounces == 0);
+  /* Both were reset. */
+  CHECK(wscount_takecount(&s.wc) == 0);
+  CHECK(wscount_takepeak(&s.wc) == 0.0);
+}
+
+static void test_bouncy(void)
+{
+  struct sim s;
+  siminit(&s, 0);
+  for (int i = 0; i < 600; i++) {
+    pulse(&s, periodfor(24.0), 5000000, 1);
+  }
+  /* Every bounce is ignored, so neither the count nor the peak get
+   * inflated. */
+  CHECK(wscount_takecount(&s.wc) == 600);
+  CHECK(near(wscount_takepeak(&s.wc), 24.0));
+  CHECK(s.wc.bounces == (600 * 5));
+}
+
+static void test_storm(void)
+{
+  struct sim s;
+  siminit(&s, 0);
+  /* 150 km/h with a gust of 200 km/h in the middle, with bounce. At
+   * that speed, the contact is only closed for a few ms. */
+  for (int i = 0; i < 3000; i++) {
+    double kmh = ((i >= 1500) && (i < 1510)) ? 200.0 : 150.0;
+    pulse(&s, periodfor(kmh), 4000000, 1);
+  }
+  CHECK(wscount_takecount(&s.wc) == 3000);
+  CHECK(near(wscount_takepeak(&s.wc), 200.0));
+  /* And a calm minute after that: one pulse every 12 s. */
+  s.t += 12000000000ULL;
+  for (int i = 0; i < 5; i++) {
+    pulse(&s, 12000000000ULL, 50000000, 1);
+  }
+  CHECK(wscount_takecount(&s.wc) == 5);
+  /* Pulses more than 10 s apart are too far apart to be measured. */
+  CHECK(wscount_takepeak(&s.wc) == 0.0);
+}
+
+static void test_wrap(void)
+{
+  struct sim s;
+  /* The capture timer wraps after about 53 s, here it does so 1 s
+   * into the test. */
+  siminit(&s, 0xffffffffULL - TICKSPERSEC);
+  for (int i = 0; i < 100; i++) {
+    pulse(&s, periodfor(48.0), 3000000, 1);
+  }
+  CHECK(wscount_takecount(&s.wc) == 100);
+  CHECK(near(wscount_takepeak(&s.wc), 48.0));
+}
+
+static void test_longgap(void)
+{
+  struct sim s;
+  siminit(&s, 0);
+  pulse(&s, periodfor(24.0), 5000000, 0);
+  /* Quiet for longer than the capture timer takes to wrap. The next
+   * pulse then has a capture value that is close to the last one, but
+   * that is no peak. */
+  s.t += 53687091200ULL - periodfor(24.0) + 1000000;
+  pulse(&s, periodfor(24.0), 5000000, 0);
+  CHECK(wscount_takecount(&s.wc) == 2);
+  CHECK(wscount_takepeak(&s.wc) == 0.0);
+}
+
+int main(void)
+{
+  test_clean();
+  test_bouncy();
+  test_storm();
+  test_wrap();
+  test_longgap();
+  return hosttest_done("test_wscount");
+}